@@ -12,12 +12,22 @@
 #include <queue>
 #include <optional>
 #include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <chrono>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_STRING_VIEW
 #include <string_view>
 #elif HAVE_EXPERIMENTAL_STRING_VIEW
@@ -38,22 +48,20 @@ extern "C" {
 #include "socket.hh"
 #include "timestamp.hh"
 #include "poller.hh"
+#include "pipe.hh"
+#include "ts_parser.hh"
+#include "tokenize.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
-static const size_t ts_packet_length = 188;
-static const char ts_packet_sync_byte = 0x47;
 static const unsigned int atsc_audio_sample_rate = 48000;
 static const unsigned int audio_block_duration = 144000;
 /* units -v '(256 / (48 kHz)) * (27 megahertz)' -> 144000 */
 static const unsigned int audio_samples_per_block = 256;
+static const uint64_t max_ingest_stall_ms = 1000;
 static const unsigned int opus_sample_overlap = 10 * 960 + 960 - 312; /* 960 = 48 kHz * 20 ms, 312 = Opus's 6.5 ms lookahead */
 
-/* if tmp_dir is not empty, output to tmp_dir first and move output chunks
- * to video_output_dir or audio_output_dir */
-static string tmp_dir;
-
 void print_usage( const string & program_name )
 {
   cerr <<
@@ -63,7 +71,12 @@ void print_usage( const string & program_name )
   "format = \"1080i30\" | \"720p60\"\n"
   "--tmp TMP : output to TMP directory first and then move output chunks "
   "to video_output_dir or audio_output_dir\n"
-  "--tcp IP:PORT : establish a TCP connection and read input from IP:PORT"
+  "--tcp IP:PORT : establish a TCP connection and read input from IP:PORT\n\n"
+  "Usage: " << program_name << " --program \"video_pid audio_pid format "
+  "frames_per_chunk audio_blocks_per_chunk audio_sample_overlap "
+  "video_output_dir audio_output_dir [TMP]\" [--program ...] [--tcp IP:PORT]\n\n"
+  "--program ARGS : decode one more program of the same multiplex on its own "
+  "thread (the eight arguments above, plus its own optional TMP directory)"
   << endl;
 }
 
@@ -73,11 +86,72 @@ inline T * notnull( const string & context, T * const x )
   return x ? x : throw runtime_error( context + ": returned null pointer" );
 }
 
+/* libmpeg2 and liba52 take non-const pointers but only read the bitstream */
+inline uint8_t * mutable_bytes( const string_view & bytes )
+{
+  return reinterpret_cast<uint8_t *>( const_cast<char *>( bytes.data() ) );
+}
+
 int64_t timestamp_difference( const uint64_t ts_64, const uint64_t ts_33 )
 {
   return static_cast<int64_t>(ts_64) - static_cast<int64_t>(ts_33);
 }
 
+/* copy one row; with non_temporal, the (aligned part of the) destination is
+   written with streaming stores that bypass the cache */
+inline void copy_row( uint8_t * dest, const uint8_t * src, size_t length,
+                      const bool non_temporal )
+{
+#ifdef __SSE2__
+  if ( non_temporal ) {
+    while ( length and (reinterpret_cast<uintptr_t>( dest ) & 15) ) {
+      *dest++ = *src++;
+      length--;
+    }
+
+    for ( ; length >= 64; length -= 64, dest += 64, src += 64 ) {
+      const __m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) );
+      const __m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 16 ) );
+      const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 32 ) );
+      const __m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 48 ) );
+      _mm_stream_si128( reinterpret_cast<__m128i *>( dest ), a );
+      _mm_stream_si128( reinterpret_cast<__m128i *>( dest + 16 ), b );
+      _mm_stream_si128( reinterpret_cast<__m128i *>( dest + 32 ), c );
+      _mm_stream_si128( reinterpret_cast<__m128i *>( dest + 48 ), d );
+    }
+
+    for ( ; length >= 16; length -= 16, dest += 16, src += 16 ) {
+      _mm_stream_si128( reinterpret_cast<__m128i *>( dest ),
+                        _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) ) );
+    }
+  }
+#else
+  (void) non_temporal;
+#endif
+
+  memcpy( dest, src, length );
+}
+
+/* copy a block of rows between planes with different strides (splitting
+   a frame into fields, or weaving fields back into a frame).
+   Frames are woven with non_temporal = true: a chunk of frames is much
+   larger than the cache and is not read again until it goes to disk. */
+inline void copy_rows( uint8_t * dest, const size_t dest_stride,
+                       const uint8_t * src, const size_t src_stride,
+                       const size_t length, const size_t rows,
+                       const bool non_temporal )
+{
+  for ( size_t row = 0; row < rows; row++ ) {
+    copy_row( dest + row * dest_stride, src + row * src_stride, length, non_temporal );
+  }
+
+#ifdef __SSE2__
+  if ( non_temporal ) {
+    _mm_sfence(); /* order streaming stores before anyone reads the frame */
+  }
+#endif
+}
+
 struct Raster
 {
   unsigned int width, height;
@@ -114,57 +188,36 @@ struct Raster
       throw runtime_error( "invalid physical_luma_width" );
     }
 
-    /* copy Y */
-    for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
-          dest_row < height;
-          source_row += 2, dest_row += 1 ) {
-      memcpy( Y.get() + dest_row * width,
-              display_raster->buf[ 0 ] + source_row * physical_luma_width,
-              width );
-    }
-
-    /* copy Cb */
-    for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
-          dest_row < height/2;
-          source_row += 2, dest_row += 1 ) {
-      memcpy( Cb.get() + dest_row * width/2,
-              display_raster->buf[ 1 ] + source_row * physical_luma_width/2,
-              width/2 );
-    }
+    const unsigned int first_row = top_field ? 0 : 1;
 
-    /* copy Cr */
-    for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
-          dest_row < height/2;
-          source_row += 2, dest_row += 1 ) {
-      memcpy( Cr.get() + dest_row * width/2,
-              display_raster->buf[ 2 ] + source_row * physical_luma_width/2,
-              width/2 );
-    }
+    /* copy every other row of Y, Cb and Cr */
+    copy_rows( Y.get(), width,
+               display_raster->buf[ 0 ] + first_row * physical_luma_width,
+               2 * physical_luma_width, width, height, false );
+    copy_rows( Cb.get(), width/2,
+               display_raster->buf[ 1 ] + first_row * physical_luma_width/2,
+               physical_luma_width, width/2, height/2, false );
+    copy_rows( Cr.get(), width/2,
+               display_raster->buf[ 2 ] + first_row * physical_luma_width/2,
+               physical_luma_width, width/2, height/2, false );
   }
-};
 
-class non_fatal_exception : public runtime_error
-{
-public:
-  using runtime_error::runtime_error;
-};
-
-class InvalidMPEG : public non_fatal_exception
-{
-public:
-  using non_fatal_exception::non_fatal_exception;
-};
+  /* weave this field into every other row of a frame */
+  void write_to_frame( const bool top_field, Raster & frame ) const
+  {
+    if ( frame.width != width or frame.height != 2 * height ) {
+      throw runtime_error( "field does not match frame dimensions" );
+    }
 
-class UnsupportedMPEG : public non_fatal_exception
-{
-public:
-  using non_fatal_exception::non_fatal_exception;
-};
+    const unsigned int first_row = top_field ? 0 : 1;
 
-class StreamMismatch : public non_fatal_exception
-{
-public:
-  using non_fatal_exception::non_fatal_exception;
+    copy_rows( frame.Y.get() + first_row * width, 2 * width,
+               Y.get(), width, width, height, true );
+    copy_rows( frame.Cb.get() + first_row * width/2, width,
+               Cb.get(), width/2, width/2, height/2, true );
+    copy_rows( frame.Cr.get() + first_row * width/2, width,
+               Cr.get(), width/2, width/2, height/2, true );
+  }
 };
 
 class HugeTimestampDifference : public non_fatal_exception
@@ -280,227 +333,6 @@ struct VideoField
   {}
 };
 
-struct TSPacketRequirements
-{
-  TSPacketRequirements( const string_view & packet )
-  {
-    /* enforce invariants */
-    if ( packet.length() != ts_packet_length ) {
-      throw InvalidMPEG( "invalid TS packet length" );
-    }
-
-    if ( packet.front() != ts_packet_sync_byte ) {
-      throw InvalidMPEG( "invalid TS sync byte" );
-    }
-  }
-};
-
-struct TSPacketHeader : TSPacketRequirements
-{
-  bool transport_error_indicator;
-  bool payload_unit_start_indicator;
-  uint16_t pid;
-  uint8_t adaptation_field_control;
-  uint8_t payload_start;
-
-  TSPacketHeader( const string_view & packet )
-    : TSPacketRequirements( packet ),
-      transport_error_indicator( packet[ 1 ] & 0x80 ),
-      payload_unit_start_indicator( packet[ 1 ] & 0x40 ),
-      pid( ((uint8_t( packet[ 1 ] ) & 0x1f) << 8) | uint8_t( packet[ 2 ] ) ),
-      adaptation_field_control( (uint8_t( packet[ 3 ] ) & 0x30) >> 4 ),
-      payload_start( 4 )
-  {
-    /* find start of payload */
-    switch ( adaptation_field_control ) {
-    case 0:
-      throw UnsupportedMPEG( "reserved value of adaptation field control" );
-    case 1:
-      /* already 4 */
-      break;
-    case 2:
-      payload_start = ts_packet_length; /* no data */
-      break;
-    case 3:
-      const uint8_t adaptation_field_length = packet[ 4 ];
-      payload_start += adaptation_field_length + 1 /* length field is 1 byte itself */;
-      break;
-    }
-
-    if ( payload_start > ts_packet_length ) {
-      throw InvalidMPEG( "invalid TS packet" );
-    }
-  }
-};
-
-struct TimestampedPESPacket
-{
-  uint64_t presentation_time_stamp;
-  size_t payload_start_index;
-  size_t payload_end_index;
-  string PES_packet;
-
-  TimestampedPESPacket( const uint64_t s_presentation_time_stamp,
-                        const size_t s_payload_start_index,
-                        const size_t PES_packet_length,
-                        string && s_PES_packet )
-    : presentation_time_stamp( s_presentation_time_stamp ),
-      payload_start_index( s_payload_start_index ),
-      payload_end_index( s_PES_packet.size() ),
-      PES_packet( move( s_PES_packet ) )
-  {
-    if ( payload_start_index >= PES_packet.size() ) {
-      throw InvalidMPEG( "empty PES payload" );
-    }
-
-    if ( PES_packet_length != 0 ) {
-      if ( PES_packet_length + 6 > PES_packet.size() ) {
-        throw InvalidMPEG( "PES_packet_length + 6 > PES_packet.size()" );
-      }
-
-      payload_end_index = PES_packet_length + 6;
-    }
-  }
-
-  uint8_t * payload_start()
-  {
-    if ( payload_start_index >= PES_packet.length()
-         or payload_start_index >= payload_end_index ) {
-      throw InvalidMPEG( "payload starts after end of PES packet" );
-    }
-    return reinterpret_cast<uint8_t *>( PES_packet.data() + payload_start_index );
-  }
-
-  uint8_t * payload_end()
-  {
-    if ( payload_end_index > PES_packet.length() ) {
-      throw InvalidMPEG( "payload ends after end of PES packet" );
-    }
-    return reinterpret_cast<uint8_t *>( PES_packet.data() + payload_end_index );
-  }
-
-  size_t payload_length() const
-  {
-    if ( payload_end_index < payload_start_index ) {
-      throw InvalidMPEG( "payload ends before it starts" );
-    }
-    return payload_end_index - payload_start_index;
-  }
-};
-
-struct PESPacketHeader
-{
-  uint8_t stream_id;
-  unsigned int payload_start;
-  unsigned int PES_packet_length;
-  bool data_alignment_indicator;
-  uint8_t PTS_DTS_flags;
-  uint64_t presentation_time_stamp;
-  uint64_t decoding_time_stamp;
-
-  static uint8_t enforce_stream_id( const bool is_video, const uint8_t stream_id )
-  {
-    if ( is_video ) {
-      if ( (stream_id & 0xf0) != 0xe0 ) {
-        throw StreamMismatch( "not an MPEG-2 video stream: " + to_string( stream_id ) );
-      }
-    } else {
-      if ( stream_id != 0xBD ) {
-        throw StreamMismatch( "not an A/52 audio stream: " + to_string( stream_id ) );
-      }
-    }
-
-    return stream_id;
-  }
-
-  PESPacketHeader( const string_view & packet, const bool is_video )
-    : stream_id( enforce_stream_id( is_video, packet.at( 3 ) ) ),
-      payload_start( packet.at( 8 ) + 9 ),
-      PES_packet_length( (packet.at( 4 ) << 8) | packet.at( 5 ) ),
-      data_alignment_indicator( packet.at( 6 ) & 0x04 ),
-      PTS_DTS_flags( (packet.at( 7 ) & 0xc0) >> 6 ),
-      presentation_time_stamp(),
-      decoding_time_stamp()
-  {
-    if ( packet.at( 0 ) != 0
-         or packet.at( 1 ) != 0
-         or packet.at( 2 ) != 1 ) {
-      throw InvalidMPEG( "invalid PES start code" );
-    }
-
-    if ( payload_start > packet.length() ) {
-      throw InvalidMPEG( "invalid PES packet" );
-    }
-
-    /*
-      unfortunately NBC San Francisco does not seem to use this
-    if ( not data_alignment_indicator ) {
-      throw runtime_error( "unaligned PES packet" );
-    }
-    */
-
-    switch ( PTS_DTS_flags ) {
-    case 0:
-      throw UnsupportedMPEG( "missing PTS and DTS" );
-    case 1:
-      throw InvalidMPEG( "forbidden value of PTS_DTS_flags" );
-    case 3:
-      decoding_time_stamp = (((uint64_t(uint8_t(packet.at( 14 )) & 0x0F) >> 1) << 30) |
-                             (uint8_t(packet.at( 15 )) << 22) |
-                             ((uint8_t(packet.at( 16 )) >> 1) << 15) |
-                             (uint8_t(packet.at( 17 )) << 7) |
-                             (uint8_t(packet.at( 18 )) >> 1));
-
-      if ( (packet.at( 14 ) & 0xf0) >> 4 != 1 ) {
-        throw InvalidMPEG( "invalid DTS prefix bits" );
-      }
-
-      if ( (packet.at( 14 ) & 0x01) != 1 ) {
-        throw InvalidMPEG( "invalid marker bit" );
-      }
-
-      if ( (packet.at( 16 ) & 0x01) != 1 ) {
-        throw InvalidMPEG( "invalid marker bit" );
-      }
-
-      if ( (packet.at( 18 ) & 0x01) != 1 ) {
-        throw InvalidMPEG( "invalid marker bit" );
-      }
-
-      /* fallthrough */
-
-    case 2:
-      presentation_time_stamp = (((uint64_t(uint8_t(packet.at( 9 )) & 0x0F) >> 1) << 30) |
-                                 (uint8_t(packet.at( 10 )) << 22) |
-                                 ((uint8_t(packet.at( 11 )) >> 1) << 15) |
-                                 (uint8_t(packet.at( 12 )) << 7) |
-                                 (uint8_t(packet.at( 13 )) >> 1));
-
-      if ( (packet.at( 9 ) & 0xf0) >> 4 != PTS_DTS_flags ) {
-        throw InvalidMPEG( "invalid PTS prefix bits" );
-      }
-
-      if ( (packet.at( 9 ) & 0x01) != 1 ) {
-        throw InvalidMPEG( "invalid marker bit" );
-      }
-
-      if ( (packet.at( 11 ) & 0x01) != 1 ) {
-        throw InvalidMPEG( "invalid marker bit" );
-      }
-
-      if ( (packet.at( 13 ) & 0x01) != 1 ) {
-         throw InvalidMPEG( "invalid marker bit" );
-      }
-    }
-
-    if ( PTS_DTS_flags == 2 ) {
-      decoding_time_stamp = presentation_time_stamp;
-    }
-
-    //    cerr << "PES packet header, is_video=" << is_video << ", dts_27M = " << 300 * decoding_time_stamp << ", pts_27M = " << 300 * presentation_time_stamp << "\n";
-  }
-};
-
 struct VideoParameters
 {
   unsigned int width {};
@@ -548,6 +380,8 @@ private:
 
   unique_ptr<a52_state_t, A52Deleter> decoder_;
 
+  string frame_buffer_ {};
+
   sample_t check_sample( const sample_t & sample )
   {
     if ( sample > 32767.4 or sample < -32767.4 ) {
@@ -573,12 +407,17 @@ public:
       // cerr << "Audio frame with pts_27M = " << 300 * PES_packet.presentation_time_stamp << "\n";
 
       int flags, sample_rate, bit_rate;
-      const int frame_length = a52_syncinfo( PES_packet.payload_start(),
+      const int frame_length = a52_syncinfo( mutable_bytes( PES_packet.contiguous( PES_packet.payload_start_index,
+                                                                                   7, frame_buffer_ ) ),
                                              &flags, &sample_rate, &bit_rate );
       if ( frame_length == 0 ) {
         throw InvalidMPEG( "invalid A/52 frame" );
       }
 
+      if ( size_t( frame_length ) > PES_packet.payload_length() ) {
+        throw InvalidMPEG( "A/52 frame extends past end of PES packet" );
+      }
+
       if ( sample_rate != atsc_audio_sample_rate ) {
         throw UnsupportedMPEG( "unsupported sample_rate of " + to_string( sample_rate ) + " Hz" );
       }
@@ -586,7 +425,11 @@ public:
       flags = A52_STEREO | A52_ADJUST_LEVEL;
       sample_t level = 32767;
 
-      if ( a52_frame( decoder_.get(), PES_packet.payload_start(),
+      /* frames usually straddle TS packets, so this gathers them into frame_buffer_ */
+      const string_view frame = PES_packet.contiguous( PES_packet.payload_start_index,
+                                                       frame_length, frame_buffer_ );
+
+      if ( a52_frame( decoder_.get(), mutable_bytes( frame ),
                       &flags, &level, 0 ) ) {
         throw InvalidMPEG( "a52_frame returned error" );
       }
@@ -743,35 +586,10 @@ private:
     }
   }
 
-public:
-  MPEG2VideoDecoder( const VideoParameters & params )
-    : decoder_( notnull( "mpeg2_init", mpeg2_init() ) ),
-      display_width_( params.width ),
-      display_height_( params.height ),
-      frame_interval_( params.frame_interval ),
-      progressive_sequence_( params.progressive )
-  {
-    if ( (display_width_ % 4 != 0)
-         or (display_height_ % 4 != 0) ) {
-      throw runtime_error( "width or height is not multiple of 4" );
-    }
-  }
-
-  void decode_frame( TimestampedPESPacket & PES_packet, /* mutable because mpeg2_buffer args are not const */
-                     queue<VideoField> & output )
+  /* actually decode until libmpeg2 has consumed its buffer */
+  void decode_buffered( unsigned int & picture_count,
+                        queue<VideoField> & output )
   {
-    mpeg2_tag_picture( decoder_.get(),
-                       PES_packet.presentation_time_stamp >> 32,
-                       PES_packet.presentation_time_stamp & 0xFFFFFFFF );
-
-    /* give bytes to the MPEG-2 video decoder */
-    mpeg2_buffer( decoder_.get(),
-                  PES_packet.payload_start(),
-                  PES_packet.payload_end() );
-
-    /* actually decode the frame */
-    unsigned int picture_count = 0;
-
     while ( true ) {
       mpeg2_state_t state = mpeg2_parse( decoder_.get() );
       const mpeg2_info_t * decoder_info = notnull( "mpeg2_info",
@@ -817,65 +635,207 @@ public:
       }
     }
   }
+
+public:
+  MPEG2VideoDecoder( const VideoParameters & params )
+    : decoder_( notnull( "mpeg2_init", mpeg2_init() ) ),
+      display_width_( params.width ),
+      display_height_( params.height ),
+      frame_interval_( params.frame_interval ),
+      progressive_sequence_( params.progressive )
+  {
+    if ( (display_width_ % 4 != 0)
+         or (display_height_ % 4 != 0) ) {
+      throw runtime_error( "width or height is not multiple of 4" );
+    }
+  }
+
+  void decode_frame( const TimestampedPESPacket & PES_packet,
+                     queue<VideoField> & output )
+  {
+    mpeg2_tag_picture( decoder_.get(),
+                       PES_packet.presentation_time_stamp >> 32,
+                       PES_packet.presentation_time_stamp & 0xFFFFFFFF );
+
+    unsigned int picture_count = 0;
+
+    /* give each TS packet's worth of bytes to the MPEG-2 video decoder in turn
+       (libmpeg2 accepts a fragmented bitstream and asks for more with STATE_BUFFER) */
+    PES_packet.for_each_payload_span(
+      [&] ( const string_view & span ) {
+        mpeg2_buffer( decoder_.get(),
+                      mutable_bytes( span ),
+                      mutable_bytes( span ) + span.size() );
+
+        decode_buffered( picture_count, output );
+      } );
+  }
+};
+
+/* a completed chunk of frames, with what its .y4m.info file will need */
+struct Y4MChunk
+{
+  vector<Raster> frames {};
+  uint64_t outer_timestamp {};
+  int64_t due_wallclock_ms {};
+  unsigned int filler_field_count {};
 };
 
-class TSParser
+/* Writes completed chunks to disk on its own thread, so the decoder only
+   waits for the disk if it falls a whole chunk behind */
+class Y4MChunkWriter
 {
 private:
-  unsigned int pid_; /* program ID of interest */
-  bool is_video_; /* true = video, false = audio */
+  string directory_;
+  string tmp_directory_; /* if not empty, write here first and then move to directory_ */
+  string y4m_header_;
 
-  string PES_packet_ {};
+  mutex mutex_ {};
+  condition_variable job_changed_ {};
+  const Y4MChunk * job_ { nullptr };
+  bool shutting_down_ { false };
+  exception_ptr error_ {};
 
-  void append_payload( const string_view & packet, const TSPacketHeader & header )
-  {
-    const string_view payload = packet.substr( header.payload_start );
-    PES_packet_.append( payload.begin(), payload.end() );
-  }
+  thread thread_;
 
-public:
-  TSParser( const unsigned int pid, const bool is_video )
-    : pid_( pid ),
-      is_video_( is_video )
+  void write_chunk( const Y4MChunk & chunk ) const
   {
-    if ( pid >= (1 << 13) ) {
-      throw runtime_error( "program ID must be less than " + to_string( 1 << 13 ) );
+    const string filename = to_string( chunk.outer_timestamp ) + ".y4m";
+    const string info_filename = to_string( chunk.outer_timestamp ) + ".y4m.info";
+
+    /* output to tmp_directory_ first if it is not empty */
+    string output_dir = tmp_directory_.empty() ? directory_ : tmp_directory_;
+
+    FileDescriptor directory_fd_ { CheckSystemCall( "open " + output_dir, open( output_dir.c_str(),
+                                                                                O_DIRECTORY ) ) };
+
+    FileDescriptor output_ { CheckSystemCall( "openat", openat( directory_fd_.fd_num(),
+                                                                filename.c_str(),
+                                                                O_WRONLY | O_CREAT | O_EXCL,
+                                                                S_IRUSR | S_IWUSR ) ) };
+
+    /* header, then FRAME marker and Y, Cb, Cr planes for each frame, gathered into few writev calls */
+    vector<string_view> buffers { y4m_header_ };
+
+    for ( const auto & frame : chunk.frames ) {
+      buffers.emplace_back( "FRAME\n" );
+      buffers.emplace_back( reinterpret_cast<char *>( frame.Y.get() ), frame.width * frame.height );
+      buffers.emplace_back( reinterpret_cast<char *>( frame.Cb.get() ), (frame.width/2) * (frame.height/2) );
+      buffers.emplace_back( reinterpret_cast<char *>( frame.Cr.get() ), (frame.width/2) * (frame.height/2) );
+    }
+
+    output_.writev( buffers );
+
+    output_.close(); /* make sure output is flushed before renaming */
+
+    /* move output file if tmp_directory_ is not empty */
+    if ( output_dir != directory_ ) {
+      fs::rename( fs::path( output_dir ) / filename,
+                  fs::path( directory_ ) / filename );
+    }
+
+    const int due_in_ms = chunk.due_wallclock_ms - timestamp_ms();
+
+    cerr << "Wrote " << output_dir + "/" + filename << " (due in " << due_in_ms << " ms)\n";
+
+    /* write diagnostic output */
+    FileDescriptor info_ { CheckSystemCall( "openat", openat( directory_fd_.fd_num(),
+                                                              info_filename.c_str(),
+                                                              O_WRONLY | O_CREAT | O_EXCL,
+                                                              S_IRUSR | S_IWUSR ) ) };
+
+    string info_string = /* wallclock timestamp */ to_string( timestamp_ms() ) + " "
+      + /* video timestamp */ to_string( chunk.outer_timestamp ) + " "
+      + /* due in (ms) */ to_string( due_in_ms ) + " "
+      + /* filler fields */ to_string( chunk.filler_field_count );
+
+    info_.write( info_string + "\n");
+
+    info_.close();
+
+    if ( output_dir != directory_ ) {
+      fs::rename( fs::path( output_dir ) / info_filename,
+                  fs::path( directory_ ) / info_filename );
     }
   }
 
-  void parse( const string_view & packet, queue<TimestampedPESPacket> & PES_packets )
+  void loop()
   {
-    TSPacketHeader header { packet };
+    unique_lock<mutex> lock { mutex_ };
 
-    if ( header.pid != pid_ ) {
-      return;
+    while ( true ) {
+      job_changed_.wait( lock, [&] { return job_ or shutting_down_; } );
+
+      if ( not job_ ) {
+        return;
+      }
+
+      lock.unlock();
+
+      try {
+        write_chunk( *job_ );
+      } catch ( ... ) {
+        lock.lock();
+        error_ = current_exception();
+        job_ = nullptr;
+        job_changed_.notify_all();
+        return;
+      }
+
+      lock.lock();
+      job_ = nullptr;
+      job_changed_.notify_all();
     }
+  }
+
+public:
+  Y4MChunkWriter( const string & directory, const string & tmp_directory,
+                  const string & y4m_header )
+    : directory_( directory ),
+      tmp_directory_( tmp_directory ),
+      y4m_header_( y4m_header ),
+      thread_( [&] { loop(); } )
+  {}
 
-    if ( header.payload_unit_start_indicator ) {
-      /* start of new PES packet */
+  ~Y4MChunkWriter()
+  {
+    {
+      unique_lock<mutex> lock { mutex_ };
+      shutting_down_ = true; /* but finish the chunk in progress */
+      job_changed_.notify_all();
+    }
 
-      /* step 1: parse and decode old PES packet if there is one */
-      if ( not PES_packet_.empty() ) {
-        /* make sure PES_packet_ is cleared even if header parsers subsequently throw an exception */
-        string PES_packet = move( PES_packet_ );
-        PES_packet_.clear();
+    thread_.join();
+  }
 
-        /* now, attempt to parse the accumulated payload as a PES packet */
-        PESPacketHeader pes_header { PES_packet, is_video_ };
+  /* wait until the last submitted chunk is on disk (or failed to get there) */
+  void wait_idle()
+  {
+    unique_lock<mutex> lock { mutex_ };
 
-        PES_packets.emplace( pes_header.presentation_time_stamp,
-                             pes_header.payload_start,
-                             pes_header.PES_packet_length,
-                             move( PES_packet ) );
-      }
+    if ( job_ ) {
+      cerr << "Warning: waiting for the previous video chunk to reach the disk\n";
+      job_changed_.wait( lock, [&] { return not job_; } );
+    }
 
-      /* step 2: start a new PES packet */
-      append_payload( packet, header );
-    } else if ( not PES_packet_.empty() ) {
-      /* interior TS packet within a PES packet */
-      append_payload( packet, header );
+    if ( error_ ) {
+      rethrow_exception( error_ );
     }
   }
+
+  /* chunk must not be touched again until wait_idle() returns */
+  void submit( const Y4MChunk & chunk )
+  {
+    wait_idle();
+
+    unique_lock<mutex> lock { mutex_ };
+    job_ = &chunk;
+    job_changed_.notify_all();
+  }
+
+  /* forbid copying */
+  Y4MChunkWriter( const Y4MChunkWriter & other ) = delete;
+  Y4MChunkWriter & operator=( const Y4MChunkWriter & other ) = delete;
 };
 
 class Y4M_Writer
@@ -886,21 +846,30 @@ private:
   uint64_t wallclock_time_for_outer_timestamp_zero_;
   uint64_t pending_chunk_outer_timestamp_ {};
   unsigned int pending_chunk_index_ {};
-  vector<Raster> pending_chunk_;
+
+  /* double buffer: one chunk being filled while the other is written out */
+  array<Y4MChunk, 2> chunks_ {};
+  unsigned int filling_chunk_ {};
   unsigned int filler_field_count_ {};
 
   unsigned int frame_interval_;
 
   string directory_;
-  string y4m_header_;
 
   uint64_t outer_timestamp_ {};
 
   optional<int64_t> last_offset_ {};
 
+  Y4MChunkWriter disk_writer_;
+
+  vector<Raster> & pending_chunk()
+  {
+    return chunks_.at( filling_chunk_ ).frames;
+  }
+
   Raster & pending_frame()
   {
-    return pending_chunk_.at( pending_chunk_index_ );
+    return pending_chunk().at( pending_chunk_index_ );
   }
 
   void write_frame_to_disk( const uint64_t first_field_presentation_time_stamp )
@@ -911,68 +880,19 @@ private:
       cerr << wallclock_ms_until_next_chunk_is_due() << " ms until this chunk is due.\n";
     }
 
-    if ( pending_chunk_index_ == pending_chunk_.size() - 1 ) {
-      const string filename = to_string( pending_chunk_outer_timestamp_ ) + ".y4m";
-      const string info_filename = to_string( pending_chunk_outer_timestamp_ ) + ".y4m.info";
-
-      /* output to tmp_dir first if tmp_dir is not empty */
-      string output_dir = tmp_dir.empty() ? directory_ : tmp_dir;
+    if ( pending_chunk_index_ == pending_chunk().size() - 1 ) {
+      Y4MChunk & chunk = chunks_.at( filling_chunk_ );
+      chunk.outer_timestamp = pending_chunk_outer_timestamp_;
+      chunk.due_wallclock_ms = pending_chunk_outer_timestamp_ / 90 + wallclock_time_for_outer_timestamp_zero_;
+      chunk.filler_field_count = filler_field_count_;
 
-      cerr << "Writing " << output_dir + "/" + filename << " ... ";
-      cerr << "(due in " << wallclock_ms_until_next_chunk_is_due() << " ms) ";
+      cerr << "Writing video chunk " << pending_chunk_outer_timestamp_ << " in the background ";
+      cerr << "(due in " << wallclock_ms_until_next_chunk_is_due() << " ms)\n";
 
-      FileDescriptor directory_fd_ { CheckSystemCall( "open " + output_dir, open( output_dir.c_str(),
-                                                                                  O_DIRECTORY ) ) };
-
-      FileDescriptor output_ { CheckSystemCall( "openat", openat( directory_fd_.fd_num(),
-                                                                  filename.c_str(),
-                                                                  O_WRONLY | O_CREAT | O_EXCL,
-                                                                  S_IRUSR | S_IWUSR ) ) };
-
-      output_.write( y4m_header_ );
-
-      for ( const auto & pending_frame : pending_chunk_ ) {
-        output_.write( "FRAME\n" );
-
-        /* Y */
-        output_.write( string_view { reinterpret_cast<char *>( pending_frame.Y.get() ), pending_frame.width * pending_frame.height } );
-
-        /* Cb */
-        output_.write( string_view { reinterpret_cast<char *>( pending_frame.Cb.get() ), (pending_frame.width/2) * (pending_frame.height/2) } );
-
-        /* Cr */
-        output_.write( string_view { reinterpret_cast<char *>( pending_frame.Cr.get() ), (pending_frame.width/2) * (pending_frame.height/2) } );
-      }
-
-      output_.close(); /* make sure output is flushed before renaming */
-
-      /* move output file if tmp_dir is not empty */
-      if ( output_dir != directory_ ) {
-        fs::rename( fs::path( output_dir ) / filename,
-                    fs::path( directory_ ) / filename );
-      }
-
-      cerr << "done.\n";
-
-      /* write diagnostic output */
-      FileDescriptor info_ { CheckSystemCall( "openat", openat( directory_fd_.fd_num(),
-                                                                info_filename.c_str(),
-                                                                O_WRONLY | O_CREAT | O_EXCL,
-                                                                S_IRUSR | S_IWUSR ) ) };
-
-      string info_string = /* wallclock timestamp */ to_string( timestamp_ms() ) + " "
-        + /* video timestamp */ to_string( pending_chunk_outer_timestamp_ ) + " "
-        + /* due in (ms) */ to_string( wallclock_ms_until_next_chunk_is_due() ) + " "
-        + /* filler fields */ to_string( filler_field_count_ );
-
-      info_.write( info_string + "\n");
-
-      info_.close();
-
-      if ( output_dir != directory_ ) {
-        fs::rename( fs::path( output_dir ) / info_filename,
-                    fs::path( directory_ ) / info_filename );
-      }
+      /* hand the chunk to the disk writer and start filling the other buffer
+         (submit waits for the other buffer's previous contents to be written) */
+      disk_writer_.submit( chunk );
+      filling_chunk_ = 1 - filling_chunk_;
 
       /* reset filler field count */
       filler_field_count_ = 0;
@@ -986,24 +906,27 @@ private:
     /* advance virtual clock */
     last_offset_ = first_field_presentation_time_stamp - outer_timestamp_;
     outer_timestamp_ += frame_interval_;
-    pending_chunk_index_ = (pending_chunk_index_ + 1) % pending_chunk_.size();
+    pending_chunk_index_ = (pending_chunk_index_ + 1) % pending_chunk().size();
   }
 
 public:
   Y4M_Writer( const uint64_t initial_wallclock_timestamp,
               const string directory,
+              const string tmp_directory,
               const unsigned int frames_per_chunk,
               const VideoParameters & params )
     : wallclock_time_for_outer_timestamp_zero_( initial_wallclock_timestamp ),
-      pending_chunk_(),
       frame_interval_( params.frame_interval ),
       directory_( directory ),
-      y4m_header_( "YUV4MPEG2 W" + to_string( params.width )
-                   + " H" + to_string( params.height ) + " " + params.y4m_description
-                   + " A1:1 C420mpeg2\n" )
+      disk_writer_( directory, tmp_directory,
+                    "YUV4MPEG2 W" + to_string( params.width )
+                    + " H" + to_string( params.height ) + " " + params.y4m_description
+                    + " A1:1 C420mpeg2\n" )
   {
-    for ( unsigned int i = 0; i < frames_per_chunk; i++ ) {
-      pending_chunk_.emplace_back( params.width, params.height );
+    for ( auto & chunk : chunks_ ) {
+      for ( unsigned int i = 0; i < frames_per_chunk; i++ ) {
+        chunk.frames.emplace_back( params.width, params.height );
+      }
     }
   }
 
@@ -1025,33 +948,7 @@ public:
     }
 
     /* copy field to proper lines of pending frame */
-
-    /* copy Y */
-    for ( unsigned int source_row = 0, dest_row = (next_field_is_top_ ? 0 : 1);
-          source_row < field.contents->height;
-          source_row += 1, dest_row += 2 ) {
-      memcpy( pending_frame().Y.get() + dest_row * pending_frame().width,
-              field.contents->Y.get() + source_row * pending_frame().width,
-              pending_frame().width );
-    }
-
-    /* copy Cb */
-    for ( unsigned int source_row = 0, dest_row = (next_field_is_top_ ? 0 : 1);
-          source_row < field.contents->height/2;
-          source_row += 1, dest_row += 2 ) {
-      memcpy( pending_frame().Cb.get() + dest_row * pending_frame().width/2,
-              field.contents->Cb.get() + source_row * pending_frame().width/2,
-              pending_frame().width/2 );
-    }
-
-    /* copy Cr */
-    for ( unsigned int source_row = 0, dest_row = (next_field_is_top_ ? 0 : 1);
-          source_row < field.contents->height/2;
-          source_row += 1, dest_row += 2 ) {
-      memcpy( pending_frame().Cr.get() + dest_row * pending_frame().width/2,
-              field.contents->Cr.get() + source_row * pending_frame().width/2,
-              pending_frame().width/2 );
-    }
+    field.contents->write_to_frame( next_field_is_top_, pending_frame() );
 
     next_field_is_top_ = !next_field_is_top_;
 
@@ -1153,6 +1050,7 @@ private:
   string overlap_samples_;
 
   string directory_;
+  string tmp_directory_; /* if not empty, write here first and then move to directory_ */
   string wav_header_;
 
   uint64_t outer_timestamp_ {};
@@ -1162,12 +1060,14 @@ private:
 public:
   WavWriter( const uint64_t initial_wallclock_timestamp,
              const string directory,
+             const string tmp_directory,
              const unsigned int audio_blocks_per_chunk,
              const unsigned int audio_sample_overlap )
     : wallclock_time_for_outer_timestamp_zero_( initial_wallclock_timestamp ),
       pending_chunk_(),
       overlap_samples_( audio_sample_overlap * 2 * 2, 0 ),
       directory_( directory ),
+      tmp_directory_( tmp_directory ),
       wav_header_()
   {
     for ( unsigned int i = 0; i < audio_blocks_per_chunk; i++ ) {
@@ -1226,8 +1126,8 @@ public:
     if ( pending_chunk_index_ == pending_chunk_.size() - 1 ) {
       const string filename = to_string( pending_chunk_outer_timestamp_ ) + ".wav";
 
-      /* output to tmp_dir first if tmp_dir is not empty */
-      string output_dir = tmp_dir.empty() ? directory_ : tmp_dir;
+      /* output to tmp_directory_ first if it is not empty */
+      string output_dir = tmp_directory_.empty() ? directory_ : tmp_directory_;
 
       cerr << "Writing " << output_dir + "/" + filename << " ... ";
       cerr << "(due in " << wallclock_ms_until_next_chunk_is_due() << " ms) ";
@@ -1274,7 +1174,7 @@ public:
 
       output_.close(); /* make sure output is flushed before renaming */
 
-      /* move output file if tmp_dir is not empty */
+      /* move output file if tmp_directory_ is not empty */
       if ( output_dir != directory_ ) {
         fs::rename( fs::path( output_dir ) / filename,
                     fs::path( directory_ ) / filename );
@@ -1367,8 +1267,6 @@ public:
 
 class AudioVideoDecoder
 {
-  TSParser video_parser;
-  TSParser audio_parser;
   queue<TimestampedPESPacket> video_PES_packets {}; /* output of TSParser */
   queue<TimestampedPESPacket> audio_PES_packets {}; /* output of TSParser */
 
@@ -1386,8 +1284,6 @@ class AudioVideoDecoder
   optional<VideoOutput> video_output {};
   optional<AudioOutput> audio_output {};
 
-  string input_buffer {};
-
   void resync()
   {
     /* synchronize the outputs before the resync */
@@ -1427,49 +1323,22 @@ class AudioVideoDecoder
   }
 
 public:
-  AudioVideoDecoder( const unsigned int video_pid,
-                     const unsigned int audio_pid,
-                     const VideoParameters & params,
+  AudioVideoDecoder( const VideoParameters & params,
                      const unsigned int frames_per_chunk,
                      const unsigned int audio_blocks_per_chunk,
                      const unsigned int audio_sample_overlap,
                      const string & video_directory,
                      const string & audio_directory,
+                     const string & tmp_directory,
                      const uint64_t initial_wallclock_timestamp )
-    : video_parser( video_pid, true ),
-      audio_parser( audio_pid, false ),
-      params( params ),
-      y4m_writer( initial_wallclock_timestamp, video_directory, frames_per_chunk, params ),
-      wav_writer( initial_wallclock_timestamp, audio_directory, audio_blocks_per_chunk, audio_sample_overlap )
+    : params( params ),
+      y4m_writer( initial_wallclock_timestamp, video_directory, tmp_directory, frames_per_chunk, params ),
+      wav_writer( initial_wallclock_timestamp, audio_directory, tmp_directory, audio_blocks_per_chunk, audio_sample_overlap )
   {}
 
-  void parse_input( const string & new_chunk )
-  {
-    /* parse transport stream packets into video and audio PES packets */
-    input_buffer.append( new_chunk );
-
-    if ( input_buffer.size() < ts_packet_length ) {
-      return;
-    }
-
-    const unsigned int packets_in_chunk = input_buffer.size() / ts_packet_length;
-    const string chunk = input_buffer.substr( 0, packets_in_chunk * ts_packet_length );
-    input_buffer.erase( 0, packets_in_chunk * ts_packet_length );
-    const string_view chunk_view { chunk };
-
-    for ( unsigned packet_no = 0; packet_no < packets_in_chunk; packet_no++ ) {
-      try {
-        video_parser.parse( chunk_view.substr( packet_no * ts_packet_length,
-                                               ts_packet_length ),
-                            video_PES_packets );
-        audio_parser.parse( chunk_view.substr( packet_no * ts_packet_length,
-                                               ts_packet_length ),
-                            audio_PES_packets );
-      } catch ( const non_fatal_exception & e ) {
-        print_exception( "transport stream input", e );
-      }
-    }
-  }
+  /* where the video and audio TSParsers should put PES packets */
+  queue<TimestampedPESPacket> & video_input() { return video_PES_packets; }
+  queue<TimestampedPESPacket> & audio_input() { return audio_PES_packets; }
 
   void decode_video()
   {
@@ -1578,6 +1447,208 @@ public:
   }
 };
 
+/* one program's worth of command-line arguments */
+struct ProgramArguments
+{
+  unsigned int video_pid;
+  unsigned int audio_pid;
+  VideoParameters params;
+  unsigned int frames_per_chunk;
+  unsigned int audio_blocks_per_chunk;
+  unsigned int audio_sample_overlap;
+  string video_directory;
+  string audio_directory;
+  string tmp_directory;
+
+  /* the eight positional arguments of single-program mode */
+  ProgramArguments( const vector<string> & args, const string & s_tmp_directory )
+    : video_pid( stoi( args.at( 0 ), nullptr, 0 ) ),
+      audio_pid( stoi( args.at( 1 ), nullptr, 0 ) ),
+      /* NB: "1080i30" is the preferred notation in Poynton's books and "Video Demystified" */
+      params( args.at( 2 ) ),
+      frames_per_chunk( stoi( args.at( 3 ) ) ),
+      audio_blocks_per_chunk( stoi( args.at( 4 ) ) ),
+      audio_sample_overlap( stoi( args.at( 5 ) ) ),
+      video_directory( args.at( 6 ) ),
+      audio_directory( args.at( 7 ) ),
+      tmp_directory( s_tmp_directory )
+  {
+    if ( audio_sample_overlap != opus_sample_overlap ) {
+      throw runtime_error( "audio_sample_overlap must be " + to_string( opus_sample_overlap ) );
+    }
+  }
+};
+
+/* In multi-program mode, each program is decoded on its own thread. The
+   ingest thread parses the program's PES packets into staging queues and
+   posts them here; they stay pinned in the ingest ring until decoded. */
+class ProgramWorker
+{
+private:
+  TSParser video_parser_;
+  TSParser audio_parser_;
+  queue<TimestampedPESPacket> video_staging_ {}; /* ingest thread only */
+  queue<TimestampedPESPacket> audio_staging_ {}; /* ingest thread only */
+
+  mutex mutex_ {};
+  condition_variable posted_ {};
+  queue<TimestampedPESPacket> video_mailbox_ {};
+  queue<TimestampedPESPacket> audio_mailbox_ {};
+  optional<uint64_t> decoding_offset_ {}; /* oldest PES packet taken but not yet decoded */
+  bool shutting_down_ { false };
+  exception_ptr error_ {};
+
+  AudioVideoDecoder decoder_; /* worker thread only */
+  FileDescriptor & wakeup_;   /* tells the ingest thread that input was released */
+  thread thread_;
+
+  static void note_oldest( const queue<TimestampedPESPacket> & PES_packets,
+                           optional<uint64_t> & oldest_offset )
+  {
+    if ( not PES_packets.empty()
+         and ( not oldest_offset or PES_packets.front().input_offset < *oldest_offset ) ) {
+      oldest_offset = PES_packets.front().input_offset;
+    }
+  }
+
+  static void take_all( queue<TimestampedPESPacket> & from,
+                        queue<TimestampedPESPacket> & to,
+                        optional<uint64_t> & oldest_offset )
+  {
+    note_oldest( from, oldest_offset );
+
+    while ( not from.empty() ) {
+      to.push( move( from.front() ) );
+      from.pop();
+    }
+  }
+
+  void loop()
+  {
+    unique_lock<mutex> lock { mutex_ };
+
+    while ( true ) {
+      /* same cadence as single-program mode: decode what arrived, or time out after 500 ms */
+      posted_.wait_for( lock, chrono::milliseconds( 500 ),
+                        [&] { return shutting_down_
+                                     or not video_mailbox_.empty()
+                                     or not audio_mailbox_.empty(); } );
+
+      /* on shutdown, decode what has been posted before returning */
+      const bool last_round = shutting_down_;
+
+      take_all( video_mailbox_, decoder_.video_input(), decoding_offset_ );
+      take_all( audio_mailbox_, decoder_.audio_input(), decoding_offset_ );
+
+      lock.unlock();
+
+      try {
+        decoder_.decode_video();
+        decoder_.decode_audio();
+        decoder_.output_video();
+        decoder_.output_audio();
+        decoder_.check_av_sync();
+        decoder_.enforce_wallclock_lag_limit();
+      } catch ( ... ) {
+        lock.lock();
+        error_ = current_exception();
+        return;
+      }
+
+      lock.lock();
+      decoding_offset_.reset();
+
+      /* not FileDescriptor::write(), whose counters are not thread-safe */
+      CheckSystemCall( "write", ::write( wakeup_.fd_num(), "x", 1 ) );
+
+      if ( last_round ) {
+        return;
+      }
+    }
+  }
+
+  void stop()
+  {
+    {
+      unique_lock<mutex> lock { mutex_ };
+      shutting_down_ = true;
+      posted_.notify_all();
+    }
+
+    if ( thread_.joinable() ) {
+      thread_.join();
+    }
+  }
+
+public:
+  ProgramWorker( const ProgramArguments & args,
+                 TSIngest & ingest,
+                 FileDescriptor & wakeup,
+                 const uint64_t initial_wallclock_timestamp )
+    : video_parser_( args.video_pid, true ),
+      audio_parser_( args.audio_pid, false ),
+      decoder_( args.params, args.frames_per_chunk, args.audio_blocks_per_chunk,
+                args.audio_sample_overlap, args.video_directory, args.audio_directory,
+                args.tmp_directory, initial_wallclock_timestamp ),
+      wakeup_( wakeup ),
+      thread_( [&] { loop(); } )
+  {
+    ingest.add_stream( video_parser_, video_staging_ );
+    ingest.add_stream( audio_parser_, audio_staging_ );
+    ingest.add_pin( [&] { return oldest_pinned(); } );
+  }
+
+  ~ProgramWorker()
+  {
+    stop();
+  }
+
+  /* ingest thread: let the worker decode what has been posted, then stop
+     it and rethrow whatever went wrong */
+  void finish()
+  {
+    stop();
+    check_error();
+  }
+
+  /* ingest thread: hand newly parsed PES packets to the worker */
+  void post()
+  {
+    if ( video_staging_.empty() and audio_staging_.empty() ) {
+      return;
+    }
+
+    unique_lock<mutex> lock { mutex_ };
+    optional<uint64_t> unused;
+    take_all( video_staging_, video_mailbox_, unused );
+    take_all( audio_staging_, audio_mailbox_, unused );
+    posted_.notify_all();
+  }
+
+  /* ingest offset of the oldest PES packet the worker still needs */
+  optional<uint64_t> oldest_pinned()
+  {
+    unique_lock<mutex> lock { mutex_ };
+    optional<uint64_t> oldest = decoding_offset_;
+    note_oldest( video_mailbox_, oldest );
+    note_oldest( audio_mailbox_, oldest );
+    return oldest;
+  }
+
+  /* rethrow whatever stopped the worker */
+  void check_error()
+  {
+    unique_lock<mutex> lock { mutex_ };
+    if ( error_ ) {
+      rethrow_exception( error_ );
+    }
+  }
+
+  /* forbid copying */
+  ProgramWorker( const ProgramWorker & other ) = delete;
+  ProgramWorker & operator=( const ProgramWorker & other ) = delete;
+};
+
 int main( int argc, char *argv[] )
 {
   try {
@@ -1586,15 +1657,18 @@ int main( int argc, char *argv[] )
     }
 
     string tcp_addr;
+    string tmp_dir;
+    vector<string> program_args;
 
     const option cmd_line_opts[] = {
-      { "tmp",    required_argument, nullptr, 't' },
-      { "tcp",    required_argument, nullptr, 'c' },
-      { nullptr,  0,                 nullptr,  0  }
+      { "tmp",     required_argument, nullptr, 't' },
+      { "tcp",     required_argument, nullptr, 'c' },
+      { "program", required_argument, nullptr, 'p' },
+      { nullptr,   0,                 nullptr,  0  }
     };
 
     while ( true ) {
-      const int opt = getopt_long( argc, argv, "t:c:", cmd_line_opts, nullptr );
+      const int opt = getopt_long( argc, argv, "t:c:p:", cmd_line_opts, nullptr );
       if ( opt == -1 ) {
         break;
       }
@@ -1606,29 +1680,47 @@ int main( int argc, char *argv[] )
       case 'c':
         tcp_addr = optarg;
         break;
+      case 'p':
+        program_args.emplace_back( optarg );
+        break;
       default:
         print_usage( argv[0] );
         return EXIT_FAILURE;
       }
     }
 
-    if ( optind != argc - 8 ) {
+    const bool multi_program = not program_args.empty();
+
+    if ( optind != argc - ( multi_program ? 0 : 8 )
+         or ( multi_program and not tmp_dir.empty() ) ) {
       print_usage( argv[0] );
       return EXIT_FAILURE;
     }
 
-    /* NB: "1080i30" is the preferred notation in Poynton's books and "Video Demystified" */
-    const unsigned int video_pid = stoi( argv[ optind++ ], nullptr, 0 );
-    const unsigned int audio_pid = stoi( argv[ optind++ ], nullptr, 0 );
-    const VideoParameters params { argv[ optind++ ] };
-    const unsigned int frames_per_chunk = stoi( argv[ optind++ ] );
-    const unsigned int audio_blocks_per_chunk = stoi( argv[ optind++ ] );
-    const unsigned int audio_sample_overlap = stoi( argv[ optind++ ] );
-    const string video_directory = argv[ optind++ ];
-    const string audio_directory = argv[ optind++ ];
+    vector<ProgramArguments> programs;
+    if ( multi_program ) {
+      for ( const auto & arg : program_args ) {
+        vector<string> args;
+        for ( const auto & token : split( arg, " " ) ) {
+          if ( not token.empty() ) {
+            args.emplace_back( token );
+          }
+        }
 
-    if ( audio_sample_overlap != opus_sample_overlap ) {
-      throw runtime_error( "audio_sample_overlap must be " + to_string( opus_sample_overlap ) );
+        const string program_tmp_dir = args.size() == 9 ? args.back() : "";
+        if ( args.size() == 9 ) {
+          args.pop_back();
+        }
+
+        if ( args.size() != 8 ) {
+          print_usage( argv[0] );
+          return EXIT_FAILURE;
+        }
+
+        programs.emplace_back( args, program_tmp_dir );
+      }
+    } else {
+      programs.emplace_back( vector<string>( argv + optind, argv + argc ), tmp_dir );
     }
 
     shared_ptr<FileDescriptor> input;
@@ -1646,16 +1738,78 @@ int main( int argc, char *argv[] )
       cerr << "Connected to " << tcp_addr << endl;
     }
 
-    AudioVideoDecoder decoder { video_pid, audio_pid, params,
-                                frames_per_chunk, audio_blocks_per_chunk,
-                                audio_sample_overlap,
-                                video_directory, audio_directory,
-                                timestamp_ms() };
+    const uint64_t initial_wallclock_timestamp = timestamp_ms();
 
     Poller poller;
+
+    if ( multi_program ) {
+      /* one ingest (and one copy of the multiplex in memory) feeds every program */
+      TSIngest ingest { TSIngest::default_capacity * programs.size() };
+
+      /* workers write a byte here whenever they release ingested input */
+      auto wakeup = make_pipe();
+
+      list<ProgramWorker> workers;
+      for ( const auto & program : programs ) {
+        workers.emplace_back( program, ingest, wakeup.second, initial_wallclock_timestamp );
+      }
+
+      poller.add_action( { wakeup.first, Direction::In,
+                           [&wakeup] {
+                             wakeup.first.read();
+                             return ResultType::Continue;
+                           } } );
+
+      /* while the ring is full of PES packets the decoding threads have not
+         caught up with, stop reading and let the input back up; wants_input()
+         drops partial PES packets only once they have stalled for a while */
+      bool input_error = false;
+      poller.add_action( { *input, Direction::In,
+                           [&ingest, &workers, &input] {
+                             ingest.read_from( *input );
+
+                             for ( auto & worker : workers ) {
+                               worker.post();
+                             }
+                             return ResultType::Continue;
+                           },
+                           [&ingest] { return ingest.wants_input( max_ingest_stall_ms ); },
+                           [&input_error] { input_error = true; } } );
+
+      while ( true ) {
+        const auto ret = poller.poll( 500 );
+        if ( ret.result == Poller::Result::Type::Exit or input->eof() or input_error ) {
+          for ( auto & worker : workers ) {
+            worker.finish();
+          }
+          return EXIT_SUCCESS;
+        }
+
+        for ( auto & worker : workers ) {
+          worker.check_error();
+        }
+      }
+    }
+
+    const ProgramArguments & program = programs.front();
+
+    AudioVideoDecoder decoder { program.params,
+                                program.frames_per_chunk, program.audio_blocks_per_chunk,
+                                program.audio_sample_overlap,
+                                program.video_directory, program.audio_directory,
+                                program.tmp_directory,
+                                initial_wallclock_timestamp };
+
+    TSParser video_parser { program.video_pid, true };
+    TSParser audio_parser { program.audio_pid, false };
+
+    TSIngest ingest;
+    ingest.add_stream( video_parser, decoder.video_input() );
+    ingest.add_stream( audio_parser, decoder.audio_input() );
+
     poller.add_action( { *input, Direction::In,
-                         [&decoder, &input] {
-                           decoder.parse_input( input->read() );
+                         [&decoder, &ingest, &input] {
+                           ingest.read_from( *input );
                            decoder.decode_video();
                            decoder.decode_audio();
                            return ResultType::Continue;
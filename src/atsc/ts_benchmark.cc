@@ -0,0 +1,159 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Measure TS ingest throughput (read, packet sync, PID filtering and PES
+   reassembly, but no decoding) over a recorded capture; or, given a ring
+   size, check that a consumer that lags behind gets every PES packet */
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <queue>
+#include <chrono>
+#include <optional>
+
+#include <fcntl.h>
+
+#include "ts_parser.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+/* the lagging consumer always catches up once ingest stalls, so any timeout
+   that made ingest drop PES packets instead would be a bug */
+static const uint64_t max_stall_ms = 60000;
+
+void print_usage( const string & program_name )
+{
+  cerr << "Usage: " << program_name << " capture.ts video_pid audio_pid [loops]\n"
+       << "       " << program_name << " capture.ts video_pid audio_pid --lagging ring_size"
+       << endl;
+}
+
+struct StreamStats
+{
+  uint64_t PES_packets {};
+  uint64_t payload_bytes {};
+
+  /* a consumer that lags behind holds PES packets until ingest stalls */
+  queue<TimestampedPESPacket> held {};
+
+  void hold( queue<TimestampedPESPacket> & PES_packets )
+  {
+    while ( not PES_packets.empty() ) {
+      held.push( move( PES_packets.front() ) );
+      PES_packets.pop();
+    }
+  }
+
+  optional<uint64_t> oldest_held() const
+  {
+    if ( held.empty() ) {
+      return {};
+    }
+
+    return held.front().input_offset;
+  }
+
+  void drain( queue<TimestampedPESPacket> & PES_packets )
+  {
+    while ( not PES_packets.empty() ) {
+      PES_packets.front().for_each_payload_span(
+        [&] ( const string_view & span ) { payload_bytes += span.size(); } );
+      PES_packets.pop();
+      this->PES_packets++;
+    }
+  }
+};
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc < 1 ) { /* for pedants */
+      abort();
+    }
+
+    const bool lagging = argc == 6 and string( argv[ 4 ] ) == "--lagging";
+
+    if ( argc != 4 and argc != 5 and not lagging ) {
+      print_usage( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+
+    FileDescriptor capture { CheckSystemCall( "open " + string( argv[ 1 ] ),
+                                              open( argv[ 1 ], O_RDONLY ) ) };
+    const unsigned int video_pid = stoi( argv[ 2 ], nullptr, 0 );
+    const unsigned int audio_pid = stoi( argv[ 3 ], nullptr, 0 );
+    const unsigned int loops = argc == 5 ? stoi( argv[ 4 ] ) : 1;
+    const size_t ring_size = lagging ? stoul( argv[ 5 ] ) : TSIngest::default_capacity;
+
+    TSParser video_parser { video_pid, true };
+    TSParser audio_parser { audio_pid, false };
+    queue<TimestampedPESPacket> video_PES_packets, audio_PES_packets;
+
+    TSIngest ingest { ring_size };
+    ingest.add_stream( video_parser, video_PES_packets );
+    ingest.add_stream( audio_parser, audio_PES_packets );
+
+    StreamStats video_stats, audio_stats;
+    uint64_t total_bytes = 0, stalls = 0;
+
+    ingest.add_pin( [&] {
+      optional<uint64_t> oldest = video_stats.oldest_held();
+      const optional<uint64_t> audio_oldest = audio_stats.oldest_held();
+      if ( not oldest or ( audio_oldest and *audio_oldest < *oldest ) ) {
+        oldest = audio_oldest;
+      }
+      return oldest;
+    } );
+
+    const auto start = steady_clock::now();
+
+    for ( unsigned int i = 0; i < loops; i++ ) {
+      capture.reset_offset();
+
+      while ( not capture.eof() ) {
+        if ( not lagging ) {
+          total_bytes += ingest.read_from( capture );
+          video_stats.drain( video_PES_packets );
+          audio_stats.drain( audio_PES_packets );
+          continue;
+        }
+
+        /* catch up only once ingest has stopped wanting input */
+        if ( not ingest.wants_input( max_stall_ms ) ) {
+          stalls++;
+          video_stats.drain( video_stats.held );
+          audio_stats.drain( audio_stats.held );
+          continue;
+        }
+
+        total_bytes += ingest.read_from( capture );
+        video_stats.hold( video_PES_packets );
+        audio_stats.hold( audio_PES_packets );
+      }
+    }
+
+    video_stats.drain( video_stats.held );
+    audio_stats.drain( audio_stats.held );
+
+    const double elapsed_s = duration<double>( steady_clock::now() - start ).count();
+
+    cout << "video PID " << video_pid << ": " << video_stats.PES_packets
+         << " PES packets, " << video_stats.payload_bytes << " payload bytes\n";
+    cout << "audio PID " << audio_pid << ": " << audio_stats.PES_packets
+         << " PES packets, " << audio_stats.payload_bytes << " payload bytes\n";
+    cout << "skipped " << ingest.bytes_skipped() << " bytes to regain sync\n";
+    if ( lagging ) {
+      cout << "stalled " << stalls << " times waiting for the consumer\n";
+    }
+    cout << fixed << setprecision( 1 )
+         << "ingested " << total_bytes / 1.0e6 << " MB in " << elapsed_s * 1000
+         << " ms: " << total_bytes / 1.0e6 / elapsed_s << " MB/s" << endl;
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,473 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "ts_parser.hh"
+
+#include <algorithm>
+#include <iostream>
+
+#include "exception.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+TSPacketRequirements::TSPacketRequirements( const string_view & packet )
+{
+  /* enforce invariants */
+  if ( packet.length() != ts_packet_length ) {
+    throw InvalidMPEG( "invalid TS packet length" );
+  }
+
+  if ( packet.front() != ts_packet_sync_byte ) {
+    throw InvalidMPEG( "invalid TS sync byte" );
+  }
+}
+
+TSPacketHeader::TSPacketHeader( const string_view & packet )
+  : TSPacketRequirements( packet ),
+    transport_error_indicator( packet[ 1 ] & 0x80 ),
+    payload_unit_start_indicator( packet[ 1 ] & 0x40 ),
+    pid( ts_packet_pid( packet.data() ) ),
+    adaptation_field_control( (uint8_t( packet[ 3 ] ) & 0x30) >> 4 ),
+    payload_start( 4 )
+{
+  /* find start of payload */
+  switch ( adaptation_field_control ) {
+  case 0:
+    throw UnsupportedMPEG( "reserved value of adaptation field control" );
+  case 1:
+    /* already 4 */
+    break;
+  case 2:
+    payload_start = ts_packet_length; /* no data */
+    break;
+  case 3:
+    const uint8_t adaptation_field_length = packet[ 4 ];
+    payload_start += adaptation_field_length + 1 /* length field is 1 byte itself */;
+    break;
+  }
+
+  if ( payload_start > ts_packet_length ) {
+    throw InvalidMPEG( "invalid TS packet" );
+  }
+}
+
+uint8_t PESPacketHeader::enforce_stream_id( const bool is_video, const uint8_t stream_id )
+{
+  if ( is_video ) {
+    if ( (stream_id & 0xf0) != 0xe0 ) {
+      throw StreamMismatch( "not an MPEG-2 video stream: " + to_string( stream_id ) );
+    }
+  } else {
+    if ( stream_id != 0xBD ) {
+      throw StreamMismatch( "not an A/52 audio stream: " + to_string( stream_id ) );
+    }
+  }
+
+  return stream_id;
+}
+
+PESPacketHeader::PESPacketHeader( const string_view & packet, const bool is_video )
+  : stream_id( enforce_stream_id( is_video, packet.at( 3 ) ) ),
+    payload_start( uint8_t( packet.at( 8 ) ) + 9 ),
+    PES_packet_length( (uint8_t( packet.at( 4 ) ) << 8) | uint8_t( packet.at( 5 ) ) ),
+    data_alignment_indicator( packet.at( 6 ) & 0x04 ),
+    PTS_DTS_flags( (packet.at( 7 ) & 0xc0) >> 6 ),
+    presentation_time_stamp(),
+    decoding_time_stamp()
+{
+  if ( packet.at( 0 ) != 0
+       or packet.at( 1 ) != 0
+       or packet.at( 2 ) != 1 ) {
+    throw InvalidMPEG( "invalid PES start code" );
+  }
+
+  if ( payload_start > packet.length() ) {
+    throw InvalidMPEG( "invalid PES packet" );
+  }
+
+  /*
+    unfortunately NBC San Francisco does not seem to use this
+  if ( not data_alignment_indicator ) {
+    throw runtime_error( "unaligned PES packet" );
+  }
+  */
+
+  switch ( PTS_DTS_flags ) {
+  case 0:
+    throw UnsupportedMPEG( "missing PTS and DTS" );
+  case 1:
+    throw InvalidMPEG( "forbidden value of PTS_DTS_flags" );
+  case 3:
+    decoding_time_stamp = (((uint64_t(uint8_t(packet.at( 14 )) & 0x0F) >> 1) << 30) |
+                           (uint8_t(packet.at( 15 )) << 22) |
+                           ((uint8_t(packet.at( 16 )) >> 1) << 15) |
+                           (uint8_t(packet.at( 17 )) << 7) |
+                           (uint8_t(packet.at( 18 )) >> 1));
+
+    if ( (packet.at( 14 ) & 0xf0) >> 4 != 1 ) {
+      throw InvalidMPEG( "invalid DTS prefix bits" );
+    }
+
+    if ( (packet.at( 14 ) & 0x01) != 1 ) {
+      throw InvalidMPEG( "invalid marker bit" );
+    }
+
+    if ( (packet.at( 16 ) & 0x01) != 1 ) {
+      throw InvalidMPEG( "invalid marker bit" );
+    }
+
+    if ( (packet.at( 18 ) & 0x01) != 1 ) {
+      throw InvalidMPEG( "invalid marker bit" );
+    }
+
+    /* fallthrough */
+
+  case 2:
+    presentation_time_stamp = (((uint64_t(uint8_t(packet.at( 9 )) & 0x0F) >> 1) << 30) |
+                               (uint8_t(packet.at( 10 )) << 22) |
+                               ((uint8_t(packet.at( 11 )) >> 1) << 15) |
+                               (uint8_t(packet.at( 12 )) << 7) |
+                               (uint8_t(packet.at( 13 )) >> 1));
+
+    if ( (packet.at( 9 ) & 0xf0) >> 4 != PTS_DTS_flags ) {
+      throw InvalidMPEG( "invalid PTS prefix bits" );
+    }
+
+    if ( (packet.at( 9 ) & 0x01) != 1 ) {
+      throw InvalidMPEG( "invalid marker bit" );
+    }
+
+    if ( (packet.at( 11 ) & 0x01) != 1 ) {
+      throw InvalidMPEG( "invalid marker bit" );
+    }
+
+    if ( (packet.at( 13 ) & 0x01) != 1 ) {
+       throw InvalidMPEG( "invalid marker bit" );
+    }
+  }
+
+  if ( PTS_DTS_flags == 2 ) {
+    decoding_time_stamp = presentation_time_stamp;
+  }
+
+  //    cerr << "PES packet header, is_video=" << is_video << ", dts_27M = " << 300 * decoding_time_stamp << ", pts_27M = " << 300 * presentation_time_stamp << "\n";
+}
+
+TimestampedPESPacket::TimestampedPESPacket( const uint64_t s_presentation_time_stamp,
+                                            const size_t s_payload_start_index,
+                                            const size_t PES_packet_length,
+                                            const uint64_t s_input_offset,
+                                            vector<string_view> && s_segments )
+  : presentation_time_stamp( s_presentation_time_stamp ),
+    payload_start_index( s_payload_start_index ),
+    payload_end_index( 0 ),
+    input_offset( s_input_offset ),
+    segments( move( s_segments ) )
+{
+  payload_end_index = size();
+
+  if ( payload_start_index >= size() ) {
+    throw InvalidMPEG( "empty PES payload" );
+  }
+
+  if ( PES_packet_length != 0 ) {
+    if ( PES_packet_length + 6 > size() ) {
+      throw InvalidMPEG( "PES_packet_length + 6 > PES_packet.size()" );
+    }
+
+    payload_end_index = PES_packet_length + 6;
+  }
+}
+
+size_t TimestampedPESPacket::size() const
+{
+  size_t total = 0;
+  for ( const auto & segment : segments ) {
+    total += segment.size();
+  }
+  return total;
+}
+
+size_t TimestampedPESPacket::payload_length() const
+{
+  if ( payload_end_index < payload_start_index ) {
+    throw InvalidMPEG( "payload ends before it starts" );
+  }
+  return payload_end_index - payload_start_index;
+}
+
+string_view TimestampedPESPacket::contiguous( const size_t index,
+                                              const size_t length,
+                                              string & scratch ) const
+{
+  size_t segment_start = 0;
+  auto segment = segments.begin();
+
+  /* find the segment containing index */
+  while ( segment != segments.end() and segment_start + segment->size() <= index ) {
+    segment_start += segment->size();
+    segment++;
+  }
+
+  if ( segment == segments.end() ) {
+    throw InvalidMPEG( "read past end of PES packet" );
+  }
+
+  /* common case: no copy */
+  if ( index + length <= segment_start + segment->size() ) {
+    return segment->substr( index - segment_start, length );
+  }
+
+  scratch.clear();
+  size_t offset = index - segment_start;
+  for ( ; segment != segments.end() and scratch.size() < length; segment++ ) {
+    scratch.append( segment->substr( offset, length - scratch.size() ) );
+    offset = 0;
+  }
+
+  if ( scratch.size() < length ) {
+    throw InvalidMPEG( "read past end of PES packet" );
+  }
+
+  return scratch;
+}
+
+TSParser::TSParser( const unsigned int pid, const bool is_video )
+  : pid_( pid ),
+    is_video_( is_video )
+{
+  if ( pid >= ts_max_pid ) {
+    throw runtime_error( "program ID must be less than " + to_string( ts_max_pid ) );
+  }
+}
+
+void TSParser::reset()
+{
+  PES_segments_.clear();
+  PES_input_offset_.reset();
+}
+
+void TSParser::append_payload( const string_view & packet,
+                               const TSPacketHeader & header,
+                               const uint64_t input_offset )
+{
+  if ( header.payload_start == ts_packet_length ) {
+    return;
+  }
+
+  if ( PES_segments_.empty() ) {
+    PES_input_offset_ = input_offset;
+  }
+
+  PES_segments_.push_back( packet.substr( header.payload_start ) );
+}
+
+void TSParser::parse( const string_view & packet, const uint64_t input_offset,
+                      queue<TimestampedPESPacket> & PES_packets )
+{
+  TSPacketHeader header { packet };
+
+  if ( header.pid != pid_ ) {
+    return;
+  }
+
+  if ( header.payload_unit_start_indicator ) {
+    /* start of new PES packet */
+
+    /* step 1: parse and decode old PES packet if there is one */
+    if ( not PES_segments_.empty() ) {
+      /* make sure the accumulator is cleared even if header parsers subsequently throw an exception */
+      TimestampedPESPacket PES_packet { 0, 0, 0, *PES_input_offset_, move( PES_segments_ ) };
+      reset();
+
+      /* now, attempt to parse the accumulated payload as a PES packet
+         (fixed fields plus optional header, normally all in the first TS packet) */
+      const uint8_t PES_header_data_length = PES_packet.contiguous( 0, 9, header_scratch_ )[ 8 ];
+      const size_t header_length = min( PES_packet.size(),
+                                        max<size_t>( 19, 9 + PES_header_data_length ) );
+      PESPacketHeader pes_header { PES_packet.contiguous( 0, header_length, header_scratch_ ),
+                                   is_video_ };
+
+      PES_packets.emplace( pes_header.presentation_time_stamp,
+                           pes_header.payload_start,
+                           pes_header.PES_packet_length,
+                           PES_packet.input_offset,
+                           move( PES_packet.segments ) );
+    }
+
+    /* step 2: start a new PES packet */
+    append_payload( packet, header, input_offset );
+  } else if ( not PES_segments_.empty() ) {
+    /* interior TS packet within a PES packet */
+    append_payload( packet, header, input_offset );
+  }
+}
+
+TSIngest::TSIngest( const size_t capacity )
+  : ring_( capacity )
+{
+  stream_for_pid_.fill( -1 );
+}
+
+void TSIngest::add_stream( TSParser & parser, queue<TimestampedPESPacket> & output )
+{
+  if ( stream_for_pid_.at( parser.pid() ) != -1 ) {
+    throw runtime_error( "program ID " + to_string( parser.pid() ) + " registered twice" );
+  }
+
+  stream_for_pid_.at( parser.pid() ) = streams_.size();
+  streams_.push_back( { parser, output } );
+}
+
+void TSIngest::add_pin( const function<optional<uint64_t>()> & oldest_pinned )
+{
+  pins_.push_back( oldest_pinned );
+}
+
+bool TSIngest::make_space()
+{
+  release_consumed_input();
+  return ring_.writable_size() > 0;
+}
+
+bool TSIngest::wants_input( const uint64_t max_stall_ms )
+{
+  if ( make_space() ) {
+    full_since_ms_.reset();
+    return true;
+  }
+
+  const uint64_t now = timestamp_ms();
+  if ( not full_since_ms_ ) {
+    full_since_ms_ = now;
+  }
+
+  if ( now - *full_since_ms_ < max_stall_ms ) {
+    return false;
+  }
+
+  /* stalled: give up on partial PES packets, but keep waiting for the
+     queued ones, which are for consumers to release */
+  full_since_ms_ = now;
+  drop_partial_PES_packets();
+  return make_space();
+}
+
+void TSIngest::drop_partial_PES_packets()
+{
+  cerr << "Warning: TS ingest buffer is full, dropping partial PES packets\n";
+
+  for ( auto & stream : streams_ ) {
+    stream.parser.reset();
+  }
+
+  release_consumed_input();
+}
+
+void TSIngest::release_consumed_input()
+{
+  /* keep everything referenced by a queued or partial PES packet */
+  uint64_t oldest_pinned = parse_offset_;
+
+  for ( const auto & stream : streams_ ) {
+    if ( not stream.output.empty() ) {
+      oldest_pinned = min( oldest_pinned, stream.output.front().input_offset );
+    }
+
+    if ( stream.parser.pinned_offset() ) {
+      oldest_pinned = min( oldest_pinned, *stream.parser.pinned_offset() );
+    }
+  }
+
+  for ( const auto & pin : pins_ ) {
+    const optional<uint64_t> offset = pin();
+    if ( offset ) {
+      oldest_pinned = min( oldest_pinned, *offset );
+    }
+  }
+
+  ring_.pop_to( oldest_pinned );
+}
+
+bool TSIngest::resync()
+{
+  /* look for a sync byte that is followed by another one a packet later */
+  const uint64_t start = parse_offset_;
+  const string_view input { ring_.at( parse_offset_ ), size_t( ring_.write_offset() - parse_offset_ ) };
+
+  size_t candidate = 1;
+  for ( ; candidate + ts_packet_length < input.size(); candidate++ ) {
+    if ( input[ candidate ] == ts_packet_sync_byte
+         and input[ candidate + ts_packet_length ] == ts_packet_sync_byte ) {
+      break;
+    }
+  }
+
+  if ( candidate + ts_packet_length >= input.size() ) {
+    /* not enough input yet to confirm; keep the tail for next time */
+    parse_offset_ += input.size() > ts_packet_length ? input.size() - ts_packet_length : 0;
+    bytes_skipped_ += parse_offset_ - start;
+    return false;
+  }
+
+  parse_offset_ += candidate;
+  bytes_skipped_ += candidate;
+
+  cerr << "Warning: lost TS sync, skipped " << candidate << " bytes\n";
+
+  /* whatever we were accumulating has a hole in it now */
+  for ( auto & stream : streams_ ) {
+    stream.parser.reset();
+  }
+
+  return true;
+}
+
+void TSIngest::parse_packets()
+{
+  while ( ring_.write_offset() - parse_offset_ >= ts_packet_length ) {
+    const char * packet = ring_.at( parse_offset_ );
+
+    if ( packet[ 0 ] != ts_packet_sync_byte ) {
+      if ( not resync() ) {
+        return;
+      }
+      continue;
+    }
+
+    /* fast path: skip PIDs nobody asked for before parsing anything else */
+    const int stream_index = stream_for_pid_[ ts_packet_pid( packet ) ];
+
+    if ( stream_index >= 0 ) {
+      Stream & stream = streams_[ stream_index ];
+
+      try {
+        stream.parser.parse( { packet, ts_packet_length }, parse_offset_, stream.output );
+      } catch ( const non_fatal_exception & e ) {
+        print_exception( "transport stream input", e );
+      }
+    }
+
+    parse_offset_ += ts_packet_length;
+  }
+}
+
+size_t TSIngest::read_from( FileDescriptor & fd )
+{
+  release_consumed_input();
+
+  if ( ring_.writable_size() == 0 ) {
+    drop_partial_PES_packets();
+
+    if ( ring_.writable_size() == 0 ) {
+      /* consumers still hold everything; leave the input where it is */
+      return 0;
+    }
+  }
+
+  const size_t bytes_read = ring_.read_from( fd );
+
+  parse_packets();
+
+  return bytes_read;
+}
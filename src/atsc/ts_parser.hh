@@ -0,0 +1,225 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef TS_PARSER_HH
+#define TS_PARSER_HH
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#ifdef HAVE_STRING_VIEW
+#include <string_view>
+#elif HAVE_EXPERIMENTAL_STRING_VIEW
+#include <experimental/string_view>
+using std::experimental::string_view;
+#endif
+
+#include "file_descriptor.hh"
+#include "ring_buffer.hh"
+
+static const size_t ts_packet_length = 188;
+static const char ts_packet_sync_byte = 0x47;
+static const unsigned int ts_max_pid = 1 << 13;
+
+class non_fatal_exception : public std::runtime_error
+{
+public:
+  using runtime_error::runtime_error;
+};
+
+class InvalidMPEG : public non_fatal_exception
+{
+public:
+  using non_fatal_exception::non_fatal_exception;
+};
+
+class UnsupportedMPEG : public non_fatal_exception
+{
+public:
+  using non_fatal_exception::non_fatal_exception;
+};
+
+class StreamMismatch : public non_fatal_exception
+{
+public:
+  using non_fatal_exception::non_fatal_exception;
+};
+
+/* program ID of a TS packet, read without validating the rest of the header */
+inline uint16_t ts_packet_pid( const char * packet )
+{
+  return ((uint8_t( packet[ 1 ] ) & 0x1f) << 8) | uint8_t( packet[ 2 ] );
+}
+
+struct TSPacketRequirements
+{
+  TSPacketRequirements( const std::string_view & packet );
+};
+
+struct TSPacketHeader : TSPacketRequirements
+{
+  bool transport_error_indicator;
+  bool payload_unit_start_indicator;
+  uint16_t pid;
+  uint8_t adaptation_field_control;
+  uint8_t payload_start;
+
+  TSPacketHeader( const std::string_view & packet );
+};
+
+struct PESPacketHeader
+{
+  uint8_t stream_id;
+  unsigned int payload_start;
+  unsigned int PES_packet_length;
+  bool data_alignment_indicator;
+  uint8_t PTS_DTS_flags;
+  uint64_t presentation_time_stamp;
+  uint64_t decoding_time_stamp;
+
+  static uint8_t enforce_stream_id( const bool is_video, const uint8_t stream_id );
+
+  PESPacketHeader( const std::string_view & packet, const bool is_video );
+};
+
+/* A PES packet whose bytes are still in the ingest buffer: a scatter list of
+   TS packet payloads, addressed with indices into their concatenation */
+struct TimestampedPESPacket
+{
+  uint64_t presentation_time_stamp;
+  size_t payload_start_index;
+  size_t payload_end_index;
+  uint64_t input_offset; /* ingest offset of the first TS packet */
+  std::vector<std::string_view> segments;
+
+  TimestampedPESPacket( const uint64_t s_presentation_time_stamp,
+                        const size_t s_payload_start_index,
+                        const size_t PES_packet_length,
+                        const uint64_t s_input_offset,
+                        std::vector<std::string_view> && s_segments );
+
+  size_t size() const;
+  size_t payload_length() const;
+
+  /* length bytes at index, as one view; gathered into scratch only when the
+     range straddles TS packets */
+  std::string_view contiguous( const size_t index, const size_t length,
+                               std::string & scratch ) const;
+
+  /* call f on each contiguous piece of the payload, in order */
+  template <class Function>
+  void for_each_payload_span( Function && f ) const
+  {
+    if ( payload_end_index > size() ) {
+      throw InvalidMPEG( "payload ends after end of PES packet" );
+    }
+
+    size_t segment_start = 0;
+    for ( const auto & segment : segments ) {
+      const size_t segment_end = segment_start + segment.size();
+      const size_t first = std::max( segment_start, payload_start_index );
+      const size_t last = std::min( segment_end, payload_end_index );
+      if ( first < last ) {
+        f( segment.substr( first - segment_start, last - first ) );
+      }
+      segment_start = segment_end;
+    }
+  }
+};
+
+class TSParser
+{
+private:
+  unsigned int pid_; /* program ID of interest */
+  bool is_video_; /* true = video, false = audio */
+
+  std::vector<std::string_view> PES_segments_ {};
+  std::optional<uint64_t> PES_input_offset_ {};
+  std::string header_scratch_ {};
+
+  void append_payload( const std::string_view & packet,
+                       const TSPacketHeader & header,
+                       const uint64_t input_offset );
+
+public:
+  TSParser( const unsigned int pid, const bool is_video );
+
+  unsigned int pid() const { return pid_; }
+
+  /* packet must stay in place until the resulting PES packet is consumed */
+  void parse( const std::string_view & packet, const uint64_t input_offset,
+              std::queue<TimestampedPESPacket> & PES_packets );
+
+  /* ingest offset of the PES packet being accumulated, if any */
+  const std::optional<uint64_t> & pinned_offset() const { return PES_input_offset_; }
+
+  /* drop the partially accumulated PES packet */
+  void reset();
+};
+
+/* Reads a transport stream directly into a ring buffer, keeps 188-byte packet
+   sync, and hands packets to the TSParser registered for their PID (other
+   PIDs are skipped without parsing their headers). PES packets reference
+   ring memory, which is recycled only once their queue has been drained. */
+class TSIngest
+{
+private:
+  struct Stream
+  {
+    TSParser & parser;
+    std::queue<TimestampedPESPacket> & output;
+  };
+
+  RingBuffer ring_;
+  uint64_t parse_offset_ { 0 };
+
+  std::vector<Stream> streams_ {};
+  std::vector<std::function<std::optional<uint64_t>()>> pins_ {};
+  std::array<int, ts_max_pid> stream_for_pid_ {};
+
+  uint64_t bytes_skipped_ { 0 };
+
+  /* when the ring was first found full of input still held by consumers */
+  std::optional<uint64_t> full_since_ms_ {};
+
+  void release_consumed_input();
+  void drop_partial_PES_packets();
+  bool resync();
+  void parse_packets();
+
+public:
+  static constexpr size_t default_capacity = 8 * 1024 * 1024;
+
+  TSIngest( const size_t capacity = default_capacity );
+
+  void add_stream( TSParser & parser, std::queue<TimestampedPESPacket> & output );
+
+  /* also keep input from the offset returned by oldest_pinned, for PES
+     packets that have been moved out of a registered output queue */
+  void add_pin( const std::function<std::optional<uint64_t>()> & oldest_pinned );
+
+  /* recycle consumed input; returns true if there is room to read */
+  bool make_space();
+
+  /* false while the ring is full of input that consumers still hold, so the
+     caller can stop reading and let the source back up; after max_stall_ms,
+     partial PES packets are dropped to make room, but queued ones are kept
+     until consumers release them */
+  bool wants_input( const uint64_t max_stall_ms );
+
+  /* read once from fd and parse every complete TS packet; returns bytes
+     read (0 on EOF, or if consumers still hold the whole ring) */
+  size_t read_from( FileDescriptor & fd );
+
+  /* bytes discarded while searching for the TS sync byte */
+  uint64_t bytes_skipped() const { return bytes_skipped_; }
+};
+
+#endif /* TS_PARSER_HH */
@@ -0,0 +1,305 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <queue>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <functional>
+
+#include "filesystem.hh"
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "poller.hh"
+#include "inotify.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [--window <time_window>]\n"
+  "       --clean <clean_dir> <clean_ext> [<clean_dir> <clean_ext> ...]\n"
+  "       --depend <dep_dir> <dep_ext> [<dep_dir> <dep_ext> ...]\n"
+  "       [--clean ... --depend ...]\n\n"
+  "Keeps running and replaces one windowcleaner and one depcleaner per\n"
+  "watched directory. Each --clean/--depend pair is a dependency group.\n\n"
+  "--window <time_window>  in every <dep_dir>, remove files with timestamped\n"
+  "                        names that are less than the newly moved-in file\n"
+  "                        - time_window\n"
+  "--clean <clean_dir> <clean_ext>  directories and file extensions to clean\n"
+  "                                 once a chunk appears in every <dep_dir>\n"
+  "--depend <dep_dir> <dep_ext>     directories containing dependent files\n"
+  "                                 and extensions"
+  << endl;
+}
+
+/* a directory kept open so that files can be removed with unlinkat */
+struct Directory
+{
+  string path;
+  string ext;
+  FileDescriptor fd;
+
+  Directory(const string & s_path, const string & s_ext)
+    : path(s_path), ext(s_ext),
+      fd(CheckSystemCall("open " + s_path,
+                         open(s_path.c_str(), O_RDONLY | O_DIRECTORY)))
+  {}
+};
+
+/* files in a ready directory ordered by the timestamps in their names */
+struct WindowIndex
+{
+  shared_ptr<Directory> dir;
+  priority_queue<int64_t, vector<int64_t>, greater<int64_t>> timestamps {};
+};
+
+/* upstream files that can be removed once a chunk (a filename stem) has
+ * appeared in every dependent directory */
+struct DependencyGroup
+{
+  vector<shared_ptr<Directory>> clean_dirs {};
+  vector<shared_ptr<Directory>> depend_dirs {};
+
+  /* stem -> which depend_dirs contain it so far, and how many; a stem is
+   * forgotten once it is in all of them, or once one of its files is
+   * removed (e.g., after a failed encode), so this is bounded by the
+   * files in depend_dirs */
+  unordered_map<string, pair<vector<bool>, size_t>> seen {};
+};
+
+/* the timestamp in a chunk's name, if it has one */
+static optional<int64_t> stem_timestamp(const string & stem)
+{
+  try {
+    return stoll(stem);
+  } catch (const exception &) {
+    return nullopt;
+  }
+}
+
+class ChannelCleaner
+{
+public:
+  ChannelCleaner(Poller & poller, const optional<int64_t> & time_window)
+    : inotify_(poller), time_window_(time_window)
+  {}
+
+  void add_group(const vector<tuple<string, string>> & clean,
+                 const vector<tuple<string, string>> & depend)
+  {
+    DependencyGroup & group = groups_.emplace_back();
+
+    for (const auto & [dir, ext] : clean) {
+      group.clean_dirs.emplace_back(make_shared<Directory>(dir, ext));
+    }
+
+    for (const auto & [dir, ext] : depend) {
+      group.depend_dirs.emplace_back(make_shared<Directory>(dir, ext));
+    }
+  }
+
+  /* watch every dependent directory, then index the files already there */
+  void start()
+  {
+    for (size_t g = 0; g < groups_.size(); g++) {
+      for (size_t d = 0; d < groups_[g].depend_dirs.size(); d++) {
+        const auto & dir = groups_[g].depend_dirs[d];
+
+        size_t window = windows_.size();
+        if (time_window_) {
+          windows_.push_back({dir});
+        }
+
+        inotify_.add_watch(dir->path, IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE,
+          [this, g, d, window](const inotify_event & event, const string &) {
+            if (event.mask & IN_ISDIR) {
+              return;
+            }
+
+            if (event.mask & IN_MOVED_TO) {
+              add_file(g, d, window, event.name);
+            } else {
+              remove_file(g, d, event.name);
+            }
+          }
+        );
+      }
+    }
+
+    for (size_t g = 0, window = 0; g < groups_.size(); g++) {
+      for (size_t d = 0; d < groups_[g].depend_dirs.size(); d++, window++) {
+        for (const auto & entry :
+             fs::directory_iterator(groups_[g].depend_dirs[d]->path)) {
+          add_file(g, d, time_window_ ? window : windows_.size(),
+                   entry.path().filename());
+        }
+      }
+    }
+
+    flush();
+  }
+
+  /* remove the files queued since the last call */
+  void flush()
+  {
+    for (const auto & [dir, filename] : pending_removals_) {
+      if (unlinkat(dir->fd.fd_num(), filename.c_str(), 0) < 0 and
+          errno != ENOENT) {
+        cerr << "Warning: file " << fs::path(dir->path) / filename
+             << " cannot be removed" << endl;
+      }
+    }
+
+    pending_removals_.clear();
+  }
+
+private:
+  Inotify inotify_;
+  optional<int64_t> time_window_;
+
+  vector<DependencyGroup> groups_ {};
+  vector<WindowIndex> windows_ {};
+
+  vector<pair<shared_ptr<Directory>, string>> pending_removals_ {};
+
+  /* filename was moved into depend_dirs[d] of groups_[g] */
+  void add_file(const size_t g, const size_t d, const size_t window,
+                const string & filename)
+  {
+    DependencyGroup & group = groups_[g];
+    const fs::path file_path = filename;
+
+    if (file_path.extension() != group.depend_dirs[d]->ext) {
+      return;
+    }
+
+    const string stem = file_path.stem();
+    const optional<int64_t> timestamp = stem_timestamp(stem);
+
+    if (window < windows_.size() and timestamp) {
+      clean_window(windows_[window], *timestamp);
+    }
+
+    /* count the dependent directories that contain stem */
+    auto & [present, count] = group.seen[stem];
+    if (present.empty()) {
+      present.resize(group.depend_dirs.size());
+    }
+
+    if (not present[d]) {
+      present[d] = true;
+      count++;
+    }
+
+    if (count == group.depend_dirs.size()) {
+      /* all of the downstream files exist so we can remove the upstream
+       * files */
+      for (const auto & clean_dir : group.clean_dirs) {
+        pending_removals_.emplace_back(clean_dir, stem + clean_dir->ext);
+      }
+
+      group.seen.erase(stem);
+    }
+  }
+
+  /* filename was removed from depend_dirs[d] of groups_[g] (cleaned); its
+   * stem can no longer be in every dependent directory at once */
+  void remove_file(const size_t g, const size_t d, const string & filename)
+  {
+    DependencyGroup & group = groups_[g];
+    const fs::path file_path = filename;
+
+    if (file_path.extension() != group.depend_dirs[d]->ext) {
+      return;
+    }
+
+    group.seen.erase(file_path.stem());
+  }
+
+  void clean_window(WindowIndex & index, const int64_t timestamp)
+  {
+    index.timestamps.push(timestamp);
+
+    while (timestamp - index.timestamps.top() > *time_window_) {
+      pending_removals_.emplace_back(
+          index.dir, to_string(index.timestamps.top()) + index.dir->ext);
+      index.timestamps.pop();
+    }
+  }
+};
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  /* parse arguments into dependency groups */
+  optional<int64_t> time_window;
+  vector<pair<vector<tuple<string, string>>,
+              vector<tuple<string, string>>>> groups;
+  vector<tuple<string, string>> * current = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    const string arg = argv[i];
+
+    if (arg == "--window" and i + 1 < argc) {
+      time_window = stoll(argv[++i]);
+      if (*time_window <= 0) {
+        cerr << "Time window cannot be negative or less than 0" << endl;
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--clean") {
+      groups.emplace_back();
+      current = &groups.back().first;
+    } else if (arg == "--depend" and not groups.empty()) {
+      current = &groups.back().second;
+    } else if (current and i + 1 < argc) {
+      current->emplace_back(argv[i], argv[i + 1]);
+      i++;
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (groups.empty()) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (const auto & [clean, depend] : groups) {
+    if (clean.empty() or depend.empty()) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Poller poller;
+  ChannelCleaner cleaner(poller, time_window);
+
+  for (const auto & [clean, depend] : groups) {
+    cleaner.add_group(clean, depend);
+  }
+
+  cleaner.start();
+
+  for (;;) {
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
+
+    /* remove everything queued by this batch of inotify events */
+    cleaner.flush();
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,523 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <tuple>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <algorithm>
+
+#include "strict_conversions.hh"
+#include "socket.hh"
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "poller.hh"
+#include "timerfd.hh"
+#include "mmap.hh"
+#include "inotify.hh"
+#include "filesystem.hh"
+#include "serialization.hh"
+#include "file_message.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+/* files sent but not yet acknowledged, per destination; also bounds the
+ * open files */
+static constexpr size_t MAX_UNACKED_FILES = 64;
+static constexpr int RECONNECT_INTERVAL_MS = 1000;
+static constexpr int STATS_INTERVAL_MS = 60000;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " SRC-ROOT SRC-DIR [SRC-DIR]...\n"
+  "       --to HOST PORT DST-ROOT [--to HOST PORT DST-ROOT]...\n\n"
+  "Keeps a connection to file_receiver on each HOST:PORT and transfers every\n"
+  "file moved into (or already in) each SRC-DIR to all of them, as\n"
+  "DST-ROOT/<SRC-DIR relative to SRC-ROOT>/<filename>. Each destination has\n"
+  "its own queue, so a slow one does not hold back the others. Files that\n"
+  "were not acknowledged are sent again after reconnecting."
+  << endl;
+}
+
+/* a file moved into a SRC-DIR, shared by the queues of all destinations;
+ * its size and checksum are computed once, by the first one to send it */
+struct ForwardedFile
+{
+  uint64_t seq;
+  string src_path;
+  string relative_path;  /* to SRC-ROOT */
+  steady_clock::time_point detected;
+
+  bool prepared {false};
+  uint64_t size {};
+  uint32_t checksum {};
+  dev_t dev {};
+  ino_t ino {};
+};
+
+/* one file_receiver, with its connection and queue */
+class Destination
+{
+public:
+  Destination(Poller & poller, const Address & server, const string & dst_root)
+    : poller_(poller), server_(server), dst_root_(dst_root)
+  {
+    poller_.add_action(Poller::Action(reconnect_timer_, Direction::In,
+      [this]()->ResultType {
+        reconnect_timer_.expirations();
+        connect();
+        return ResultType::Continue;
+      }
+    ));
+  }
+
+  void enqueue(const shared_ptr<ForwardedFile> & file)
+  {
+    files_.push_back({file});
+  }
+
+  void connect()
+  {
+    /* the actions on the previous socket were removed when it failed */
+    socket_ = make_unique<TCPSocket>();
+    socket_->set_blocking(false);
+    socket_->set_nodelay();
+
+    try {
+      socket_->connect(server_);
+    } catch (const exception & e) {
+      print_exception("connect", e);
+      schedule_reconnect();
+      return;
+    }
+
+    state_ = State::Connecting;
+
+    poller_.add_action(Poller::Action(*socket_, Direction::Out,
+      [this]()->ResultType { return send_files(); },
+      [this]()->bool {
+        return state_ == State::Connecting or
+               (state_ == State::Connected and sending_ < files_.size()
+                and sending_ < MAX_UNACKED_FILES);
+      },
+      [this]() { disconnect("connection error"); }
+    ));
+
+    poller_.add_action(Poller::Action(*socket_, Direction::In,
+      [this]()->ResultType { return read_acks(); },
+      [this]()->bool { return state_ == State::Connected; },
+      [this]() { disconnect("connection error"); }
+    ));
+  }
+
+  void print_stats(const double cpu_s)
+  {
+    cerr << server_.str() << ": delivered " << files_delivered_ << " files ("
+         << bytes_delivered_ / 1000000.0 << " MB) in the last "
+         << STATS_INTERVAL_MS / 1000 << " s; latency avg "
+         << (files_delivered_ ? total_latency_ms_ / files_delivered_ : 0)
+         << " ms, max " << max_latency_ms_ << " ms; " << files_.size()
+         << " files queued; total CPU " << cpu_s << " s" << endl;
+
+    files_delivered_ = 0;
+    bytes_delivered_ = 0;
+    total_latency_ms_ = 0;
+    max_latency_ms_ = 0;
+  }
+
+private:
+  enum class State { Disconnected, Connecting, Connected };
+
+  /* a file in this destination's queue */
+  struct PendingFile
+  {
+    shared_ptr<ForwardedFile> file;
+
+    /* opened when the transfer starts and kept until the file is
+     * acknowledged, so a retransmission does not depend on the file still
+     * being in SRC-DIR */
+    optional<FileDescriptor> fd {};
+    string header {};
+  };
+
+  Poller & poller_;
+  Address server_;
+  fs::path dst_root_;
+
+  unique_ptr<TCPSocket> socket_ {};
+  State state_ {State::Disconnected};
+  Timerfd reconnect_timer_ {};
+
+  /* acknowledgement order: the first sending_ files are in flight */
+  deque<PendingFile> files_ {};
+  size_t sending_ {0};
+  size_t header_offset_ {0};
+  off_t file_offset_ {0};
+  string acks_ {};
+
+  /* delivered since the last print_stats() */
+  uint64_t files_delivered_ {0};
+  uint64_t bytes_delivered_ {0};
+  double total_latency_ms_ {0};
+  double max_latency_ms_ {0};
+
+  void schedule_reconnect()
+  {
+    state_ = State::Disconnected;
+    reconnect_timer_.start(RECONNECT_INTERVAL_MS);
+  }
+
+  /* leave the socket open until the poller has removed its actions;
+   * connect() replaces it */
+  ResultType disconnect(const string & reason)
+  {
+    if (state_ != State::Disconnected) {
+      cerr << "Disconnected from " << server_.str() << " (" << reason
+           << "); " << files_.size() << " files to (re)send" << endl;
+
+      poller_.remove_fd(socket_->fd_num());
+      schedule_reconnect();
+    }
+
+    /* everything in flight will be sent again */
+    sending_ = 0;
+    header_offset_ = 0;
+    file_offset_ = 0;
+    acks_.clear();
+
+    return ResultType::CancelAll;
+  }
+
+  /* open the file and compute its header; false if it is gone, or is no
+   * longer the file other destinations were sent */
+  bool open_file(PendingFile & pending)
+  {
+    ForwardedFile & file = *pending.file;
+
+    const int fd_num = open(file.src_path.c_str(), O_RDONLY);
+    if (fd_num < 0) {
+      if (errno == ENOENT) {
+        cerr << "Warning: " << file.src_path
+             << " was removed before it could be sent to "
+             << server_.str() << endl;
+        return false;
+      }
+
+      throw unix_error("open (" + file.src_path + ")");
+    }
+
+    FileDescriptor fd(fd_num);
+
+    struct stat st;
+    CheckSystemCall("fstat", fstat(fd.fd_num(), &st));
+
+    if (not file.prepared) {
+      file.size = st.st_size;
+      file.dev = st.st_dev;
+      file.ino = st.st_ino;
+
+      if (file.size > 0) {
+        auto data = mmap_shared(nullptr, file.size, PROT_READ, MAP_SHARED,
+                                fd.fd_num(), 0);
+        file.checksum = crc32({static_cast<const char *>(data.get()),
+                               file.size});
+      }
+
+      file.prepared = true;
+    } else if (st.st_dev != file.dev or st.st_ino != file.ino or
+               static_cast<uint64_t>(st.st_size) != file.size) {
+      cerr << "Warning: " << file.src_path << " was replaced before it "
+           << "could be sent to " << server_.str() << endl;
+      return false;
+    }
+
+    pending.header = FileMsg(file.seq, file.size, file.checksum,
+                             dst_root_ / file.relative_path).to_string();
+    pending.fd = move(fd);
+    return true;
+  }
+
+  ResultType send_files()
+  {
+    socket_->register_write();
+
+    if (state_ == State::Connecting) {
+      try {
+        socket_->verify_no_errors();
+      } catch (const exception & e) {
+        return disconnect(e.what());
+      }
+
+      state_ = State::Connected;
+      cerr << "Connected to " << server_.str() << endl;
+    }
+
+    while (sending_ < files_.size() and sending_ < MAX_UNACKED_FILES) {
+      PendingFile & pending = files_[sending_];
+
+      if (not pending.fd and not open_file(pending)) {
+        files_.erase(files_.begin() + sending_);
+        continue;
+      }
+
+      const uint64_t size = pending.file->size;
+
+      ssize_t n;
+      if (header_offset_ < pending.header.size()) {
+        /* hold the header back until the contents follow it */
+        n = send(socket_->fd_num(), pending.header.data() + header_offset_,
+                 pending.header.size() - header_offset_,
+                 MSG_MORE | MSG_NOSIGNAL);
+        if (n > 0) {
+          header_offset_ += n;
+        }
+      } else if (static_cast<uint64_t>(file_offset_) < size) {
+        /* straight from the page cache, at this destination's offset */
+        n = sendfile(socket_->fd_num(), pending.fd->fd_num(), &file_offset_,
+                     size - file_offset_);
+        if (n == 0) {
+          /* the file shrank after it was opened; the receiver would wait
+           * for the missing bytes forever */
+          cerr << "Warning: " << pending.file->src_path
+               << " was truncated; dropping it" << endl;
+          files_.erase(files_.begin() + sending_);
+          return disconnect("truncated file");
+        }
+      } else {
+        sending_++;
+        header_offset_ = 0;
+        file_offset_ = 0;
+        continue;
+      }
+
+      if (n < 0) {
+        if (errno == EAGAIN or errno == EWOULDBLOCK) {
+          break;
+        }
+
+        return disconnect(strerror(errno));
+      }
+    }
+
+    return ResultType::Continue;
+  }
+
+  ResultType read_acks()
+  {
+    if (state_ != State::Connected) {
+      /* disconnected earlier in this poll */
+      socket_->register_read();
+      return ResultType::CancelAll;
+    }
+
+    string data;
+    try {
+      data = socket_->read();
+    } catch (const exception & e) {
+      return disconnect(e.what());
+    }
+
+    if (data.empty()) {
+      return disconnect("closed by peer");
+    }
+
+    acks_.append(data);
+
+    size_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= acks_.size(); pos += sizeof(uint64_t)) {
+      acknowledge(get_uint64(acks_.data() + pos));
+    }
+    acks_.erase(0, pos);
+
+    return ResultType::Continue;
+  }
+
+  /* file_receiver acknowledges the files in the order they were sent */
+  void acknowledge(const uint64_t seq)
+  {
+    if (sending_ == 0 or files_.front().file->seq != seq) {
+      cerr << "Warning: unexpected acknowledgement of file " << seq
+           << " from " << server_.str() << endl;
+      return;
+    }
+
+    const ForwardedFile & file = *files_.front().file;
+    const double latency_ms = duration<double, milli>(
+        steady_clock::now() - file.detected).count();
+
+    files_delivered_++;
+    bytes_delivered_ += file.size;
+    total_latency_ms_ += latency_ms;
+    max_latency_ms_ = max(max_latency_ms_, latency_ms);
+
+    cerr << "Delivered file " << file.src_path << " to " << server_.str()
+         << " (" << latency_ms << " ms)" << endl;
+
+    files_.pop_front();
+    sending_--;
+  }
+};
+
+class FileForwarder
+{
+public:
+  FileForwarder(Poller & poller, const string & src_root)
+    : poller_(poller), src_root_(src_root), inotify_(poller)
+  {
+    stats_timer_.start(STATS_INTERVAL_MS, STATS_INTERVAL_MS);
+    poller_.add_action(Poller::Action(stats_timer_, Direction::In,
+      [this]()->ResultType {
+        stats_timer_.expirations();
+        print_stats();
+        return ResultType::Continue;
+      }
+    ));
+  }
+
+  void add_destination(const Address & server, const string & dst_root)
+  {
+    destinations_.emplace_back(
+        make_unique<Destination>(poller_, server, dst_root));
+  }
+
+  /* queue the files moved into src_dir, and the files already there */
+  void watch(const string & src_dir)
+  {
+    if (src_dir.compare(0, src_root_.size(), src_root_) != 0) {
+      throw runtime_error(src_dir + " is not in " + src_root_);
+    }
+
+    /* remove the prefix of SRC-ROOT, and any separators after it */
+    string relative_dir = src_dir.substr(src_root_.size());
+    relative_dir.erase(0, relative_dir.find_first_not_of('/'));
+
+    inotify_.add_watch(src_dir, IN_MOVED_TO,
+      [this, src_dir, relative_dir](const inotify_event & event,
+                                    const string &) {
+        if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
+          return;
+        }
+
+        enqueue(fs::path(src_dir) / event.name,
+                fs::path(relative_dir) / event.name);
+      }
+    );
+
+    for (const auto & entry : fs::directory_iterator(src_dir)) {
+      if (fs::is_regular_file(entry.path())) {
+        enqueue(entry.path(), fs::path(relative_dir) / entry.path().filename());
+      }
+    }
+  }
+
+  void connect()
+  {
+    for (auto & destination : destinations_) {
+      destination->connect();
+    }
+  }
+
+private:
+  Poller & poller_;
+  string src_root_;
+  Inotify inotify_;
+  vector<unique_ptr<Destination>> destinations_ {};
+  Timerfd stats_timer_ {};
+
+  uint64_t next_seq_ {0};
+
+  void enqueue(const string & src_path, const string & relative_path)
+  {
+    auto file = make_shared<ForwardedFile>(ForwardedFile{
+        next_seq_++, src_path, relative_path, steady_clock::now()});
+
+    for (auto & destination : destinations_) {
+      destination->enqueue(file);
+    }
+  }
+
+  void print_stats()
+  {
+    rusage usage;
+    CheckSystemCall("getrusage", getrusage(RUSAGE_SELF, &usage));
+
+    const double cpu_s = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+    for (auto & destination : destinations_) {
+      destination->print_stats(cpu_s);
+    }
+  }
+};
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  /* split the arguments into SRC-ROOT, SRC-DIRs and destinations */
+  vector<string> src_dirs;
+  vector<tuple<string, uint16_t, string>> destinations;
+
+  for (int i = 1; i < argc; i++) {
+    const string arg = argv[i];
+
+    if (arg == "--to" and i + 3 < argc) {
+      destinations.emplace_back(argv[i + 1],
+                                narrow_cast<uint16_t>(stoi(argv[i + 2])),
+                                argv[i + 3]);
+      i += 3;
+    } else if (destinations.empty() and arg.substr(0, 2) != "--") {
+      src_dirs.emplace_back(arg);
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (src_dirs.size() < 2 or destinations.empty()) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* peer resets are handled where send and sendfile fail */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    throw runtime_error("signal: failed to ignore SIGPIPE");
+  }
+
+  Poller poller;
+  FileForwarder forwarder(poller, src_dirs.front());
+
+  for (const auto & [host, port, dst_root] : destinations) {
+    forwarder.add_destination({host, port}, dst_root);
+  }
+
+  for (size_t i = 1; i < src_dirs.size(); i++) {
+    forwarder.watch(src_dirs[i]);
+  }
+
+  forwarder.connect();
+
+  for (;;) {
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
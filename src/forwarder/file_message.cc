@@ -1,33 +1,78 @@
 #include "file_message.hh"
 #include "serialization.hh"
+#include "strict_conversions.hh"
 
 #include <endian.h>
+#include <array>
 #include <stdexcept>
 
 using namespace std;
 
-FileMsg::FileMsg(const uint16_t _dst_path_len, const string & _dst_path)
-  : dst_path_len(_dst_path_len), dst_path(_dst_path)
+FileMsg::FileMsg(const uint64_t _seq, const uint64_t _file_size,
+                 const uint32_t _checksum, const string & _dst_path)
+  : seq(_seq), file_size(_file_size), checksum(_checksum),
+    dst_path_len(narrow_cast<uint16_t>(_dst_path.size())), dst_path(_dst_path)
 {}
 
-FileMsg::FileMsg(const string & str)
+FileMsg::FileMsg(const string_view str)
 {
+  if (peek_size(str) == 0) {
+    throw runtime_error("FileMsg is incomplete");
+  }
+
   const char * data = str.data();
 
-  if (str.size() < sizeof(dst_path_len)) {
-    throw runtime_error("FileMsg is too small to contain dst_path_len");
+  seq = get_uint64(data);
+  file_size = get_uint64(data + 8);
+  checksum = get_uint32(data + 16);
+  dst_path_len = get_uint16(data + 20);
+  dst_path = str.substr(fixed_size, dst_path_len);
+}
+
+size_t FileMsg::peek_size(const string_view str)
+{
+  if (str.size() < fixed_size) {
+    return 0;
   }
 
-  dst_path_len = get_uint16(data);
-  dst_path = str.substr(sizeof(dst_path_len), dst_path_len);
+  const size_t total = fixed_size + get_uint16(str.data() + fixed_size - 2);
+  return str.size() < total ? 0 : total;
 }
 
 string FileMsg::to_string() const
 {
-  return put_field(dst_path_len) + dst_path;
+  return put_field(seq) + put_field(file_size) + put_field(checksum)
+         + put_field(dst_path_len) + dst_path;
 }
 
 unsigned int FileMsg::size() const
 {
-  return sizeof(dst_path_len) + dst_path.size();
+  return fixed_size + dst_path.size();
+}
+
+static array<uint32_t, 256> make_crc32_table()
+{
+  array<uint32_t, 256> table {};
+
+  for (uint32_t i = 0; i < table.size(); i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+
+  return table;
+}
+
+uint32_t crc32(const string_view data, const uint32_t crc)
+{
+  static const array<uint32_t, 256> table = make_crc32_table();
+
+  uint32_t c = ~crc;
+  for (const char byte : data) {
+    c = table[(c ^ static_cast<uint8_t>(byte)) & 0xFF] ^ (c >> 8);
+  }
+
+  return ~c;
 }
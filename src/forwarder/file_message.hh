@@ -1,18 +1,35 @@
 #ifndef FILE_MESSAGE_HH
 #define FILE_MESSAGE_HH
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 
+/* Header of a file on a file_forwarder -> file_receiver connection, which
+ * carries any number of files back to back: each header is followed by
+ * file_size bytes of file contents. The receiver acknowledges a file by
+ * sending back its seq (put_field(uint64_t)) once it has been renamed to
+ * dst_path; unacknowledged files are sent again after reconnecting. */
 class FileMsg
 {
 public:
+  uint64_t seq {};
+  uint64_t file_size {};
+  uint32_t checksum {};  /* CRC-32 of the file contents */
   uint16_t dst_path_len {};
   std::string dst_path {};
 
-  FileMsg(const uint16_t dst_path_len, const std::string & dst_path);
+  /* seq, file_size, checksum and dst_path_len */
+  static constexpr size_t fixed_size = 22;
+
+  FileMsg(const uint64_t seq, const uint64_t file_size,
+          const uint32_t checksum, const std::string & dst_path);
 
   /* parse a file message from network */
-  FileMsg(const std::string & str);
+  FileMsg(const std::string_view str);
+
+  /* size of the header at the front of str, or 0 if it is incomplete */
+  static size_t peek_size(const std::string_view str);
 
   /* make network representation of file message */
   std::string to_string() const;
@@ -20,4 +37,7 @@ public:
   unsigned int size() const;
 };
 
+/* CRC-32 (as in zlib) of data, continuing from crc */
+uint32_t crc32(const std::string_view data, const uint32_t crc = 0);
+
 #endif /* FILE_MESSAGE_HH */
@@ -3,13 +3,18 @@
 #include <iostream>
 #include <stdexcept>
 #include <map>
+#include <optional>
+#include <string_view>
 
 #include "strict_conversions.hh"
 #include "socket.hh"
 #include "file_descriptor.hh"
 #include "exception.hh"
 #include "poller.hh"
+#include "pipe.hh"
+#include "mmap.hh"
 #include "filesystem.hh"
+#include "serialization.hh"
 #include "file_message.hh"
 
 using namespace std;
@@ -18,52 +23,216 @@ using namespace PollerShortNames;
 static uint16_t global_file_id = 0;  /* intended to wrap around */
 static fs::path tmp_dir_path = fs::temp_directory_path();
 
+/* limits; a connection holds at most buffer_size bytes in user space and
+ * buffer_size bytes in its pipe */
+static size_t max_connections = 64;
+static size_t buffer_size = 256 * 1024;
+static uint64_t max_file_size = 1024 * 1024 * 1024;
+
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " PORT [TMP-DIR]\n\n"
-  "TMP-DIR: directory to save temp file; "
-  "must be unique for each file_receiver process"
+  "Usage: " << program_name << " PORT [TMP-DIR] [--max-connections N]\n"
+  "       [--buffer-size BYTES] [--max-file-size BYTES]\n\n"
+  "TMP-DIR: directory to save temp file if O_TMPFILE is not supported; "
+  "must be unique for each file_receiver process\n"
+  "--max-connections N    stop accepting beyond N connections (default 64)\n"
+  "--buffer-size BYTES    per-connection read and pipe size (default 256 KiB)\n"
+  "--max-file-size BYTES  drop connections announcing larger files "
+  "(default 1 GiB)"
   << endl;
 }
 
 class Client
 {
 public:
-  Client(TCPSocket && _socket) : socket(move(_socket)), buffer() {}
+  Client(TCPSocket && _socket)
+    : socket(move(_socket)), buffer_(), pipe_(make_pipe())
+  {
+    /* a blocking splice would wait until the whole length has arrived */
+    socket.set_blocking(false);
+    socket.set_nodelay();
+
+    /* as much as a splice may move at once; best effort */
+    fcntl(pipe_.second.fd_num(), F_SETPIPE_SZ, static_cast<int>(buffer_size));
+  }
 
-  void write_to_file() const
+  /* receive whatever the socket has; return false to close the connection */
+  bool receive()
   {
-    FileMsg metadata(buffer);
-    fs::path dst_path = metadata.dst_path;
-    fs::path tmp_path = tmp_dir_path / (dst_path.filename().string() + "."
-                                        + to_string(global_file_id++));
+    if (file_ and buffer_.empty()) {
+      /* contents go from the socket to the file without being copied
+       * to user space */
+      const uint64_t remaining = file_->metadata.file_size - file_->received;
+      const ssize_t n = splice(socket.fd_num(), nullptr,
+                               pipe_.second.fd_num(), nullptr,
+                               min<uint64_t>(remaining, buffer_size),
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      socket.register_read();
 
-    /* create parent directories if they don't exist yet */
-    if (dst_path.has_parent_path()) {
-      fs::create_directories(dst_path.parent_path());
-    }
-    if (tmp_path.has_parent_path()) {
-      fs::create_directories(tmp_path.parent_path());
+      if (n == 0) {
+        return false;  /* EOF */
+      } else if (n < 0) {
+        if (errno == EAGAIN) {
+          return true;
+        }
+        throw unix_error("splice");
+      }
+
+      for (ssize_t moved = 0; moved < n;) {
+        moved += CheckSystemCall("splice", splice(pipe_.first.fd_num(), nullptr,
+            file_->fd.fd_num(), nullptr, n - moved, SPLICE_F_MOVE));
+      }
+
+      file_->received += n;
+    } else {
+      const string data = socket.read(buffer_size);
+      if (data.empty()) {
+        return false;  /* EOF */
+      }
+
+      buffer_.append(data);
     }
 
-    FileDescriptor fd(CheckSystemCall("open (" + tmp_path.string() + ")",
-        open(tmp_path.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)));
+    return consume_buffer();
+  }
+
+  TCPSocket socket;
+
+private:
+  /* the file being received */
+  struct IncomingFile
+  {
+    FileMsg metadata;
+    FileDescriptor fd;
+    optional<fs::path> tmp_path {};  /* unset for an O_TMPFILE */
+    uint64_t received {0};
+  };
+
+  /* bytes read from the socket but not yet consumed: a partial header,
+   * or the small files and headers that arrived with it */
+  string buffer_;
+
+  pair<FileDescriptor, FileDescriptor> pipe_;
+  optional<IncomingFile> file_ {};
+
+  bool consume_buffer()
+  {
+    for (;;) {
+      if (not file_) {
+        const size_t header_size = FileMsg::peek_size(buffer_);
+        if (header_size == 0) {
+          return true;
+        }
+
+        FileMsg metadata(buffer_);
+        buffer_.erase(0, header_size);
 
-    /* avoid writing empty data */
-    if (buffer.size() > metadata.size()) {
-      fd.write(buffer.substr(metadata.size()));
+        if (metadata.file_size > max_file_size) {
+          cerr << "File " << metadata.dst_path << " exceeds the maximum size "
+               << max_file_size << "; dropping the connection" << endl;
+          return false;
+        }
+
+        open_file(move(metadata));
+      }
+
+      const size_t take = min<uint64_t>(
+          buffer_.size(), file_->metadata.file_size - file_->received);
+      if (take > 0) {
+        file_->fd.write(string_view(buffer_).substr(0, take));
+        buffer_.erase(0, take);
+        file_->received += take;
+      }
+
+      if (file_->received < file_->metadata.file_size) {
+        return true;
+      }
+
+      if (not finish_file()) {
+        return false;
+      }
     }
+  }
+
+  /* an unnamed file in the destination directory if possible, which only
+   * gets a name once it is complete */
+  void open_file(FileMsg && metadata)
+  {
+    const fs::path dst_path = metadata.dst_path;
+    const fs::path dst_dir = dst_path.has_parent_path() ?
+                             dst_path.parent_path() : ".";
+
+    /* create parent directories if they don't exist yet */
+    fs::create_directories(dst_dir);
+
+    int fd_num = open(dst_dir.c_str(), O_TMPFILE | O_RDWR, 0644);
+    optional<fs::path> tmp_path;
 
-    fd.close();
+    if (fd_num < 0) {
+      if (errno != EOPNOTSUPP and errno != EISDIR) {
+        throw unix_error("open O_TMPFILE (" + dst_dir.string() + ")");
+      }
 
-    fs::rename(tmp_path, dst_path);
+      tmp_path = tmp_dir_path / (dst_path.filename().string() + "."
+                                 + to_string(global_file_id++));
+      if (tmp_path->has_parent_path()) {
+        fs::create_directories(tmp_path->parent_path());
+      }
 
-    cerr << "Received " << tmp_path << " and moved to " << dst_path << endl;
+      fd_num = CheckSystemCall("open (" + tmp_path->string() + ")",
+          open(tmp_path->c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+    }
+
+    file_.emplace(IncomingFile{move(metadata), fd_num, move(tmp_path)});
   }
 
-  TCPSocket socket;
-  string buffer;
+  /* verify, name and acknowledge the complete file; false if corrupted */
+  bool finish_file()
+  {
+    const FileMsg & metadata = file_->metadata;
+    const fs::path dst_path = metadata.dst_path;
+
+    uint32_t checksum = 0;
+    if (metadata.file_size > 0) {
+      auto data = mmap_shared(nullptr, metadata.file_size, PROT_READ,
+                              MAP_SHARED, file_->fd.fd_num(), 0);
+      checksum = crc32({static_cast<const char *>(data.get()),
+                        metadata.file_size});
+    }
+
+    if (checksum != metadata.checksum) {
+      cerr << "Checksum mismatch in " << dst_path
+           << "; dropping the connection" << endl;
+      if (file_->tmp_path) {
+        fs::remove(*file_->tmp_path);
+      }
+      return false;
+    }
+
+    if (file_->tmp_path) {
+      fs::rename(*file_->tmp_path, dst_path);
+    } else {
+      /* linkat fails if the name exists, so link to a hidden name and
+       * rename it over dst_path atomically */
+      const fs::path link_path = dst_path.parent_path() /
+          ("." + dst_path.filename().string() + "."
+           + to_string(global_file_id++));
+      const string proc_path =
+          "/proc/self/fd/" + to_string(file_->fd.fd_num());
+
+      CheckSystemCall("linkat (" + link_path.string() + ")",
+                      linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD,
+                             link_path.c_str(), AT_SYMLINK_FOLLOW));
+      fs::rename(link_path, dst_path);
+    }
+
+    socket.write(put_field(metadata.seq));
+    cerr << "Received " << dst_path << endl;
+
+    file_.reset();
+    return true;
+  }
 };
 
 int main(int argc, char * argv[])
@@ -72,14 +241,33 @@ int main(int argc, char * argv[])
     abort();
   }
 
-  if (argc != 2 and argc != 3) {
+  if (argc < 2) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   uint16_t port = narrow_cast<uint16_t>(stoi(argv[1]));
-  if (argc == 3) {
-    tmp_dir_path = argv[2];
+
+  for (int i = 2; i < argc; i++) {
+    const string arg = argv[i];
+
+    if (arg == "--max-connections" and i + 1 < argc) {
+      max_connections = stoul(argv[++i]);
+    } else if (arg == "--buffer-size" and i + 1 < argc) {
+      buffer_size = stoul(argv[++i]);
+    } else if (arg == "--max-file-size" and i + 1 < argc) {
+      max_file_size = stoull(argv[++i]);
+    } else if (i == 2 and arg.substr(0, 2) != "--") {
+      tmp_dir_path = arg;
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (max_connections == 0 or buffer_size == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
   }
 
   TCPSocket listening_socket;
@@ -109,21 +297,32 @@ int main(int argc, char * argv[])
 
       poller.add_action(Poller::Action(client.socket, Direction::In,
         [client_id, &client, &clients]()->ResultType {
-          const string & data = client.socket.read();
-          client.buffer.append(data);
+          bool keep;
+          try {
+            keep = client.receive();
+          } catch (const exception & e) {
+            print_exception("file_receiver", e);
+            keep = false;
+          }
 
-          if (data.empty()) {  // EOF
-            client.write_to_file();
+          /* at EOF, a partially received file is dropped; the forwarder
+           * sends it again on its next connection */
+          if (not keep) {
             clients.erase(client_id);
             return ResultType::CancelAll;
           }
 
           return ResultType::Continue;
-        }
+        },
+        [] { return true; },
+        /* a reset connection must not keep its slot */
+        [client_id, &clients]() { clients.erase(client_id); }
       ));
 
       return ResultType::Continue;
-    }
+    },
+    /* further connections wait in the backlog */
+    [&clients]() { return clients.size() < max_connections; }
   ));
 
   for (;;) {
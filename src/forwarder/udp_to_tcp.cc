@@ -1,11 +1,16 @@
+#include <sys/socket.h>
+
 #include <iostream>
 #include <string>
 #include <cstdint>
-#include <deque>
+#include <cstring>
+#include <array>
 
 #include "strict_conversions.hh"
 #include "socket.hh"
 #include "poller.hh"
+#include "ring_buffer.hh"
+#include "exception.hh"
 #include "util.hh"
 
 using namespace std;
@@ -20,6 +25,60 @@ void print_usage(const string & program_name)
   << endl;
 }
 
+/* buffered data beyond which we warn, or give up on the TCP client */
+static constexpr size_t WARN_BUFFER_SIZE = 10 * 1024 * 1024;  // 10 MB
+static constexpr size_t MAX_BUFFER_SIZE = 50 * 1024 * 1024;   // 50 MB
+
+/* datagrams per recvmmsg; each is received into its own slot of the ring
+ * large enough for any datagram, then moved to follow the previous one */
+static constexpr size_t BATCH_SIZE = 64;
+static constexpr size_t SLOT_SIZE = 65536;
+
+/* absorb bursts while the poller is busy draining to TCP */
+static constexpr int UDP_RECV_BUFFER_SIZE = 16 * 1024 * 1024;
+
+/* receive up to BATCH_SIZE datagrams straight into the ring; returns the
+ * number of datagrams received (0 on EWOULDBLOCK) */
+static size_t receive_batch(UDPSocket & udp_socket, RingBuffer & ring)
+{
+  char * const region = ring.writable_region();
+
+  array<iovec, BATCH_SIZE> iovs;
+  array<mmsghdr, BATCH_SIZE> msgs {};
+  for (size_t i = 0; i < BATCH_SIZE; i++) {
+    iovs[i] = {region + i * SLOT_SIZE, SLOT_SIZE};
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  const int received = recvmmsg(udp_socket.fd_num(), msgs.data(), BATCH_SIZE,
+                                MSG_DONTWAIT, nullptr);
+  udp_socket.register_read();
+
+  if (received < 0) {
+    if (errno == EAGAIN or errno == EWOULDBLOCK) {
+      return 0;
+    }
+    throw unix_error("recvmmsg");
+  }
+
+  /* pack the datagrams back to back */
+  size_t length = 0;
+  for (int i = 0; i < received; i++) {
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      throw runtime_error("recvmmsg: datagram truncated");
+    }
+
+    if (i > 0) {
+      memmove(region + length, region + i * SLOT_SIZE, msgs[i].msg_len);
+    }
+    length += msgs[i].msg_len;
+  }
+
+  ring.push(length);
+  return received;
+}
+
 void accept_one_client(TCPSocket & listening_socket, const uint16_t udp_port)
 {
   Poller poller;
@@ -28,6 +87,8 @@ void accept_one_client(TCPSocket & listening_socket, const uint16_t udp_port)
   UDPSocket udp_socket;
   udp_socket.bind(Address("0", udp_port));
   udp_socket.set_blocking(false);
+  const int recv_buffer_size =
+    udp_socket.set_recv_buffer_size(UDP_RECV_BUFFER_SIZE);
 
   /* wait for the first connection blockingly */
   TCPSocket client = listening_socket.accept();
@@ -35,68 +96,46 @@ void accept_one_client(TCPSocket & listening_socket, const uint16_t udp_port)
 
   cerr << "Start forwarding datagrams from UDP "
        << udp_socket.local_address().str() << " to TCP "
-       << client.peer_address().str() << endl;
+       << client.peer_address().str() << " (UDP receive buffer "
+       << recv_buffer_size << " bytes)" << endl;
 
-  /* start forwarding */
-  deque<string> buffer;
-  uint64_t buffer_size = 0;
+  /* start forwarding; a full batch always fits below the give-up size */
+  RingBuffer buffer(MAX_BUFFER_SIZE + BATCH_SIZE * SLOT_SIZE);
 
   /* read datagrams from UDP socket into the buffer */
   poller.add_action(Poller::Action(udp_socket, Direction::In,
-    [&udp_socket, &udp_port, &buffer, &buffer_size, &client]() {
-      while (true) {
-        const auto [ignore, data] = udp_socket.recvfrom();
-
-        if (not data) { // EWOULDBLOCK; try again when data is available
-          break;
-        }
-
-        buffer_size += data->size();
-
-        buffer.emplace_back(move(*data));
-
-        if (buffer_size > 50 * 1024 * 1024) { // 50 MB
-          /* try to gracefully close sockets */
-          client.close();
-          udp_socket.close();
-
-          throw runtime_error("Error: give up forwarding data");
-        } else if (buffer_size > 10 * 1024 * 1024) { // 10 MB
-          cerr << "[" << date_time() << "] "
-               << "port=" << udp_port << ", "
-               << "buffer=" << buffer_size << endl;
-        }
+    [&udp_socket, &udp_port, &buffer, &client]() {
+      while (receive_batch(udp_socket, buffer) == BATCH_SIZE and
+             buffer.readable_size() <= MAX_BUFFER_SIZE) {}
+
+      const size_t buffer_size = buffer.readable_size();
+
+      if (buffer_size > MAX_BUFFER_SIZE) {
+        /* try to gracefully close sockets */
+        client.close();
+        udp_socket.close();
+
+        throw runtime_error("Error: give up forwarding data");
+      } else if (buffer_size > WARN_BUFFER_SIZE) {
+        cerr << "[" << date_time() << "] "
+             << "port=" << udp_port << ", "
+             << "buffer=" << buffer_size << endl;
       }
 
       return ResultType::Continue;
     }
   ));
 
-  /* write datagrams to TCP client socket from the buffer */
+  /* write datagrams to TCP client socket from the buffer, which is
+   * contiguous even when it wraps around */
   poller.add_action(Poller::Action(client, Direction::Out,
-    [&client, &buffer, &buffer_size]() {
-      while (not buffer.empty()) {
-        string & data = buffer.front();
-
-        const size_t bytes_written = client.nb_write(data);
-        if (bytes_written == 0) { // EWOULDBLOCK
-          break;
-        }
-
-        buffer_size -= bytes_written;
-
-        if (bytes_written < data.size()) { // partial write
-          data.erase(0, bytes_written);
-        } else { // full write
-          buffer.pop_front();
-        }
-      }
-
+    [&client, &buffer]() {
+      buffer.pop(client.nb_write(buffer.readable_region()));
       return ResultType::Continue;
     },
     /* interested only when buffer is not empty */
     [&buffer]() {
-      return not buffer.empty();
+      return buffer.readable_size() > 0;
     }
   ));
 
@@ -0,0 +1,173 @@
+#include <sys/socket.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <array>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#include "strict_conversions.hh"
+#include "socket.hh"
+#include "poller.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+/* datagrams per sendmmsg */
+static constexpr size_t BATCH_SIZE = 64;
+
+/* stop once the TCP stream has been idle this long after the last send */
+static constexpr int IDLE_TIMEOUT_MS = 1000;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " UDP-PORT TCP-PORT [-n DATAGRAMS] "
+  "[-s DATAGRAM-SIZE]\n\n"
+  "Connect to a running udp_to_tcp on localhost, send DATAGRAMS datagrams\n"
+  "(default 1000000) of DATAGRAM-SIZE bytes (default 1316, i.e., 7 TS\n"
+  "packets) to its UDP port as fast as possible, and report the throughput\n"
+  "and the datagrams that arrived intact, in order, over TCP"
+  << endl;
+}
+
+/* every datagram starts with its sequence number */
+static void send_datagrams(const uint16_t udp_port, const uint64_t count,
+                           const size_t size)
+{
+  UDPSocket socket;
+  socket.connect(Address("127.0.0.1", udp_port));
+
+  vector<char> data(BATCH_SIZE * size);
+  array<iovec, BATCH_SIZE> iovs;
+  array<mmsghdr, BATCH_SIZE> msgs {};
+
+  for (uint64_t seq = 0; seq < count;) {
+    const size_t batch = min<uint64_t>(BATCH_SIZE, count - seq);
+
+    for (size_t i = 0; i < batch; i++) {
+      char * datagram = data.data() + i * size;
+      const uint64_t datagram_seq = seq + i;
+      memcpy(datagram, &datagram_seq, sizeof(datagram_seq));
+
+      iovs[i] = {datagram, size};
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    seq += CheckSystemCall("sendmmsg",
+                           sendmmsg(socket.fd_num(), msgs.data(), batch, 0));
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  if (argc < 3) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const uint16_t udp_port = narrow_cast<uint16_t>(stoi(argv[1]));
+  const uint16_t tcp_port = narrow_cast<uint16_t>(stoi(argv[2]));
+  uint64_t count = 1000000;
+  size_t size = 7 * 188;
+
+  for (int i = 3; i < argc; i++) {
+    const string arg = argv[i];
+
+    if (arg == "-n" and i + 1 < argc) {
+      count = stoull(argv[++i]);
+    } else if (arg == "-s" and i + 1 < argc) {
+      size = stoul(argv[++i]);
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (size < sizeof(uint64_t)) {
+    cerr << "DATAGRAM-SIZE must be at least " << sizeof(uint64_t) << endl;
+    return EXIT_FAILURE;
+  }
+
+  TCPSocket tcp_socket;
+  tcp_socket.connect(Address("127.0.0.1", tcp_port));
+
+  /* give udp_to_tcp a moment to start forwarding */
+  this_thread::sleep_for(milliseconds(100));
+
+  const auto start = steady_clock::now();
+  auto last_byte = start;
+
+  atomic<bool> sender_done {false};
+  thread sender([&]() {
+    try {
+      send_datagrams(udp_port, count, size);
+    } catch (const exception & e) {
+      print_exception("send_datagrams", e);
+    }
+    sender_done = true;
+  });
+
+  /* check that datagrams arrive whole and in order; some may be lost */
+  string partial;
+  uint64_t received = 0, next_seq = 0, bytes = 0;
+
+  Poller poller;
+  poller.add_action(Poller::Action(tcp_socket, Direction::In,
+    [&]() {
+      const string data = tcp_socket.read();
+      if (data.empty()) {
+        throw runtime_error("udp_to_tcp closed the connection");
+      }
+
+      last_byte = steady_clock::now();
+      bytes += data.size();
+      partial.append(data);
+
+      size_t pos = 0;
+      for (; pos + size <= partial.size(); pos += size) {
+        uint64_t seq;
+        memcpy(&seq, partial.data() + pos, sizeof(seq));
+
+        if (seq < next_seq or seq >= count) {
+          throw runtime_error("datagram out of order or corrupted");
+        }
+
+        next_seq = seq + 1;
+        received++;
+      }
+      partial.erase(0, pos);
+
+      return ResultType::Continue;
+    }
+  ));
+
+  while (received < count) {
+    const auto ret = poller.poll(IDLE_TIMEOUT_MS);
+
+    if (ret.result == Poller::Result::Type::Timeout and sender_done) {
+      break;
+    }
+  }
+
+  sender.join();
+
+  const double seconds = duration<double>(last_byte - start).count();
+
+  cout << "Forwarded " << received << "/" << count << " datagrams ("
+       << 100.0 * received / count << "%) in " << seconds << " s: "
+       << bytes * 8 / seconds / 1e6 << " Mbit/s, "
+       << received / seconds << " datagrams/s" << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -1,10 +1,10 @@
 #include "channel.hh"
 
-#include <fcntl.h>
 #include <fstream>
 #include <algorithm>
 
-#include "file_descriptor.hh"
+#include "vod_manifest.hh"
+#include "chunk_archive.hh"
 #include "exception.hh"
 #include "timestamp.hh"
 
@@ -18,6 +18,8 @@ static const string DEFAULT_AUDIO_CODEC = "audio/webm; codecs=\"opus\"";
 static const unsigned int DEFAULT_PRESENT_DELAY_CHUNK = 15;  // chunks
 static const unsigned int PRESENT_CLEAN_DIFF = 150;  // chunks
 static const unsigned int MAX_UNCHANGED_LIVE_EDGE_MS = 10000;  // ms
+static const size_t DEFAULT_VOD_CACHE_MAPPINGS = 4096;
+static const uint64_t DEFAULT_VOD_CACHE_MB = 1024;  // MB
 
 Channel::Channel(const string & name, const fs::path & media_dir,
                  const YAML::Node & config, Inotify & inotify)
@@ -50,17 +52,33 @@ Channel::Channel(const string & name, const fs::path & media_dir,
     if (config["repeat"]) {
       throw runtime_error("repeat can't be set if live is true");
     }
+
+    if (config["vod_cache_mappings"] or config["vod_cache_mb"]) {
+      throw runtime_error("vod_cache_* can't be set if live is true");
+    }
+
+    mmap_video_files(inotify);
+    mmap_audio_files(inotify);
+    load_ssim_files(inotify);
   } else {
     repeat_ = config["repeat"] ? config["repeat"].as<bool>() : false;
 
     if (config["present_delay_chunk"]) {
       throw runtime_error("present_delay_chunk can't be set if live is false");
     }
-  }
 
-  mmap_video_files(inotify);
-  mmap_audio_files(inotify);
-  load_ssim_files(inotify);
+    const size_t cache_mappings = config["vod_cache_mappings"] ?
+        config["vod_cache_mappings"].as<size_t>() : DEFAULT_VOD_CACHE_MAPPINGS;
+    const uint64_t cache_mb = config["vod_cache_mb"] ?
+        config["vod_cache_mb"].as<uint64_t>() : DEFAULT_VOD_CACHE_MB;
+    vod_cache_.emplace(cache_mappings, cache_mb * 1024 * 1024);
+
+    /* a pre-recorded channel is indexed once; as ever, only live channels
+     * watch their directories for new files */
+    if (not load_chunk_archives()) {
+      load_vod_manifest();
+    }
+  }
 
   if (not live_) {
     /* set init_vts_ to be the first ready timestamp */
@@ -198,7 +216,13 @@ mmap_t Channel::vinit(const VideoFormat & format) const
 
 mmap_t Channel::vdata(const VideoFormat & format, const uint64_t ts) const
 {
-  return vdata_.at(ts).at(format);
+  const mmap_t & data_size = vdata_.at(ts).at(format);
+  if (live_ or get<0>(data_size)) {
+    return data_size;
+  }
+
+  return vod_cache_->get(input_path_ / "ready" / format.to_string()
+                         / (to_string(ts) + ".m4s"));
 }
 
 const map<VideoFormat, mmap_t> & Channel::vdata(const uint64_t ts) const
@@ -223,7 +247,13 @@ mmap_t Channel::ainit(const AudioFormat & format) const
 
 mmap_t Channel::adata(const AudioFormat & format, const uint64_t ts) const
 {
-  return adata_.at(ts).at(format);
+  const mmap_t & data_size = adata_.at(ts).at(format);
+  if (live_ or get<0>(data_size)) {
+    return data_size;
+  }
+
+  return vod_cache_->get(input_path_ / "ready" / format.to_string()
+                         / (to_string(ts) + ".chk"));
 }
 
 const map<AudioFormat, mmap_t> & Channel::adata(const uint64_t ts) const
@@ -231,21 +261,6 @@ const map<AudioFormat, mmap_t> & Channel::adata(const uint64_t ts) const
   return adata_.at(ts);
 }
 
-mmap_t mmap_file(const string & filepath)
-{
-  try {
-    FileDescriptor fd(CheckSystemCall("open (" + filepath + ")",
-                      open(filepath.c_str(), O_RDONLY)));
-    size_t size = fd.filesize();
-    shared_ptr<void> data = mmap_shared(nullptr, size, PROT_READ,
-                                        MAP_PRIVATE, fd.fd_num(), 0);
-    return {static_pointer_cast<char>(data), size};
-  } catch (const exception & e) {
-    print_exception("mmap_file", e);
-    return {nullptr, 0};
-  }
-}
-
 void Channel::munmap_video(const uint64_t ts)
 {
   uint64_t clean_window_ts = (clean_window_chunk_.value() - 1) * vduration_;
@@ -531,3 +546,112 @@ void Channel::load_ssim_files(Inotify & inotify)
     }
   }
 }
+
+void Channel::load_vod_manifest()
+{
+  const fs::path ready_dir = input_path_ / "ready";
+
+  vector<string> dirs;
+  for (const auto & vf : vformats_) {
+    dirs.emplace_back(vf.to_string());
+    dirs.emplace_back(vf.to_string() + "-ssim");
+  }
+  for (const auto & af : aformats_) {
+    dirs.emplace_back(af.to_string());
+  }
+
+  const auto manifest = VODManifest::load_or_build(ready_dir, dirs);
+
+  for (const auto & vf : vformats_) {
+    const auto & video = manifest.dir(vf.to_string());
+    if (not video.init.empty()) {
+      vinit_.emplace(vf, mmap_file(ready_dir / vf.to_string() / video.init));
+    }
+
+    for (const auto & [ts, size] : video.sizes) {
+      vdata_[ts][vf] = {nullptr, size};
+    }
+
+    const auto & ssim = manifest.dir(vf.to_string() + "-ssim");
+    for (const auto & [ts, value] : ssim.ssims) {
+      vssim_[ts][vf] = value;
+    }
+  }
+
+  for (const auto & af : aformats_) {
+    const auto & audio = manifest.dir(af.to_string());
+    if (not audio.init.empty()) {
+      ainit_.emplace(af, mmap_file(ready_dir / af.to_string() / audio.init));
+    }
+
+    for (const auto & [ts, size] : audio.sizes) {
+      adata_[ts][af] = {nullptr, size};
+    }
+  }
+
+  /* visit the chunks in order so that the frontiers grow contiguously */
+  for (const auto & entry : vdata_) {
+    update_vready_frontier(entry.first);
+  }
+  for (const auto & entry : adata_) {
+    update_aready_frontier(entry.first);
+  }
+
+  cerr << "Channel " << name_ << ": indexed " << vdata_.size()
+       << " video and " << adata_.size() << " audio chunks in "
+       << ready_dir << endl;
+}
+
+bool Channel::load_chunk_archives()
+{
+  const fs::path ready_dir = input_path_ / "ready";
+
+  for (const auto & vf : vformats_) {
+    if (not ChunkArchive::exists(ready_dir, vf.to_string())) {
+      return false;
+    }
+  }
+  for (const auto & af : aformats_) {
+    if (not ChunkArchive::exists(ready_dir, af.to_string())) {
+      return false;
+    }
+  }
+
+  for (const auto & vf : vformats_) {
+    const ChunkArchive archive {ready_dir, vf.to_string()};
+    if (get<0>(archive.init())) {
+      vinit_.emplace(vf, archive.init());
+    }
+
+    for (const auto & chunk : archive.chunks()) {
+      vdata_[chunk.ts][vf] = chunk.data;
+      if (chunk.ssim) {
+        vssim_[chunk.ts][vf] = *chunk.ssim;
+      }
+    }
+  }
+
+  for (const auto & af : aformats_) {
+    const ChunkArchive archive {ready_dir, af.to_string()};
+    if (get<0>(archive.init())) {
+      ainit_.emplace(af, archive.init());
+    }
+
+    for (const auto & chunk : archive.chunks()) {
+      adata_[chunk.ts][af] = chunk.data;
+    }
+  }
+
+  /* visit the chunks in order so that the frontiers grow contiguously */
+  for (const auto & entry : vdata_) {
+    update_vready_frontier(entry.first);
+  }
+  for (const auto & entry : adata_) {
+    update_aready_frontier(entry.first);
+  }
+
+  cerr << "Channel " << name_ << ": serve " << vdata_.size() << " video and "
+       << adata_.size() << " audio chunks from the archives in "
+       << ready_dir << endl;
+  return true;
+}
@@ -9,12 +9,10 @@
 
 #include "filesystem.hh"
 #include "inotify.hh"
-#include "mmap.hh"
+#include "mmap_cache.hh"
 #include "media_formats.hh"
 #include "yaml.hh"
 
-using mmap_t = std::tuple<std::shared_ptr<char>, size_t>;
-
 class Channel
 {
 public:
@@ -38,6 +36,9 @@ public:
    * unavailable if live edge hasn't advanced for MAX_UNCHANGED_LIVE_EDGE_MS */
   void enforce_moving_live_edge();
 
+  /* on non-live channels without chunk archives, media chunks are mapped
+   * only when requested by vdata(format, ts) or adata(format, ts); the maps
+   * returned by vdata(ts) and adata(ts) hold the chunk sizes but no data */
   mmap_t vinit(const VideoFormat & format) const;
   mmap_t vdata(const VideoFormat & format, const uint64_t ts) const;
   const std::map<VideoFormat, mmap_t> & vdata(const uint64_t ts) const;
@@ -109,6 +110,9 @@ private:
   std::optional<uint64_t> init_vts_ {};
   bool repeat_ {};
 
+  /* recently used media chunks of a non-live channel */
+  mutable std::optional<MmapCache> vod_cache_ {};
+
   bool vready(const uint64_t ts) const;
   bool aready(const uint64_t ts) const;
 
@@ -129,6 +133,13 @@ private:
   void do_read_ssim(const fs::path & filepath, const VideoFormat & vf);
   void load_ssim_files(Inotify & inotify);
 
+  /* serve a non-live channel from the archives made by pack_chunks, one
+   * mapping per format; false if any format has not been packed */
+  bool load_chunk_archives();
+
+  /* index the chunks of a non-live channel without mapping them */
+  void load_vod_manifest();
+
   void update_vready_frontier(const uint64_t vts);
   void update_aready_frontier(const uint64_t ats);
 };
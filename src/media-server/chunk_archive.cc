@@ -0,0 +1,199 @@
+#include "chunk_archive.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <limits>
+
+#include "file_descriptor.hh"
+#include "temp_file.hh"
+#include "path.hh"
+#include "serialization.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const string ARCHIVE_EXT = ".pack";
+static const string INDEX_MAGIC = "PUFFPACK";
+static const uint32_t INDEX_VERSION = 2;
+
+/* the index follows the chunks in the archive, so that an archive and its
+ * index are always replaced together; integers in network byte order:
+ *   header: magic (8 bytes), version (4), number of chunks (4),
+ *           init segment offset (8) and size (8)
+ *   then per chunk: ts (8), offset (8), size (8),
+ *           SSIM (8, the bits of a double; NaN if unknown)
+ * and the archive ends with the offset of the index (8) */
+static constexpr size_t HEADER_SIZE = 32;
+static constexpr size_t ENTRY_SIZE = 32;
+static constexpr size_t TRAILER_SIZE = 8;
+
+/* readable by media servers running as other users */
+static constexpr mode_t ARCHIVE_MODE = 0644;
+
+static uint64_t double_to_bits(const double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static double bits_to_double(const uint64_t bits)
+{
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static string read_file(const fs::path & filepath)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + filepath.string() + ")",
+                    open(filepath.c_str(), O_RDONLY)));
+  return fd.read_exactly(fd.filesize());
+}
+
+void ChunkArchive::pack(const fs::path & ready_dir, const string & dir)
+{
+  optional<fs::path> init_path;
+  map<uint64_t, fs::path> segments;
+
+  for (const auto & file : fs::directory_iterator(ready_dir / dir)) {
+    const fs::path & filepath = file.path();
+    const string filestem = filepath.stem();
+    const string extension = filepath.extension();
+
+    if (filestem == "init") {
+      init_path = filepath;
+    } else if (extension == ".m4s" or extension == ".chk") {
+      segments.emplace(stoull(filestem), filepath);
+    }
+  }
+
+  map<uint64_t, double> ssims;
+  const fs::path ssim_dir = ready_dir / (dir + "-ssim");
+  if (fs::is_directory(ssim_dir)) {
+    for (const auto & file : fs::directory_iterator(ssim_dir)) {
+      const fs::path & filepath = file.path();
+      if (filepath.extension() == ".ssim") {
+        ifstream ssim_file(filepath);
+        string line;
+        getline(ssim_file, line);
+
+        ssims[stoull(filepath.stem())] = stod(line);
+      }
+    }
+  }
+
+  /* append the segments and the index to a new archive, then move it into
+   * place */
+  const fs::path archive_path = ready_dir / (dir + ARCHIVE_EXT);
+  uint64_t offset = 0, init_size = 0;
+  string entries;
+
+  string tmp_name;
+  try {
+    UniqueFile archive {archive_path.string()};
+    tmp_name = archive.name();
+    CheckSystemCall("fchmod", fchmod(archive.fd().fd_num(), ARCHIVE_MODE));
+
+    if (init_path) {
+      const string data = read_file(*init_path);
+      archive.fd().write(data);
+      init_size = data.size();
+      offset += data.size();
+    }
+
+    for (const auto & [ts, filepath] : segments) {
+      const string data = read_file(filepath);
+      archive.fd().write(data);
+
+      const auto it = ssims.find(ts);
+      const double ssim = it != ssims.end() ?
+          it->second : numeric_limits<double>::quiet_NaN();
+
+      entries += put_field(ts) + put_field(offset)
+                 + put_field(static_cast<uint64_t>(data.size()))
+                 + put_field(double_to_bits(ssim));
+      offset += data.size();
+    }
+
+    archive.fd().write(INDEX_MAGIC + put_field(INDEX_VERSION)
+                       + put_field(static_cast<uint32_t>(segments.size()))
+                       + put_field(static_cast<uint64_t>(0))
+                       + put_field(init_size)
+                       + entries + put_field(offset));
+  } catch (const exception &) {
+    /* do not leave a partial archive behind */
+    if (not tmp_name.empty()) {
+      unlink(tmp_name.c_str());
+    }
+    throw;
+  }
+
+  roost::rename(tmp_name, archive_path.string());
+}
+
+bool ChunkArchive::exists(const fs::path & ready_dir, const string & dir)
+{
+  return fs::exists(ready_dir / (dir + ARCHIVE_EXT));
+}
+
+ChunkArchive::ChunkArchive(const fs::path & ready_dir, const string & dir)
+{
+  /* map the whole archive once; the index and every slice share the mapping */
+  const fs::path archive_path = ready_dir / (dir + ARCHIVE_EXT);
+  const mmap_t region = mmap_file(archive_path);
+  const char * data = get<0>(region).get();
+  const uint64_t archive_size = get<1>(region);
+
+  if (data == nullptr or archive_size < HEADER_SIZE + TRAILER_SIZE) {
+    throw runtime_error(archive_path.string() + ": not a chunk archive");
+  }
+
+  /* the chunks end where the index starts */
+  const uint64_t index_offset = get_uint64(data + archive_size - TRAILER_SIZE);
+  if (index_offset > archive_size - TRAILER_SIZE - HEADER_SIZE) {
+    throw runtime_error(archive_path.string() + ": truncated");
+  }
+
+  const char * index = data + index_offset;
+  const uint64_t index_size = archive_size - TRAILER_SIZE - index_offset;
+
+  if (string(index, INDEX_MAGIC.size()) != INDEX_MAGIC
+      or get_uint32(index + 8) != INDEX_VERSION) {
+    throw runtime_error(archive_path.string() + ": unknown format");
+  }
+
+  const uint32_t num_chunks = get_uint32(index + 12);
+  if (index_size != HEADER_SIZE + num_chunks * ENTRY_SIZE) {
+    throw runtime_error(archive_path.string() + ": truncated");
+  }
+
+  auto slice = [&](const uint64_t offset, const uint64_t size)->mmap_t {
+    if (offset > index_offset or size > index_offset - offset) {
+      throw runtime_error(archive_path.string() + ": chunk out of bounds");
+    }
+
+    return {shared_ptr<char>(get<0>(region), get<0>(region).get() + offset),
+            size};
+  };
+
+  const uint64_t init_size = get_uint64(index + 24);
+  if (init_size > 0) {
+    init_ = slice(get_uint64(index + 16), init_size);
+  }
+
+  chunks_.reserve(num_chunks);
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    const char * entry = index + HEADER_SIZE + i * ENTRY_SIZE;
+    const double ssim = bits_to_double(get_uint64(entry + 24));
+
+    chunks_.push_back({get_uint64(entry),
+                       slice(get_uint64(entry + 8), get_uint64(entry + 16)),
+                       isnan(ssim) ? nullopt : optional<double>(ssim)});
+  }
+}
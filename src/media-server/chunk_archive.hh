@@ -0,0 +1,43 @@
+#ifndef CHUNK_ARCHIVE_HH
+#define CHUNK_ARCHIVE_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <optional>
+
+#include "filesystem.hh"
+#include "mmap_cache.hh"
+
+/* all the chunks of one format of a pre-recorded channel packed into
+ * <ready dir>/<dir>.pack: the init segment, the media segments in timestamp
+ * order, then their index; the SSIMs in <ready dir>/<dir>-ssim, if present,
+ * are kept in the index */
+class ChunkArchive
+{
+public:
+  struct Chunk
+  {
+    uint64_t ts;
+    mmap_t data;  /* a slice of the mapped archive */
+    std::optional<double> ssim;
+  };
+
+  /* pack <ready dir>/<dir> into an archive, replacing the existing one */
+  static void pack(const fs::path & ready_dir, const std::string & dir);
+
+  static bool exists(const fs::path & ready_dir, const std::string & dir);
+
+  /* map the archive as a single region; throws if it is inconsistent */
+  ChunkArchive(const fs::path & ready_dir, const std::string & dir);
+
+  /* {nullptr, 0} if the directory had no init segment */
+  const mmap_t & init() const { return init_; }
+  const std::vector<Chunk> & chunks() const { return chunks_; }
+
+private:
+  mmap_t init_ {};
+  std::vector<Chunk> chunks_ {};
+};
+
+#endif /* CHUNK_ARCHIVE_HH */
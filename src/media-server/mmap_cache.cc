@@ -0,0 +1,66 @@
+#include "mmap_cache.hh"
+
+#include <fcntl.h>
+#include <stdexcept>
+
+#include "file_descriptor.hh"
+#include "mmap.hh"
+#include "exception.hh"
+
+using namespace std;
+
+mmap_t mmap_file(const string & filepath)
+{
+  try {
+    FileDescriptor fd(CheckSystemCall("open (" + filepath + ")",
+                      open(filepath.c_str(), O_RDONLY)));
+    size_t size = fd.filesize();
+    shared_ptr<void> data = mmap_shared(nullptr, size, PROT_READ,
+                                        MAP_PRIVATE, fd.fd_num(), 0);
+    return {static_pointer_cast<char>(data), size};
+  } catch (const exception & e) {
+    print_exception("mmap_file", e);
+    return {nullptr, 0};
+  }
+}
+
+MmapCache::MmapCache(const size_t max_mappings, const uint64_t max_bytes)
+  : max_mappings_(max_mappings), max_bytes_(max_bytes)
+{
+  if (max_mappings_ == 0) {
+    throw runtime_error("MmapCache: at least one mapping is required");
+  }
+}
+
+mmap_t MmapCache::get(const string & filepath)
+{
+  auto it = index_.find(filepath);
+  if (it != index_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+
+  mmap_t data_size = mmap_file(filepath);
+  if (std::get<0>(data_size) == nullptr) {
+    return data_size;
+  }
+
+  lru_.emplace_front(filepath, data_size);
+  index_.emplace(filepath, lru_.begin());
+  bytes_ += std::get<1>(data_size);
+
+  evict();
+
+  return data_size;
+}
+
+void MmapCache::evict()
+{
+  /* never evict the mapping just added, even if it alone exceeds max_bytes_ */
+  while (lru_.size() > 1 and
+         (lru_.size() > max_mappings_ or bytes_ > max_bytes_)) {
+    bytes_ -= std::get<1>(lru_.back().second);
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
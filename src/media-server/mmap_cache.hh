@@ -0,0 +1,44 @@
+#ifndef MMAP_CACHE_HH
+#define MMAP_CACHE_HH
+
+#include <cstdint>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <tuple>
+
+using mmap_t = std::tuple<std::shared_ptr<char>, size_t>;
+
+/* mmap the whole file read-only; return {nullptr, 0} on failure */
+mmap_t mmap_file(const std::string & filepath);
+
+/* maps files on first request and keeps the most recently used ones mapped,
+ * bounded by the number of mappings and their total size; a mapping evicted
+ * while still referenced elsewhere is unmapped once released there */
+class MmapCache
+{
+public:
+  MmapCache(const size_t max_mappings, const uint64_t max_bytes);
+
+  /* map filepath unless it is mapped already, and mark it most recently used;
+   * failures are not cached */
+  mmap_t get(const std::string & filepath);
+
+  size_t mappings() const { return lru_.size(); }
+  uint64_t bytes() const { return bytes_; }
+
+private:
+  size_t max_mappings_;
+  uint64_t max_bytes_;
+
+  /* most recently used first */
+  std::list<std::pair<std::string, mmap_t>> lru_ {};
+  std::unordered_map<std::string,
+      std::list<std::pair<std::string, mmap_t>>::iterator> index_ {};
+  uint64_t bytes_ {0};
+
+  void evict();
+};
+
+#endif /* MMAP_CACHE_HH */
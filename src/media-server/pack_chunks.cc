@@ -0,0 +1,67 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "filesystem.hh"
+#include "chunk_archive.hh"
+#include "exception.hh"
+
+using namespace std;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " <ready_dir> [<format> ...]\n\n"
+  "Pack the chunks of a pre-recorded channel into one indexed archive per\n"
+  "format, <ready_dir>/<format>.pack. The SSIMs in <ready_dir>/<format>-ssim,\n"
+  "if present, go into the index.\n"
+  "Packs every format directory in <ready_dir> if no format is given."
+  << endl;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  if (argc < 2) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const fs::path ready_dir = argv[1];
+
+  vector<string> formats;
+  for (int i = 2; i < argc; i++) {
+    formats.emplace_back(argv[i]);
+  }
+
+  if (formats.empty()) {
+    for (const auto & file : fs::directory_iterator(ready_dir)) {
+      const string name = file.path().filename();
+      const string suffix = "-ssim";
+
+      if (fs::is_directory(file.path()) and not (name.size() > suffix.size()
+          and name.compare(name.size() - suffix.size(), suffix.size(),
+                           suffix) == 0)) {
+        formats.emplace_back(name);
+      }
+    }
+  }
+
+  try {
+    for (const auto & format : formats) {
+      ChunkArchive::pack(ready_dir, format);
+
+      const ChunkArchive archive {ready_dir, format};
+      cerr << "Packed " << archive.chunks().size() << " chunks of "
+           << format << endl;
+    }
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
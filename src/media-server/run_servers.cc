@@ -2,8 +2,12 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
 #include <crypto++/sha.h>
 #include <crypto++/hex.h>
+#include <crypto++/osrng.h>
 #include <pqxx/pqxx>
 
 #include "filesystem.hh"
@@ -14,14 +18,23 @@
 #include "exception.hh"
 #include "timestamp.hh"
 #include "yaml.hh"
+#include "timerfd.hh"
+#include "secure_socket.hh"
 
 using namespace std;
 using namespace CryptoPP;
+using namespace PollerShortNames;
 
 static string yaml_config;
 static YAML::Node config;
 static fs::path src_path;  /* path to puffer/src directory */
 
+/* a new TLS session ticket key is generated this often, and the key file
+ * keeps the last NUM_TICKET_KEYS so that tickets remain valid for at least
+ * SSLContext::SESSION_TIMEOUT_S */
+static const unsigned int TICKET_KEY_ROTATION_MS = 60 * 60 * 1000;
+static const size_t NUM_TICKET_KEYS = 3;
+
 void print_usage(const string & program_name)
 {
   cerr << "Usage: " << program_name << " <YAML configuration> [--maintenance]" << endl;
@@ -29,7 +42,7 @@ void print_usage(const string & program_name)
 
 string sha256(const string & input)
 {
-  SHA256 hash;
+  CryptoPP::SHA256 hash;  /* not OpenSSL's SHA256() */
   string digest;
   StringSource s(input, true,
     new HashFilter(hash,
@@ -84,6 +97,25 @@ int retrieve_expt_id(const string & json_str)
   return -1;
 }
 
+/* put a new random key at the front of the ticket key file, which every
+ * ws_media_server reloads once it changes */
+void rotate_ticket_keys(const string & key_file, AutoSeededRandomPool & prng)
+{
+  string keys(sizeof(SessionTicketKey), '\0');
+  prng.GenerateBlock(reinterpret_cast<unsigned char *>(keys.data()),
+                     keys.size());
+
+  /* keep the previous keys to accept the tickets they encrypted */
+  if (fs::exists(key_file)) {
+    ifstream old_keys(key_file, ios::binary);
+    keys.append(istreambuf_iterator<char>(old_keys),
+                istreambuf_iterator<char>());
+    keys.resize(min(keys.size(), NUM_TICKET_KEYS * sizeof(SessionTicketKey)));
+  }
+
+  roost::atomic_create(keys, key_file, true, 0600);
+}
+
 int run_maintenance_servers()
 {
   cerr << "Running maintenance servers" << endl;
@@ -127,6 +159,28 @@ int run_ws_media_servers()
     fs::remove_all(ipc_dir);
   }
 
+  /* share the TLS session ticket keys among all media servers, so that a
+   * viewer can resume its session on any of them */
+  Timerfd ticket_key_timer;
+  AutoSeededRandomPool prng;
+
+  if (config["ssl_session_ticket_key_file"]) {
+    const string key_file = config["ssl_session_ticket_key_file"].as<string>();
+    rotate_ticket_keys(key_file, prng);
+
+    proc_manager.poller().add_action(Poller::Action(ticket_key_timer,
+      Direction::In,
+      [&ticket_key_timer, &prng, key_file]()->Result {
+        if (ticket_key_timer.expirations() > 0) {
+          rotate_ticket_keys(key_file, prng);
+        }
+        return ResultType::Continue;
+      }
+    ));
+
+    ticket_key_timer.start(TICKET_KEY_ROTATION_MS, TICKET_KEY_ROTATION_MS);
+  }
+
   /* run media servers in each experimental group */
   const auto & expt_json = src_path / "scripts" / "expt_json.py";
   const auto & ws_media_server = src_path / "media-server/ws_media_server";
@@ -0,0 +1,169 @@
+#include "vod_manifest.hh"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+
+#include "path.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const string MANIFEST_NAME = "vod_manifest";
+static const string MANIFEST_MAGIC = "puffer-vod-manifest";
+static const unsigned int MANIFEST_VERSION = 2;
+
+/* manifest format, one record per line:
+ *   puffer-vod-manifest <version>
+ *   dir <dir> <mtime of dir when it was listed>
+ *   init <dir> <file name>
+ *   size <dir> <ts> <bytes>
+ *   ssim <dir> <ts> <ssim> */
+
+/* in file_time_type ticks; compared only for equality */
+static int64_t dir_mtime(const fs::path & dir_path)
+{
+  return fs::last_write_time(dir_path).time_since_epoch().count();
+}
+
+VODManifest VODManifest::load_or_build(const fs::path & ready_dir,
+                                       const vector<string> & dirs)
+{
+  auto manifest = load(ready_dir, dirs);
+  if (manifest) {
+    return move(*manifest);
+  }
+
+  cerr << "Building " << (ready_dir / MANIFEST_NAME).string() << endl;
+  VODManifest built = build(ready_dir, dirs);
+  built.save(ready_dir);
+  return built;
+}
+
+optional<VODManifest> VODManifest::load(const fs::path & ready_dir,
+                                        const vector<string> & dirs)
+{
+  const fs::path manifest_path = ready_dir / MANIFEST_NAME;
+  if (not fs::exists(manifest_path)) {
+    return nullopt;
+  }
+
+  ifstream in(manifest_path);
+  string line;
+  getline(in, line);
+  if (line != MANIFEST_MAGIC + " " + to_string(MANIFEST_VERSION)) {
+    cerr << "Ignoring " << manifest_path.string()
+         << ": unknown format" << endl;
+    return nullopt;
+  }
+
+  VODManifest manifest;
+  while (getline(in, line)) {
+    istringstream record(line);
+    string tag, dir;
+    record >> tag >> dir;
+
+    if (tag == "dir") {
+      record >> manifest.dirs_[dir].mtime;
+    } else if (tag == "init") {
+      record >> manifest.dirs_[dir].init;
+    } else if (tag == "size") {
+      uint64_t ts, size;
+      if (record >> ts >> size) {
+        manifest.dirs_[dir].sizes[ts] = size;
+      }
+    } else if (tag == "ssim") {
+      uint64_t ts;
+      double ssim;
+      if (record >> ts >> ssim) {
+        manifest.dirs_[dir].ssims[ts] = ssim;
+      }
+    } else {
+      record.setstate(ios::failbit);
+    }
+
+    if (not record) {
+      cerr << "Ignoring " << manifest_path.string()
+           << ": malformed record \"" << line << "\"" << endl;
+      return nullopt;
+    }
+  }
+
+  /* stale if any directory has gained or lost files since it was listed;
+   * an mtime that differs at all, rather than one newer than the manifest,
+   * also catches changes made within the same timestamp tick */
+  for (const auto & dir : dirs) {
+    const auto it = manifest.dirs_.find(dir);
+    if (it == manifest.dirs_.end() or
+        it->second.mtime != dir_mtime(ready_dir / dir)) {
+      return nullopt;
+    }
+  }
+
+  return manifest;
+}
+
+VODManifest VODManifest::build(const fs::path & ready_dir,
+                               const vector<string> & dirs)
+{
+  VODManifest manifest;
+
+  for (const auto & dir : dirs) {
+    Dir & entries = manifest.dirs_[dir];
+
+    /* before listing, so that a file added meanwhile makes it stale */
+    entries.mtime = dir_mtime(ready_dir / dir);
+
+    for (const auto & file : fs::directory_iterator(ready_dir / dir)) {
+      const fs::path & filepath = file.path();
+      const string filestem = filepath.stem();
+      const string extension = filepath.extension();
+
+      if (filestem == "init") {
+        entries.init = filepath.filename();
+      } else if (extension == ".m4s" or extension == ".chk") {
+        entries.sizes[stoull(filestem)] = fs::file_size(filepath);
+      } else if (extension == ".ssim") {
+        ifstream ssim_file(filepath);
+        string line;
+        getline(ssim_file, line);
+
+        entries.ssims[stoull(filestem)] = stod(line);
+      }
+    }
+  }
+
+  return manifest;
+}
+
+void VODManifest::save(const fs::path & ready_dir) const
+{
+  ostringstream out;
+  out << setprecision(numeric_limits<double>::max_digits10);
+  out << MANIFEST_MAGIC << " " << MANIFEST_VERSION << "\n";
+
+  for (const auto & [dir, entries] : dirs_) {
+    out << "dir " << dir << " " << entries.mtime << "\n";
+
+    if (not entries.init.empty()) {
+      out << "init " << dir << " " << entries.init << "\n";
+    }
+
+    for (const auto & [ts, size] : entries.sizes) {
+      out << "size " << dir << " " << ts << " " << size << "\n";
+    }
+
+    for (const auto & [ts, ssim] : entries.ssims) {
+      out << "ssim " << dir << " " << ts << " " << ssim << "\n";
+    }
+  }
+
+  /* the media directory may be read-only; the channel can still be served */
+  try {
+    roost::atomic_create(out.str(), (ready_dir / MANIFEST_NAME).string());
+  } catch (const exception & e) {
+    print_exception("VODManifest", e);
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef VOD_MANIFEST_HH
+#define VOD_MANIFEST_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <optional>
+
+#include "filesystem.hh"
+
+/* index of the segments of a pre-recorded channel, so that the channel can
+ * start without listing, opening or mapping each of its files; it is saved
+ * next to the indexed directories and rebuilt when any of them has changed */
+class VODManifest
+{
+public:
+  /* what one directory (e.g., ready/<video format>) contains */
+  struct Dir
+  {
+    std::string init {};  /* file name of the init segment, if any */
+    std::map<uint64_t, uint64_t> sizes {};  /* ts -> size of <ts>.m4s/.chk */
+    std::map<uint64_t, double> ssims {};    /* ts -> SSIM in <ts>.ssim */
+    int64_t mtime {0};  /* of the directory when it was listed */
+  };
+
+  /* load the manifest saved in ready_dir if it indexes all the dirs and none
+   * of them has changed since; otherwise rebuild it and try to save it */
+  static VODManifest load_or_build(const fs::path & ready_dir,
+                                   const std::vector<std::string> & dirs);
+
+  const Dir & dir(const std::string & name) const { return dirs_.at(name); }
+
+private:
+  std::map<std::string, Dir> dirs_ {};
+
+  static std::optional<VODManifest> load(const fs::path & ready_dir,
+                                         const std::vector<std::string> & dirs);
+  static VODManifest build(const fs::path & ready_dir,
+                           const std::vector<std::string> & dirs);
+  void save(const fs::path & ready_dir) const;
+};
+
+#endif /* VOD_MANIFEST_HH */
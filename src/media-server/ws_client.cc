@@ -37,6 +37,8 @@ void WebSocketClient::reset_helper()
 
   last_video_send_ts_.reset();
   tcp_info_.reset();
+
+  unsent_video_.reset();
 }
 
 void WebSocketClient::init_channel(const shared_ptr<Channel> & channel,
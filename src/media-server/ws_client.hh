@@ -85,6 +85,18 @@ public:
   std::optional<uint64_t> last_video_send_ts() const { return last_video_send_ts_; }
   std::optional<TCPInfo> tcp_info() const { return tcp_info_; }
 
+  /* the rest of the video chunk being sent, which is divided into frames
+   * of frame_size media bytes only as the connection has room for them */
+  struct UnsentVideo {
+    std::string channel;
+    uint64_t ts;
+    double ssim;
+    size_t frame_size;
+    VideoSegment segment;
+  };
+
+  std::optional<UnsentVideo> & unsent_video() { return unsent_video_; }
+
   /* mutators */
   void set_init_id(const unsigned int init_id);
 
@@ -184,6 +196,8 @@ private:
   /* TCP info before sending a video chunk */
   std::optional<TCPInfo> tcp_info_ {};
 
+  std::optional<UnsentVideo> unsent_video_ {};
+
   /* (re)instantiate abr_algo_ */
   void init_abr_algo();
 
@@ -41,7 +41,16 @@ YAML::Node config;
 static map<string, shared_ptr<Channel>> channels;  /* key: channel name */
 static map<uint64_t, WebSocketClient> clients;  /* key: connection ID */
 
-static const size_t MAX_WS_FRAME_B = 100 * 1024;  /* 10 KB */
+/* media bytes in each WebSocket frame, chosen for each chunk from the
+ * connection's TCP info within these bounds (min_ws_frame_b and
+ * max_ws_frame_b in the YAML configuration) */
+static size_t min_ws_frame_b = 16 * 1024;
+static size_t max_ws_frame_b = 256 * 1024;
+
+/* a frame should not delay the frames queued behind it longer than this */
+static const unsigned int MAX_WS_FRAME_DELAY_MS = 20;
+
+static const unsigned int SEND_BUDGET_B = 1024 * 1024; /* per connection */
 static const unsigned int MAX_IDLE_MS = 60000; /* clean idle connections */
 
 static const unsigned int MAX_CONNECTION_NUM = 10; /* max connections */
@@ -55,6 +64,11 @@ static map<string, FileDescriptor> log_fds;  /* map log name to fd */
 static const unsigned int MAX_LOG_FILESIZE = 100 * 1024 * 1024;  /* 100 MB */
 static uint64_t last_minute = 0;  /* in ms; multiple of 60000 */
 
+/* TLS session resumption */
+static string ticket_key_file;  /* shared by the servers; empty if none */
+static fs::file_time_type ticket_key_mtime;
+static long last_handshakes = 0, last_resumed_handshakes = 0;
+
 void print_usage(const string & program_name)
 {
   cerr <<
@@ -109,6 +123,52 @@ void append_to_log(const string & log_stem, const string & log_line)
   }
 }
 
+/* about a congestion window of media per frame, so that the client acks
+ * each window, but no more than the connection delivers in
+ * MAX_WS_FRAME_DELAY_MS, so that audio and control frames are not held
+ * up behind it */
+size_t ws_frame_size(const TCPInfo & tcpi)
+{
+  uint64_t frame_size = uint64_t(tcpi.cwnd) * tcpi.mss;
+
+  if (tcpi.delivery_rate > 0) {
+    frame_size = min(frame_size,
+                     tcpi.delivery_rate * MAX_WS_FRAME_DELAY_MS / 1000);
+  }
+
+  return clamp<uint64_t>(frame_size, min_ws_frame_b, max_ws_frame_b);
+}
+
+/* queue frames of the video chunk being sent while the connection has room
+ * for them; the rest is queued by the writable callback */
+void queue_unsent_video(WebSocketServer & server, WebSocketClient & client)
+{
+  auto & unsent = client.unsent_video();
+
+  while (unsent and server.writable(client.connection_id())) {
+    VideoSegment & segment = unsent->segment;
+
+    ServerVideoMsg video_msg(client.init_id().value(),
+                             unsent->channel,
+                             segment.format().to_string(),
+                             unsent->ts,
+                             segment.offset(),
+                             segment.length(),
+                             unsent->ssim);
+    string frame_payload = video_msg.to_string();
+    segment.read(frame_payload, unsent->frame_size);
+
+    /* audio and control frames overtake queued video frames */
+    WSFrame frame {true, WSFrame::OpCode::Binary, move(frame_payload)};
+    server.queue_frame(client.connection_id(), frame,
+                       WebSocketServer::Priority::Low);
+
+    if (segment.done()) {
+      unsent.reset();
+    }
+  }
+}
+
 void serve_video_to_client(WebSocketServer & server,
                            WebSocketClient & client)
 {
@@ -135,20 +195,13 @@ void serve_video_to_client(WebSocketServer & server,
   VideoSegment next_vsegment {next_vformat, data_mmap, init_mmap};
 
   /* divide the next segment into WebSocket frames and send */
-  while (not next_vsegment.done()) {
-    ServerVideoMsg video_msg(client.init_id().value(),
-                             channel->name(),
-                             next_vformat.to_string(),
-                             next_vts,
-                             next_vsegment.offset(),
-                             next_vsegment.length(),
-                             ssim);
-    string frame_payload = video_msg.to_string();
-    next_vsegment.read(frame_payload, MAX_WS_FRAME_B - frame_payload.size());
+  const size_t frame_size = ws_frame_size(tcpi);
+  const size_t num_frames =
+    (next_vsegment.length() + frame_size - 1) / frame_size;
 
-    WSFrame frame {true, WSFrame::OpCode::Binary, move(frame_payload)};
-    server.queue_frame(client.connection_id(), frame);
-  }
+  client.unsent_video().emplace(WebSocketClient::UnsentVideo {
+    channel->name(), next_vts, ssim, frame_size, move(next_vsegment)});
+  queue_unsent_video(server, client);
 
   /* finish sending */
   client.set_next_vts(next_vts + channel->vduration());
@@ -170,7 +223,8 @@ void serve_video_to_client(WebSocketServer & server,
       + to_string(tcpi.min_rtt) + "," + to_string(tcpi.rtt) + ","
       + to_string(tcpi.delivery_rate) + ","
       + double_to_string(client.video_playback_buf(), 3) + ","
-      + double_to_string(client.cum_rebuffer(), 3);
+      + double_to_string(client.cum_rebuffer(), 3) + ","
+      + to_string(num_frames);
     append_to_log("video_sent", log_line);
   }
 }
@@ -195,7 +249,11 @@ void serve_audio_to_client(WebSocketServer & server,
   const auto data_mmap = channel->adata(next_aformat, next_ats);
   AudioSegment next_asegment {next_aformat, data_mmap, init_mmap};
 
-  /* divide the next segment into WebSocket frames and send */
+  /* divide the next segment into WebSocket frames and send; audio chunks
+   * are small, and are queued ahead of video at once to avoid stalls */
+  const size_t frame_size =
+    ws_frame_size(server.get_tcp_info(client.connection_id()));
+
   while (not next_asegment.done()) {
     ServerAudioMsg audio_msg(client.init_id().value(),
                              channel->name(),
@@ -204,7 +262,7 @@ void serve_audio_to_client(WebSocketServer & server,
                              next_asegment.offset(),
                              next_asegment.length());
     string frame_payload = audio_msg.to_string();
-    next_asegment.read(frame_payload, MAX_WS_FRAME_B - frame_payload.size());
+    next_asegment.read(frame_payload, frame_size);
 
     WSFrame frame {true, WSFrame::OpCode::Binary, move(frame_payload)};
     server.queue_frame(client.connection_id(), frame);
@@ -332,14 +390,38 @@ void log_active_streams(const uint64_t this_minute)
   }
 }
 
-void log_server_info(const uint64_t this_minute)
+void log_server_info(const uint64_t this_minute, WebSocketServer & server)
 {
+  /* TLS handshakes completed in the past minute, and how many resumed a
+   * session instead of doing a full handshake */
+  const long handshakes = server.ssl_context().handshakes();
+  const long resumed_handshakes = server.ssl_context().resumed_handshakes();
+
   /* the tag "server_id" is used to avoid data point overwriting;
    * the field "server_id" is used to count distinct values, i.e., the number
    * of running servers, as a workaround until InfluxDB supports DISTINCT
    * function to operate on tags */
-  string log_line = to_string(this_minute) + "," + server_id + "," + server_id;
+  string log_line = to_string(this_minute) + "," + server_id + "," + server_id
+    + "," + to_string(handshakes - last_handshakes)
+    + "," + to_string(resumed_handshakes - last_resumed_handshakes);
   append_to_log("server_info", log_line);
+
+  last_handshakes = handshakes;
+  last_resumed_handshakes = resumed_handshakes;
+}
+
+/* load the session ticket keys again once run_servers has rotated them */
+void reload_ticket_keys(WebSocketServer & server)
+{
+  if (ticket_key_file.empty()) {
+    return;
+  }
+
+  const auto mtime = fs::last_write_time(ticket_key_file);
+  if (mtime != ticket_key_mtime) {
+    server.ssl_context().use_session_ticket_key_file(ticket_key_file);
+    ticket_key_mtime = mtime;
+  }
 }
 
 void start_slow_timer(Timerfd & slow_timer, WebSocketServer & server)
@@ -363,6 +445,13 @@ void start_slow_timer(Timerfd & slow_timer, WebSocketServer & server)
         }
       }
 
+      try {
+        reload_ticket_keys(server);
+      } catch (const exception & e) {
+        /* keep the current keys */
+        print_exception("reload_ticket_keys", e);
+      }
+
       set<uint64_t> connections_to_clean;
 
       for (auto & [connection_id, client] : clients) {
@@ -391,7 +480,7 @@ void start_slow_timer(Timerfd & slow_timer, WebSocketServer & server)
           last_minute = this_minute;
         } else if (this_minute > last_minute) {
           /* server info: server heartbeats, etc. */
-          log_server_info(this_minute);
+          log_server_info(this_minute, server);
 
           /* write active_streams count to file */
           log_active_streams(this_minute);
@@ -576,9 +665,10 @@ void handle_client_video_ack(WebSocketClient & client,
   if (client.last_video_send_ts()) {
     uint64_t trans_time = timestamp_ms() - *client.last_video_send_ts();
 
-    /* look up media chunk size (excluding the size of init chunk size) */
-    const auto data_mmap = channel->vdata(msg.video_format, msg.timestamp);
-    auto media_chunk_size = get<1>(data_mmap);
+    /* look up media chunk size (excluding the size of init chunk size);
+     * the size map does not map the chunk again on non-live channels */
+    const auto & data_map = channel->vdata(msg.timestamp);
+    auto media_chunk_size = get<1>(data_map.at(msg.video_format));
 
     /* notify the ABR algorithm that a video chunk is acked */
     client.video_chunk_acked(msg.video_format, msg.ssim,
@@ -707,6 +797,16 @@ int run_websocket_server(pqxx::nontransaction & db_work)
     abr_config = fingerprint["abr_config"];
   }
 
+  if (config["min_ws_frame_b"]) {
+    min_ws_frame_b = config["min_ws_frame_b"].as<size_t>();
+  }
+  if (config["max_ws_frame_b"]) {
+    max_ws_frame_b = config["max_ws_frame_b"].as<size_t>();
+  }
+  if (min_ws_frame_b == 0 or min_ws_frame_b > max_ws_frame_b) {
+    throw runtime_error("invalid min_ws_frame_b or max_ws_frame_b");
+  }
+
   const string ip = "0.0.0.0";
   /* run each server on a different port */
   const uint16_t port = config["ws_base_port"].as<uint16_t>() + server_id_int;
@@ -726,6 +826,26 @@ int run_websocket_server(pqxx::nontransaction & db_work)
   #else
   server.ssl_context().use_private_key_file(config["ssl_private_key"].as<string>());
   server.ssl_context().use_certificate_file(config["ssl_certificate"].as<string>());
+
+  /* viewers reconnect often (channel switches, errors, reloads); let them
+   * resume their TLS sessions on any server sharing the ticket keys */
+  server.ssl_context().enable_session_resumption("puffer");
+  if (config["ssl_session_ticket_key_file"]) {
+    ticket_key_file = config["ssl_session_ticket_key_file"].as<string>();
+    reload_ticket_keys(server);
+  }
+
+  /* keep full handshakes after a reconnect storm from stalling the media
+   * of connected viewers: complete them on helper threads, and pace them */
+  if (config["tls_handshake_threads"]) {
+    server.set_handshake_threads(
+      config["tls_handshake_threads"].as<unsigned int>());
+  }
+  server.set_accept_limits(
+    config["max_accepts_per_s"] ?
+      config["max_accepts_per_s"].as<unsigned int>() : 0,
+    config["max_pending_handshakes"] ?
+      config["max_pending_handshakes"].as<unsigned int>() : 0);
   cerr << "Launching secure WebSocket server on port " << port << endl;
   if (portal_debug) {
     cerr << "Error in YAML config: 'debug' must be false in 'portal_settings'" << endl;
@@ -839,6 +959,26 @@ int run_websocket_server(pqxx::nontransaction & db_work)
     }
   );
 
+  /* queue the rest of the video chunks being sent as connections drain */
+  server.set_send_budget(SEND_BUDGET_B);
+  server.set_writable_callback(
+    [&server](const uint64_t connection_id)
+    {
+      auto client_it = clients.find(connection_id);
+      if (client_it == clients.end()) {
+        return;
+      }
+
+      try {
+        queue_unsent_video(server, client_it->second);
+      } catch (const exception & e) {
+        cerr << client_signature(connection_id)
+             << ": warning in writable callback: " << e.what() << endl;
+        server.close_connection(connection_id);
+      }
+    }
+  );
+
   server.set_close_callback(
     [](const uint64_t connection_id)
     {
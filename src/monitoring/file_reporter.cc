@@ -199,13 +199,23 @@ int main(int argc, char * argv[])
   Poller poller;
   Inotify inotify(poller);
 
+  /* points that could not be posted yet are spooled in spool_dir, if any */
   const auto & influx = config["influxdb_connection"];
+  string spool_path;
+  if (influx["spool_dir"]) {
+    fs::path spool_dir = influx["spool_dir"].as<string>();
+    fs::create_directories(spool_dir);
+    spool_path = spool_dir / "file_reporter.spool";
+  }
+
   InfluxDBClient influxdb_client(
       poller,
       {influx["host"].as<string>(), to_string(influx["port"].as<uint16_t>())},
       influx["dbname"].as<string>(),
       influx["user"].as<string>(),
-      safe_getenv(influx["password"].as<string>()));
+      safe_getenv(influx["password"].as<string>()),
+      spool_path,
+      influx["gzip"] and influx["gzip"].as<bool>());
 
   for (const auto & channel_name : channel_set) {
     const auto & channel_config = config["channel_configs"][channel_name];
@@ -0,0 +1,150 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "formatter.hh"
+#include "tokenize.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+static constexpr size_t PAYLOAD_SIZE = 1024 * 1024;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [-n <lines>] <format.conf> [<format.conf> ...]\n\n"
+  "Generate <lines> (default 1000000) log lines matching each log format and\n"
+  "report how many lines per second log_reporter can turn into InfluxDB line\n"
+  "protocol, by copying every field (split + format) and without copying\n"
+  "(split_into + format_to)"
+  << endl;
+}
+
+/* a random log line with a plausible value for each field in format_string:
+ * a timestamp for {0}, integers for {N}i, and short strings otherwise */
+static string make_log_line(const string & format_string, mt19937 & prng)
+{
+  uniform_int_distribution<uint64_t> integer {0, 100000000};
+  uniform_int_distribution<int> letter {'a', 'z'};
+
+  vector<string> values;
+
+  for (size_t lpos = 0; (lpos = format_string.find('{', lpos)) != string::npos;
+       lpos++) {
+    const size_t rpos = format_string.find('}', lpos);
+    const size_t index = stoul(format_string.substr(lpos + 1, rpos - lpos - 1));
+    if (index >= values.size()) {
+      values.resize(index + 1);
+    }
+
+    if (index == 0) {
+      values[index] = to_string(1500000000000 + integer(prng));
+    } else if (rpos + 1 < format_string.size() and
+               format_string[rpos + 1] == 'i') {
+      values[index] = to_string(integer(prng));
+    } else {
+      string value(8, ' ');
+      for (auto & c : value) {
+        c = static_cast<char>(letter(prng));
+      }
+      values[index] = value;
+    }
+  }
+
+  string line;
+  for (size_t i = 0; i < values.size(); i++) {
+    line += (i ? "," : "") + values[i];
+  }
+  return line;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  size_t num_lines = 1000000;
+  int arg_idx = 1;
+
+  if (arg_idx + 1 < argc and string(argv[arg_idx]) == "-n") {
+    num_lines = stoul(argv[arg_idx + 1]);
+    arg_idx += 2;
+  }
+
+  if (arg_idx >= argc or num_lines == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  mt19937 prng {0};
+
+  for (; arg_idx < argc; arg_idx++) {
+    const string filename = argv[arg_idx];
+
+    ifstream format_ifstream(filename);
+    string format_string;
+    getline(format_ifstream, format_string);
+
+    Formatter formatter;
+    formatter.parse(format_string);
+
+    vector<string> lines;
+    for (size_t i = 0; i < num_lines; i++) {
+      lines.emplace_back(make_log_line(format_string, prng));
+    }
+
+    /* both ways must produce the same output */
+    vector<string_view> values;
+    for (size_t i = 0; i < min<size_t>(num_lines, 1000); i++) {
+      string compiled;
+      split_into(lines[i], ',', values);
+      formatter.format_to(compiled, values);
+
+      if (compiled != formatter.format(split(lines[i], ","))) {
+        throw runtime_error(filename + ": format_to does not match format");
+      }
+    }
+
+    /* like log_reporter, append to a payload that is posted at 1 MB */
+    string payload;
+    payload.reserve(2 * PAYLOAD_SIZE);
+
+    /* each line copied into a vector<string>, then into a new string */
+    auto start = steady_clock::now();
+    for (const auto & line : lines) {
+      payload += formatter.format(split(line, ",")) + "\n";
+      if (payload.size() >= PAYLOAD_SIZE) {
+        payload.clear();
+      }
+    }
+    const duration<double> copy_time = steady_clock::now() - start;
+
+    /* fields are views into the line, formatted into the payload */
+    payload.clear();
+    start = steady_clock::now();
+    for (const auto & line : lines) {
+      split_into(line, ',', values);
+      formatter.format_to(payload, values);
+      payload += '\n';
+      if (payload.size() >= PAYLOAD_SIZE) {
+        payload.clear();
+      }
+    }
+    const duration<double> compiled_time = steady_clock::now() - start;
+
+    cout << fixed << setprecision(0) << filename << ": "
+         << num_lines / copy_time.count() << " lines/s copied, "
+         << num_lines / compiled_time.count() << " lines/s in place ("
+         << setprecision(1) << copy_time / compiled_time << "x)\n";
+  }
+
+  return EXIT_SUCCESS;
+}
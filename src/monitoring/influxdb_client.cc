@@ -1,72 +1,424 @@
 #include "influxdb_client.hh"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
 #include <iostream>
-#include "http_request.hh"
+#include <cstring>
+#include <algorithm>
+
+#include "exception.hh"
+#include "serialization.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
+/* coalesce payloads into requests of about this size */
+static constexpr size_t MAX_BATCH_SIZE = 1024 * 1024;
+static constexpr int FLUSH_INTERVAL_MS = 1000;
+
+/* requests held in memory; the rest wait in the spool */
+static constexpr size_t MAX_MEMORY_SIZE = 16 * 1024 * 1024;
+static constexpr uint64_t MAX_SPOOL_SIZE = 1024 * 1024 * 1024;
+
+/* requests pipelined on the connection */
+static constexpr size_t MAX_IN_FLIGHT = 4;
+
+static constexpr int MIN_BACKOFF_MS = 250;
+static constexpr int MAX_BACKOFF_MS = 30000;
+
+static string gzip_compress(const string & data)
+{
+  z_stream stream {};
+  if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16 /* gzip */, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw runtime_error("deflateInit2 failed");
+  }
+
+  string compressed(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+  stream.avail_out = compressed.size();
+
+  const int ret = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+
+  if (ret != Z_STREAM_END) {
+    throw runtime_error("deflate failed");
+  }
+
+  compressed.resize(stream.total_out);
+  return compressed;
+}
+
+/* read length bytes at offset, or fewer at the end of the file */
+static string pread_string(const FileDescriptor & fd, const size_t length,
+                           const uint64_t offset)
+{
+  string data(length, '\0');
+  size_t bytes_read = 0;
+
+  while (bytes_read < length) {
+    const ssize_t n = CheckSystemCall("pread", pread(fd.fd_num(),
+        data.data() + bytes_read, length - bytes_read, offset + bytes_read));
+    if (n == 0) {
+      break;
+    }
+
+    bytes_read += n;
+  }
+
+  data.resize(bytes_read);
+  return data;
+}
+
 InfluxDBClient::InfluxDBClient(Poller & poller,
                                const Address & address,
                                const string & database,
                                const string & user,
-                               const string & password)
+                               const string & password,
+                               const string & spool_path,
+                               const bool gzip)
+  : poller_(poller), influxdb_addr_(address), database_(database),
+    user_(user), password_(password), gzip_(gzip),
+    backoff_ms_(MIN_BACKOFF_MS)
 {
-  influxdb_addr_ = address;
-  sock_.connect(influxdb_addr_);
+  if (not spool_path.empty()) {
+    spool_.emplace(CheckSystemCall("open (" + spool_path + ")",
+        open(spool_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)));
 
-  database_ = database;
-  user_ = user;
-  password_ = password;
+    spool_size_ = spool_->filesize();
+    if (spool_size_ > 0) {
+      cerr << "InfluxDBClient: replaying " << spool_size_
+           << " bytes from " << spool_path << endl;
+    }
+  }
 
-  poller.add_action(Poller::Action(sock_, Direction::In,
+  poller_.add_action(Poller::Action(reconnect_timer_, Direction::In,
     [this]()->Result {
-      /* must read HTTP responses from InfluxDB, then basically ignore them */
-      const string response = sock_.read();
-      if (response.empty()) {
-        throw runtime_error("peer socket in InfluxDB has closed");
-      }
-
+      reconnect_timer_.expirations();
+      connect();
       return ResultType::Continue;
     }
   ));
 
-  poller.add_action(Poller::Action(sock_, Direction::Out,
+  poller_.add_action(Poller::Action(flush_timer_, Direction::In,
     [this]()->Result {
-      while (not buffer_.empty()) {
-        string & data = buffer_.front();
-
-        const size_t bytes_written = sock_.nb_write(data);
-        if (bytes_written == 0) { // EWOULDBLOCK
-          break;
-        } else if (bytes_written < data.size()) { // partial write
-          data.erase(0, bytes_written);
-        } else { // full write
-          buffer_.pop_front();
+      flush_timer_.expirations();
+
+      for (const auto & [precision, payload] : pending_) {
+        if (not payload.empty()) {
+          seal(precision);
         }
       }
 
       return ResultType::Continue;
-    },
-    [this]()->bool {
-      return not buffer_.empty();
     }
   ));
+  flush_timer_.start(FLUSH_INTERVAL_MS, FLUSH_INTERVAL_MS);
+
+  connect();
 }
 
 void InfluxDBClient::post(const string & payload,
                           const std::string & precision)
+{
+  if (payload.empty()) {
+    return;
+  }
+
+  string & pending = pending_[precision];
+  pending += payload;
+  if (pending.back() != '\n') {
+    pending += '\n';
+  }
+
+  if (pending.size() >= MAX_BATCH_SIZE) {
+    seal(precision);
+  }
+}
+
+void InfluxDBClient::connect()
+{
+  /* the actions on the previous socket were removed when it failed */
+  sock_ = make_unique<TCPSocket>();
+  sock_->set_blocking(false);
+  parser_ = make_unique<HTTPResponseParser>();
+
+  try {
+    sock_->connect(influxdb_addr_);
+  } catch (const exception & e) {
+    state_ = State::Connecting;
+    disconnect(e.what());
+    return;
+  }
+
+  state_ = State::Connecting;
+
+  poller_.add_action(Poller::Action(*sock_, Direction::Out,
+    [this]()->Result { return send_requests(); },
+    [this]()->bool {
+      return state_ == State::Connecting or
+             (state_ == State::Connected and
+              (request_offset_ < request_.size() or
+               (in_flight_ < queue_.size() and in_flight_ < MAX_IN_FLIGHT)));
+    },
+    [this]() { disconnect("connection error"); }
+  ));
+
+  poller_.add_action(Poller::Action(*sock_, Direction::In,
+    [this]()->Result { return read_responses(); },
+    [this]()->bool { return state_ == State::Connected; },
+    [this]() { disconnect("connection error"); }
+  ));
+}
+
+/* leave the socket open until the poller has removed its actions;
+ * connect() replaces it */
+Result InfluxDBClient::disconnect(const string & reason)
+{
+  if (state_ != State::Disconnected) {
+    cerr << "InfluxDBClient: disconnected from " << influxdb_addr_.str()
+         << " (" << reason << "); " << queue_.size() << " requests queued, "
+         << spool_size_ - spool_read_offset_ << " bytes spooled; retrying in "
+         << backoff_ms_ << " ms" << endl;
+
+    poller_.remove_fd(sock_->fd_num());
+    state_ = State::Disconnected;
+
+    reconnect_timer_.start(backoff_ms_);
+    backoff_ms_ = min(2 * backoff_ms_, MAX_BACKOFF_MS);
+  }
+
+  /* every request without a response will be sent again */
+  in_flight_ = 0;
+  request_.clear();
+  request_offset_ = 0;
+
+  return ResultType::CancelAll;
+}
+
+Result InfluxDBClient::send_requests()
+{
+  sock_->register_write();
+
+  if (state_ == State::Connecting) {
+    try {
+      sock_->verify_no_errors();
+    } catch (const exception & e) {
+      return disconnect(e.what());
+    }
+
+    state_ = State::Connected;
+    refill_from_spool();
+  }
+
+  for (;;) {
+    if (request_offset_ == request_.size()) {
+      if (in_flight_ == queue_.size() or in_flight_ == MAX_IN_FLIGHT) {
+        break;
+      }
+
+      const HTTPRequest request = make_request(queue_[in_flight_]);
+      parser_->new_request_arrived(request);
+      request_ = request.str();
+      request_offset_ = 0;
+      in_flight_++;
+    }
+
+    const ssize_t n = send(sock_->fd_num(), request_.data() + request_offset_,
+                           request_.size() - request_offset_, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        break;
+      }
+
+      return disconnect(strerror(errno));
+    }
+
+    request_offset_ += n;
+  }
+
+  return ResultType::Continue;
+}
+
+Result InfluxDBClient::read_responses()
+{
+  if (state_ != State::Connected) {
+    /* disconnected earlier in this poll */
+    sock_->register_read();
+    return ResultType::CancelAll;
+  }
+
+  string data;
+  try {
+    data = sock_->read();
+  } catch (const exception & e) {
+    return disconnect(e.what());
+  }
+
+  if (data.empty()) {
+    return disconnect("peer socket in InfluxDB has closed");
+  }
+
+  try {
+    parser_->parse(data);
+  } catch (const exception & e) {
+    return disconnect(e.what());
+  }
+
+  while (not parser_->empty()) {
+    const string status = parser_->front().status_code();
+    const string body = parser_->front().body();
+    parser_->pop();
+
+    if (in_flight_ == 0) {
+      return disconnect("unexpected response");
+    }
+
+    if (status.front() == '5') {
+      /* InfluxDB is overloaded or failing; try again later */
+      return disconnect("HTTP " + status + ": " + body);
+    }
+
+    if (status.front() == '2') {
+      backoff_ms_ = MIN_BACKOFF_MS;
+    } else {
+      /* sending the same data again would not help */
+      cerr << "InfluxDBClient: dropping " << queue_.front().body.size()
+           << " bytes rejected with HTTP " << status << ": " << body << endl;
+    }
+
+    queued_size_ -= queue_.front().body.size();
+    queue_.pop_front();
+    in_flight_--;
+  }
+
+  refill_from_spool();
+  return ResultType::Continue;
+}
+
+void InfluxDBClient::seal(const string & precision)
+{
+  string & pending = pending_.at(precision);
+  Batch batch {precision, gzip_ ? gzip_compress(pending) : move(pending)};
+  pending.clear();
+
+  enqueue(move(batch));
+}
+
+void InfluxDBClient::enqueue(Batch && batch)
+{
+  const bool fits_in_memory =
+    queue_.empty() or queued_size_ + batch.body.size() <= MAX_MEMORY_SIZE;
+
+  /* keep the spool in order, and on disk while InfluxDB is unreachable */
+  if (spool_ and (state_ != State::Connected or not fits_in_memory or
+                  spool_read_offset_ < spool_size_)) {
+    const string record = put_field(uint16_t(batch.precision.size()))
+                          + batch.precision
+                          + put_field(uint32_t(batch.body.size()))
+                          + batch.body;
+
+    if (spool_size_ + record.size() > MAX_SPOOL_SIZE) {
+      cerr << "InfluxDBClient: spool is full; dropping "
+           << batch.body.size() << " bytes" << endl;
+      return;
+    }
+
+    spool_->write(record);
+    spool_size_ += record.size();
+    return;
+  }
+
+  if (not fits_in_memory) {
+    cerr << "InfluxDBClient: " << queued_size_ << " bytes queued; dropping "
+         << batch.body.size() << " bytes" << endl;
+    return;
+  }
+
+  queued_size_ += batch.body.size();
+  queue_.emplace_back(move(batch));
+}
+
+void InfluxDBClient::refill_from_spool()
+{
+  if (not spool_ or state_ != State::Connected) {
+    return;
+  }
+
+  while (spool_read_offset_ < spool_size_) {
+    uint64_t offset = spool_read_offset_;
+
+    const string precision_size = pread_string(*spool_, sizeof(uint16_t),
+                                               offset);
+    offset += precision_size.size();
+
+    Batch batch {};
+    string body_size;
+    if (precision_size.size() == sizeof(uint16_t)) {
+      batch.precision = pread_string(*spool_, get_uint16(precision_size.data()),
+                                     offset);
+      offset += batch.precision.size();
+      body_size = pread_string(*spool_, sizeof(uint32_t), offset);
+      offset += body_size.size();
+    }
+
+    uint32_t size = 0;
+    if (body_size.size() == sizeof(uint32_t)) {
+      size = get_uint32(body_size.data());
+
+      if (not queue_.empty() and queued_size_ + size > MAX_MEMORY_SIZE) {
+        break;
+      }
+
+      batch.body = pread_string(*spool_, size, offset);
+      offset += batch.body.size();
+    }
+
+    if (body_size.size() < sizeof(uint32_t) or batch.body.size() < size) {
+      /* left by a process that died while appending */
+      cerr << "InfluxDBClient: discarding a truncated record in the spool"
+           << endl;
+      spool_size_ = spool_read_offset_;
+      CheckSystemCall("ftruncate", ftruncate(spool_->fd_num(), spool_size_));
+      break;
+    }
+
+    spool_read_offset_ = offset;
+    queued_size_ += size;
+    queue_.emplace_back(move(batch));
+  }
+
+  /* start over once everything spooled has been posted; until then a
+   * restart replays the spool from the beginning */
+  if (spool_size_ > 0 and spool_read_offset_ == spool_size_ and
+      queue_.empty()) {
+    CheckSystemCall("ftruncate", ftruncate(spool_->fd_num(), 0));
+    spool_read_offset_ = 0;
+    spool_size_ = 0;
+  }
+}
+
+HTTPRequest InfluxDBClient::make_request(const Batch & batch) const
 {
   HTTPRequest request;
   request.set_first_line("POST /write?db=" + database_ + "&u=" + user_ + "&p="
-                         + password_ + "&precision=" + precision + " HTTP/1.1");
+                         + password_ + "&precision=" + batch.precision
+                         + " HTTP/1.1");
 
   request.add_header(HTTPHeader{"Host", influxdb_addr_.str()});
   request.add_header(HTTPHeader{"Content-Type",
                                 "application/x-www-form-urlencoded"});
+  if (gzip_) {
+    request.add_header(HTTPHeader{"Content-Encoding", "gzip"});
+  }
   request.add_header(HTTPHeader{"Content-Length",
-                                to_string(payload.size())});
+                                to_string(batch.body.size())});
   request.done_with_headers();
-  request.read_in_body(payload);
-  buffer_.emplace_back(request.str());
+  request.read_in_body(batch.body);
+  return request;
 }
@@ -1,9 +1,33 @@
+#ifndef INFLUXDB_CLIENT_HH
+#define INFLUXDB_CLIENT_HH
+
 #include <string>
 #include <deque>
+#include <map>
+#include <memory>
+#include <optional>
 
 #include "socket.hh"
 #include "poller.hh"
+#include "timerfd.hh"
+#include "file_descriptor.hh"
+#include "http_request.hh"
+#include "http_response_parser.hh"
 
+/* Posts line-protocol data points to InfluxDB's /write endpoint.
+ *
+ * Payloads posted with the same precision are coalesced into one request
+ * until it reaches MAX_BATCH_SIZE or has waited FLUSH_INTERVAL_MS, and the
+ * body is optionally gzip-compressed. A request stays queued until InfluxDB
+ * responds with 2xx (or 4xx, which a retry would not fix); the connection
+ * is reestablished with exponential backoff and unacknowledged requests
+ * are sent again.
+ *
+ * At most MAX_MEMORY_SIZE bytes of requests are held in memory. Requests
+ * sealed while disconnected or beyond that are appended to the spool file,
+ * if any, and read back in order once InfluxDB keeps up; a spool left
+ * behind by a previous process is replayed too. Points are identified by
+ * measurement, tags and timestamp, so posting one twice is harmless. */
 class InfluxDBClient
 {
 public:
@@ -11,18 +35,66 @@ public:
                  const Address & address,
                  const std::string & database,
                  const std::string & user,
-                 const std::string & password);
+                 const std::string & password,
+                 const std::string & spool_path = "",
+                 const bool gzip = false);
 
   void post(const std::string & payload,
             const std::string & precision = "ms");
 
+  /* forbid copying */
+  InfluxDBClient(const InfluxDBClient & other) = delete;
+  InfluxDBClient & operator=(const InfluxDBClient & other) = delete;
+
 private:
-  Address influxdb_addr_ {};
-  TCPSocket sock_ {};
+  /* an HTTP request body and the time precision of its points */
+  struct Batch {
+    std::string precision;
+    std::string body;
+  };
+
+  enum class State { Disconnected, Connecting, Connected };
+
+  Poller & poller_;
+  Address influxdb_addr_;
+
+  std::string database_;
+  std::string user_;
+  std::string password_;
+  bool gzip_;
 
-  std::string database_ {};
-  std::string user_ {};
-  std::string password_ {};
+  std::unique_ptr<TCPSocket> sock_ {};
+  State state_ {State::Disconnected};
+  Timerfd reconnect_timer_ {};
+  int backoff_ms_;
 
-  std::deque<std::string> buffer_ {};
+  /* payloads being coalesced, by precision */
+  std::map<std::string, std::string> pending_ {};
+  Timerfd flush_timer_ {};
+
+  /* in the order they are sent; the first in_flight_ await a response */
+  std::deque<Batch> queue_ {};
+  size_t queued_size_ {0};
+  size_t in_flight_ {0};
+  std::string request_ {};     /* being written */
+  size_t request_offset_ {0};
+  std::unique_ptr<HTTPResponseParser> parser_ {};
+
+  /* spooled batches in [spool_read_offset_, spool_size_) */
+  std::optional<FileDescriptor> spool_ {};
+  uint64_t spool_read_offset_ {0};
+  uint64_t spool_size_ {0};
+
+  void connect();
+  Poller::Action::Result disconnect(const std::string & reason);
+  Poller::Action::Result send_requests();
+  Poller::Action::Result read_responses();
+
+  /* seal the pending payload of precision into a batch */
+  void seal(const std::string & precision);
+  void enqueue(Batch && batch);
+  void refill_from_spool();
+  HTTPRequest make_request(const Batch & batch) const;
 };
+
+#endif /* INFLUXDB_CLIENT_HH */
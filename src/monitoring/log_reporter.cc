@@ -5,12 +5,16 @@
 #include <vector>
 #include <deque>
 #include <string>
+#include <string_view>
+#include <optional>
+#include <charconv>
 #include <fstream>
 
 #include "util.hh"
 #include "yaml-cpp/yaml.h"
 #include "inotify.hh"
 #include "poller.hh"
+#include "ring_buffer.hh"
 #include "file_descriptor.hh"
 #include "filesystem.hh"
 #include "tokenize.hh"
@@ -25,6 +29,14 @@ using namespace PollerShortNames;
 /* payload data format to post to DB (a "format string" in a vector) */
 static Formatter formatter;
 
+/* log content is read into a buffer of this size; a longer line is an
+ * error */
+static constexpr size_t READ_BUFFER_SIZE = 16 * 1024 * 1024;
+
+/* hand formatted lines to InfluxDBClient, which coalesces them into
+ * requests, after each read or once they reach this size */
+static constexpr size_t MAX_PAYLOAD_SIZE = 1024 * 1024;
+
 void print_usage(const string & program_name)
 {
   cerr <<
@@ -32,14 +44,23 @@ void print_usage(const string & program_name)
   << endl;
 }
 
-tuple<string, string> enforce_unique(const string & line,
-                                     deque<uint64_t> & unique_ns)
+/* make the timestamp (in ms, after the last space) of a formatted line
+ * unique; returns the new timestamp in ns if it had to be changed */
+optional<uint64_t> enforce_unique(const string_view line,
+                                  deque<uint64_t> & unique_ns)
 {
-  auto last_space = line.rfind(' ');
-  string before_last_space = line.substr(0, last_space);
-  string orig_ts_str = line.substr(last_space + 1);
+  const string_view orig_ts_str = line.substr(line.rfind(' ') + 1);
+
+  uint64_t orig_ts_ms;
+  const auto [ptr, ec] = from_chars(orig_ts_str.data(),
+                                    orig_ts_str.data() + orig_ts_str.size(),
+                                    orig_ts_ms);
+  if (ec != errc() or ptr != orig_ts_str.data() + orig_ts_str.size()) {
+    throw runtime_error("enforce_unique: invalid timestamp "
+                        + string(orig_ts_str));
+  }
 
-  const uint64_t orig_ts_ns = stoll(orig_ts_str) * MILLION;  /* ms -> ns */
+  const uint64_t orig_ts_ns = orig_ts_ms * MILLION;  /* ms -> ns */
 
   /* pop if ts in ms < orig_new_ts in ms */
   while (not unique_ns.empty()) {
@@ -67,11 +88,10 @@ tuple<string, string> enforce_unique(const string & line,
 
   if (new_ts_ns == orig_ts_ns) {
     /* no duplicate timestamp exists */
-    return make_tuple(line, "ms");
+    return nullopt;
   } else {
     /* duplicate timestamp exists; post the incremented timestamp */
-    string new_line = before_last_space + " " + to_string(new_ts_ns);
-    return make_tuple(new_line, "ns");
+    return new_ts_ns;
   }
 }
 
@@ -87,16 +107,92 @@ int tail_loop(const YAML::Node & config, const string & log_path,
   Poller poller;
   Inotify inotify(poller);
 
+  /* points that could not be posted yet are spooled in spool_dir, if any */
   const auto & influx = config["influxdb_connection"];
+  string spool_path;
+  if (influx["spool_dir"]) {
+    fs::path spool_dir = influx["spool_dir"].as<string>();
+    fs::create_directories(spool_dir);
+    spool_path = spool_dir / (fs::path(log_path).filename().string()
+                              + ".spool");
+  }
+
   InfluxDBClient influxdb_client(
       poller,
       {influx["host"].as<string>(), to_string(influx["port"].as<uint16_t>())},
       influx["dbname"].as<string>(),
       influx["user"].as<string>(),
-      safe_getenv(influx["password"].as<string>()));
+      safe_getenv(influx["password"].as<string>()),
+      spool_path,
+      influx["gzip"] and influx["gzip"].as<bool>());
+
+  /* lines waiting to be posted, with time precision 'ms' and 'ns' */
+  string payload, ns_payload;
+
+  auto post_payloads = [&payload, &ns_payload, &influxdb_client]() {
+    if (not payload.empty()) {
+      influxdb_client.post(payload);
+      payload.clear();
+    }
+
+    if (not ns_payload.empty()) {
+      influxdb_client.post(ns_payload, "ns");
+      ns_payload.clear();
+    }
+  };
 
   bool log_rotated = false;  /* whether log rotation happened */
-  string buf;  /* used to assemble content read from the log into lines */
+
+  /* content read from the log, assembled into lines in place */
+  RingBuffer buf(READ_BUFFER_SIZE);
+  vector<string_view> values;  /* fields of the current line */
+
+  /* format and consume every complete line in buf */
+  auto consume_lines = [&]() {
+    const string_view data = buf.readable_region();
+    size_t begin = 0;
+
+    for (size_t end; (end = data.find('\n', begin)) != string_view::npos;
+         begin = end + 1) {
+      split_into(data.substr(begin, end - begin), ',', values);
+
+      const size_t line_start = payload.size();
+      try {
+        formatter.format_to(payload, values);
+      } catch (const exception & e) {
+        /* InfluxDB would reject the entire payload */
+        cerr << "Warning: skipping invalid log line ("
+             << e.what() << ")" << endl;
+        payload.resize(line_start);
+        continue;
+      }
+
+      /* enforce data uniqueness for crucial measurements */
+      optional<uint64_t> new_ts_ns;
+      if (crucial_measurements) {
+        new_ts_ns = enforce_unique(string_view(payload).substr(line_start),
+                                   unique_ns);
+      }
+
+      if (new_ts_ns) {
+        /* move the line over with the incremented timestamp in ns */
+        const size_t last_space = payload.rfind(' ');
+        ns_payload.append(payload, line_start, last_space + 1 - line_start);
+        ns_payload += to_string(*new_ts_ns) + "\n";
+        payload.resize(line_start);
+      } else {
+        payload += '\n';
+      }
+
+      if (payload.size() >= MAX_PAYLOAD_SIZE or
+          ns_payload.size() >= MAX_PAYLOAD_SIZE) {
+        post_payloads();
+      }
+    }
+
+    buf.pop(begin);
+    post_payloads();
+  };
 
   for (;;) {
     FileDescriptor fd(CheckSystemCall("open (" + log_path + ")",
@@ -104,44 +200,23 @@ int tail_loop(const YAML::Node & config, const string & log_path,
     fd.seek(0, SEEK_END);
 
     int wd = inotify.add_watch(log_path, IN_MODIFY | IN_CLOSE_WRITE,
-      [&log_rotated, &buf, &fd, &influxdb_client,
-       crucial_measurements, &unique_ns]
+      [&log_rotated, &buf, &fd, &consume_lines]
       (const inotify_event & event, const string &) {
         if (event.mask & IN_MODIFY) {
-          string new_content = fd.read();
-          if (new_content.empty()) {
-            /* return if nothing more to read */
-            return;
-          }
-          buf += new_content;
-
-          /* find new lines iteratively */
-          size_t pos = 0;
-          string payload;
-
-          while ((pos = buf.find("\n")) != string::npos) {
-            const string & line = buf.substr(0, pos);
-            vector<string> values = split(line, ",");
-
-            /* enforce data uniqueness for crucial measurements */
-            if (crucial_measurements) {
-              auto [new_line, precision] = enforce_unique(
-                  formatter.format(values), unique_ns);
-              if (precision == "ms") {
-                payload += new_line + "\n";
-              } else {
-                /* post data points with other time precisions immediately */
-                influxdb_client.post(new_line, precision);
-              }
-            } else {
-              payload += formatter.format(values) + "\n";
+          /* read everything there is, e.g., a backlog after rotation */
+          for (;;) {
+            if (buf.writable_size() == 0) {
+              throw runtime_error("log line longer than "
+                                  + to_string(READ_BUFFER_SIZE) + " bytes");
             }
 
-            buf = buf.substr(pos + 1);
-          }
+            if (buf.read_from(fd) == 0) {
+              /* return if nothing more to read */
+              return;
+            }
 
-          /* post aggregated lines (with time precision 'ms') */
-          influxdb_client.post(payload);
+            consume_lines();
+          }
         } else if (event.mask & IN_CLOSE_WRITE) {
           /* old log was closed; open and watch new log in next loop */
           log_rotated = true;
@@ -0,0 +1,83 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "mp4_parser.hh"
+#include "mp4_file.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace MP4;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [-n <loops>] <file.mp4> [<file.mp4> ...]\n\n"
+  "Parse every MP4 file (and write it back out to /dev/null) <loops> times\n"
+  "and report the throughput of each"
+  << endl;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  unsigned int loops = 100;
+  int arg_idx = 1;
+
+  if (arg_idx + 1 < argc and string(argv[arg_idx]) == "-n") {
+    loops = stoi(argv[arg_idx + 1]);
+    arg_idx += 2;
+  }
+
+  if (arg_idx >= argc or loops == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t total_bytes = 0;
+  duration<double> total_parse {}, total_write {};
+
+  for (; arg_idx < argc; arg_idx++) {
+    const string filename = argv[arg_idx];
+    duration<double> parse_time {}, write_time {};
+    uint64_t file_size = 0;
+
+    for (unsigned int i = 0; i < loops; i++) {
+      const auto start = steady_clock::now();
+
+      MP4Parser parser(filename);
+      parser.parse();
+
+      const auto parsed = steady_clock::now();
+
+      MP4File output("/dev/null", O_WRONLY);
+      parser.save_to_mp4(output);
+      output.flush();
+
+      write_time += steady_clock::now() - parsed;
+      parse_time += parsed - start;
+
+      file_size = MP4File(filename, O_RDONLY).filesize();
+    }
+
+    const double mb = file_size * loops / 1.0e6;
+    cout << fixed << setprecision(1) << filename << ": "
+         << file_size << " bytes, parse " << mb / parse_time.count()
+         << " MB/s, write " << mb / write_time.count() << " MB/s\n";
+
+    total_bytes += file_size * loops;
+    total_parse += parse_time;
+    total_write += write_time;
+  }
+
+  cout << fixed << setprecision(1) << "total: parse "
+       << total_bytes / 1.0e6 / total_parse.count() << " MB/s, write "
+       << total_bytes / 1.0e6 / total_write.count() << " MB/s" << endl;
+
+  return EXIT_SUCCESS;
+}
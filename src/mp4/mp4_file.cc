@@ -1,159 +1,243 @@
 #include <fcntl.h>
 #include <unistd.h>
-#include <endian.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
 
 #include "exception.hh"
+#include "mmap.hh"
 #include "mp4_file.hh"
 
 using namespace std;
 using namespace MP4;
 
+/* flush the write buffer once it grows past this size */
+static const size_t write_buffer_size = 1024 * 1024;
+
 MP4File::MP4File(const string & filename, int flags)
   : FileDescriptor(CheckSystemCall("open (" + filename + ")",
                                    open(filename.c_str(), flags)))
-{}
+{
+  map_if_read_only(flags);
+}
 
 MP4File::MP4File(const string & filename, int flags, mode_t mode)
   : FileDescriptor(CheckSystemCall("open (" + filename + ")",
                                    open(filename.c_str(), flags, mode)))
-{}
-
-uint8_t MP4File::read_uint8()
 {
-  string data = read(1);
-  const uint8_t * size = reinterpret_cast<const uint8_t *>(data.c_str());
-  return *size;
+  map_if_read_only(flags);
 }
 
-uint16_t MP4File::read_uint16()
+MP4File::~MP4File()
 {
-  string data = read(2);
-  const uint16_t * size = reinterpret_cast<const uint16_t *>(data.c_str());
-  return be16toh(*size);
+  try {
+    flush();
+  } catch (const exception & e) {
+    print_exception("MP4File", e);
+  }
 }
 
-uint32_t MP4File::read_uint32()
+void MP4File::map_if_read_only(const int flags)
 {
-  string data = read(4);
-  const uint32_t * size = reinterpret_cast<const uint32_t *>(data.c_str());
-  return be32toh(*size);
-}
+  if ((flags & O_ACCMODE) != O_RDONLY) {
+    buffer_offset_ = offset_ = FileDescriptor::curr_offset();
+    return;
+  }
 
-uint64_t MP4File::read_uint64()
-{
-  string data = read(8);
-  const uint64_t * size = reinterpret_cast<const uint64_t *>(data.c_str());
-  return be64toh(*size);
+  read_only_ = true;
+
+  struct stat file_stat;
+  CheckSystemCall("fstat", fstat(fd_num(), &file_stat));
+  size_ = file_stat.st_size;
+
+  if (size_ > 0) {
+    mapping_ = mmap_shared(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_num(), 0);
+    data_ = static_cast<const char *>(mapping_.get());
+  }
 }
 
-int8_t MP4File::read_int8()
+const char * MP4File::consume(const size_t length)
 {
-  string data = read(1);
-  const int8_t * size = reinterpret_cast<const int8_t *>(data.c_str());
-  return *size;
+  if (not read_only_) {
+    throw runtime_error("MP4File: cannot read a file opened for writing");
+  }
+
+  if (offset_ > size_ or length > size_ - offset_) {
+    throw runtime_error("MP4File: read past the end of file");
+  }
+
+  const char * data = data_ + offset_;
+  offset_ += length;
+  return data;
 }
 
-int16_t MP4File::read_int16()
+template <typename T>
+T MP4File::read_big_endian()
 {
-  string data = read(2);
-  const int16_t * size = reinterpret_cast<const int16_t *>(data.c_str());
-  return be16toh(*size);
+  const auto * bytes = reinterpret_cast<const uint8_t *>(consume(sizeof(T)));
+
+  make_unsigned_t<T> value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value = (value << 8) | bytes[i];
+  }
+
+  return static_cast<T>(value);
 }
 
-int32_t MP4File::read_int32()
+uint8_t MP4File::read_uint8() { return read_big_endian<uint8_t>(); }
+uint16_t MP4File::read_uint16() { return read_big_endian<uint16_t>(); }
+uint32_t MP4File::read_uint32() { return read_big_endian<uint32_t>(); }
+uint64_t MP4File::read_uint64() { return read_big_endian<uint64_t>(); }
+int8_t MP4File::read_int8() { return read_big_endian<int8_t>(); }
+int16_t MP4File::read_int16() { return read_big_endian<int16_t>(); }
+int32_t MP4File::read_int32() { return read_big_endian<int32_t>(); }
+int64_t MP4File::read_int64() { return read_big_endian<int64_t>(); }
+
+string MP4File::read(const size_t length)
 {
-  string data = read(4);
-  const int32_t * size = reinterpret_cast<const int32_t *>(data.c_str());
-  return be32toh(*size);
+  return string(consume(length), length);
 }
 
-int64_t MP4File::read_int64()
+string MP4File::read_exactly(const size_t length)
 {
-  string data = read(8);
-  const int64_t * size = reinterpret_cast<const int64_t *>(data.c_str());
-  return be64toh(*size);
+  return read(length);
 }
 
-void MP4File::write_uint8(const uint8_t data)
+string_view MP4File::read_view(const size_t length)
 {
-  write(string(1, static_cast<char>(data)));
+  return string_view(consume(length), length);
 }
 
-void MP4File::write_uint16(const uint16_t data)
+template <typename T>
+void MP4File::write_big_endian(const T data)
 {
-  uint16_t host_data = htobe16(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 2));
+  char bytes[sizeof(T)];
+  make_unsigned_t<T> value = data;
+  for (size_t i = sizeof(T); i > 0; i--) {
+    bytes[i - 1] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+
+  write(string_view(bytes, sizeof(T)));
 }
 
-void MP4File::write_uint32(const uint32_t data)
+void MP4File::write_uint8(const uint8_t data) { write_big_endian(data); }
+void MP4File::write_uint16(const uint16_t data) { write_big_endian(data); }
+void MP4File::write_uint32(const uint32_t data) { write_big_endian(data); }
+void MP4File::write_uint64(const uint64_t data) { write_big_endian(data); }
+void MP4File::write_int8(const int8_t data) { write_big_endian(data); }
+void MP4File::write_int16(const int16_t data) { write_big_endian(data); }
+void MP4File::write_int32(const int32_t data) { write_big_endian(data); }
+void MP4File::write_int64(const int64_t data) { write_big_endian(data); }
+
+void MP4File::write(const string_view data)
 {
-  const uint32_t host_data = htobe32(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 4));
+  if (read_only_) {
+    throw runtime_error("MP4File: cannot write to a file opened read-only");
+  }
+
+  if (buffer_.size() + data.size() <= write_buffer_size) {
+    buffer_.append(data);
+  } else {
+    /* large payloads (e.g., mdat) go out with the buffer, without a copy */
+    FileDescriptor::writev({buffer_, data});
+    buffer_offset_ += buffer_.size() + data.size();
+    buffer_.clear();
+  }
+
+  offset_ += data.size();
 }
 
-void MP4File::write_uint64(const uint64_t data)
+void MP4File::write_zeros(const size_t bytes)
 {
-  uint64_t host_data = htobe64(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 8));
+  write(string(bytes, 0));
 }
 
-void MP4File::write_int8(const int8_t data)
+void MP4File::write_string(const string & data, const size_t bytes)
 {
-  write(string(1, static_cast<char>(data)));
+  if (data.size() != bytes) {
+    throw runtime_error("data size != bytes");
+  }
+
+  write(data);
 }
 
-void MP4File::write_int16(const int16_t data)
+template <typename T>
+void MP4File::write_big_endian_at(const T data, const uint64_t offset)
 {
-  int16_t host_data = htobe16(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 2));
+  char bytes[sizeof(T)];
+  make_unsigned_t<T> value = data;
+  for (size_t i = sizeof(T); i > 0; i--) {
+    bytes[i - 1] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+
+  if (offset >= buffer_offset_ and
+      offset + sizeof(T) <= buffer_offset_ + buffer_.size()) {
+    /* still buffered: patch in memory */
+    memcpy(&buffer_[offset - buffer_offset_], bytes, sizeof(T));
+  } else {
+    /* already written out (or past the end): patch the file */
+    flush();
+    if (CheckSystemCall("pwrite", pwrite(fd_num(), bytes, sizeof(T), offset))
+        != sizeof(T)) {
+      throw runtime_error("MP4File: short write");
+    }
+    register_write();
+  }
 }
 
-void MP4File::write_int32(const int32_t data)
+void MP4File::write_uint32_at(const uint32_t data, const uint64_t offset)
 {
-  int32_t host_data = htobe32(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 4));
+  write_big_endian_at(data, offset);
 }
 
-void MP4File::write_int64(const int64_t data)
+void MP4File::write_int32_at(const int32_t data, const uint64_t offset)
 {
-  int64_t host_data = htobe64(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 8));
+  write_big_endian_at(data, offset);
 }
 
-void MP4File::write_zeros(const size_t bytes)
+void MP4File::flush()
 {
-  for (size_t i = 0; i < bytes; ++i) {
-    write(string(1, static_cast<char>(0)));
+  if (buffer_.empty()) {
+    return;
   }
+
+  FileDescriptor::writev({buffer_});
+  buffer_offset_ += buffer_.size();
+  buffer_.clear();
 }
 
-void MP4File::write_string(const string & data, const size_t bytes)
+uint64_t MP4File::seek(const int64_t offset, const int whence)
 {
-  if (data.size() != bytes) {
-    throw runtime_error("data size != bytes");
+  if (read_only_) {
+    /* reading from memory */
+    const int64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? offset_ : size_;
+    if (base + offset < 0) {
+      throw runtime_error("MP4File: seek before the beginning of file");
+    }
+
+    offset_ = base + offset;
+    return offset_;
   }
 
-  write(data);
+  flush();
+  buffer_offset_ = offset_ = FileDescriptor::seek(offset, whence);
+  return offset_;
 }
 
-void MP4File::write_uint32_at(const uint32_t data, const uint64_t offset)
+uint64_t MP4File::inc_offset(const int64_t offset)
 {
-  uint64_t prev_offset = curr_offset();
-  seek(offset, SEEK_SET);
-  write_uint32(data);
-  seek(prev_offset, SEEK_SET);
+  return seek(offset, SEEK_CUR);
 }
 
-void MP4File::write_int32_at(const int32_t data, const uint64_t offset)
+uint64_t MP4File::filesize()
 {
-  uint64_t prev_offset = curr_offset();
-  seek(offset, SEEK_SET);
-  write_int32(data);
-  seek(prev_offset, SEEK_SET);
+  if (read_only_) {
+    return size_;
+  }
+
+  flush();
+  return FileDescriptor::filesize();
 }
@@ -5,17 +5,28 @@
 #include <cstdint>
 #include <string>
 #include <tuple>
+#include <memory>
 
 #include "file_descriptor.hh"
 
 namespace MP4 {
 
-class MP4File : public FileDescriptor
+/* A read-only MP4File is mmap'd and parsed in memory; otherwise writes are
+ * collected in a buffer (where back-patching is free) and flushed in large
+ * writes, so that reading or writing a chunk takes a handful of syscalls.
+ * The offset methods below track the logical offset, which differs from the
+ * kernel's while writes are buffered; FileDescriptor is a private base so
+ * that its own offset methods cannot be reached, e.g., through a
+ * FileDescriptor &. */
+class MP4File : private FileDescriptor
 {
 public:
   MP4File(const std::string & filename, int flags);
   MP4File(const std::string & filename, int flags, mode_t mode);
 
+  /* flushes buffered writes */
+  ~MP4File();
+
   /* read bytes from file and return meaningful data */
   uint8_t read_uint8();
   uint16_t read_uint16();
@@ -26,6 +37,14 @@ public:
   int32_t read_int32();
   int64_t read_int64();
 
+  /* read exactly 'length' bytes (throws at end of file) */
+  std::string read(const size_t length);
+  std::string read_exactly(const size_t length);
+
+  /* like read(), but points into the mapping instead of copying;
+   * valid as long as this MP4File */
+  std::string_view read_view(const size_t length);
+
   /* write bytes to file */
   void write_uint8(const uint8_t data);
   void write_uint16(const uint16_t data);
@@ -36,6 +55,8 @@ public:
   void write_int32(const int32_t data);
   void write_int64(const int64_t data);
 
+  void write(const std::string_view data);
+
   /* write 'bytes' bytes of zeros to file */
   void write_zeros(const size_t bytes);
 
@@ -44,6 +65,42 @@ public:
   /* overwrite 'data' at 'offset' */
   void write_uint32_at(const uint32_t data, const uint64_t offset);
   void write_int32_at(const int32_t data, const uint64_t offset);
+
+  /* write out everything buffered so far */
+  void flush();
+
+  /* manipulate file offset */
+  uint64_t seek(const int64_t offset, const int whence);
+  uint64_t curr_offset() const { return offset_; }
+  uint64_t inc_offset(const int64_t offset);
+
+  uint64_t filesize();
+
+  /* forbid copying */
+  MP4File(const MP4File & other) = delete;
+  MP4File & operator=(const MP4File & other) = delete;
+
+private:
+  /* reading: the whole file, if it was opened read-only */
+  bool read_only_ {false};
+  std::shared_ptr<void> mapping_ {};
+  const char * data_ {nullptr};
+  uint64_t size_ {0};
+
+  uint64_t offset_ {0};
+
+  /* writing: bytes not yet written, starting at file offset buffer_offset_ */
+  std::string buffer_ {};
+  uint64_t buffer_offset_ {0};
+
+  void map_if_read_only(const int flags);
+
+  /* pointer to the next 'length' bytes to read, advancing the offset */
+  const char * consume(const size_t length);
+
+  template <typename T> T read_big_endian();
+  template <typename T> void write_big_endian(const T data);
+  template <typename T> void write_big_endian_at(const T data, const uint64_t offset);
 };
 
 } /* namespace MP4 */
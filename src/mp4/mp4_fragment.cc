@@ -9,8 +9,9 @@
 #include "filesystem.hh"
 #include "strict_conversions.hh"
 #include "tokenize.hh"
-#include "mp4_parser.hh"
 #include "mp4_file.hh"
+#include "mp4_index.hh"
+#include "box.hh"
 #include "ftyp_box.hh"
 #include "mvhd_box.hh"
 #include "tkhd_box.hh"
@@ -21,11 +22,6 @@
 #include "mfhd_box.hh"
 #include "tfhd_box.hh"
 #include "tfdt_box.hh"
-#include "stsz_box.hh"
-#include "ctts_box.hh"
-#include "stts_box.hh"
-#include "stsc_box.hh"
-#include "stco_box.hh"
 #include "trun_box.hh"
 
 using namespace std;
@@ -53,57 +49,68 @@ uint64_t scale_global_timestamp(const uint64_t global_timestamp,
   return narrow_round<uint64_t>(sec * new_timescale);
 }
 
-void create_ftyp_box(MP4Parser & mp4_parser, MP4File & output_mp4)
+/* parse the single box at 'header' with one of the typed box classes */
+template <class BoxType>
+BoxType parse_box(MP4File & input, const BoxHeader & header)
 {
-  /* Create ftyp box and add compatible brand */
-  auto ftyp_box = static_pointer_cast<FtypBox>(
-      mp4_parser.find_first_box_of("ftyp"));
-  ftyp_box->add_compatible_brand("iso5");
-  ftyp_box->write_box(output_mp4);
+  BoxType box(8 + header.data_size, header.type);
+
+  input.seek(header.data_offset, SEEK_SET);
+  box.parse_data(input, header.data_size);
+
+  return box;
+}
+
+const BoxHeader & find_box(const MP4Index & index, const string & type)
+{
+  const int box = index.find_first_box_of(type);
+  if (box < 0) {
+    throw runtime_error("input MP4 does not contain a " + type + " box");
+  }
+
+  return index.box(box);
+}
+
+/* copy a box unmodified (but always with a 32-bit size) */
+void copy_box(MP4File & input, const BoxHeader & header, MP4File & output)
+{
+  output.write_uint32(narrow_cast<uint32_t>(8 + header.data_size));
+  output.write_string(header.type, 4);
+
+  input.seek(header.data_offset, SEEK_SET);
+  output.write(input.read_view(header.data_size));
+}
+
+/* write a sample table box of the same version and flags, but no entries */
+void write_empty_table(MP4File & input, const BoxHeader & header,
+                       MP4File & output)
+{
+  input.seek(header.data_offset, SEEK_SET);
+  const uint32_t version_flags = input.read_uint32();
+
+  /* stsz has a sample_size field before sample_count */
+  const bool is_stsz = header.type == "stsz";
+
+  output.write_uint32(is_stsz ? 20 : 16);
+  output.write_string(header.type, 4);
+  output.write_uint32(version_flags);
+  if (is_stsz) {
+    output.write_uint32(0);  // sample_size
+  }
+  output.write_uint32(0);  // entry_count or sample_count
+}
+
+void create_ftyp_box(MP4File & input, const MP4Index & index,
+                     MP4File & output_mp4)
+{
+  /* copy ftyp box and add compatible brand */
+  auto ftyp_box = parse_box<FtypBox>(input, find_box(index, "ftyp"));
+  ftyp_box.add_compatible_brand("iso5");
+  ftyp_box.write_box(output_mp4);
 }
 
-void create_moov_box(MP4Parser & mp4_parser, MP4File & output_mp4)
+void create_mvex_box(MP4File & output_mp4)
 {
-  /* create mvhd box and set duration to 0 */
-  auto mvhd_box = static_pointer_cast<MvhdBox>(
-      mp4_parser.find_first_box_of("mvhd"));
-  mvhd_box->set_duration(0);
-
-  /* set duration to 0 in tkhd box */
-  auto tkhd_box = static_pointer_cast<TkhdBox>(
-      mp4_parser.find_first_box_of("tkhd"));
-  tkhd_box->set_duration(0);
-
-  /* set segment duration to 0 in elst box */
-  auto elst_box = static_pointer_cast<ElstBox>(
-      mp4_parser.find_first_box_of("elst"));
-  elst_box->set_segment_duration(0);
-
-  /* set duration to 0 in mdhd box */
-  auto mdhd_box = static_pointer_cast<MdhdBox>(
-      mp4_parser.find_first_box_of("mdhd"));
-  mdhd_box->set_duration(0);
-
-  /* remove stss and ctts boxes from stbl box */
-  auto stbl_box = mp4_parser.find_first_box_of("stbl");
-  stbl_box->remove_child("stss");
-  stbl_box->remove_child("ctts");
-
-  /* clear the entries in stts, stsc, stsz, stco boxes */
-  auto stts_box = static_pointer_cast<SttsBox>(stbl_box->find_child("stts"));
-  stts_box->set_entries({});
-
-  auto stsc_box = static_pointer_cast<StscBox>(stbl_box->find_child("stsc"));
-  stsc_box->set_entries({});
-
-  auto stsz_box = static_pointer_cast<StszBox>(stbl_box->find_child("stsz"));
-  stsz_box->set_sample_size(0);
-  stsz_box->set_entries({});
-
-  auto stco_box = static_pointer_cast<StcoBox>(stbl_box->find_child("stco"));
-  stco_box->set_entries({});
-
-  /* create mvex box */
   auto trex_box = make_shared<TrexBox>(
       "trex",  // type
       0,       // version
@@ -116,17 +123,72 @@ void create_moov_box(MP4Parser & mp4_parser, MP4File & output_mp4)
   );
   auto mvex_box = make_shared<Box>("mvex");
   mvex_box->add_child(move(trex_box));
+  mvex_box->write_box(output_mp4);
+}
+
+/* copy 'box' of moov into the init segment, setting durations to 0 and
+ * emptying the sample tables on the way */
+void create_moov_child(MP4File & input, const MP4Index & index,
+                       const int box, MP4File & output_mp4)
+{
+  const BoxHeader & header = index.box(box);
+  const string & type = header.type;
+
+  if (type == "mvhd") {
+    auto mvhd_box = parse_box<MvhdBox>(input, header);
+    mvhd_box.set_duration(0);
+    mvhd_box.write_box(output_mp4);
+  } else if (type == "tkhd") {
+    auto tkhd_box = parse_box<TkhdBox>(input, header);
+    tkhd_box.set_duration(0);
+    tkhd_box.write_box(output_mp4);
+  } else if (type == "elst") {
+    auto elst_box = parse_box<ElstBox>(input, header);
+    elst_box.set_segment_duration(0);
+    elst_box.write_box(output_mp4);
+  } else if (type == "mdhd") {
+    auto mdhd_box = parse_box<MdhdBox>(input, header);
+    mdhd_box.set_duration(0);
+    mdhd_box.write_box(output_mp4);
+  } else if (type == "stss" or type == "ctts") {
+    /* removed from stbl box */
+  } else if (type == "stts" or type == "stsc" or
+             type == "stsz" or type == "stco") {
+    write_empty_table(input, header, output_mp4);
+  } else if (type == "moov" or type == "trak" or type == "edts" or
+             type == "mdia" or type == "minf" or type == "stbl") {
+    const uint64_t size_offset = output_mp4.curr_offset();
+    Box container_box(type);
+    container_box.write_size_type(output_mp4);
+
+    bool mvex_written = false;
+    for (const int child : index.children(box)) {
+      create_moov_child(input, index, child, output_mp4);
+
+      /* insert mvex box after the (first) trak box */
+      if (type == "moov" and not mvex_written and
+          index.box(child).type == "trak") {
+        create_mvex_box(output_mp4);
+        mvex_written = true;
+      }
+    }
 
-  /* create moov box; insert mvex box after trak box */
-  auto moov_box = mp4_parser.find_first_box_of("moov");
-  moov_box->insert_child(move(mvex_box), "trak");
-  moov_box->write_box(output_mp4);
+    container_box.fix_size_at(output_mp4, size_offset);
+  } else {
+    copy_box(input, header, output_mp4);
+  }
 }
 
-void create_init_segment(MP4Parser & mp4_parser, MP4File & output_mp4)
+void create_init_segment(MP4File & input, const MP4Index & index,
+                         MP4File & output_mp4)
 {
-  create_ftyp_box(mp4_parser, output_mp4);
-  create_moov_box(mp4_parser, output_mp4);
+  create_ftyp_box(input, index, output_mp4);
+
+  const int moov_box = index.find_first_box_of("moov");
+  if (moov_box < 0) {
+    throw runtime_error("input MP4 does not contain a moov box");
+  }
+  create_moov_child(input, index, moov_box, output_mp4);
 }
 
 void create_styp_box(MP4File & output_mp4)
@@ -141,13 +203,11 @@ void create_styp_box(MP4File & output_mp4)
   styp_box->write_box(output_mp4);
 }
 
-unsigned int create_sidx_box(MP4Parser & mp4_parser, MP4File & output_mp4,
+unsigned int create_sidx_box(MdhdBox & mdhd_box, MP4File & output_mp4,
                              const uint64_t global_timestamp)
 {
-  auto mdhd_box = static_pointer_cast<MdhdBox>(
-      mp4_parser.find_first_box_of("mdhd"));
-  uint32_t timescale = mdhd_box->timescale();
-  uint32_t duration = narrow_cast<uint32_t>(mdhd_box->duration());
+  uint32_t timescale = mdhd_box.timescale();
+  uint32_t duration = narrow_cast<uint32_t>(mdhd_box.duration());
 
   uint64_t mp4_ts = scale_global_timestamp(global_timestamp, timescale);
 
@@ -197,41 +257,105 @@ uint32_t check_sample_count(const uint32_t size_cnt,
   return same_cnt;
 }
 
-vector<TrunBox::Sample> create_samples(MP4Parser & mp4_parser,
-                                       const uint32_t trun_flags)
+/* number of entries of entry_size bytes that fit in a box after its
+ * header_size bytes of fixed fields */
+uint64_t max_entries(const BoxHeader & box, const uint64_t header_size,
+                     const uint64_t entry_size)
+{
+  return (box.data_size - min(box.data_size, header_size)) / entry_size;
+}
+
+/* number of samples in stsz; it must fit in stsz (one size per sample) or,
+ * if all samples have the same size, in mdat */
+uint32_t read_sample_count(MP4File & input, const MP4Index & index)
+{
+  const BoxHeader & stsz = find_box(index, "stsz");
+
+  input.seek(stsz.data_offset + 4 /* version and flags */, SEEK_SET);
+  const uint32_t sample_size = input.read_uint32();
+  const uint32_t sample_count = input.read_uint32();
+
+  const uint64_t max_count = sample_size == 0 ? max_entries(stsz, 12, 4)
+      : find_box(index, "mdat").data_size / sample_size;
+  if (sample_count > max_count) {
+    throw runtime_error("stsz: sample count exceeds the size of the box");
+  }
+
+  return sample_count;
+}
+
+/* expand the (sample_count, value) entries of stts or ctts into one value
+ * per sample; the expanded count is untrusted, so it is bounded by the
+ * number of samples in stsz */
+vector<uint32_t> read_sample_runs(MP4File & input, const BoxHeader & table,
+                                  const uint32_t max_samples)
 {
-  vector<TrunBox::Sample> samples;
+  input.seek(table.data_offset + 4 /* version and flags */, SEEK_SET);
+  const uint32_t entry_count = input.read_uint32();
+
+  if (entry_count > max_entries(table, 8, 8)) {
+    throw runtime_error(table.type
+                        + ": entry count exceeds the size of the box");
+  }
+
+  vector<uint32_t> values;
+  for (uint32_t i = 0; i < entry_count; ++i) {
+    const uint32_t sample_count = input.read_uint32();
+    const uint32_t value = input.read_uint32();
+
+    if (sample_count > max_samples - values.size()) {
+      throw runtime_error(table.type + ": more samples than in stsz");
+    }
+    values.insert(values.end(), sample_count, value);
+  }
+
+  return values;
+}
+
+/* per-sample sizes in stsz (empty if all samples have the same size);
+ * sample_count is from read_sample_count() */
+vector<uint32_t> read_sample_sizes(MP4File & input, const BoxHeader & stsz,
+                                   const uint32_t sample_count)
+{
+  input.seek(stsz.data_offset + 4 /* version and flags */, SEEK_SET);
+  const uint32_t sample_size = input.read_uint32();
+  input.read_uint32(); /* sample_count */
+
+  vector<uint32_t> sizes;
+  if (sample_size == 0) {
+    sizes.resize(sample_count);
+    for (auto & size : sizes) {
+      size = input.read_uint32();
+    }
+  }
+
+  return sizes;
+}
+
+/* write trun box from the flat sample tables; return the offset of its
+ * data_offset field, to be filled in once moof is created */
+uint64_t create_trun_box(MP4File & input, const MP4Index & index,
+                         MP4File & output_mp4, const uint32_t trun_flags,
+                         const uint32_t first_sample_flags)
+{
+  const uint32_t sample_count = read_sample_count(input, index);
 
   vector<uint32_t> size_entries;
   if (trun_flags & TrunBox::sample_size_present) {
-    auto stsz_box = static_pointer_cast<StszBox>(
-                        mp4_parser.find_first_box_of("stsz"));
-
-    size_entries = stsz_box->entries();
+    size_entries = read_sample_sizes(input, find_box(index, "stsz"),
+                                     sample_count);
   }
 
   vector<uint32_t> duration_entries;
   if (trun_flags & TrunBox::sample_duration_present) {
-    auto stts_box = static_pointer_cast<SttsBox>(
-                        mp4_parser.find_first_box_of("stts"));
-
-    for (const auto & stts_entry : stts_box->entries()) {
-      for (uint32_t i = 0; i < stts_entry.sample_count; ++i) {
-        duration_entries.emplace_back(stts_entry.sample_delta);
-      }
-    }
+    duration_entries = read_sample_runs(input, find_box(index, "stts"),
+                                        sample_count);
   }
 
   vector<uint32_t> offset_entries;
   if (trun_flags & TrunBox::sample_composition_time_offsets_present) {
-    auto ctts_box = static_pointer_cast<CttsBox>(
-                        mp4_parser.find_first_box_of("ctts"));
-
-    for (const auto & ctts_entry : ctts_box->entries()) {
-      for (uint32_t i = 0; i < ctts_entry.sample_count; ++i) {
-        offset_entries.emplace_back(ctts_entry.sample_offset);
-      }
-    }
+    offset_entries = read_sample_runs(input, find_box(index, "ctts"),
+                                      sample_count);
   }
 
   /* sanity check for consistent sample count */
@@ -240,46 +364,65 @@ vector<TrunBox::Sample> create_samples(MP4Parser & mp4_parser,
   uint32_t offset_cnt = offset_entries.size();
   uint32_t sample_cnt = check_sample_count(size_cnt, duration_cnt, offset_cnt);
 
-  for (unsigned int i = 0; i < sample_cnt; ++i) {
-    samples.push_back({
-      duration_cnt ? duration_entries[i] : 0,  // sample_duration
-      size_cnt ? size_entries[i] : 0,      // sample_size
-      0,                                   // sample_flags (not present)
-      offset_cnt ? offset_entries[i] : 0,  // sample_composition_time_offset
-    });
+  uint64_t size_offset = output_mp4.curr_offset();
+  FullBox trun_box("trun", 0, trun_flags);
+  trun_box.write_size_type(output_mp4);
+  trun_box.write_version_flags(output_mp4);
+
+  output_mp4.write_uint32(sample_cnt);
+
+  /* trun_flags always has data_offset_present */
+  uint64_t data_offset_offset = output_mp4.curr_offset();
+  output_mp4.write_int32(0);
+
+  if (trun_flags & TrunBox::first_sample_flags_present) {
+    output_mp4.write_uint32(first_sample_flags);
+  }
+
+  for (uint32_t i = 0; i < sample_cnt; ++i) {
+    if (duration_cnt) {
+      output_mp4.write_uint32(duration_entries[i]);
+    }
+    if (size_cnt) {
+      output_mp4.write_uint32(size_entries[i]);
+    }
+    if (offset_cnt) {
+      output_mp4.write_uint32(offset_entries[i]);
+    }
   }
 
-  return samples;
+  trun_box.fix_size_at(output_mp4, size_offset);
+
+  return data_offset_offset;
 }
 
-uint32_t get_default_sample_duration(MP4Parser & mp4_parser)
+uint32_t get_default_sample_duration(MP4File & input, const MP4Index & index)
 {
-  auto stts_box = static_pointer_cast<SttsBox>(
-      mp4_parser.find_first_box_of("stts"));
+  const BoxHeader & stts = find_box(index, "stts");
 
-  auto stts_entries = stts_box->entries();
-  if (stts_entries.size() == 1) {
-    return stts_entries[0].sample_delta;
+  input.seek(stts.data_offset + 4 /* version and flags */, SEEK_SET);
+  if (input.read_uint32() == 1) {
+    input.read_uint32(); /* sample_count */
+    return input.read_uint32();
   }
 
   return 0;
 }
 
-uint32_t get_default_sample_size(MP4Parser & mp4_parser)
+uint32_t get_default_sample_size(MP4File & input, const MP4Index & index)
 {
-  auto stsz_box = static_pointer_cast<StszBox>(
-      mp4_parser.find_first_box_of("stsz"));
+  const BoxHeader & stsz = find_box(index, "stsz");
 
-  return stsz_box->sample_size();
+  input.seek(stsz.data_offset + 4 /* version and flags */, SEEK_SET);
+  return input.read_uint32();
 }
 
-void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
+void create_moof_box(MP4File & input, const MP4Index & index,
+                     MdhdBox & mdhd_box, MP4File & output_mp4,
                      const uint64_t global_timestamp)
 {
-  auto mdhd_box = static_pointer_cast<MdhdBox>(
-      mp4_parser.find_first_box_of("mdhd"));
-  uint32_t timescale = mdhd_box->timescale();
-  uint32_t duration = narrow_cast<uint32_t>(mdhd_box->duration());
+  uint32_t timescale = mdhd_box.timescale();
+  uint32_t duration = narrow_cast<uint32_t>(mdhd_box.duration());
 
   uint64_t mp4_ts = scale_global_timestamp(global_timestamp, timescale);
   uint32_t sequence_number = narrow_round<uint32_t>(
@@ -297,14 +440,14 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
                         TfhdBox::default_sample_flags_present;
   uint32_t trun_flags = TrunBox::data_offset_present;
 
-  uint32_t default_sample_duration = get_default_sample_duration(mp4_parser);
+  uint32_t default_sample_duration = get_default_sample_duration(input, index);
   if (default_sample_duration) {
     tfhd_flags |= TfhdBox::default_sample_duration_present;
   } else {
     trun_flags |= TrunBox::sample_duration_present;
   }
 
-  uint32_t default_sample_size = get_default_sample_size(mp4_parser);
+  uint32_t default_sample_size = get_default_sample_size(input, index);
   if (default_sample_size) {
     tfhd_flags |= TfhdBox::default_sample_size_present;
   } else {
@@ -312,15 +455,15 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
   }
 
   uint32_t default_sample_flags, first_sample_flags;
-  if (mp4_parser.is_video()) {
+  if (index.is_video()) {
     default_sample_flags = 0x1010000;
     first_sample_flags = 0x2000000;
     trun_flags |= TrunBox::first_sample_flags_present;
 
-    if (mp4_parser.find_first_box_of("ctts") != nullptr) {
+    if (index.find_first_box_of("ctts") >= 0) {
       trun_flags |= TrunBox::sample_composition_time_offsets_present;
     }
-  } else if (mp4_parser.is_audio()) {
+  } else {
     default_sample_flags = 0x2000000;
     first_sample_flags = 0;
   }
@@ -342,17 +485,6 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
       mp4_ts   // base_media_decode_time
   );
 
-  vector<TrunBox::Sample> samples = create_samples(mp4_parser, trun_flags);
-
-  auto trun_box = make_shared<TrunBox>(
-      "trun",         // type
-      0,              // version
-      trun_flags,     // flags
-      move(samples),  // samples
-      0,              // data_offset, will be filled in once moof is created
-      first_sample_flags
-  );
-
   /* write boxes one by one to get the position of 'data_offset' */
   uint64_t moof_offset = output_mp4.curr_offset();
   auto moof_box = make_shared<Box>("moof");
@@ -365,42 +497,52 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
   tfhd_box->write_box(output_mp4);
   tfdt_box->write_box(output_mp4);
 
-  uint64_t trun_offset = output_mp4.curr_offset();
-  trun_box->write_box(output_mp4);
+  uint64_t data_offset_offset = create_trun_box(input, index, output_mp4,
+                                                trun_flags, first_sample_flags);
 
   traf_box->fix_size_at(output_mp4, traf_offset);
   moof_box->fix_size_at(output_mp4, moof_offset);
 
-  /* fill in 'data_offset' in trun box at 'trun_offset + 16'
+  /* fill in 'data_offset' in trun box
    * data_offset = size of moof + header size of mdat (8) */
   uint64_t moof_size = output_mp4.curr_offset() - moof_offset;
   int32_t data_offset_value = narrow_cast<int32_t>(moof_size + 8);
-  output_mp4.write_int32_at(data_offset_value,
-                            trun_offset + trun_box->data_offset_pos());
+  output_mp4.write_int32_at(data_offset_value, data_offset_offset);
 }
 
-void create_media_segment(MP4Parser & mp4_parser, MP4File & output_mp4,
+void create_media_segment(MP4File & input, const MP4Index & index,
+                          MP4File & output_mp4,
                           const uint64_t global_timestamp)
 {
+  auto mdhd_box = parse_box<MdhdBox>(input, find_box(index, "mdhd"));
+
   create_styp_box(output_mp4);
 
   /* create sidx box and save the position of referenced_size */
   uint64_t sidx_offset = output_mp4.curr_offset();
-  unsigned int sidx_ref_list_pos = create_sidx_box(mp4_parser, output_mp4,
+  unsigned int sidx_ref_list_pos = create_sidx_box(mdhd_box, output_mp4,
                                                    global_timestamp);
 
   uint64_t moof_offset = output_mp4.curr_offset();
-  create_moof_box(mp4_parser, output_mp4, global_timestamp);
+  create_moof_box(input, index, mdhd_box, output_mp4, global_timestamp);
 
-  auto mdat_box = mp4_parser.find_first_box_of("mdat");
-  mdat_box->write_box(output_mp4);
+  /* the samples are written straight from the input mapping */
+  const BoxHeader & mdat = find_box(index, "mdat");
+  input.seek(mdat.data_offset, SEEK_SET);
+  const string_view samples = input.read_view(mdat.data_size);
 
-  /* fill in 'referenced_size' = size of moof + size of mdat in sidx box */
+  output_mp4.write_uint32(narrow_cast<uint32_t>(8 + samples.size()));
+  output_mp4.write_string("mdat", 4);
+
+  /* fill in 'referenced_size' = size of moof + size of mdat in sidx box
+   * (while it is still buffered, before the samples are written) */
   uint32_t referenced_size = narrow_cast<uint32_t>(
-      output_mp4.curr_offset() - moof_offset);
+      output_mp4.curr_offset() + samples.size() - moof_offset);
   /* set referenced_size's most significant bit to 0 (reference_type) */
   output_mp4.write_uint32_at(referenced_size & 0x7FFFFFFF,
                              sidx_offset + sidx_ref_list_pos);
+
+  output_mp4.write(samples);
 }
 
 uint64_t get_timestamp(const string & filepath)
@@ -412,30 +554,30 @@ void fragment(const string & input_mp4,
               const string & init_segment,
               const string & media_segment)
 {
-  MP4Parser mp4_parser(input_mp4);
-  /* skip parsing avc1 and mp4a boxes (if exist) but save them as raw data */
-  mp4_parser.ignore_box("avc1");
-  mp4_parser.ignore_box("mp4a");
-  mp4_parser.parse();
+  /* index the box headers in one pass over the mapped input; boxes are
+   * parsed (or copied) from the mapping only when they are written */
+  MP4File input(input_mp4, O_RDONLY);
+  const MP4Index index(input);
 
-  if (not mp4_parser.is_video() and not mp4_parser.is_audio()) {
+  if (not index.is_video() and not index.is_audio()) {
     throw runtime_error("input MP4 is not a supported video or audio");
   }
 
-  /* run create_init_segment last so it can safely make changes to parser */
   if (media_segment.size()) {
     /* get timestamp in global timescale from input MP4's filename */
     const uint64_t global_timestamp = get_timestamp(input_mp4);
 
     MP4File output_mp4(media_segment, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    create_media_segment(mp4_parser, output_mp4, global_timestamp);
+    create_media_segment(input, index, output_mp4, global_timestamp);
+    output_mp4.flush();
   }
 
   if (init_segment.size()) {
     MP4File output_mp4(init_segment, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    create_init_segment(mp4_parser, output_mp4);
+    create_init_segment(input, index, output_mp4);
+    output_mp4.flush();
   }
 }
 
@@ -0,0 +1,79 @@
+#include <stdexcept>
+
+#include "mp4_index.hh"
+#include "mp4_parser.hh"
+
+using namespace std;
+using namespace MP4;
+
+MP4Index::MP4Index(MP4File & mp4)
+{
+  scan(mp4, 0, mp4.filesize(), -1);
+}
+
+int MP4Index::find_first_box_of(const string & type) const
+{
+  for (size_t i = 0; i < boxes_.size(); i++) {
+    if (boxes_[i].type == type) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+vector<int> MP4Index::children(const int index) const
+{
+  vector<int> ret;
+
+  /* descendants follow their parent until the parent's end */
+  const uint64_t end = box(index).end();
+  for (size_t i = index + 1; i < boxes_.size() and boxes_[i].offset < end; i++) {
+    if (boxes_[i].parent == index) {
+      ret.emplace_back(i);
+    }
+  }
+
+  return ret;
+}
+
+void MP4Index::scan(MP4File & mp4, const uint64_t start_offset,
+                    const uint64_t total_size, const int parent)
+{
+  const uint64_t end_offset = start_offset + total_size;
+  mp4.seek(start_offset, SEEK_SET);
+
+  while (mp4.curr_offset() + 8 <= end_offset) {
+    const uint64_t offset = mp4.curr_offset();
+    uint64_t size = mp4.read_uint32();
+    string type = mp4.read(4);
+
+    if (size == 0) {
+      size = end_offset - offset;
+    } else if (size == 1) {
+      size = mp4.read_uint64();
+    }
+
+    const uint64_t data_offset = mp4.curr_offset();
+    if (size < data_offset - offset or size > end_offset - offset) {
+      throw runtime_error("MP4Index: invalid size of " + type + " box");
+    }
+
+    const uint64_t data_size = offset + size - data_offset;
+    const bool is_container =
+      mp4_container_boxes.find(type) != mp4_container_boxes.end();
+    const bool is_stsd = type == "stsd";
+
+    const int index = boxes_.size();
+    boxes_.push_back({move(type), offset, data_offset, data_size, parent});
+
+    if (is_container) {
+      scan(mp4, data_offset, data_size, index);
+    } else if (is_stsd and data_size >= 8) {
+      /* skip version, flags and entry_count to reach the sample entries */
+      scan(mp4, data_offset + 8, data_size - 8, index);
+    }
+
+    mp4.seek(offset + size, SEEK_SET);
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef MP4_INDEX_HH
+#define MP4_INDEX_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mp4_file.hh"
+
+namespace MP4 {
+
+/* Location of a box in the file; its payload is not parsed or copied */
+struct BoxHeader
+{
+  std::string type;
+  uint64_t offset;       /* start of the box */
+  uint64_t data_offset;  /* start of the payload, after size and type */
+  uint64_t data_size;
+  int parent;            /* index of the parent box, or -1 at top level */
+
+  uint64_t end() const { return data_offset + data_size; }
+};
+
+/* A flat alternative to MP4Parser: a single pass over the box headers of
+ * a (read-only, mmap'd) MP4File, descending into the same container boxes
+ * as MP4Parser and into the sample entries of stsd. Boxes are kept in
+ * depth-first order, so the first box of a type is the one that
+ * MP4Parser::find_first_box_of() would return. */
+class MP4Index
+{
+public:
+  MP4Index(MP4File & mp4);
+
+  const std::vector<BoxHeader> & boxes() const { return boxes_; }
+  const BoxHeader & box(const int index) const { return boxes_.at(index); }
+
+  /* index of the first box of 'type', or -1 if not found */
+  int find_first_box_of(const std::string & type) const;
+
+  /* indices of the boxes directly inside box 'index' */
+  std::vector<int> children(const int index) const;
+
+  bool is_video() const { return find_first_box_of("avc1") >= 0; }
+  bool is_audio() const { return find_first_box_of("mp4a") >= 0; }
+
+private:
+  std::vector<BoxHeader> boxes_ {};
+
+  void scan(MP4File & mp4, const uint64_t start_offset,
+            const uint64_t total_size, const int parent);
+};
+
+} /* namespace MP4 */
+
+#endif /* MP4_INDEX_HH */
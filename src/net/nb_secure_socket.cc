@@ -3,6 +3,7 @@
 #include "nb_secure_socket.hh"
 
 #include <cassert>
+#include <algorithm>
 
 using namespace std;
 
@@ -18,6 +19,12 @@ void NBSecureSocket::accept()
   state_ = State::needs_accept;
 }
 
+void NBSecureSocket::handshake_completed(const Mode mode)
+{
+  mode_ = mode;
+  state_ = State::ready;
+}
+
 void NBSecureSocket::continue_SSL_connect()
 {
   if (state_ == State::needs_connect) {
@@ -94,30 +101,87 @@ void NBSecureSocket::continue_SSL_accept()
   throw runtime_error("session already connected");
 }
 
-void NBSecureSocket::continue_SSL_write()
+void NBSecureSocket::fill_record_buffer()
 {
-  try {
-    SecureSocket::write(write_buffer_.size() ? write_buffer_.front() : string(),
-                        state_ == State::needs_ssl_read_to_write);
+  /* drop what has been written; less than a record is left to move */
+  record_base_ += record_offset_;
+  record_buffer_.erase(0, record_offset_);
+  record_offset_ = 0;
+
+  /* forget the strings that have been written entirely */
+  while (record_starts_.size() > 1 and record_starts_[1] <= record_base_) {
+    record_starts_.pop_front();
   }
-  catch (ssl_error & s) {
-    switch (s.error_code()) {
-    case SSL_ERROR_WANT_READ:
-      state_ = State::needs_ssl_read_to_write;
-      break;
 
-    case SSL_ERROR_WANT_WRITE:
-      state_ = State::needs_ssl_write_to_write;
-      break;
+  while (record_buffer_.size() < SSL3_RT_MAX_PLAIN_LENGTH and
+         not write_buffer_.empty()) {
+    if (front_continues_) {
+      front_continues_ = false;
+    } else {
+      record_starts_.push_back(record_base_ + record_buffer_.size());
+    }
 
-    default:
-      throw;
+    if (record_buffer_.empty()) {
+      record_buffer_ = move(write_buffer_.front());
+    } else {
+      record_buffer_.append(write_buffer_.front());
     }
 
-    return;
+    write_buffer_.pop_front();
+  }
+}
+
+void NBSecureSocket::continue_SSL_write()
+{
+  const bool register_as_read = (state_ == State::needs_ssl_read_to_write);
+  bool wrote_record = false;
+
+  /* write until everything is written or the socket would block */
+  for (;;) {
+    if (record_length_ == 0) {
+      if (record_buffer_.size() - record_offset_ < SSL3_RT_MAX_PLAIN_LENGTH) {
+        fill_record_buffer();
+      }
+
+      record_length_ = min(record_buffer_.size() - record_offset_,
+                           static_cast<size_t>(SSL3_RT_MAX_PLAIN_LENGTH));
+
+      if (record_length_ == 0) {
+        break;
+      }
+    }
+
+    try {
+      SecureSocket::write(record_buffer_.data() + record_offset_,
+                          record_length_, register_as_read);
+    }
+    catch (ssl_error & s) {
+      switch (s.error_code()) {
+      case SSL_ERROR_WANT_READ:
+        state_ = State::needs_ssl_read_to_write;
+        break;
+
+      case SSL_ERROR_WANT_WRITE:
+        state_ = State::needs_ssl_write_to_write;
+        break;
+
+      default:
+        throw;
+      }
+
+      return;
+    }
+
+    record_offset_ += record_length_;
+    record_length_ = 0;
+    wrote_record = true;
+  }
+
+  if (not wrote_record) {
+    /* nothing was queued */
+    register_service(not register_as_read);
   }
 
-  write_buffer_.pop_front();
   state_ = State::ready;
 }
 
@@ -153,9 +217,22 @@ string NBSecureSocket::ezread()
   return buffer;
 }
 
+void NBSecureSocket::ezwrite(string && msg, const bool more)
+{
+  if (write_open_ and not write_buffer_.empty()) {
+    write_buffer_.back().append(msg);
+  } else {
+    /* the open message has already been coalesced into record_buffer_ */
+    front_continues_ = write_open_;
+    write_buffer_.emplace_back(move(msg));
+  }
+
+  write_open_ = more;
+}
+
 unsigned int NBSecureSocket::buffer_bytes() const
 {
-  unsigned int total_bytes = 0;
+  unsigned int total_bytes = record_buffer_.size() - record_offset_;
 
   for (const auto & buffer : write_buffer_) {
     total_bytes += buffer.size();
@@ -164,7 +241,32 @@ unsigned int NBSecureSocket::buffer_bytes() const
   return total_bytes;
 }
 
-void NBSecureSocket::clear_buffer()
+bool NBSecureSocket::clear_buffer()
 {
+  /* written so far, including a record that SSL_write must retry */
+  const uint64_t started = record_base_ + record_offset_ + record_length_;
+
+  /* the open message has started if it is the last one in record_buffer_
+   * (perhaps continued by write_buffer_'s only string) and was reached */
+  if (write_open_ and
+      (write_buffer_.empty() or
+       (front_continues_ and write_buffer_.size() == 1)) and
+      not record_starts_.empty() and record_starts_.back() < started) {
+    return true;
+  }
+
   write_buffer_.clear();
+  write_open_ = false;
+  front_continues_ = false;
+
+  /* keep the rest of the string that has started, not those after it */
+  const auto next = find_if(record_starts_.begin(), record_starts_.end(),
+    [started](const uint64_t start) { return start >= started; });
+
+  if (next != record_starts_.end()) {
+    record_buffer_.resize(*next - record_base_);
+    record_starts_.erase(next, record_starts_.end());
+  }
+
+  return false;
 }
@@ -3,6 +3,7 @@
 #ifndef CONNECTION_HH
 #define CONNECTION_HH
 
+#include <cstdint>
 #include <string>
 #include <deque>
 
@@ -39,6 +40,28 @@ private:
   std::deque<std::string> write_buffer_ {};
   std::string read_buffer_ {};
 
+  /* strings from write_buffer_ are coalesced here and written from
+   * record_offset_ in full-size TLS records */
+  std::string record_buffer_ {};
+  size_t record_offset_ {0};
+
+  /* length of the record being written; after WANT_READ/WANT_WRITE,
+   * SSL_write must be retried with the same bytes */
+  size_t record_length_ {0};
+
+  /* stream position of record_buffer_[0], and those at which the strings
+   * coalesced into record_buffer_ start (from the one record_offset_ is in),
+   * so that clear_buffer() can tell which strings have started */
+  uint64_t record_base_ {0};
+  std::deque<uint64_t> record_starts_ {};
+
+  /* the last string queued is continued by the next ezwrite(), and
+   * write_buffer_.front() continues the last string in record_buffer_ */
+  bool write_open_ {false};
+  bool front_continues_ {false};
+
+  void fill_record_buffer();
+
 public:
   NBSecureSocket(SecureSocket && sock)
     : SecureSocket(std::move(sock))
@@ -47,19 +70,34 @@ public:
   void connect();
   void accept();
 
+  /* the handshake was completed on the SecureSocket before it was moved
+   * in (e.g., by TLSHandshakePool) */
+  void handshake_completed(const Mode mode);
+
   void continue_SSL_connect();
   void continue_SSL_accept();
   void continue_SSL_write();
   void continue_SSL_read();
 
   std::string ezread();
-  void ezwrite(const std::string & msg) { write_buffer_.emplace_back(msg); };
-  void ezwrite(std::string && msg) { write_buffer_.emplace_back(move(msg)); };
+  /* with more set, the next ezwrite() continues the same message */
+  void ezwrite(std::string && msg, const bool more = false);
+  void ezwrite(const std::string & msg, const bool more = false)
+  {
+    ezwrite(std::string(msg), more);
+  }
   unsigned int buffer_bytes() const;
 
-  void clear_buffer();
+  /* drop the queued strings that have not started to be written; one that
+   * has is written whole, lest the peer receive a truncated message.
+   * Returns true if that is a message still open to ezwrite(..., more). */
+  bool clear_buffer();
+
+  bool something_to_write() const
+  {
+    return write_buffer_.size() > 0 or record_offset_ < record_buffer_.size();
+  }
 
-  bool something_to_write() const { return (write_buffer_.size() > 0); }
   bool something_to_read() const { return (read_buffer_.size() > 0); }
 
   State state() const  { return state_; }
@@ -5,8 +5,18 @@
 #include <thread>
 #include <mutex>
 
+#include <fcntl.h>
+#include <cstring>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
 #include "secure_socket.hh"
 #include "exception.hh"
+#include "file_descriptor.hh"
 
 using namespace std;
 
@@ -64,7 +74,7 @@ SSL_CTX * initialize_new_context()
 }
 
 SSLContext::SSLContext()
-    : ctx_( initialize_new_context() )
+    : ctx_( initialize_new_context() ), ticket_keys_()
 {}
 
 SecureSocket::SecureSocket( TCPSocket && sock, SSL * ssl )
@@ -160,10 +170,15 @@ string SecureSocket::read( const bool register_as_write )
 }
 
 void SecureSocket::write( const string & message, const bool register_as_read )
+{
+    write( message.data(), message.length(), register_as_read );
+}
+
+void SecureSocket::write( const char * data, const size_t length, const bool register_as_read )
 {
     /* SSL_write returns with success if complete contents of message are written */
     ERR_clear_error();
-    ssize_t bytes_written = SSL_write( ssl_.get(), message.data(), message.length() );
+    ssize_t bytes_written = SSL_write( ssl_.get(), data, length );
 
     if ( bytes_written <= 0 ) {
         int error_return = SSL_get_error( ssl_.get(), bytes_written );
@@ -183,6 +198,14 @@ int SecureSocket::get_error( const int return_value )
     return SSL_get_error( ssl_.get(), return_value );
 }
 
+void SecureSocket::quiet_shutdown( void )
+{
+    if ( SSL_is_init_finished( ssl_.get() ) ) {
+        SSL_set_quiet_shutdown( ssl_.get(), 1 );
+        SSL_shutdown( ssl_.get() );
+    }
+}
+
 void SSLContext::use_certificate_file( const std::string & cert_file )
 {
   ERR_clear_error();
@@ -204,3 +227,145 @@ void SSLContext::use_private_key_file( const std::string & pkey_file )
     throw ssl_error( "SSL_CTX_use_certificate_file" );
   }
 }
+
+void SSLContext::enable_session_resumption( const string & session_id_context )
+{
+    if ( session_id_context.size() > SSL_MAX_SID_CTX_LENGTH ) {
+        throw runtime_error( "session ID context is longer than "
+                             + to_string( SSL_MAX_SID_CTX_LENGTH ) + " bytes" );
+    }
+
+    SSL_CTX_set_session_cache_mode( ctx_.get(), SSL_SESS_CACHE_SERVER );
+    SSL_CTX_set_timeout( ctx_.get(), SESSION_TIMEOUT_S );
+
+    if ( not SSL_CTX_set_session_id_context(
+             ctx_.get(),
+             reinterpret_cast<const unsigned char *>( session_id_context.data() ),
+             session_id_context.size() ) ) {
+        throw ssl_error( "SSL_CTX_set_session_id_context" );
+    }
+}
+
+/* where an SSL_CTX keeps its SSLContext's ticket keys */
+static int ticket_keys_index()
+{
+    static const int index = SSL_CTX_get_ex_new_index( 0, nullptr, nullptr, nullptr, nullptr );
+    return index;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_ctx;
+
+static bool init_ticket_mac( EVP_MAC_CTX * mac_ctx, const SessionTicketKey & key )
+{
+    char digest[] = "SHA256";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY,
+                                           const_cast<unsigned char *>( key.hmac_key ),
+                                           sizeof( key.hmac_key ) ),
+        OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, digest, 0 ),
+        OSSL_PARAM_construct_end()
+    };
+
+    return EVP_MAC_CTX_set_params( mac_ctx, params );
+}
+#else
+typedef HMAC_CTX ticket_mac_ctx;
+
+static bool init_ticket_mac( HMAC_CTX * mac_ctx, const SessionTicketKey & key )
+{
+    return HMAC_Init_ex( mac_ctx, key.hmac_key, sizeof( key.hmac_key ),
+                         EVP_sha256(), nullptr );
+}
+#endif
+
+/* returns 1 on success, 2 if the ticket should be renewed with the current
+   key, 0 if the ticket key is unknown (a full handshake follows), or -1 */
+static int ticket_key_callback( SSL * ssl, unsigned char * key_name, unsigned char * iv,
+                                EVP_CIPHER_CTX * cipher_ctx, ticket_mac_ctx * mac_ctx,
+                                int enc )
+{
+    auto * ticket_keys = static_cast<SessionTicketKeys *>(
+        SSL_CTX_get_ex_data( SSL_get_SSL_CTX( ssl ), ticket_keys_index() ) );
+
+    if ( not ticket_keys ) {
+        return -1;
+    }
+
+    unique_lock<mutex> lock { ticket_keys->mutex };
+    const vector<SessionTicketKey> & keys = ticket_keys->keys;
+
+    if ( keys.empty() ) {
+        return -1;
+    }
+
+    if ( enc ) {
+        const SessionTicketKey & key = keys.front();
+        memcpy( key_name, key.name, sizeof( key.name ) );
+
+        if ( RAND_bytes( iv, EVP_CIPHER_iv_length( EVP_aes_256_cbc() ) ) <= 0 or
+             not EVP_EncryptInit_ex( cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv ) or
+             not init_ticket_mac( mac_ctx, key ) ) {
+            return -1;
+        }
+
+        return 1;
+    }
+
+    for ( auto it = keys.begin(); it != keys.end(); it++ ) {
+        if ( memcmp( key_name, it->name, sizeof( it->name ) ) == 0 ) {
+            if ( not init_ticket_mac( mac_ctx, *it ) or
+                 not EVP_DecryptInit_ex( cipher_ctx, EVP_aes_256_cbc(), nullptr, it->aes_key, iv ) ) {
+                return -1;
+            }
+
+            return it == keys.begin() ? 1 : 2;
+        }
+    }
+
+    return 0;
+}
+
+void SSLContext::use_session_ticket_key_file( const string & key_file )
+{
+    FileDescriptor fd { CheckSystemCall( "open (" + key_file + ")",
+                                         open( key_file.c_str(), O_RDONLY ) ) };
+    const string contents = fd.read_exactly( fd.filesize() );
+
+    if ( contents.empty() or contents.size() % sizeof( SessionTicketKey ) ) {
+        throw runtime_error( key_file + ": not a sequence of "
+                             + to_string( sizeof( SessionTicketKey ) ) + "-byte keys" );
+    }
+
+    vector<SessionTicketKey> keys( contents.size() / sizeof( SessionTicketKey ) );
+    memcpy( keys.data(), contents.data(), contents.size() );
+
+    if ( ticket_keys_ ) {
+        unique_lock<mutex> lock { ticket_keys_->mutex };
+        ticket_keys_->keys = move( keys );
+        return;
+    }
+
+    ticket_keys_ = make_unique<SessionTicketKeys>();
+    ticket_keys_->keys = move( keys );
+
+    if ( not SSL_CTX_set_ex_data( ctx_.get(), ticket_keys_index(), ticket_keys_.get() ) ) {
+        throw ssl_error( "SSL_CTX_set_ex_data" );
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx_.get(), ticket_key_callback );
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb( ctx_.get(), ticket_key_callback );
+#endif
+}
+
+long SSLContext::handshakes() const
+{
+    return SSL_CTX_sess_accept_good( ctx_.get() );
+}
+
+long SSLContext::resumed_handshakes() const
+{
+    return SSL_CTX_sess_hits( ctx_.get() );
+}
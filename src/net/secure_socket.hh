@@ -4,6 +4,8 @@
 
 #pragma once
 #include <memory>
+#include <vector>
+#include <mutex>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
@@ -47,7 +49,28 @@ public:
 
     std::string read( const bool register_as_write = false );
     void write( const std::string & message, const bool register_as_read = false );
+    void write( const char * data, const size_t length, const bool register_as_read = false );
     int get_error( const int return_value );
+
+    /* mark the session as cleanly ended without sending close_notify, so
+       that freeing the socket does not remove it from the session cache */
+    void quiet_shutdown( void );
+};
+
+/* a session ticket key; a ticket key file is a sequence of these */
+struct SessionTicketKey
+{
+    unsigned char name[ 16 ];
+    unsigned char hmac_key[ 32 ];
+    unsigned char aes_key[ 32 ];
+};
+
+/* the first key encrypts new tickets; all of them decrypt. Handshakes may
+   run on other threads (see TLSHandshakePool) */
+struct SessionTicketKeys
+{
+    std::mutex mutex {};
+    std::vector<SessionTicketKey> keys {};
 };
 
 class SSLContext
@@ -57,11 +80,29 @@ private:
     typedef std::unique_ptr<SSL_CTX, CTX_deleter> CTX_handle;
     CTX_handle ctx_;
 
+    std::unique_ptr<SessionTicketKeys> ticket_keys_;
+
 public:
+    /* how long a session can be resumed */
+    static constexpr long SESSION_TIMEOUT_S = 2 * 60 * 60;
+
     SSLContext();
 
     SecureSocket new_secure_socket( TCPSocket && sock );
 
     void use_certificate_file( const std::string & cert_file );
     void use_private_key_file( const std::string & pkey_file );
+
+    /* server side: resume sessions from a session cache (TLS 1.2 clients
+       without tickets) and from session tickets */
+    void enable_session_resumption( const std::string & session_id_context );
+
+    /* encrypt session tickets with keys from key_file (written by
+       run_servers), so that servers sharing it can resume each other's
+       sessions; may be called again to load rotated keys */
+    void use_session_ticket_key_file( const std::string & key_file );
+
+    /* handshakes completed as a server, and those that resumed a session */
+    long handshakes() const;
+    long resumed_handshakes() const;
 };
@@ -72,11 +72,14 @@ void Socket::bind( const Address & address )
 }
 
 /* connect socket to a specified peer address */
+/* in nonblocking mode, completion is signaled by writability; check it
+   with TCPSocket::verify_no_errors() */
 void Socket::connect( const Address & address )
 {
-    CheckSystemCall( "connect", ::connect( fd_num(),
-                                           &address.to_sockaddr(),
-                                           address.size() ) );
+    if ( ::connect( fd_num(), &address.to_sockaddr(), address.size() ) < 0
+         and errno != EINPROGRESS ) {
+        throw unix_error( "connect" );
+    }
     register_write();
 }
 
@@ -169,6 +172,22 @@ void Socket::set_reuseport( void )
     setsockopt( SOL_SOCKET, SO_REUSEPORT, int( true ) );
 }
 
+int Socket::set_recv_buffer_size( const int size )
+{
+    try {
+        setsockopt( SOL_SOCKET, SO_RCVBUFFORCE, size );
+    } catch ( const exception & ) {
+        /* unprivileged: capped at net.core.rmem_max */
+        setsockopt( SOL_SOCKET, SO_RCVBUF, size );
+    }
+
+    int granted = 0;
+    getsockopt( SOL_SOCKET, SO_RCVBUF, granted );
+
+    /* the kernel doubles the requested size for its bookkeeping */
+    return granted / 2;
+}
+
 /* turn on timestamps on receipt */
 void UDPSocket::set_timestamps( void )
 {
@@ -264,6 +283,16 @@ void TCPSocket::set_congestion_control( const string & cc )
     }
 }
 
+void TCPSocket::set_nodelay()
+{
+    setsockopt( IPPROTO_TCP, TCP_NODELAY, int( true ) );
+}
+
+void TCPSocket::set_notsent_lowat( const unsigned int bytes )
+{
+    setsockopt( IPPROTO_TCP, TCP_NOTSENT_LOWAT, bytes );
+}
+
 string TCPSocket::get_congestion_control() const
 {
     char optval[ TCP_CC_NAME_MAX ];
@@ -280,6 +309,7 @@ TCPInfo TCPSocket::get_tcp_info() const
   /* construct a TCPInfo of our interest */
   TCPInfo ret;
   ret.cwnd = x.tcpi_snd_cwnd;
+  ret.mss = x.tcpi_snd_mss;
   ret.in_flight = x.tcpi_unacked - x.tcpi_sacked - x.tcpi_lost + x.tcpi_retrans;
   ret.min_rtt = x.tcpi_min_rtt;
   ret.rtt = x.tcpi_rtt;
@@ -47,6 +47,10 @@ public:
     /* allow local address to be reused sooner, at the cost of some robustness */
     void set_reuseaddr( void );
     void set_reuseport( void );
+
+    /* request a receive buffer of size bytes (beyond net.core.rmem_max if
+       privileged); returns the size granted */
+    int set_recv_buffer_size( const int size );
 };
 
 /* UDP socket */
@@ -81,6 +85,7 @@ private:
 struct TCPInfo
 {
   uint32_t cwnd;      /* congestion window (packets) */
+  uint32_t mss;       /* sender maximum segment size (bytes) */
   uint32_t in_flight; /* packets "in flight" */
   uint32_t min_rtt;   /* minimum RTT in microsecond */
   uint32_t rtt;       /* RTT in microsecond */
@@ -109,6 +114,14 @@ public:
     /* are there pending errors on a nonblocking socket? */
     void verify_no_errors() const;
 
+    /* send small writes (e.g., acknowledgements) without waiting for ACKs */
+    void set_nodelay();
+
+    /* report the socket writable only while fewer than bytes are queued in
+       the kernel and not yet sent, so that the rest queues up (and can be
+       reordered) in the application */
+    void set_notsent_lowat( const unsigned int bytes );
+
     /* set the current congestion control algorithm */
     void set_congestion_control( const std::string & cc );
 
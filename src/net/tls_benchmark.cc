@@ -0,0 +1,199 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Measure the cost of sending WebSocket media over TLS: an NBSecureSocket
+   served by a Poller, as in WSServer, writes to a client on loopback */
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "socket.hh"
+#include "secure_socket.hh"
+#include "nb_secure_socket.hh"
+#include "poller.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " <certificate> <private key> [-n <MB>]\n\n"
+  "Send <MB> (default 1000) of server-video and server-audio frames, each\n"
+  "preceded by a small metadata frame, over TLS on loopback, and report the\n"
+  "write syscalls and polls per MB and the CPU time per Gbit of the sender"
+  << endl;
+}
+
+/* write syscalls made by this process so far */
+static uint64_t write_syscalls()
+{
+  ifstream io {"/proc/self/io"};
+  string key;
+  uint64_t value;
+
+  while (io >> key >> value) {
+    if (key == "syscw:") {
+      return value;
+    }
+  }
+
+  throw runtime_error("no syscw in /proc/self/io");
+}
+
+static double cpu_seconds()
+{
+  rusage usage;
+  CheckSystemCall("getrusage", getrusage(RUSAGE_SELF, &usage));
+
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* read and discard total_bytes */
+static void run_client(const Address & server_addr, const uint64_t total_bytes)
+{
+  TCPSocket sock;
+  sock.connect(server_addr);
+
+  SSLContext ssl_context;
+  SecureSocket client = ssl_context.new_secure_socket(move(sock));
+  client.connect();
+
+  uint64_t bytes_read = 0;
+  while (bytes_read < total_bytes) {
+    const string data = client.read();
+    if (data.empty()) {
+      throw runtime_error("server closed the connection");
+    }
+
+    bytes_read += data.size();
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  uint64_t total_mb = 1000;
+
+  if (argc == 5 and string(argv[3]) == "-n") {
+    total_mb = stoull(argv[4]);
+  } else if (argc != 3) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* what ws_media_server queues for a video chunk and an audio chunk */
+  const vector<string> frames {string(200, 'v'), string(100000, 'V'),
+                               string(200, 'a'), string(8000, 'A')};
+
+  uint64_t round_bytes = 0;
+  for (const auto & frame : frames) {
+    round_bytes += frame.size();
+  }
+
+  const uint64_t rounds = total_mb * 1000000 / round_bytes + 1;
+  const uint64_t total_bytes = rounds * round_bytes;
+
+  TCPSocket listener;
+  listener.bind({"127.0.0.1", 0});
+  listener.listen();
+
+  const pid_t pid = CheckSystemCall("fork", fork());
+  if (pid == 0) {
+    try {
+      run_client(listener.local_address(), total_bytes);
+    } catch (const exception & e) {
+      print_exception("tls_benchmark client", e);
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  SSLContext ssl_context;
+  ssl_context.use_certificate_file(argv[1]);
+  ssl_context.use_private_key_file(argv[2]);
+
+  TCPSocket client = listener.accept();
+  client.set_blocking(false);
+  NBSecureSocket sock {ssl_context.new_secure_socket(move(client))};
+  sock.accept();
+
+  Poller poller;
+  uint64_t rounds_queued = 0;
+  uint64_t polls = 0;
+
+  /* the client never sends anything after the handshake */
+  poller.add_action(Poller::Action(sock, Direction::In,
+    []() { return ResultType::Continue; },
+    []() { return false; }));
+
+  /* like WSServer, queue more frames once everything has been written */
+  poller.add_action(Poller::Action(sock, Direction::Out,
+    [&]()->Result {
+      if (rounds_queued == rounds) {
+        return ResultType::Exit;
+      }
+
+      for (const auto & frame : frames) {
+        sock.ezwrite(frame);
+      }
+      rounds_queued++;
+
+      return ResultType::Continue;
+    }));
+
+  /* complete the handshake before measuring */
+  while (not sock.ready()) {
+    poller.poll(-1);
+  }
+
+  const uint64_t syscalls_before = write_syscalls();
+  const double cpu_before = cpu_seconds();
+  const auto start = steady_clock::now();
+
+  for (;;) {
+    polls++;
+    const auto ret = poller.poll(-1);
+    if (ret.result == Poller::Result::Type::Exit) {
+      if (ret.exit_status != EXIT_SUCCESS) {
+        return ret.exit_status;
+      }
+      break;
+    }
+  }
+
+  const duration<double> elapsed = steady_clock::now() - start;
+  const double cpu = cpu_seconds() - cpu_before;
+  const uint64_t syscalls = write_syscalls() - syscalls_before;
+
+  int status;
+  CheckSystemCall("waitpid", waitpid(pid, &status, 0));
+  if (not WIFEXITED(status) or WEXITSTATUS(status) != EXIT_SUCCESS) {
+    cerr << "Error: client failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const double mb = total_bytes / 1e6;
+  const double gbit = total_bytes * 8 / 1e9;
+
+  cout << fixed << setprecision(1) << mb << " MB in " << elapsed.count()
+       << " s (" << gbit / elapsed.count() << " Gbps): "
+       << syscalls / mb << " write syscalls/MB, "
+       << polls / mb << " polls/MB, " << setprecision(3)
+       << cpu / gbit << " CPU-s/Gbit" << endl;
+
+  return EXIT_SUCCESS;
+}
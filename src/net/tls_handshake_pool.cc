@@ -0,0 +1,166 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "tls_handshake_pool.hh"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+#include "pipe.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+/* how often a worker waiting for its client checks whether to stop */
+static constexpr int STOP_CHECK_MS = 100;
+
+TLSHandshakePool::TLSHandshakePool(Poller & poller,
+                                   const unsigned int num_threads,
+                                   const Callback & callback)
+  : callback_(callback), pipe_(make_pipe())
+{
+  if (num_threads == 0) {
+    throw runtime_error("TLSHandshakePool: at least one thread is required");
+  }
+
+  poller.add_action(Poller::Action(pipe_.first, Direction::In,
+    [this]()->Result {
+      hand_back();
+      return ResultType::Continue;
+    }
+  ));
+
+  for (unsigned int i = 0; i < num_threads; i++) {
+    workers_.emplace_back([this]() { work(); });
+  }
+}
+
+TLSHandshakePool::~TLSHandshakePool()
+{
+  {
+    unique_lock<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_available_.notify_all();
+
+  for (auto & worker : workers_) {
+    worker.join();
+  }
+}
+
+void TLSHandshakePool::add(SecureSocket && sock)
+{
+  {
+    unique_lock<mutex> lock(mutex_);
+    todo_.emplace_back(move(sock));
+  }
+
+  pending_++;
+  work_available_.notify_one();
+}
+
+void TLSHandshakePool::hand_back()
+{
+  /* one byte per finished handshake, successful or not */
+  pipe_.first.read();
+
+  vector<SecureSocket> done;
+  {
+    unique_lock<mutex> lock(mutex_);
+    swap(done, done_);
+  }
+
+  for (auto & sock : done) {
+    pending_--;
+
+    NBSecureSocket nb_sock {move(sock)};
+    nb_sock.handshake_completed(NBSecureSocket::Mode::accept);
+    callback_(move(nb_sock));
+  }
+}
+
+void TLSHandshakePool::work()
+{
+  for (;;) {
+    unique_lock<mutex> lock(mutex_);
+    work_available_.wait(lock, [this]() { return stop_ or not todo_.empty(); });
+
+    if (stop_) {
+      return;
+    }
+
+    SecureSocket sock = move(todo_.front());
+    todo_.pop_front();
+    lock.unlock();
+
+    bool succeeded = true;
+    try {
+      handshake(sock);
+    } catch (const exception & e) {
+      print_exception("TLSHandshakePool", e);
+      succeeded = false;
+    }
+
+    lock.lock();
+    if (succeeded) {
+      done_.emplace_back(move(sock));
+    } else {
+      pending_--;
+    }
+    lock.unlock();
+
+    /* not FileDescriptor::write(), whose counters are not thread-safe */
+    CheckSystemCall("write", ::write(pipe_.second.fd_num(), "x", 1));
+  }
+}
+
+void TLSHandshakePool::handshake(SecureSocket & sock)
+{
+  const auto deadline = steady_clock::now()
+                        + milliseconds(HANDSHAKE_TIMEOUT_MS);
+
+  for (;;) {
+    pollfd pfd {sock.fd_num(), 0, 0};
+
+    try {
+      sock.accept();
+      return;
+    } catch (const ssl_error & e) {
+      switch (e.error_code()) {
+      case SSL_ERROR_WANT_READ:
+        pfd.events = POLLIN;
+        break;
+
+      case SSL_ERROR_WANT_WRITE:
+        pfd.events = POLLOUT;
+        break;
+
+      default:
+        throw;
+      }
+    }
+
+    /* wait for the client */
+    for (;;) {
+      if (stop_) {
+        throw runtime_error("TLSHandshakePool is stopping");
+      }
+
+      const auto remaining_ms = duration_cast<milliseconds>(
+          deadline - steady_clock::now()).count();
+      if (remaining_ms <= 0) {
+        throw runtime_error("TLS handshake timed out");
+      }
+
+      const int timeout_ms = min<long>(remaining_ms, STOP_CHECK_MS);
+      if (CheckSystemCall("poll", ::poll(&pfd, 1, timeout_ms)) > 0) {
+        break;
+      }
+    }
+  }
+}
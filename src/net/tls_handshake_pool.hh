@@ -0,0 +1,67 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef TLS_HANDSHAKE_POOL_HH
+#define TLS_HANDSHAKE_POOL_HH
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <utility>
+
+#include "secure_socket.hh"
+#include "nb_secure_socket.hh"
+#include "file_descriptor.hh"
+#include "poller.hh"
+
+/* Completes the server side of TLS handshakes on worker threads, so that
+ * full (RSA/ECDHE) handshakes do not stall an event loop that is serving
+ * other clients. Sockets are handed back to the event loop as ready
+ * NBSecureSockets; workers wake up the poller through a pipe. */
+class TLSHandshakePool
+{
+public:
+  using Callback = std::function<void(NBSecureSocket &&)>;
+
+  /* give up on a client that has not completed its handshake by then */
+  static constexpr int HANDSHAKE_TIMEOUT_MS = 10000;
+
+  TLSHandshakePool(Poller & poller, const unsigned int num_threads,
+                   const Callback & callback);
+  ~TLSHandshakePool();
+
+  /* complete the handshake of an accepted nonblocking socket; callback is
+   * called from the poller once it has succeeded */
+  void add(SecureSocket && sock);
+
+  /* handshakes added and not yet handed back or failed */
+  size_t pending() const { return pending_; }
+
+  /* forbid copying */
+  TLSHandshakePool(const TLSHandshakePool & other) = delete;
+  TLSHandshakePool & operator=(const TLSHandshakePool & other) = delete;
+
+private:
+  Callback callback_;
+
+  std::mutex mutex_ {};
+  std::condition_variable work_available_ {};
+  std::deque<SecureSocket> todo_ {};
+  std::vector<SecureSocket> done_ {};
+  std::atomic<bool> stop_ {false};
+  std::atomic<size_t> pending_ {0};
+
+  /* a worker writes a byte to the pipe after each handshake */
+  std::pair<FileDescriptor, FileDescriptor> pipe_;
+
+  std::vector<std::thread> workers_ {};
+
+  void work();
+  void handshake(SecureSocket & sock);
+  void hand_back();
+};
+
+#endif /* TLS_HANDSHAKE_POOL_HH */
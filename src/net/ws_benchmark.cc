@@ -0,0 +1,180 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Measure WebSocket parsing of the traffic a media server receives from
+   clients: small masked text frames carrying client-vidack, client-audack
+   and client-info messages */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <list>
+#include <chrono>
+#include <random>
+
+#include "ws_frame.hh"
+#include "ws_message.hh"
+#include "ws_message_parser.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+/* bytes returned by each read from a (TLS) socket */
+static constexpr size_t READ_SIZE = 16 * 1024;
+
+/* what the server needs to keep up with */
+static constexpr double TARGET_MSGS_PER_SEC = 100000;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [-n <messages>]\n\n"
+  "Parse <messages> (default 1000000) masked client messages, fed in reads\n"
+  "of " << READ_SIZE << " bytes, and report messages/s, compared with\n"
+  "copying each frame out of the buffer and unmasking it byte by byte"
+  << endl;
+}
+
+/* a JSON message like the ones puffer.js sends */
+static string make_client_message(const uint64_t i, mt19937 & prng)
+{
+  uniform_real_distribution<double> buffer {0, 15};
+  const string n = to_string(i);
+
+  switch (i % 5) {
+  case 0:
+    return "{\"initId\":1,\"event\":\"timer\",\"videoBuffer\":"
+           + to_string(buffer(prng)) + ",\"audioBuffer\":"
+           + to_string(buffer(prng)) + ",\"cumRebuffer\":0.5,"
+           "\"screenWidth\":1920,\"screenHeight\":1080,"
+           "\"type\":\"client-info\"}";
+  case 1:
+    return "{\"initId\":1,\"channel\":\"nbc\",\"format\":\"128k\","
+           "\"timestamp\":" + n + ",\"byteOffset\":0,\"byteLength\":"
+           + n + ",\"totalByteLength\":" + n + ",\"videoBuffer\":"
+           + to_string(buffer(prng)) + ",\"audioBuffer\":"
+           + to_string(buffer(prng)) + ",\"cumRebuffer\":0.5,"
+           "\"type\":\"client-audack\"}";
+  default:
+    return "{\"initId\":1,\"channel\":\"nbc\",\"format\":\"1280x720-22\","
+           "\"timestamp\":" + n + ",\"byteOffset\":0,\"byteLength\":"
+           + n + ",\"totalByteLength\":" + n + ",\"videoBuffer\":"
+           + to_string(buffer(prng)) + ",\"audioBuffer\":"
+           + to_string(buffer(prng)) + ",\"cumRebuffer\":0.5,"
+           "\"ssim\":0.987654,\"type\":\"client-vidack\"}";
+  }
+}
+
+/* how messages were parsed before: every frame copied out of the buffer
+   with substr() and erase(), unmasked one byte at a time, and turned into a
+   message through a list of frames */
+static size_t reference_parse(string & raw_buffer, const string & buf,
+                              vector<string> & payloads)
+{
+  raw_buffer.append(buf);
+  size_t count = 0;
+
+  while (not raw_buffer.empty()) {
+    const uint64_t expected_length = WSFrame::expected_length(raw_buffer);
+    if (raw_buffer.length() < expected_length) {
+      break;
+    }
+
+    const string frame_str = raw_buffer.substr(0, expected_length);
+    raw_buffer.erase(0, expected_length);
+
+    const WSFrame::Header header {frame_str};
+    string payload = frame_str.substr(header.header_length());
+    const uint32_t key_be = htobe32(*header.masking_key());
+    const char * key = reinterpret_cast<const char *>(&key_be);
+    for (size_t i = 0; i < payload.length(); i++) {
+      payload[i] ^= key[i % 4];
+    }
+
+    WSMessage message {list<WSFrame>{
+      WSFrame {header.fin(), header.opcode(), move(payload)}}};
+    payloads.emplace_back(message.payload());
+    count++;
+  }
+
+  return count;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  uint64_t num_messages = 1000000;
+
+  if (argc == 3 and string(argv[1]) == "-n") {
+    num_messages = stoull(argv[2]);
+  } else if (argc != 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* the client-to-server stream, as it arrives on the socket */
+  mt19937 prng {0};
+  vector<string> messages;
+  string stream;
+
+  for (uint64_t i = 0; i < num_messages; i++) {
+    messages.emplace_back(make_client_message(i, prng));
+    stream += WSFrame {true, WSFrame::OpCode::Text, messages.back(),
+                       static_cast<uint32_t>(prng())}.to_string();
+  }
+
+  vector<string> reads;
+  for (size_t i = 0; i < stream.size(); i += READ_SIZE) {
+    reads.emplace_back(stream.substr(i, READ_SIZE));
+  }
+
+  /* the reference parser */
+  vector<string> reference_payloads;
+  reference_payloads.reserve(num_messages);
+  string raw_buffer;
+
+  auto start = steady_clock::now();
+  for (const auto & buf : reads) {
+    reference_parse(raw_buffer, buf, reference_payloads);
+  }
+  const duration<double> reference_time = steady_clock::now() - start;
+
+  /* WSMessageParser */
+  vector<string> payloads;
+  payloads.reserve(num_messages);
+  WSMessageParser parser;
+
+  start = steady_clock::now();
+  for (const auto & buf : reads) {
+    parser.parse(buf);
+
+    while (not parser.empty()) {
+      payloads.emplace_back(move(parser.front().payload()));
+      parser.pop();
+    }
+  }
+  const duration<double> parser_time = steady_clock::now() - start;
+
+  if (payloads != messages or reference_payloads != messages) {
+    cerr << "Error: parsed messages do not match the messages sent" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const double reference_rate = num_messages / reference_time.count();
+  const double parser_rate = num_messages / parser_time.count();
+  const double mb = stream.size() / 1.0e6;
+
+  cout << fixed << setprecision(0) << num_messages << " messages ("
+       << setprecision(1) << mb << " MB): copying parser "
+       << setprecision(0) << reference_rate << " msgs/s ("
+       << setprecision(1) << mb / reference_time.count() << " MB/s), "
+       << "WSMessageParser " << setprecision(0) << parser_rate << " msgs/s ("
+       << setprecision(1) << mb / parser_time.count() << " MB/s), "
+       << parser_rate / TARGET_MSGS_PER_SEC << "x the target of "
+       << setprecision(0) << TARGET_MSGS_PER_SEC << " msgs/s" << endl;
+
+  return EXIT_SUCCESS;
+}
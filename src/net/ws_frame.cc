@@ -4,8 +4,13 @@
 #include "serialization.hh"
 
 #include <iostream>
+#include <cstring>
 #include <endian.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 WSFrame::Header::Header(const Chunk & chunk)
@@ -132,11 +137,56 @@ WSFrame::WSFrame(const Chunk & chunk)
   }
 
   if (header_.masking_key()) {
-    const string mk = put_field(*header_.masking_key());
+    mask(payload_.data(), payload_.length(), *header_.masking_key());
+  }
+}
 
-    for (size_t i = 0; i < payload_.length(); i++) {
-      payload_[i] ^= mk[i % 4];
-    }
+void WSFrame::mask(char * data, const uint64_t length,
+                   const uint32_t masking_key)
+{
+  /* the key in network byte order, repeated to the widest XOR below; as
+   * every step is a multiple of 4 bytes, byte i is XORed with key byte
+   * i % 4 */
+  alignas(32) char pattern[32];
+  const uint32_t key_be = htobe32(masking_key);
+  for (size_t i = 0; i < sizeof(pattern); i += sizeof(key_be)) {
+    memcpy(pattern + i, &key_be, sizeof(key_be));
+  }
+
+  uint64_t i = 0;
+
+#ifdef __AVX2__
+  const __m256i key256 =
+    _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern));
+
+  for (; i + 32 <= length; i += 32) {
+    __m256i * p = reinterpret_cast<__m256i *>(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+  }
+#endif
+
+#ifdef __SSE2__
+  const __m128i key128 =
+    _mm_load_si128(reinterpret_cast<const __m128i *>(pattern));
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i * p = reinterpret_cast<__m128i *>(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+  }
+#endif
+
+  uint64_t key64;
+  memcpy(&key64, pattern, sizeof(key64));
+
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    word ^= key64;
+    memcpy(data + i, &word, sizeof(word));
+  }
+
+  for (; i < length; i++) {
+    data[i] ^= pattern[i % 4];
   }
 }
 
@@ -171,18 +221,15 @@ string WSFrame::to_string() const
   }
 
   if (header_.masking_key()) {
-    string mk = put_field(*header_.masking_key());
-    output += mk;
+    output += put_field(*header_.masking_key());
+  }
 
-    string masked_payload;
-    masked_payload.reserve(payload_.length());
+  const size_t payload_offset = output.length();
+  output += payload_;
 
-    for (size_t i = 0; i < payload_.length(); i++) {
-      masked_payload.push_back(payload_[i] ^ mk[i % 4]);
-    }
-  }
-  else {
-    output += payload_;
+  if (header_.masking_key()) {
+    mask(output.data() + payload_offset, payload_.length(),
+         *header_.masking_key());
   }
 
   return output;
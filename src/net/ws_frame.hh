@@ -59,6 +59,12 @@ public:
   std::string to_string() const;
 
   static uint64_t expected_length( const Chunk & chunk );
+
+  /* XOR length bytes of data in place with the masking key (RFC 6455,
+   * section 5.3), which is its own inverse; data[0] must be the first byte
+   * of the payload */
+  static void mask(char * data, const uint64_t length,
+                   const uint32_t masking_key);
 };
 
 #endif /* WS_FRAME_HH */
@@ -11,6 +11,10 @@ WSMessage::WSMessage(const WSFrame & frame)
   : WSMessage(list<WSFrame>{frame})
 {}
 
+WSMessage::WSMessage(const Type type, string && payload)
+  : type_(type), payload_(move(payload))
+{}
+
 WSMessage::WSMessage(const list<WSFrame> & frames)
 {
   if (frames.size() == 0) {
@@ -21,6 +21,7 @@ private:
 public:
   WSMessage(const WSFrame & frame);
   WSMessage(const std::list<WSFrame> & frames);
+  WSMessage(const Type type, std::string && payload);
 
   Type type() const { return type_; }
   const std::string & payload() const { return payload_; }
@@ -6,57 +6,92 @@ using namespace std;
 
 void WSMessageParser::parse(const string & buf)
 {
-  raw_buffer_.append(buf);
+  buffer_.append(buf);
 
   /* repeatedly parse complete frames */
-  while (not raw_buffer_.empty()) {
-    uint64_t expected_length = WSFrame::expected_length(raw_buffer_);
+  while (offset_ < buffer_.size()) {
+    const Chunk remaining {
+      reinterpret_cast<const uint8_t *>(buffer_.data()) + offset_,
+      buffer_.size() - offset_};
 
-    if (raw_buffer_.length() < expected_length) {
+    const uint64_t expected_length = WSFrame::expected_length(remaining);
+
+    if (remaining.size() < expected_length) {
       /* still need more bytes to have a complete frame */
-      return;
+      break;
     }
 
     /* okay, we have a complete frame now! */
-    WSFrame frame {raw_buffer_.substr(0, expected_length)};
-    raw_buffer_.erase(0, expected_length);
+    const WSFrame::Header header {remaining};
+    char * payload = buffer_.data() + offset_ +
+                     (expected_length - header.payload_length());
 
-    switch (frame.header().opcode()) {
-    case WSFrame::OpCode::Continuation:
-      if (frame_buffer_.size() == 0) {
-        throw runtime_error("message cannot start with a continuation frame");
-      }
+    if (header.masking_key()) {
+      WSFrame::mask(payload, header.payload_length(), *header.masking_key());
+    }
 
-      frame_buffer_.emplace_back(move(frame));
-      break;
+    offset_ += expected_length;
+    handle_frame(header, {payload, header.payload_length()});
+  }
 
-    case WSFrame::OpCode::Text:
-    case WSFrame::OpCode::Binary:
-      if (frame_buffer_.size() != 0) {
-        throw runtime_error("expected a continuation message, got text/binary");
-      }
+  /* drop the parsed bytes once they are at least half of the buffer, so
+   * that each byte is moved O(1) times on average */
+  if (offset_ == buffer_.size()) {
+    buffer_.clear();
+    offset_ = 0;
+  } else if (offset_ >= buffer_.size() / 2) {
+    buffer_.erase(0, offset_);
+    offset_ = 0;
+  }
+}
 
-      frame_buffer_.emplace_back(move(frame));
-      break;
+void WSMessageParser::handle_frame(const WSFrame::Header & header,
+                                   const string_view payload)
+{
+  switch (header.opcode()) {
+  case WSFrame::OpCode::Continuation:
+    if (not fragmented_type_) {
+      throw runtime_error("message cannot start with a continuation frame");
+    }
+
+    fragmented_payload_.append(payload);
+
+    if (header.fin()) {
+      complete_messages_.emplace(*fragmented_type_,
+                                 move(fragmented_payload_));
+      fragmented_type_.reset();
+      fragmented_payload_.clear();
+    }
+    break;
 
-    case WSFrame::OpCode::Close:
-    case WSFrame::OpCode::Ping:
-    case WSFrame::OpCode::Pong:
-      if (not frame.header().fin()) {
-        throw runtime_error("control frames must not be fragmented");
-      }
-
-      /* we don't put control frames into the frame buffer, we directly create
-      the message from those and push them into the output queue */
-      complete_messages_.emplace(list<WSFrame>{frame});
-      return;
-    default:
-      throw runtime_error("invalid opcode");
+  case WSFrame::OpCode::Text:
+  case WSFrame::OpCode::Binary:
+    if (fragmented_type_) {
+      throw runtime_error("expected a continuation message, got text/binary");
     }
 
-    if (frame.header().fin()) {
-      complete_messages_.emplace(frame_buffer_);
-      frame_buffer_.clear();
+    if (header.fin()) {
+      /* the common case: a message in a single frame */
+      complete_messages_.emplace(header.opcode(), string(payload));
+    } else {
+      fragmented_type_ = header.opcode();
+      fragmented_payload_.assign(payload);
     }
+    break;
+
+  case WSFrame::OpCode::Close:
+  case WSFrame::OpCode::Ping:
+  case WSFrame::OpCode::Pong:
+    if (not header.fin()) {
+      throw runtime_error("control frames must not be fragmented");
+    }
+
+    /* control frames may arrive in the middle of a fragmented message;
+     * they go directly into the output queue */
+    complete_messages_.emplace(header.opcode(), string(payload));
+    break;
+
+  default:
+    throw runtime_error("invalid opcode");
   }
 }
@@ -4,19 +4,31 @@
 #define WS_MESSAGE_PARSER_HH
 
 #include <string>
+#include <string_view>
 #include <queue>
-#include <list>
+#include <optional>
 
 #include "ws_message.hh"
 #include "ws_frame.hh"
 
+/* Parses frames in place: headers are read and payloads unmasked where
+ * they were received, and only a message's payload is copied out */
 class WSMessageParser
 {
 private:
-  std::string raw_buffer_ {};
-  std::list<WSFrame> frame_buffer_ {};
+  /* bytes before offset_ have been parsed; the buffer is reused */
+  std::string buffer_ {};
+  size_t offset_ {0};
+
+  /* a message fragmented into several frames, until its last frame */
+  std::optional<WSMessage::Type> fragmented_type_ {};
+  std::string fragmented_payload_ {};
+
   std::queue<WSMessage> complete_messages_ {};
 
+  void handle_frame(const WSFrame::Header & header,
+                    const std::string_view payload);
+
 public:
   void parse(const std::string & buf);
 
@@ -0,0 +1,246 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Measure how long audio frames wait behind video frames queued for the
+   same client, when all frames share one queue and when audio is queued
+   with a higher priority than video */
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <optional>
+
+#include "socket.hh"
+#include "secure_socket.hh"
+#include "ws_server.hh"
+#include "ws_frame.hh"
+#include "timerfd.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+/* what ws_media_server queues: video frames as long as the connection is
+   writable, and a smaller audio frame every so often */
+static constexpr size_t VIDEO_FRAME_SIZE = 100 * 1024;
+static constexpr size_t AUDIO_FRAME_SIZE = 16 * 1024;
+static constexpr int AUDIO_INTERVAL_MS = 100;
+static constexpr unsigned int SEND_BUDGET = 1024 * 1024;
+
+/* the client's bottleneck, in front of which data queues up */
+static constexpr int CLIENT_RCVBUF = 256 * 1024;
+
+static constexpr int WARMUP_MS = 1000;
+static constexpr int DURATION_MS = 5000;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " <certificate> <private key> [-r <Mbps>]\n\n"
+  "Saturate a TLS WebSocket connection, read by a client at <Mbps> (default\n"
+  "20), with " << VIDEO_FRAME_SIZE << "-byte video frames, queue a "
+  << AUDIO_FRAME_SIZE << "-byte audio frame every " << AUDIO_INTERVAL_MS
+  << " ms,\nand report the audio delivery delay with a single queue and "
+  "with audio\nqueued at a higher priority than video"
+  << endl;
+}
+
+/* read at rate_mbps, and report the delays of the audio frames */
+static void run_client(const Address & server_addr, const double rate_mbps,
+                       const string & label)
+{
+  TCPSocket tcp_sock;
+  CheckSystemCall("setsockopt", setsockopt(tcp_sock.fd_num(), SOL_SOCKET,
+    SO_RCVBUF, &CLIENT_RCVBUF, sizeof(CLIENT_RCVBUF)));
+  tcp_sock.connect(server_addr);
+
+  SSLContext ssl_context;
+  SecureSocket sock = ssl_context.new_secure_socket(move(tcp_sock));
+  sock.connect();
+  sock.write("GET / HTTP/1.1\r\n"
+             "Host: localhost\r\n"
+             "Upgrade: websocket\r\n"
+             "Connection: Upgrade\r\n"
+             "Origin: https://localhost\r\n"
+             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+             "Sec-WebSocket-Version: 13\r\n\r\n");
+
+  const auto start = steady_clock::now();
+  const auto measure_start = start + milliseconds(WARMUP_MS);
+  const auto end = measure_start + milliseconds(DURATION_MS);
+
+  string buf;
+  bool upgraded = false;
+  uint64_t bytes_read = 0, video_bytes = 0;
+  vector<double> audio_delays;
+
+  for (auto now = start; now < end; now = steady_clock::now()) {
+    const string data = sock.read();
+    if (data.empty()) {
+      throw runtime_error("server closed the connection");
+    }
+
+    buf += data;
+    bytes_read += data.size();
+
+    if (not upgraded) {
+      const size_t header_end = buf.find("\r\n\r\n");
+      if (header_end == string::npos) {
+        continue;
+      }
+
+      buf.erase(0, header_end + 4);
+      upgraded = true;
+    }
+
+    /* frames from the server are not masked */
+    while (buf.size() >= WSFrame::expected_length(buf)) {
+      const WSFrame::Header header {buf};
+      const size_t length = WSFrame::expected_length(buf);
+
+      if (now >= measure_start) {
+        if (buf[header.header_length()] == 'A') {
+          int64_t sent_ns;
+          buf.copy(reinterpret_cast<char *>(&sent_ns), sizeof(sent_ns),
+                   header.header_length() + 1);
+          audio_delays.emplace_back(
+            (now.time_since_epoch().count() - sent_ns) / 1e6);
+        } else {
+          video_bytes += length;
+        }
+      }
+
+      buf.erase(0, length);
+    }
+
+    /* read no faster than the bottleneck */
+    this_thread::sleep_until(start + microseconds(
+      static_cast<int64_t>(bytes_read * 8 / rate_mbps)));
+  }
+
+  if (audio_delays.empty()) {
+    throw runtime_error("no audio frames received");
+  }
+
+  sort(audio_delays.begin(), audio_delays.end());
+  cout << fixed << setprecision(1) << label << ": audio delay p50 "
+       << audio_delays[audio_delays.size() / 2] << " ms, p99 "
+       << audio_delays[audio_delays.size() * 99 / 100] << " ms, max "
+       << audio_delays.back() << " ms ("
+       << audio_delays.size() << " frames); video "
+       << video_bytes * 8 / 1e3 / DURATION_MS << " Mbps" << endl;
+}
+
+static int run(const string & cert, const string & key,
+               const double rate_mbps, const bool priorities)
+{
+  /* find a free port for the server */
+  Address server_addr;
+  {
+    TCPSocket sock;
+    sock.bind({"127.0.0.1", 0});
+    server_addr = sock.local_address();
+  }
+
+  WebSocketSecureServer server {server_addr, "cubic"};
+  server.ssl_context().use_certificate_file(cert);
+  server.ssl_context().use_private_key_file(key);
+  server.set_send_budget(SEND_BUDGET);
+
+  const string label = priorities ? "audio before video" : "single queue";
+
+  const pid_t pid = CheckSystemCall("fork", fork());
+  if (pid == 0) {
+    try {
+      run_client(server_addr, rate_mbps, label);
+    } catch (const exception & e) {
+      print_exception("ws_priority_benchmark client", e);
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  const auto video_priority = priorities ? WebSocketSecureServer::Priority::Low
+                                         : WebSocketSecureServer::Priority::High;
+  const string video_payload(VIDEO_FRAME_SIZE, 'V');
+  optional<uint64_t> client;
+
+  auto queue_video = [&](const uint64_t connection_id) {
+    while (server.writable(connection_id)) {
+      server.queue_frame(connection_id,
+        WSFrame {true, WSFrame::OpCode::Binary, video_payload},
+        video_priority);
+    }
+  };
+
+  server.set_message_callback([](const uint64_t, const WSMessage &) {});
+  server.set_open_callback(
+    [&](const uint64_t connection_id) {
+      client = connection_id;
+      queue_video(connection_id);
+    });
+  server.set_writable_callback(queue_video);
+  server.set_close_callback([&](const uint64_t) { client.reset(); });
+
+  Timerfd audio_timer;
+  server.poller().add_action(Poller::Action(audio_timer, Direction::In,
+    [&]()->Result {
+      audio_timer.expirations();
+
+      if (client) {
+        string payload(AUDIO_FRAME_SIZE, 'A');
+        const int64_t now = steady_clock::now().time_since_epoch().count();
+        payload.replace(1, sizeof(now),
+                        reinterpret_cast<const char *>(&now), sizeof(now));
+
+        server.queue_frame(*client,
+          WSFrame {true, WSFrame::OpCode::Binary, move(payload)});
+      }
+
+      return ResultType::Continue;
+    }));
+  audio_timer.start(AUDIO_INTERVAL_MS, AUDIO_INTERVAL_MS);
+
+  int status;
+  while (CheckSystemCall("waitpid", waitpid(pid, &status, WNOHANG)) == 0) {
+    server.loop_once();
+  }
+
+  if (not WIFEXITED(status) or WEXITSTATUS(status) != EXIT_SUCCESS) {
+    cerr << "Error: client failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  double rate_mbps = 20;
+
+  if (argc == 5 and string(argv[3]) == "-r") {
+    rate_mbps = stod(argv[4]);
+  } else if (argc != 3) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (run(argv[1], argv[2], rate_mbps, false) != EXIT_SUCCESS or
+      run(argv[1], argv[2], rate_mbps, true) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
 #include <crypto++/sha.h>
 #include <crypto++/hex.h>
 #include <crypto++/base64.h>
@@ -100,19 +101,6 @@ HTTPResponse create_handshake_response(const HTTPRequest & request)
   return response;
 }
 
-template<>
-WSServer<TCPSocket>::Connection::Connection(TCPSocket && sock, SSLContext &)
-  : socket(move(sock))
-{}
-
-template<>
-WSServer<NBSecureSocket>::Connection::Connection(TCPSocket && sock,
-                                                 SSLContext & ssl_context)
-  : socket(ssl_context.new_secure_socket(move(sock)))
-{
-  socket.accept();
-}
-
 template<>
 string WSServer<TCPSocket>::Connection::read()
 {
@@ -125,30 +113,91 @@ string WSServer<NBSecureSocket>::Connection::read()
   return socket.ezread();
 }
 
+template<class SocketType>
+deque<string> * WSServer<SocketType>::Connection::next_queue()
+{
+  /* finish the message being sent before switching queues */
+  if (send_buffer_offset > 0) {
+    return &send_buffer[sending];
+  }
+
+  for (sending = 0; sending < send_buffer.size(); sending++) {
+    if (not send_buffer[sending].empty()) {
+      return &send_buffer[sending];
+    }
+  }
+
+  return nullptr;
+}
+
 template<>
-void WSServer<TCPSocket>::Connection::write()
+void WSServer<TCPSocket>::Connection::write(const size_t quantum)
 {
-  while (not send_buffer.empty()) {
-    string & data = send_buffer.front();
+  size_t written = 0;
 
-    const size_t bytes_written = socket.nb_write(data);
+  while (written < quantum) {
+    deque<string> * queue = next_queue();
+    if (not queue) {
+      break;
+    }
+
+    const string & data = queue->front();
+    const size_t length = min(data.size() - send_buffer_offset,
+                              quantum - written);
+
+    const size_t bytes_written =
+      socket.nb_write({data.data() + send_buffer_offset, length});
     if (bytes_written == 0) { // EWOULDBLOCK
       break;
-    } else if (bytes_written < data.size()) { // partial write
-      data.erase(0, bytes_written);
-    } else { // full write
-      send_buffer.pop_front();
+    }
+
+    written += bytes_written;
+    send_buffer_offset += bytes_written;
+
+    if (send_buffer_offset == data.size()) { // full write
+      queue->pop_front();
+      send_buffer_offset = 0;
     }
   }
+
+  send_buffer_bytes -= written;
 }
 
 template<>
-void WSServer<NBSecureSocket>::Connection::write()
+void WSServer<NBSecureSocket>::Connection::write(const size_t quantum)
 {
-  while (not send_buffer.empty()) {
-    socket.ezwrite(move(send_buffer.front()));
-    send_buffer.pop_front();
+  size_t written = 0;
+
+  while (written < quantum) {
+    deque<string> * queue = next_queue();
+    if (not queue) {
+      break;
+    }
+
+    string & data = queue->front();
+    const size_t length = data.size() - send_buffer_offset;
+
+    if (length > quantum - written) {
+      /* the rest of this message goes to the socket next time */
+      socket.ezwrite(data.substr(send_buffer_offset, quantum - written),
+                     true);
+      send_buffer_offset += quantum - written;
+      written = quantum;
+      break;
+    }
+
+    if (send_buffer_offset == 0) {
+      socket.ezwrite(move(data));
+    } else {
+      socket.ezwrite(data.substr(send_buffer_offset));
+    }
+
+    queue->pop_front();
+    send_buffer_offset = 0;
+    written += length;
   }
+
+  send_buffer_bytes -= written;
 }
 
 template<class SocketType>
@@ -160,188 +209,346 @@ void WSServer<SocketType>::init_listener_socket()
   listener_socket_.set_reuseport();
   listener_socket_.set_congestion_control(congestion_control_);
   listener_socket_.bind(listener_addr_);
-  listener_socket_.listen();
+  listener_socket_.listen(LISTEN_BACKLOG);
 
   poller_.add_action(Poller::Action(listener_socket_, Direction::In,
     [this]()->ResultType
     {
       TCPSocket client = listener_socket_.accept();
       client.set_blocking(false);
+      client.set_notsent_lowat(NOTSENT_LOWAT);
+
+      if (max_accepts_per_s_ > 0) {
+        accept_tokens_ -= 1;
+      }
+
+      accept_connection(move(client));
+      return ResultType::Continue;
+    },
+    [this]()->bool
+    {
+      return (max_accepts_per_s_ == 0 or accept_tokens_ >= 1) and
+             (max_pending_handshakes_ == 0 or
+              pending_handshakes() < max_pending_handshakes_);
+    }
+  ));
+}
 
-      const uint64_t conn_id = last_connection_id_++;
-      connections_.emplace(piecewise_construct,
-                           forward_as_tuple(conn_id),
-                           forward_as_tuple(move(client), ssl_context_));
-      Connection & conn = connections_.at(conn_id);
+template<>
+void WSServer<TCPSocket>::accept_connection(TCPSocket && client)
+{
+  add_connection(move(client));
+}
 
-      /* add the actions for this connection */
-      poller_.add_action(Poller::Action(conn.socket, Direction::In,
-        [this, &conn, conn_id]()->ResultType
-        {
-          const string data = conn.read();
+template<>
+void WSServer<NBSecureSocket>::accept_connection(TCPSocket && client)
+{
+  SecureSocket socket = ssl_context_.new_secure_socket(move(client));
 
-          if (data.empty()) {
-            /* peer socket is gone */
+  if (handshake_pool_) {
+    /* add_connection() once the handshake is complete */
+    handshake_pool_->add(move(socket));
+    return;
+  }
+
+  NBSecureSocket nb_socket {move(socket)};
+  nb_socket.accept();
+  add_connection(move(nb_socket));
+}
+
+template<class SocketType>
+void WSServer<SocketType>::add_connection(SocketType && socket)
+{
+  const uint64_t conn_id = last_connection_id_++;
+  connections_.emplace(piecewise_construct,
+                       forward_as_tuple(conn_id),
+                       forward_as_tuple(move(socket)));
+  Connection & conn = connections_.at(conn_id);
+  count_handshake(conn);
+
+  /* add the actions for this connection */
+  poller_.add_action(Poller::Action(conn.socket, Direction::In,
+    [this, &conn, conn_id]()->ResultType
+    {
+      const string data = conn.read();
+
+      if (data.empty()) {
+        /* peer socket is gone */
+        force_close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
+
+      if (conn.state == Connection::State::NotConnected) {
+        try {
+          conn.ws_handshake_parser.parse(data);
+        } catch (const exception & e) {
+          /* close the connection if received an invalid message */
+          print_exception("ws_server", e);
+          conn.failed = true;
+          force_close_connection(conn_id);
+          return ResultType::CancelAll;
+        }
+
+        while (not conn.ws_handshake_parser.empty()) {
+          auto request = move(conn.ws_handshake_parser.front());
+          conn.ws_handshake_parser.pop();
+
+          const auto & response = create_handshake_response(request);
+          auto & queue = conn.send_buffer.at(
+            static_cast<size_t>(Priority::High));
+          queue.emplace_back(response.str());
+          conn.send_buffer_bytes += queue.back().size();
+
+          /* only continue with status code of 101 */
+          if (response.status_code() != "101") {
+            /* TODO: response will not reach the client side currently */
+            conn.failed = true;
             force_close_connection(conn_id);
             return ResultType::CancelAll;
           }
 
-          if (conn.state == Connection::State::NotConnected) {
-            try {
-              conn.ws_handshake_parser.parse(data);
-            } catch (const exception & e) {
-              /* close the connection if received an invalid message */
-              print_exception("ws_server", e);
-              force_close_connection(conn_id);
-              return ResultType::CancelAll;
-            }
-
-            while (not conn.ws_handshake_parser.empty()) {
-              auto request = move(conn.ws_handshake_parser.front());
-              conn.ws_handshake_parser.pop();
-
-              const auto & response = create_handshake_response(request);
-              conn.send_buffer.emplace_back(response.str());
-
-              /* only continue with status code of 101 */
-              if (response.status_code() != "101") {
-                /* TODO: response will not reach the client side currently */
-                force_close_connection(conn_id);
-                return ResultType::CancelAll;
-              }
-
-              conn.state = Connection::State::Connecting;
-            }
-          }
-          else if (conn.state == Connection::State::Connected) {
-            try {
-              conn.ws_message_parser.parse(data);
-            } catch (const exception & e) {
-              /* close the connection if received an invalid message */
-              print_exception("ws_server", e);
-              wait_close_connection(conn_id);
-            }
-
-            while (not conn.ws_message_parser.empty()) {
-              WSMessage message = move(conn.ws_message_parser.front());
-              conn.ws_message_parser.pop();
-
-              switch (message.type()) {
-              case WSMessage::Type::Text:
-              case WSMessage::Type::Binary:
-                message_callback_(conn_id, message);
-                break;
-
-              case WSMessage::Type::Close:
-              {
-                /* respond to client-initiated close */
-                WSFrame close_frame { true, WSFrame::OpCode::Close,
-                                      message.payload() };
-                queue_frame(conn_id, close_frame);
-                force_close_connection(conn_id);
-                return ResultType::CancelAll;
-              }
-
-              case WSMessage::Type::Ping:
-              {
-                WSFrame pong { true, WSFrame::OpCode::Pong, "" };
-                queue_frame(conn_id, pong);
-                break;
-              }
-
-              case WSMessage::Type::Pong:
-                break;
-
-              default:
-                assert(false);  /* will not happen */
-                break;
-              }
-            }
-          }
-          else if (conn.state == Connection::State::Closing) {
-            try {
-              conn.ws_message_parser.parse(data);
-            } catch (const exception & e) {
-              /* close the connection if received an invalid message */
-              print_exception("ws_server", e);
-              force_close_connection(conn_id);
-              return ResultType::CancelAll;
-            }
-
-            while (not conn.ws_message_parser.empty()) {
-              WSMessage message = move(conn.ws_message_parser.front());
-              conn.ws_message_parser.pop();
-
-              switch (message.type()) {
-              case WSMessage::Type::Close:
-                /* complete server-initiated close */
-                force_close_connection(conn_id);
-                return ResultType::CancelAll;
-
-              default:
-                /* all the other message types are ignored */
-                break;
-              }
-            }
-          } else {
-            cerr << "Invalid conn.state = " << (int) conn.state << endl;
+          conn.state = Connection::State::Connecting;
+        }
+      }
+      else if (conn.state == Connection::State::Connected) {
+        try {
+          conn.ws_message_parser.parse(data);
+        } catch (const exception & e) {
+          /* close the connection if received an invalid message */
+          print_exception("ws_server", e);
+          conn.failed = true;
+          wait_close_connection(conn_id);
+        }
+
+        while (not conn.ws_message_parser.empty()) {
+          WSMessage message = move(conn.ws_message_parser.front());
+          conn.ws_message_parser.pop();
+
+          switch (message.type()) {
+          case WSMessage::Type::Text:
+          case WSMessage::Type::Binary:
+            message_callback_(conn_id, message);
+            break;
+
+          case WSMessage::Type::Close:
+          {
+            /* respond to client-initiated close */
+            WSFrame close_frame { true, WSFrame::OpCode::Close,
+                                  message.payload() };
+            queue_frame(conn_id, close_frame);
             force_close_connection(conn_id);
             return ResultType::CancelAll;
           }
 
-          return ResultType::Continue;
-        },
-        [&conn]()->bool
-        {
-          return (conn.state != Connection::State::Connecting) and
-                 (conn.state != Connection::State::Closed);
-        }
-      ));
-
-      poller_.add_action(Poller::Action(conn.socket, Direction::Out,
-        [this, &conn, conn_id]()->ResultType
-        {
-          if (conn.state == Connection::State::Connecting) {
-            if (conn.data_to_write()) {
-              conn.write();
-            }
-
-            if (not conn.data_to_write()) {
-              /* if we've sent the whole handshake response */
-              conn.state = Connection::State::Connected;
-              open_callback_(conn_id);
-            }
+          case WSMessage::Type::Ping:
+          {
+            WSFrame pong { true, WSFrame::OpCode::Pong, "" };
+            queue_frame(conn_id, pong);
+            break;
           }
-          else if ((conn.state == Connection::State::Connected or
-                    conn.state == Connection::State::Closing or
-                    conn.state == Connection::State::Closed) and
-                   conn.data_to_write()) {
-            conn.write();
+
+          case WSMessage::Type::Pong:
+            break;
+
+          default:
+            assert(false);  /* will not happen */
+            break;
           }
+        }
+      }
+      else if (conn.state == Connection::State::Closing) {
+        try {
+          conn.ws_message_parser.parse(data);
+        } catch (const exception & e) {
+          /* close the connection if received an invalid message */
+          print_exception("ws_server", e);
+          conn.failed = true;
+          force_close_connection(conn_id);
+          return ResultType::CancelAll;
+        }
 
-          if (conn.state == Connection::State::Closed and
-              not conn.data_to_write()) {
+        while (not conn.ws_message_parser.empty()) {
+          WSMessage message = move(conn.ws_message_parser.front());
+          conn.ws_message_parser.pop();
+
+          switch (message.type()) {
+          case WSMessage::Type::Close:
+            /* complete server-initiated close */
             force_close_connection(conn_id);
             return ResultType::CancelAll;
+
+          default:
+            /* all the other message types are ignored */
+            break;
           }
+        }
+      } else {
+        cerr << "Invalid conn.state = " << (int) conn.state << endl;
+        conn.failed = true;
+        force_close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
 
-          return ResultType::Continue;
-        },
-        [&conn]()->bool
-        {
-          return (conn.state == Connection::State::Connecting) or
-                 ((conn.state == Connection::State::Connected or
-                   conn.state == Connection::State::Closing or
-                   conn.state == Connection::State::Closed) and
-                  conn.interested_in_sending());
+      return ResultType::Continue;
+    },
+    [this, &conn]()->bool
+    {
+      /* NBSecureSocket asks only once its TLS handshake is complete */
+      handshake_done(conn);
+
+      return (conn.state != Connection::State::Connecting) and
+             (conn.state != Connection::State::Closed);
+    }
+  ));
+
+  poller_.add_action(Poller::Action(conn.socket, Direction::Out,
+    [this, &conn, conn_id]()->ResultType
+    {
+      if (conn.state == Connection::State::Connecting) {
+        if (conn.data_to_write()) {
+          conn.write(SEND_QUANTUM);
         }
-      ));
+
+        if (not conn.data_to_write()) {
+          /* if we've sent the whole handshake response */
+          conn.state = Connection::State::Connected;
+          open_callback_(conn_id);
+        }
+      }
+      else if ((conn.state == Connection::State::Connected or
+                conn.state == Connection::State::Closing or
+                conn.state == Connection::State::Closed) and
+               conn.data_to_write()) {
+        conn.write(SEND_QUANTUM);
+      }
+
+      if (conn.over_budget and conn.state == Connection::State::Connected
+          and writable(conn_id)) {
+        conn.over_budget = false;
+
+        if (writable_callback_) {
+          writable_callback_(conn_id);
+        }
+      }
+
+      if (conn.state == Connection::State::Closed and
+          not conn.data_to_write()) {
+        force_close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
 
       return ResultType::Continue;
+    },
+    [this, &conn]()->bool
+    {
+      handshake_done(conn);
+
+      return (conn.state == Connection::State::Connecting) or
+             ((conn.state == Connection::State::Connected or
+               conn.state == Connection::State::Closing or
+               conn.state == Connection::State::Closed) and
+              conn.interested_in_sending()) or
+             /* to tell the application once it has drained */
+             (conn.state == Connection::State::Connected and
+              conn.over_budget);
     }
   ));
 }
 
+template<>
+size_t WSServer<TCPSocket>::pending_handshakes() const
+{
+  return 0;
+}
+
+template<>
+size_t WSServer<NBSecureSocket>::pending_handshakes() const
+{
+  if (handshake_pool_) {
+    return handshake_pool_->pending();
+  }
+
+  return pending_handshakes_;
+}
+
+template<>
+void WSServer<TCPSocket>::count_handshake(Connection &)
+{}
+
+template<>
+void WSServer<NBSecureSocket>::count_handshake(Connection & conn)
+{
+  /* those from handshake_pool_ have already completed theirs */
+  if (not conn.socket.accepted()) {
+    conn.handshake_pending = true;
+    pending_handshakes_++;
+  }
+}
+
+template<class SocketType>
+void WSServer<SocketType>::handshake_done(Connection & conn)
+{
+  if (conn.handshake_pending) {
+    conn.handshake_pending = false;
+    pending_handshakes_--;
+  }
+}
+
+template<>
+void WSServer<TCPSocket>::set_handshake_threads(const unsigned int)
+{
+  throw runtime_error("WSServer: handshake threads require TLS");
+}
+
+template<>
+void WSServer<NBSecureSocket>::set_handshake_threads(
+    const unsigned int num_threads)
+{
+  if (handshake_pool_) {
+    throw runtime_error("WSServer: handshake threads are already set");
+  }
+
+  if (num_threads == 0) {
+    return;
+  }
+
+  handshake_pool_ = make_unique<TLSHandshakePool>(poller_, num_threads,
+    [this](NBSecureSocket && socket) { add_connection(move(socket)); });
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_accept_limits(const unsigned int max_per_s,
+                                             const unsigned int max_pending)
+{
+  max_accepts_per_s_ = max_per_s;
+  max_pending_handshakes_ = max_pending;
+
+  /* a token bucket refilled every ACCEPT_TICK_MS, holding up to one tick's
+   * worth of accepts so that they are spread over the second */
+  const double burst = max(1.0, max_per_s * ACCEPT_TICK_MS / 1000.0);
+  accept_tokens_ = burst;
+
+  if (max_per_s == 0 or accept_timer_started_) {
+    return;
+  }
+
+  poller_.add_action(Poller::Action(accept_timer_, Direction::In,
+    [this]()->ResultType
+    {
+      const uint64_t ticks = accept_timer_.expirations();
+      const double tick_burst =
+        max(1.0, max_accepts_per_s_ * ACCEPT_TICK_MS / 1000.0);
+
+      accept_tokens_ = min(tick_burst, accept_tokens_ +
+        ticks * max_accepts_per_s_ * ACCEPT_TICK_MS / 1000.0);
+      return ResultType::Continue;
+    }
+  ));
+
+  accept_timer_.start(ACCEPT_TICK_MS, ACCEPT_TICK_MS);
+  accept_timer_started_ = true;
+}
+
 template<class SocketType>
 WSServer<SocketType>::WSServer(const Address & listener_addr,
                                const string & congestion_control)
@@ -353,7 +560,8 @@ WSServer<SocketType>::WSServer(const Address & listener_addr,
 
 template<class SocketType>
 bool WSServer<SocketType>::queue_frame(const uint64_t connection_id,
-                                       const WSFrame & frame)
+                                       const WSFrame & frame,
+                                       const Priority priority)
 {
   Connection & conn = connections_.at(connection_id);
 
@@ -364,10 +572,24 @@ bool WSServer<SocketType>::queue_frame(const uint64_t connection_id,
 
   /* frame.to_string() inevitably copies frame.payload_ into the return string,
    * but the return string will be moved into conn.send_buffer without copy */
-  conn.send_buffer.emplace_back(frame.to_string());
+  auto & queue = conn.send_buffer.at(static_cast<size_t>(priority));
+  queue.emplace_back(frame.to_string());
+  conn.send_buffer_bytes += queue.back().size();
+
+  if (not writable(connection_id)) {
+    conn.over_budget = true;
+  }
+
   return true;
 }
 
+template<class SocketType>
+bool WSServer<SocketType>::writable(const uint64_t connection_id) const
+{
+  return send_budget_ == 0 or
+         connections_.at(connection_id).buffer_bytes() < send_budget_;
+}
+
 template<class SocketType>
 void WSServer<SocketType>::wait_close_connection(const uint64_t connection_id)
 {
@@ -448,38 +670,26 @@ Address WSServer<SocketType>::peer_addr(const uint64_t connection_id) const
 template<>
 bool WSServer<TCPSocket>::Connection::interested_in_sending() const
 {
-  return send_buffer.size() > 0;
+  return data_to_write();
 }
 
 template<>
 bool WSServer<NBSecureSocket>::Connection::interested_in_sending() const
 {
-  return send_buffer.size() > 0 or socket.something_to_write();
+  return data_to_write() or socket.something_to_write();
 }
 
 template<>
 unsigned int WSServer<TCPSocket>::Connection::buffer_bytes() const
 {
-  unsigned int total_bytes = 0;
-  for (const auto & buffer : send_buffer) {
-    total_bytes += buffer.size();
-  }
-
-  return total_bytes;
+  return send_buffer_bytes;
 }
 
 template<>
 unsigned int WSServer<NBSecureSocket>::Connection::buffer_bytes() const
 {
-  unsigned int total_bytes = 0;
-  for (const auto & buffer : send_buffer) {
-    total_bytes += buffer.size();
-  }
-
   /* NBSecureSocket maintains another buffer by itself */
-  total_bytes += socket.buffer_bytes();
-
-  return total_bytes;
+  return send_buffer_bytes + socket.buffer_bytes();
 }
 
 template<class SocketType>
@@ -488,17 +698,52 @@ unsigned int WSServer<SocketType>::buffer_bytes(const uint64_t conn_id) const
   return connections_.at(conn_id).buffer_bytes();
 }
 
+template<class SocketType>
+void WSServer<SocketType>::Connection::clear_queues(const bool keep_started)
+{
+  /* a frame that has started to be written must be sent whole */
+  string started;
+  if (keep_started) {
+    started = move(send_buffer[sending].front());
+  }
+
+  for (auto & queue : send_buffer) {
+    queue.clear();
+  }
+
+  if (keep_started) {
+    send_buffer_bytes = started.size() - send_buffer_offset;
+    send_buffer[sending].emplace_back(move(started));
+  } else {
+    send_buffer_offset = 0;
+    send_buffer_bytes = 0;
+  }
+}
+
 template<>
 void WSServer<TCPSocket>::Connection::clear_buffer()
 {
-  send_buffer.clear();
+  clear_queues(send_buffer_offset > 0);
 }
 
 template<>
 void WSServer<NBSecureSocket>::Connection::clear_buffer()
 {
-  send_buffer.clear();
-  socket.clear_buffer();
+  /* the socket keeps what it has of a started frame, and tells whether
+   * the rest of it is still to be handed over */
+  clear_queues(socket.clear_buffer());
+}
+
+template<>
+void WSServer<TCPSocket>::Connection::end_session()
+{}
+
+template<>
+void WSServer<NBSecureSocket>::Connection::end_session()
+{
+  /* keep the session resumable; OpenSSL has already evicted it if a fatal
+   * alert was sent or received */
+  socket.quiet_shutdown();
 }
 
 template<class SocketType>
@@ -514,6 +759,14 @@ Poller::Result WSServer<SocketType>::loop_once()
 
   /* let's garbage collect the closed connections */
   for (const uint64_t conn_id : closed_connections_) {
+    Connection & conn = connections_.at(conn_id);
+
+    /* do not resume the session of a peer that misbehaved */
+    if (not conn.failed) {
+      conn.end_session();
+    }
+
+    handshake_done(conn);
     connections_.erase(conn_id);
   }
 
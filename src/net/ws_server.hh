@@ -7,13 +7,17 @@
 #include <set>
 #include <functional>
 #include <deque>
+#include <array>
+#include <memory>
 
 #include "socket.hh"
 #include "nb_secure_socket.hh"
 #include "poller.hh"
+#include "timerfd.hh"
 #include "address.hh"
 #include "http_request_parser.hh"
 #include "ws_message_parser.hh"
+#include "tls_handshake_pool.hh"
 
 /* this implementation is not thread-safe. */
 template<class SocketType>
@@ -23,6 +27,11 @@ public:
   using MessageCallback = std::function<void(const uint64_t, const WSMessage &)>;
   using OpenCallback = std::function<void(const uint64_t)>;
   using CloseCallback = std::function<void(const uint64_t)>;
+  using WritableCallback = std::function<void(const uint64_t)>;
+
+  /* queued frames of higher priority are sent first; a frame that has
+   * started going out is always finished first */
+  enum class Priority { High = 0, Low, Count };
 
 private:
   uint64_t last_connection_id_ {0};
@@ -43,25 +52,51 @@ private:
     HTTPRequestParser ws_handshake_parser {};
     WSMessageParser ws_message_parser {};
 
-    /* outgoing messages */
-    std::deque<std::string> send_buffer {};
+    /* outgoing messages, one queue per priority; send_buffer_offset bytes
+     * of the first message of send_buffer[sending] have been handed to the
+     * socket, and send_buffer_bytes remain in all queues */
+    std::array<std::deque<std::string>,
+               static_cast<size_t>(Priority::Count)> send_buffer {};
+    size_t sending {0};
     size_t send_buffer_offset {0};
+    size_t send_buffer_bytes {0};
+
+    /* send_buffer has reached the send budget since the last time the
+     * application was told the connection is writable */
+    bool over_budget {false};
+
+    /* closed because the peer sent something invalid */
+    bool failed {false};
 
-    Connection(TCPSocket && sock, SSLContext & ssl_context);
+    /* counted in pending_handshakes_ until its TLS handshake is complete */
+    bool handshake_pending {false};
+
+    Connection(SocketType && sock) : socket(std::move(sock)) {}
 
     std::string read();
-    void write();
+
+    /* hand at most quantum bytes from send_buffer to the socket */
+    void write(const size_t quantum);
+
+    /* the queue to write from next, or nullptr if all are empty */
+    std::deque<std::string> * next_queue();
 
     /* the connection has data to write to TCPSocket directly,
      * or write to NBSecureSocket's internal send_buffer */
-    bool data_to_write() const { return send_buffer.size() > 0; }
+    bool data_to_write() const { return send_buffer_bytes > 0; }
 
     /* tell the poller if the connection is interested in sending
      * i.e., it or its NBSecureSocket has pending data in the send_buffer */
     bool interested_in_sending() const;
 
     unsigned int buffer_bytes() const;
+
+    /* drop the queued frames, except the rest of one that has started */
     void clear_buffer();
+    void clear_queues(const bool keep_started);
+
+    /* called before a closed connection that has not failed is destroyed */
+    void end_session();
   };
 
   SSLContext ssl_context_ {};
@@ -74,13 +109,56 @@ private:
   MessageCallback message_callback_ {};
   OpenCallback open_callback_ {};
   CloseCallback close_callback_ {};
+  WritableCallback writable_callback_ {};
 
   std::set<uint64_t> closed_connections_ {};
 
   std::string congestion_control_ {};
 
+  /* bytes written to a connection's socket each time it is polled, so that
+   * a connection with a whole chunk queued takes turns with the others */
+  static constexpr size_t SEND_QUANTUM = 64 * 1024;
+
+  /* unsent bytes a connection's kernel buffer holds before the socket is
+   * no longer writable; the rest waits in send_buffer, by priority */
+  static constexpr unsigned int NOTSENT_LOWAT = 128 * 1024;
+
+  /* see set_send_budget() */
+  unsigned int send_budget_ {0};
+
+  /* connections waiting to be accepted queue up in the kernel */
+  static constexpr int LISTEN_BACKLOG = 1024;
+
+  /* accept limits (0 means no limit); see set_accept_limits() */
+  static constexpr int ACCEPT_TICK_MS = 100;
+  unsigned int max_accepts_per_s_ {0};
+  unsigned int max_pending_handshakes_ {0};
+  double accept_tokens_ {0};
+  Timerfd accept_timer_ {};
+  bool accept_timer_started_ {false};
+
+  /* completes TLS handshakes off the event loop, if enabled */
+  std::unique_ptr<TLSHandshakePool> handshake_pool_ {};
+
   void init_listener_socket();
 
+  /* start the handshake of an accepted socket, or hand it to the pool */
+  void accept_connection(TCPSocket && client);
+
+  /* poll on a connection's socket; for NBSecureSocket, the TLS handshake
+   * may still be in progress */
+  void add_connection(SocketType && socket);
+
+  /* TLS handshakes that are not complete yet */
+  size_t pending_handshakes() const;
+
+  /* handshakes in progress on the event loop, kept up to date by
+   * count_handshake() and handshake_done() rather than by walking
+   * connections_ each time the listener is polled */
+  size_t pending_handshakes_ {0};
+  void count_handshake(Connection & conn);
+  void handshake_done(Connection & conn);
+
   /* gracefully close the connection */
   void wait_close_connection(const uint64_t connection_id);
 
@@ -98,11 +176,36 @@ public:
 
   SSLContext & ssl_context() { return ssl_context_; }
 
+  /* complete TLS handshakes on num_threads worker threads instead of in the
+   * event loop; may be called once, for WSServer<NBSecureSocket> only */
+  void set_handshake_threads(const unsigned int num_threads);
+
+  /* accept at most max_per_s connections per second, and none while
+   * max_pending TLS handshakes are incomplete (0 means no limit); the
+   * others wait in the listen queue */
+  void set_accept_limits(const unsigned int max_per_s,
+                         const unsigned int max_pending);
+
   void set_message_callback(MessageCallback func) { message_callback_ = func; }
   void set_open_callback(OpenCallback func) { open_callback_ = func; }
   void set_close_callback(CloseCallback func) { close_callback_ = func; }
 
-  bool queue_frame(const uint64_t connection_id, const WSFrame & frame);
+  /* called when a connection whose buffer_bytes() reached the send budget
+   * has drained below it */
+  void set_writable_callback(WritableCallback func)
+  {
+    writable_callback_ = func;
+  }
+
+  /* bytes that may be queued on a connection before it stops being
+   * writable() (0 means no limit); queue_frame() still accepts frames
+   * beyond the budget, so callers should check writable() */
+  void set_send_budget(const unsigned int bytes) { send_budget_ = bytes; }
+
+  bool writable(const uint64_t connection_id) const;
+
+  bool queue_frame(const uint64_t connection_id, const WSFrame & frame,
+                   const Priority priority = Priority::High);
 
   Address peer_addr(const uint64_t connection_id) const;
 
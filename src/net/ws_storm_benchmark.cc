@@ -0,0 +1,398 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Measure how a reconnect storm (many clients doing full TLS handshakes at
+   once) stalls the delivery of media to the clients already connected to a
+   WebSocketSecureServer */
+
+#include <getopt.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "socket.hh"
+#include "secure_socket.hh"
+#include "ws_server.hh"
+#include "ws_frame.hh"
+#include "timerfd.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+/* a media frame is queued for every client this often */
+static constexpr int MEDIA_INTERVAL_MS = 10;
+static constexpr size_t MEDIA_FRAME_SIZE = 16 * 1024;
+
+/* do not queue media for a client that has this much unsent */
+static constexpr unsigned int MAX_CLIENT_BUFFER = 1000000;
+
+/* phases of the run, as seen by the clients */
+static constexpr int WARMUP_MS = 1000;
+static constexpr int COOLDOWN_MS = 1000;
+enum Phase { Warmup, Before, Storm, Cooldown, Done };
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " <certificate> <private key> [options]\n\n"
+  "Options:\n"
+  "-t, --threads <N>             handshake threads (default 0: in the loop)\n"
+  "-r, --max-accepts-per-s <R>   accept rate limit (default 0: none)\n"
+  "-p, --max-pending <P>         pending handshake limit (default 0: none)\n"
+  "-k, --clients <K>             media clients (default 10)\n"
+  "-m, --storm <M>               reconnecting clients (default 500)\n"
+  "-c, --concurrency <C>         of the reconnecting clients (default 8)\n\n"
+  "Serve " << MEDIA_FRAME_SIZE << "-byte frames every " << MEDIA_INTERVAL_MS
+  << " ms to <K> clients, then make <M>\nnew connections (TLS and WebSocket "
+  "handshakes), and report the delivery\ndelay and the longest gap between "
+  "frames before and during the storm"
+  << endl;
+}
+
+/* delivery delays and gaps between frames, in ms */
+struct Samples
+{
+  vector<double> delays {};
+  double max_gap {0};
+};
+
+static string ws_upgrade_request()
+{
+  return "GET / HTTP/1.1\r\n"
+         "Host: localhost\r\n"
+         "Upgrade: websocket\r\n"
+         "Connection: Upgrade\r\n"
+         "Origin: https://localhost\r\n"
+         "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+         "Sec-WebSocket-Version: 13\r\n\r\n";
+}
+
+/* connect, complete the TLS and WebSocket handshakes, and return whatever
+   was read after the handshake response */
+static string ws_connect(SecureSocket & sock)
+{
+  sock.connect();
+  sock.write(ws_upgrade_request());
+
+  string buf;
+  for (;;) {
+    const string data = sock.read();
+    if (data.empty()) {
+      throw runtime_error("server closed the connection");
+    }
+
+    buf += data;
+    const size_t end = buf.find("\r\n\r\n");
+    if (end != string::npos) {
+      if (buf.compare(0, 12, "HTTP/1.1 101") != 0) {
+        throw runtime_error("WebSocket handshake failed");
+      }
+      return buf.substr(end + 4);
+    }
+  }
+}
+
+static void run_media_client(const Address & server_addr,
+                             const atomic<int> & phase,
+                             vector<Samples> & samples)
+{
+  TCPSocket tcp_sock;
+  tcp_sock.connect(server_addr);
+
+  SSLContext ssl_context;
+  SecureSocket sock = ssl_context.new_secure_socket(move(tcp_sock));
+  string buf = ws_connect(sock);
+
+  auto last_arrival = steady_clock::now();
+
+  while (phase != Done) {
+    /* frames from the server are not masked */
+    while (buf.size() >= WSFrame::expected_length(buf)) {
+      const WSFrame::Header header {buf};
+      const size_t length = WSFrame::expected_length(buf);
+
+      if (header.opcode() == WSFrame::OpCode::Binary) {
+        const auto now = steady_clock::now();
+        int64_t sent_ns;
+        buf.copy(reinterpret_cast<char *>(&sent_ns), sizeof(sent_ns),
+                 header.header_length());
+
+        Samples & s = samples.at(phase);
+        s.delays.emplace_back((now.time_since_epoch().count() - sent_ns) / 1e6);
+        s.max_gap = max(s.max_gap,
+          duration<double, milli>(now - last_arrival).count());
+        last_arrival = now;
+      }
+
+      buf.erase(0, length);
+    }
+
+    /* ACK right away, so that Nagle's algorithm on the server does not hold
+       back the end of a frame until a delayed ACK */
+    const int quickack = 1;
+    CheckSystemCall("setsockopt", setsockopt(sock.fd_num(), IPPROTO_TCP,
+      TCP_QUICKACK, &quickack, sizeof(quickack)));
+
+    const string data = sock.read();
+    if (data.empty()) {
+      throw runtime_error("server closed the connection");
+    }
+    buf += data;
+  }
+}
+
+static void run_storm_client(const Address & server_addr,
+                             atomic<int> & remaining)
+{
+  SSLContext ssl_context;
+
+  while (remaining.fetch_sub(1) > 0) {
+    TCPSocket tcp_sock;
+    tcp_sock.connect(server_addr);
+
+    /* a new session every time: a full handshake */
+    SecureSocket sock = ssl_context.new_secure_socket(move(tcp_sock));
+    ws_connect(sock);
+  }
+}
+
+static void print_samples(const string & label, vector<Samples> & samples)
+{
+  vector<double> delays;
+  double max_gap = 0;
+  for (const auto & s : samples) {
+    delays.insert(delays.end(), s.delays.begin(), s.delays.end());
+    max_gap = max(max_gap, s.max_gap);
+  }
+
+  if (delays.empty()) {
+    cout << label << ": no frames" << endl;
+    return;
+  }
+
+  sort(delays.begin(), delays.end());
+  cout << fixed << setprecision(1) << label << ": " << delays.size()
+       << " frames, delay p50 " << delays[delays.size() / 2]
+       << " ms, p99 " << delays[delays.size() * 99 / 100]
+       << " ms, max " << delays.back()
+       << " ms; longest gap " << max_gap << " ms" << endl;
+}
+
+static void run_clients(const Address & server_addr,
+                        const unsigned int num_clients,
+                        const unsigned int storm_size,
+                        const unsigned int concurrency)
+{
+  atomic<int> phase {Warmup};
+  vector<vector<Samples>> samples(num_clients, vector<Samples>(Done));
+  atomic<bool> failed {false};
+
+  vector<thread> media_clients;
+  for (unsigned int i = 0; i < num_clients; i++) {
+    media_clients.emplace_back([&, i]() {
+      try {
+        run_media_client(server_addr, phase, samples[i]);
+      } catch (const exception & e) {
+        print_exception("media client", e);
+        failed = true;
+      }
+    });
+  }
+
+  /* measure for as long before the storm */
+  this_thread::sleep_for(milliseconds(WARMUP_MS));
+  phase = Before;
+  this_thread::sleep_for(milliseconds(WARMUP_MS));
+
+  phase = Storm;
+  const auto storm_start = steady_clock::now();
+  atomic<int> remaining {static_cast<int>(storm_size)};
+
+  vector<thread> storm_clients;
+  for (unsigned int i = 0; i < concurrency; i++) {
+    storm_clients.emplace_back([&]() {
+      try {
+        run_storm_client(server_addr, remaining);
+      } catch (const exception & e) {
+        print_exception("storm client", e);
+        failed = true;
+      }
+    });
+  }
+
+  for (auto & t : storm_clients) {
+    t.join();
+  }
+
+  const duration<double> storm_time = steady_clock::now() - storm_start;
+  phase = Cooldown;
+  this_thread::sleep_for(milliseconds(COOLDOWN_MS));
+  phase = Done;
+
+  for (auto & t : media_clients) {
+    t.join();
+  }
+
+  if (failed) {
+    _exit(EXIT_FAILURE);
+  }
+
+  vector<Samples> before, storm;
+  for (auto & s : samples) {
+    before.emplace_back(move(s[Before]));
+    storm.emplace_back(move(s[Storm]));
+  }
+
+  cout << fixed << setprecision(1) << storm_size << " connections in "
+       << storm_time.count() << " s (" << setprecision(0)
+       << storm_size / storm_time.count() << " handshakes/s)" << endl;
+  print_samples("before the storm", before);
+  print_samples("during the storm", storm);
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  const option cmd_line_opts[] = {
+    {"threads",           required_argument, nullptr, 't'},
+    {"max-accepts-per-s", required_argument, nullptr, 'r'},
+    {"max-pending",       required_argument, nullptr, 'p'},
+    {"clients",           required_argument, nullptr, 'k'},
+    {"storm",             required_argument, nullptr, 'm'},
+    {"concurrency",       required_argument, nullptr, 'c'},
+    { nullptr,            0,                 nullptr,  0 },
+  };
+
+  unsigned int num_threads = 0, max_accepts_per_s = 0, max_pending = 0;
+  unsigned int num_clients = 10, storm_size = 500, concurrency = 8;
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "t:r:p:k:m:c:",
+                                cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 't':
+      num_threads = stoul(optarg);
+      break;
+    case 'r':
+      max_accepts_per_s = stoul(optarg);
+      break;
+    case 'p':
+      max_pending = stoul(optarg);
+      break;
+    case 'k':
+      num_clients = stoul(optarg);
+      break;
+    case 'm':
+      storm_size = stoul(optarg);
+      break;
+    case 'c':
+      concurrency = stoul(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 2 or num_clients == 0 or concurrency == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* find a free port for the server */
+  Address server_addr;
+  {
+    TCPSocket sock;
+    sock.bind({"127.0.0.1", 0});
+    server_addr = sock.local_address();
+  }
+
+  WebSocketSecureServer server {server_addr, "cubic"};
+  server.ssl_context().use_certificate_file(argv[optind]);
+  server.ssl_context().use_private_key_file(argv[optind + 1]);
+  server.set_accept_limits(max_accepts_per_s, max_pending);
+
+  /* fork before any threads are started */
+  const pid_t pid = CheckSystemCall("fork", fork());
+  if (pid == 0) {
+    try {
+      run_clients(server_addr, num_clients, storm_size, concurrency);
+    } catch (const exception & e) {
+      print_exception("ws_storm_benchmark client", e);
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  server.set_handshake_threads(num_threads);
+
+  /* the first clients to connect are the media clients */
+  set<uint64_t> media_clients;
+  unsigned int opened = 0;
+
+  server.set_message_callback([](const uint64_t, const WSMessage &) {});
+  server.set_open_callback(
+    [&](const uint64_t connection_id) {
+      if (opened++ < num_clients) {
+        media_clients.insert(connection_id);
+      }
+    });
+  server.set_close_callback(
+    [&](const uint64_t connection_id) {
+      media_clients.erase(connection_id);
+    });
+
+  Timerfd media_timer;
+  server.poller().add_action(Poller::Action(media_timer, Direction::In,
+    [&]()->Result {
+      media_timer.expirations();
+
+      for (const uint64_t connection_id : media_clients) {
+        if (server.buffer_bytes(connection_id) > MAX_CLIENT_BUFFER) {
+          continue;
+        }
+
+        string payload(MEDIA_FRAME_SIZE, 'V');
+        const int64_t now = steady_clock::now().time_since_epoch().count();
+        payload.replace(0, sizeof(now),
+                        reinterpret_cast<const char *>(&now), sizeof(now));
+
+        server.queue_frame(connection_id,
+          WSFrame {true, WSFrame::OpCode::Binary, move(payload)});
+      }
+
+      return ResultType::Continue;
+    }));
+  media_timer.start(MEDIA_INTERVAL_MS, MEDIA_INTERVAL_MS);
+
+  int status;
+  while (CheckSystemCall("waitpid", waitpid(pid, &status, WNOHANG)) == 0) {
+    server.loop_once();
+  }
+
+  if (not WIFEXITED(status) or WEXITSTATUS(status) != EXIT_SUCCESS) {
+    cerr << "Error: clients failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
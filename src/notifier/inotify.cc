@@ -63,8 +63,9 @@ void Inotify::rm_watch(const int wd)
 
 Result Inotify::handle_events()
 {
-  /* explicitly ensure the buffer is sufficient to read at least one event */
-  const int BUF_LEN = sizeof(inotify_event) + NAME_MAX + 1;
+  /* explicitly ensure the buffer is sufficient to read at least one event,
+   * and read a burst of events (e.g., a batch of moved-in chunks) at once */
+  const int BUF_LEN = 16 * (sizeof(inotify_event) + NAME_MAX + 1);
 
   /* read events */
   string event_buf = inotify_fd_.read(BUF_LEN);
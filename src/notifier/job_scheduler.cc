@@ -0,0 +1,51 @@
+#include <iostream>
+#include <string>
+
+#include "poller.hh"
+#include "job_scheduler.hh"
+#include "strict_conversions.hh"
+#include "exception.hh"
+
+using namespace std;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " <socket> <max_jobs> [--report <period_ms>]\n\n"
+  "Run the pipeline's job scheduler on its own, listening on <socket>\n"
+  "for notifiers started with --scheduler <socket> ...; at most <max_jobs>\n"
+  "jobs run at once. Queue latency is logged every <period_ms> (default\n"
+  "60000; 0 to disable)."
+  << endl;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  if (argc != 3 and not (argc == 5 and string(argv[3]) == "--report")) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    Poller poller;
+    JobScheduler scheduler(poller, argv[1], narrow_cast<unsigned int>(
+                                              stoul(argv[2])));
+    if (argc == 5) {
+      scheduler.set_report_period(stoull(argv[4]));
+    }
+
+    for (;;) {
+      auto ret = poller.poll(-1);
+      if (ret.result != Poller::Result::Type::Success) {
+        return ret.exit_status;
+      }
+    }
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+}
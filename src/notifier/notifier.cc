@@ -13,13 +13,16 @@ void print_usage(const string & prog)
 {
   cerr <<
   "Usage: " << prog << " <src_dir> <src_ext> [--check <dst_dir> <dst_ext>]\n"
-  "       [--tmp <tmp_dir>] --exec <program> [program args]\n\n"
+  "       [--tmp <tmp_dir>] [--scheduler ...] --exec <program> [program args]\n\n"
   "<src_dir>           source directory\n"
   "<src_ext>           extension of files in <src_dir> to watch\n"
   "[--check <dst_dir> <dst_ext>]\n"
   "                    make sure an output file with extension <dst_ext>\n"
   "                    appears in <dst_dir> eventually\n"
   "[--tmp <tmp_dir>]   temporary directory to use whenever it is needed\n"
+  "[--scheduler <socket> <channel> <stage> <priority>]\n"
+  "                    wait for the pipeline's job scheduler listening on\n"
+  "                    <socket> before running the program\n"
   "--exec <program>    program to run after a new file <src_filepath> is\n"
   "                    moved into <src_dir>. The program must take at least\n"
   "                    one argument: <src_filepath>, and must take a second\n"
@@ -40,7 +43,7 @@ Notifier::Notifier(const string & src_dir,
     check_mode_(false), dst_dir_(), dst_ext_(),
     tmp_dir_(), program_(program), prog_args_(prog_args),
     process_manager_(), inotify_(process_manager_.poller()),
-    prefixes_()
+    prefixes_(), scheduler_(), job_ids_()
 {
   /* check mode */
   if (dst_dir_opt and dst_ext_opt) {
@@ -96,7 +99,31 @@ inline string Notifier::get_tmp_path(const string & prefix)
   return fs::path(tmp_dir_) / (prefix + dst_ext_);
 }
 
+void Notifier::use_scheduler(const string & socket_path,
+                             const string & channel,
+                             const string & stage,
+                             const unsigned int priority)
+{
+  scheduler_ = make_unique<JobSchedulerClient>(
+      process_manager_.poller(), socket_path, channel, stage, priority);
+}
+
 void Notifier::run_as_child(const string & filename)
+{
+  if (not scheduler_) {
+    start_job(filename, "");
+    return;
+  }
+
+  /* queue the job; the scheduler orders jobs by chunk (filename stem) */
+  scheduler_->submit(fs::path(filename).stem(),
+    [this, filename](const string & job_id) {
+      start_job(filename, job_id);
+    }
+  );
+}
+
+void Notifier::start_job(const string & filename, const string & job_id)
 {
   string prefix = fs::path(filename).stem();
 
@@ -118,8 +145,9 @@ void Notifier::run_as_child(const string & filename)
   args.insert(args.end(), prog_args_.begin(), prog_args_.end());
 
   /* run program_ as a child */
+  pid_t pid;
   if (check_mode_) {
-    pid_t pid = process_manager_.run_as_child(program_, args,
+    pid = process_manager_.run_as_child(program_, args,
       [this](const pid_t & pid) {
         /* verify that the correct output has been written */
         assert(check_mode_);
@@ -130,13 +158,36 @@ void Notifier::run_as_child(const string & filename)
         fs::rename(get_tmp_path(prefix), get_dst_path(prefix));
 
         prefixes_.erase(pid);
+        job_done(pid);
       }
     );
 
     prefixes_.emplace(pid, prefix);
+  } else if (scheduler_) {
+    pid = process_manager_.run_as_child(program_, args,
+      [this](const pid_t & pid) {
+        job_done(pid);
+      }
+    );
   } else {
-    process_manager_.run_as_child(program_, args);
+    pid = process_manager_.run_as_child(program_, args);
+  }
+
+  if (scheduler_) {
+    job_ids_.emplace(pid, job_id);
+  }
+}
+
+void Notifier::job_done(const pid_t & pid)
+{
+  const auto it = job_ids_.find(pid);
+  if (it == job_ids_.end()) {
+    return;
   }
+
+  /* give the slot back to the scheduler */
+  scheduler_->done(it->second);
+  job_ids_.erase(it);
 }
 
 void Notifier::process_existing_files()
@@ -193,6 +244,7 @@ int main(int argc, char * argv[])
 
   optional<string> dst_dir_opt, dst_ext_opt;
   optional<string> tmp_dir_opt;
+  optional<vector<string>> scheduler_opt;
 
   for (;;) {
     if (arg_idx >= argc) {
@@ -208,6 +260,13 @@ int main(int argc, char * argv[])
       dst_ext_opt = argv[arg_idx++];
     } else if (opt_arg == "--tmp") {
       tmp_dir_opt = argv[arg_idx++];
+    } else if (opt_arg == "--scheduler") {
+      if (arg_idx + 4 > argc) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      scheduler_opt = vector<string>(argv + arg_idx, argv + arg_idx + 4);
+      arg_idx += 4;
     } else if (opt_arg == "--exec") {
       break;
     }
@@ -232,6 +291,12 @@ int main(int argc, char * argv[])
 
   Notifier notifier(src_dir, src_ext, dst_dir_opt, dst_ext_opt,
                     tmp_dir_opt, program, prog_args);
+
+  if (scheduler_opt) {
+    const auto & sched = *scheduler_opt;
+    notifier.use_scheduler(sched[0], sched[1], sched[2], stoul(sched[3]));
+  }
+
   notifier.process_existing_files();
   return notifier.loop();
 }
@@ -5,11 +5,13 @@
 #include <optional>
 #include <vector>
 #include <unordered_map>
+#include <memory>
 
 #include "signalfd.hh"
 #include "poller.hh"
 #include "inotify.hh"
 #include "child_process.hh"
+#include "job_scheduler.hh"
 
 class Notifier
 {
@@ -22,6 +24,12 @@ public:
            const std::string & program,
            const std::vector<std::string> & prog_args);
 
+  /* start jobs only when the pipeline's JobScheduler allows it */
+  void use_scheduler(const std::string & socket_path,
+                     const std::string & channel,
+                     const std::string & stage,
+                     const unsigned int priority);
+
   void process_existing_files();
 
   int loop();
@@ -41,12 +49,17 @@ private:
 
   std::unordered_map<pid_t, std::string> prefixes_;
 
+  std::unique_ptr<JobSchedulerClient> scheduler_;
+  std::unordered_map<pid_t, std::string> job_ids_;
+
   /* helper functions */
   inline std::string get_src_path(const std::string & prefix);
   inline std::string get_dst_path(const std::string & prefix);
   inline std::string get_tmp_path(const std::string & prefix);
 
-  void run_as_child(const std::string & prefix);
+  void run_as_child(const std::string & filename);
+  void start_job(const std::string & filename, const std::string & job_id);
+  void job_done(const pid_t & pid);
 };
 
 #endif /* NOTIFIER_HH */
@@ -1,245 +1,29 @@
 /* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
 
+#include <fcntl.h>
+#include <cstring>
 #include <memory>
 #include <iostream>
 #include <vector>
 #include <algorithm>
-#include <endian.h>
-
-#include <sndfile.hh>
-#include <opus/opus.h>
+#include <functional>
+#include <thread>
+#include <exception>
 
 extern "C" {
 #include <libavformat/avformat.h>
 }
 
 #include "media_formats.hh"
-
-const unsigned int SAMPLE_RATE = 48000; /* Hz */
-const unsigned int NUM_CHANNELS = 2;
-const unsigned int NUM_SAMPLES_IN_OPUS_FRAME = 960;
-const unsigned int EXPECTED_LOOKAHEAD = 312; /* 6.5 ms * 48 kHz */
-const unsigned int EXTRA_FRAMES_PREPENDED = 10;
-const unsigned int OVERLAP_SAMPLES_PREPENDED = (EXTRA_FRAMES_PREPENDED + 1) * NUM_SAMPLES_IN_OPUS_FRAME - EXPECTED_LOOKAHEAD;
-const unsigned int NUM_SAMPLES_IN_OUTPUT = 230400; /* 48kHz * 4.8s */
-const unsigned int NUM_SAMPLES_IN_INPUT = OVERLAP_SAMPLES_PREPENDED + NUM_SAMPLES_IN_OUTPUT;
-const unsigned int MAX_COMPRESSED_FRAME_SIZE = 131072; /* bytes */
-const unsigned int WEBM_TIMEBASE = 1000;
-const float VOLUME_FACTOR = 4.0; /* amplify the volume by 4x */
-
-/* make sure target file length is integer number of Opus frames */
-static_assert( (NUM_SAMPLES_IN_OUTPUT / NUM_SAMPLES_IN_OPUS_FRAME) * NUM_SAMPLES_IN_OPUS_FRAME
-               == NUM_SAMPLES_IN_OUTPUT );
-
-const unsigned int NUM_FRAMES_IN_OUTPUT = NUM_SAMPLES_IN_OUTPUT / NUM_SAMPLES_IN_OPUS_FRAME;
-
-/* make sure file is long enough */
-static_assert( NUM_SAMPLES_IN_OUTPUT > 4 * NUM_SAMPLES_IN_OPUS_FRAME );
-
-/* view of raw input, and storage for compressed output */
-using wav_frame_t = std::basic_string_view<int16_t>;
-using opus_frame_t = std::pair<size_t, std::array<uint8_t, MAX_COMPRESSED_FRAME_SIZE>>; // length, buffer
-
-/*
-
-Theory of operation.
-
-Starting with:
-
-   chunk #0: samples 0      .. 230399 (4.8 s)
-   chunk #1: samples 230400 .. 460799 (4.8 s)
-
-Then prepend 648 samples of the previous chunk to each chunk:
-
-   chunk #0: 648 silent       + 0      .. 230399 (4.8135 s)
-   chunk #1: 229752 .. 230399 + 230400 .. 460799 (4.8135 s)
-
-Now encode as Opus with first two frames independent:
-
- chunk #0:
-   frame 0 (independent): 312 of ignore, then 648 silent                     (chop!)
-   frame 1 (independent):                0      .. 959
-   frame 2              :                960    .. 1919
-   frame 3              :                1920   .. 2879
-   ...
-   frame 240            :                229400 .. 230399
-
- chunk #1:
-   frame 0 (independent): 312 of ignore, then 229752 .. 230399                     (chop!)
-   frame 1 (independent):                230400 .. 231359
-   frame 2              :                231360 .. 232319
-   frame 3              :                232320 .. 233279
-   ...
-   frame 240            :                459840 .. 460799
-
-Chopping produces:
-
- chunk #0:
-   frame 1 (independent):                0      .. 959
-   frame 2              :                960    .. 1919
-   frame 3              :                1920   .. 2879
-   ...
-   frame 240            :                229400 .. 230399
-
- chunk #1:
-   frame 1 (independent):                230400 .. 231359
-   frame 2              :                231360 .. 232319
-   frame 3              :                232320 .. 233279
-   ...
-   frame 240            :                459840 .. 460799
-
-So, for gapless playback, we prepend 648 samples from the previous chunk, then encode
-the first two frames as independent (no prediction), and chop the
-first of them. In practice we use 10 extra overlapping frames because this seems
-to make all the audible glitches go away.
-
-*/
+#include "filesystem.hh"
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "strict_conversions.hh"
+#include "webm_writer.hh"
+#include "opus_wrapper.hh"
 
 using namespace std;
 
-template <typename T>
-inline T * notnull( const string & context, T * const x )
-{
-  return x ? x : throw runtime_error( context + ": returned null pointer" );
-}
-
-/* wrap Opus encoder in RAII class with error cherk */
-class OpusEncoderWrapper
-{
-  struct opus_deleter { void operator()( OpusEncoder * x ) const { opus_encoder_destroy( x ); } };
-  unique_ptr<OpusEncoder, opus_deleter> encoder_ {};
-
-  static int opus_check( const int retval )
-  {
-    if ( retval < 0 ) {
-      throw runtime_error( "Opus error: " + string( opus_strerror( retval ) ) );      
-    }
-
-    return retval;
-  }
-
-public:
-  OpusEncoderWrapper( const int bit_rate )
-  {
-    int out;
-
-    /* create encoder */
-    encoder_.reset( notnull( "opus_encoder_create",
-                             opus_encoder_create( SAMPLE_RATE, NUM_CHANNELS, OPUS_APPLICATION_AUDIO, &out ) ) );
-    opus_check( out );
-
-    /* set bit rate */
-    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_SET_BITRATE( bit_rate ) ) );
-
-    /* check bitrate */
-    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_GET_BITRATE( &out ) ) );
-    if ( out != bit_rate ) { throw runtime_error( "bit rate mismatch" ); }
-
-    /* check sample rate */
-    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_GET_SAMPLE_RATE( &out ) ) );
-    if ( out != SAMPLE_RATE ) { throw runtime_error( "sample rate mismatch" ); }
-
-    /* check lookahead */
-    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_GET_LOOKAHEAD( &out ) ) );
-    if ( out != EXPECTED_LOOKAHEAD ) { throw runtime_error( "lookahead mismatch" ); }
-  }
-
-  void disable_prediction()
-  {
-    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_SET_PREDICTION_DISABLED( 1 ) ) );
-  }
-
-  void enable_prediction()
-  {
-    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_SET_PREDICTION_DISABLED( 0 ) ) );
-  }
-
-  void encode( const wav_frame_t & wav_frame, opus_frame_t & opus_frame )
-  {
-    if ( wav_frame.size() != NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME ) {
-      throw runtime_error( "wav_frame is not 20 ms long" );
-    }
-
-    /* make a copy of wav_frame data to adjust the volume */
-    std::vector<int16_t> adjusted_wav_frame( wav_frame.begin(), wav_frame.end() );
-    for ( size_t i = 0; i < adjusted_wav_frame.size(); i++ ) {
-      int32_t sample = static_cast<int32_t>( adjusted_wav_frame[i] * VOLUME_FACTOR );
-      sample = clamp( sample, INT16_MIN, INT16_MAX );
-      adjusted_wav_frame[i] = sample;
-    }
-
-    opus_frame.first = opus_check( opus_encode( encoder_.get(),
-                                                adjusted_wav_frame.data(),
-                                                NUM_SAMPLES_IN_OPUS_FRAME,
-                                                opus_frame.second.data(),
-                                                opus_frame.second.size() ) );
-  }
-};
-
-/* wrap WAV file with error/validity checks */
-class WavWrapper
-{
-  SndfileHandle handle_;
-  vector<int16_t> samples_;
-
-public:
-  WavWrapper( const string & filename )
-    : handle_( filename ),
-      samples_( NUM_CHANNELS * ( NUM_SAMPLES_IN_INPUT + EXPECTED_LOOKAHEAD ) )
-  {
-    if ( handle_.error() ) {
-      throw runtime_error( filename + ": " + handle_.strError() );
-    }
-
-    if ( handle_.format() != (SF_FORMAT_WAV | SF_FORMAT_PCM_16) ) {
-      throw runtime_error( filename + ": not a 16-bit PCM WAV file" );
-    }
-
-    if ( handle_.samplerate() != SAMPLE_RATE ) {
-      throw runtime_error( filename + " sample rate is " + to_string( handle_.samplerate() ) + ", not " + to_string( SAMPLE_RATE ) );
-    }
-
-    if ( handle_.channels() != NUM_CHANNELS ) {
-      throw runtime_error( filename + " channel # is " + to_string( handle_.channels() ) + ", not " + to_string( NUM_CHANNELS ) );
-    }
-
-    if ( handle_.frames() != NUM_SAMPLES_IN_INPUT ) {
-      throw runtime_error( filename + " length is " + to_string( handle_.frames() ) + ", not " + to_string( NUM_SAMPLES_IN_INPUT ) + " samples" );
-    }
-
-    /* read file into memory */
-    const auto retval = handle_.read( samples_.data(), NUM_CHANNELS * NUM_SAMPLES_IN_INPUT );
-    if ( retval != NUM_CHANNELS * NUM_SAMPLES_IN_INPUT ) {
-      throw runtime_error( "unexpected read of " + to_string( retval ) + " samples" );
-    }
-
-    /* verify EOF */
-    int16_t dummy;
-    if ( 0 != handle_.read( &dummy, 1 ) ) {
-      throw runtime_error( "unexpected extra data in WAV file" );
-    }
-  }
-
-  wav_frame_t view( const size_t offset )
-  {
-    if ( offset > samples_.size() ) {
-      throw out_of_range( "offset > samples_.size()" );
-    }
-
-    const size_t member_length = NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME;
-
-    if ( offset + member_length > samples_.size() ) {
-      throw out_of_range( "offset + len > samples_.size()" );
-    }
-
-    /* second bounds check */
-    int16_t first_sample __attribute((unused)) = samples_.at( offset );
-    int16_t last_sample __attribute((unused)) = samples_.at( offset + member_length - 1 );
-
-    return { samples_.data() + offset, member_length };
-  }
-};
-
 class AVFormatWrapper
 {
   struct av_deleter { void operator()( AVFormatContext * x ) const { avformat_free_context( x ); } };
@@ -305,25 +89,11 @@ public:
     audio_stream_->codecpar->initial_padding = 0;
     audio_stream_->codecpar->trailing_padding = 0;
 
-    /* write OpusHead structure as private data -- required by https://wiki.xiph.org/MatroskaOpus,
-       the unofficial Opus-in-WebM spec, and enforced by libnestegg (used by Firefox) */
-
-    struct __attribute__ ((packed)) OpusHead
-    {
-      array<char, 8> signature = { 'O', 'p', 'u', 's', 'H', 'e', 'a', 'd' };
-      uint8_t version = 1;
-      uint8_t channels = NUM_CHANNELS;
-      uint16_t pre_skip = htole16( 0 );
-      uint32_t input_sample_rate = htole32( SAMPLE_RATE );
-      uint16_t output_gain = htole16( 0 );
-      uint8_t channel_mapping_family = 0;
-    } opus_head;
-
-    static_assert( sizeof( opus_head ) == 19 );
-
-    audio_stream_->codecpar->extradata = reinterpret_cast<uint8_t *>( notnull( "av_malloc", av_malloc( 19 + AV_INPUT_BUFFER_PADDING_SIZE ) ) );
-    audio_stream_->codecpar->extradata_size = 19;
-    memcpy( audio_stream_->codecpar->extradata, &opus_head, sizeof( OpusHead ) );
+    /* write OpusHead structure as private data */
+    const string head = opus_head();
+    audio_stream_->codecpar->extradata = reinterpret_cast<uint8_t *>( notnull( "av_malloc", av_malloc( head.size() + AV_INPUT_BUFFER_PADDING_SIZE ) ) );
+    audio_stream_->codecpar->extradata_size = head.size();
+    memcpy( audio_stream_->codecpar->extradata, head.data(), head.size() );
 
     /* now write the header */
     av_check( avformat_write_header( context_.get(), nullptr ) );
@@ -371,9 +141,21 @@ public:
   AVFormatWrapper & operator=( const AVFormatWrapper & other ) = delete;
 };
 
+int parse_bit_rate( const string & str )
+{
+  const AudioFormat audio_format { str };
+
+  if ( audio_format.bitrate <= 0 or audio_format.bitrate > 256 ) {
+    throw runtime_error( "invalid bit rate: " + str );
+  }
+
+  return audio_format.bitrate * 1000; /* bits per second */
+}
+
 void opus_encode( int argc, char *argv[] ) {
   if ( argc != 5 ) {
-    throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " WAV_INPUT WEBM_OUTPUT -b BIT_RATE [e.g., \"64k\"]" );
+    throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " WAV_INPUT WEBM_OUTPUT -b BIT_RATE [e.g., \"64k\"]\n"
+                         "   or: " + string( argv[ 0 ] ) + " WAV_INPUT --tmp TMP_DIR -b BIT_RATE READY_DIR [-b BIT_RATE READY_DIR]..." );
   }
 
   /* parse arguments */
@@ -385,16 +167,11 @@ void opus_encode( int argc, char *argv[] ) {
     throw runtime_error( "-b argument is mandatory" );
   }
 
-  const AudioFormat audio_format { argv[ 4 ] };
-
-  if ( audio_format.bitrate <= 0 or audio_format.bitrate > 256 ) {
-    throw runtime_error( "invalid bit rate: " + string( argv[ 4 ] ) );
-  }
-
-  const int bit_rate = audio_format.bitrate * 1000; /* bits per second */
+  const int bit_rate = parse_bit_rate( argv[ 4 ] );
 
   /* open input WAV file */
   WavWrapper wav_file { input_filename };
+  wav_file.amplify();
 
   /* create Opus encoder */
   OpusEncoderWrapper encoder { bit_rate };
@@ -405,24 +182,118 @@ void opus_encode( int argc, char *argv[] ) {
   /* create .webm output */
   AVFormatWrapper output { output_filename, bit_rate };
 
-  /* encode the whole file, outputting every frame except the first,
-     and with prediction disabled until frame #2 */
+  encode_chunk( wav_file, encoder, opus_frame,
+                [&output]( opus_frame_t & frame, const unsigned int starting_sample_number ) {
+                  output.write( frame, starting_sample_number );
+                } );
+}
+
+/* write data to tmp_path, then move it into place */
+void write_and_rename( const fs::path & tmp_path, const fs::path & dst_path,
+                       const function<void( FileDescriptor & )> & write )
+{
+  {
+    FileDescriptor fd { CheckSystemCall( "open (" + tmp_path.string() + ")",
+                                         open( tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) };
+    write( fd );
+  }
+
+  fs::rename( tmp_path, dst_path );
+}
+
+/* encode one bit rate straight into <READY_DIR>/<num>.chk, and init.webm if missing */
+void encode_fragment( const WavWrapper & wav_file,
+                      const string & chunk_name,
+                      const uint64_t timecode,
+                      const int bit_rate,
+                      const fs::path & tmp_dir,
+                      const fs::path & ready_dir )
+{
+  OpusEncoderWrapper encoder { bit_rate };
+  auto opus_frame = make_unique<opus_frame_t>();
+
+  WebmCluster cluster { timecode };
+
+  encode_chunk( wav_file, encoder, *opus_frame,
+                [&cluster]( opus_frame_t & frame, const unsigned int starting_sample_number ) {
+                  cluster.add_simple_block( narrow_cast<int16_t>( WEBM_TIMEBASE * starting_sample_number / SAMPLE_RATE ),
+                                            { reinterpret_cast<const char *>( frame.second.data() ), frame.first } );
+                } );
+
+  const string tmp_prefix = chunk_name + "-" + to_string( bit_rate );
+
+  const fs::path init_path = ready_dir / "init.webm";
+  if ( not fs::exists( init_path ) ) {
+    const string init = opus_init_segment( SAMPLE_RATE, NUM_CHANNELS, opus_head(),
+                                           WEBM_TIMEBASE * NUM_SAMPLES_IN_OUTPUT / SAMPLE_RATE );
+    write_and_rename( tmp_dir / ( tmp_prefix + "-init.webm" ), init_path,
+                      [&init]( FileDescriptor & fd ) { fd.write( init ); } );
+  }
+
+  write_and_rename( tmp_dir / ( tmp_prefix + ".chk" ), ready_dir / ( chunk_name + ".chk" ),
+                    [&cluster]( FileDescriptor & fd ) { cluster.write( fd ); } );
+}
+
+/* read the WAV once, and encode it at every bit rate in parallel */
+void opus_fragment( int argc, char *argv[] )
+{
+  if ( argc < 6 or ( argc - 4 ) % 3 != 0 ) {
+    throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " WAV_INPUT --tmp TMP_DIR -b BIT_RATE READY_DIR [-b BIT_RATE READY_DIR]..." );
+  }
 
-  encoder.disable_prediction();
+  const fs::path input_filename = argv[ 1 ];
+  const fs::path tmp_dir = argv[ 3 ];
 
-  for ( unsigned int frame_no = 0; frame_no < NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED; frame_no++ ) {
-    if ( frame_no == EXTRA_FRAMES_PREPENDED ) {
-      encoder.enable_prediction();
+  const string chunk_name = input_filename.stem();
+
+  /* on restart the notifier runs us on every WAV still in its directory;
+     skip the bit rates whose fragment is already in place */
+  vector<pair<int, fs::path>> outputs;
+  for ( int i = 4; i < argc; i += 3 ) {
+    if ( string( argv[ i ] ) != "-b" ) {
+      throw runtime_error( "expected -b BIT_RATE READY_DIR" );
     }
 
-    if ( frame_no == NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED - 1 ) {
-      encoder.disable_prediction();
+    const int bit_rate = parse_bit_rate( argv[ i + 1 ] );
+    const fs::path ready_dir = argv[ i + 2 ];
+
+    if ( not fs::exists( ready_dir / ( chunk_name + ".chk" ) ) ) {
+      outputs.emplace_back( bit_rate, ready_dir );
     }
+  }
+
+  if ( outputs.empty() ) {
+    return;
+  }
+
+  /* the chunk's timestamp (in global timescale) is its name; WebM timecodes are in ms */
+  const double seconds = static_cast<double>( stoull( chunk_name ) ) / GLOBAL_TIMESCALE;
+  const uint64_t timecode = narrow_round<uint64_t>( seconds * WEBM_TIMEBASE );
+
+  WavWrapper wav_file { input_filename };
+  wav_file.amplify();
+
+  vector<thread> encoders;
+  vector<exception_ptr> errors( outputs.size() );
+
+  for ( size_t i = 0; i < outputs.size(); i++ ) {
+    encoders.emplace_back( [&, i] {
+      try {
+        encode_fragment( wav_file, chunk_name, timecode,
+                         outputs[ i ].first, tmp_dir, outputs[ i ].second );
+      } catch ( ... ) {
+        errors[ i ] = current_exception();
+      }
+    } );
+  }
 
-    encoder.encode( wav_file.view( frame_no * NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME ), opus_frame );
+  for ( auto & encoder : encoders ) {
+    encoder.join();
+  }
 
-    if ( frame_no >= EXTRA_FRAMES_PREPENDED ) {
-      output.write( opus_frame, (frame_no - EXTRA_FRAMES_PREPENDED) * NUM_SAMPLES_IN_OPUS_FRAME );
+  for ( const auto & error : errors ) {
+    if ( error ) {
+      rethrow_exception( error );
     }
   }
 }
@@ -434,7 +305,11 @@ int main( int argc, char *argv[] )
   }
 
   try {
-    opus_encode( argc, argv );
+    if ( argc > 2 and string( argv[ 2 ] ) == "--tmp" ) {
+      opus_fragment( argc, argv );
+    } else {
+      opus_encode( argc, argv );
+    }
   } catch ( const exception & e ) {
     cerr << argv[ 0 ] << ": " << e.what() << "\n";
     return EXIT_FAILURE;
@@ -0,0 +1,135 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "opus_wrapper.hh"
+#include "media_formats.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+/* what the volume adjustment did before it was vectorized */
+static void reference_gain( const int16_t * in, int16_t * out, const size_t count, const float gain )
+{
+  for ( size_t i = 0; i < count; i++ ) {
+    const int32_t scaled = static_cast<int32_t>( in[ i ] * gain );
+    out[ i ] = clamp( scaled, INT16_MIN, INT16_MAX );
+  }
+}
+
+static double ms_since( const steady_clock::time_point start )
+{
+  return duration<double, milli>( steady_clock::now() - start ).count();
+}
+
+/* time the gain kernel against the scalar loop on a chunk of random samples */
+static void benchmark_gain( const unsigned int loops )
+{
+  const size_t count = NUM_CHANNELS * ( NUM_SAMPLES_IN_INPUT + EXPECTED_LOOKAHEAD );
+
+  vector<int16_t> input( count ), expected( count ), output( count );
+  mt19937 prng { 0 };
+  uniform_int_distribution<int> sample { INT16_MIN, INT16_MAX };
+  generate( input.begin(), input.end(), [&] { return sample( prng ); } );
+
+  double reference_ms = 0, kernel_ms = 0;
+
+  for ( unsigned int i = 0; i < loops; i++ ) {
+    auto start = steady_clock::now();
+    reference_gain( input.data(), expected.data(), count, VOLUME_FACTOR );
+    reference_ms += ms_since( start );
+
+    start = steady_clock::now();
+    pcm_apply_gain( input.data(), output.data(), count, VOLUME_FACTOR );
+    kernel_ms += ms_since( start );
+
+    if ( output != expected ) {
+      throw runtime_error( "pcm_apply_gain does not match the scalar reference" );
+    }
+  }
+
+  cout << fixed << setprecision( 3 )
+       << "gain per chunk: scalar " << reference_ms / loops << " ms, kernel "
+       << kernel_ms / loops << " ms\n";
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc <= 0 ) {
+    abort();
+  }
+
+  if ( argc < 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " WAV_INPUT [-n LOOPS] [BIT_RATE]... (default: 64k)\n";
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const string input_filename = argv[ 1 ];
+    unsigned int loops = 10;
+    vector<string> bit_rates;
+
+    for ( int i = 2; i < argc; i++ ) {
+      if ( string( argv[ i ] ) == "-n" and i + 1 < argc ) {
+        loops = stoul( argv[ ++i ] );
+      } else {
+        bit_rates.emplace_back( argv[ i ] );
+      }
+    }
+
+    if ( bit_rates.empty() ) {
+      bit_rates.emplace_back( "64k" );
+    }
+
+    if ( loops == 0 ) {
+      throw runtime_error( "LOOPS must be positive" );
+    }
+
+    benchmark_gain( loops );
+
+    /* per-chunk time, split into preprocessing and Opus */
+    double read_ms = 0, gain_ms = 0;
+    vector<double> opus_ms( bit_rates.size() );
+    vector<size_t> opus_bytes( bit_rates.size() );
+    opus_frame_t opus_frame;
+
+    for ( unsigned int i = 0; i < loops; i++ ) {
+      auto start = steady_clock::now();
+      WavWrapper wav_file { input_filename };
+      read_ms += ms_since( start );
+
+      start = steady_clock::now();
+      wav_file.amplify();
+      gain_ms += ms_since( start );
+
+      for ( size_t j = 0; j < bit_rates.size(); j++ ) {
+        start = steady_clock::now();
+        OpusEncoderWrapper encoder { AudioFormat( bit_rates[ j ] ).bitrate * 1000 };
+        encode_chunk( wav_file, encoder, opus_frame,
+                      [&]( opus_frame_t & frame, const unsigned int ) {
+                        opus_bytes[ j ] += frame.first;
+                      } );
+        opus_ms[ j ] += ms_since( start );
+      }
+    }
+
+    cout << "preprocessing per chunk: read " << read_ms / loops << " ms, gain "
+         << gain_ms / loops << " ms\n";
+
+    for ( size_t j = 0; j < bit_rates.size(); j++ ) {
+      cout << "opus " << bit_rates[ j ] << " per chunk: " << opus_ms[ j ] / loops
+           << " ms (" << opus_bytes[ j ] / loops << " bytes)\n";
+    }
+  } catch ( const exception & e ) {
+    cerr << argv[ 0 ] << ": " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <endian.h>
+
+#include "opus_wrapper.hh"
+
+using namespace std;
+
+/* OpusHead structure, the codec private data -- required by https://wiki.xiph.org/MatroskaOpus,
+   the unofficial Opus-in-WebM spec, and enforced by libnestegg (used by Firefox) */
+string opus_head()
+{
+  struct __attribute__ ((packed)) OpusHead
+  {
+    array<char, 8> signature = { 'O', 'p', 'u', 's', 'H', 'e', 'a', 'd' };
+    uint8_t version = 1;
+    uint8_t channels = NUM_CHANNELS;
+    uint16_t pre_skip = htole16( 0 );
+    uint32_t input_sample_rate = htole32( SAMPLE_RATE );
+    uint16_t output_gain = htole16( 0 );
+    uint8_t channel_mapping_family = 0;
+  } opus_head;
+
+  static_assert( sizeof( opus_head ) == 19 );
+
+  return string( reinterpret_cast<const char *>( &opus_head ), sizeof( opus_head ) );
+}
+
+/* encode the whole file, outputting every frame except the first,
+   and with prediction disabled until frame #2 */
+void encode_chunk( const WavWrapper & wav_file,
+                   OpusEncoderWrapper & encoder,
+                   opus_frame_t & opus_frame,
+                   const function<void( opus_frame_t & opus_frame,
+                                        const unsigned int starting_sample_number )> & output )
+{
+  encoder.disable_prediction();
+
+  for ( unsigned int frame_no = 0; frame_no < NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED; frame_no++ ) {
+    if ( frame_no == EXTRA_FRAMES_PREPENDED ) {
+      encoder.enable_prediction();
+    }
+
+    if ( frame_no == NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED - 1 ) {
+      encoder.disable_prediction();
+    }
+
+    encoder.encode( wav_file.view( frame_no * NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME ), opus_frame );
+
+    if ( frame_no >= EXTRA_FRAMES_PREPENDED ) {
+      output( opus_frame, (frame_no - EXTRA_FRAMES_PREPENDED) * NUM_SAMPLES_IN_OPUS_FRAME );
+    }
+  }
+}
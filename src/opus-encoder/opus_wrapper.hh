@@ -0,0 +1,252 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef OPUS_WRAPPER_HH
+#define OPUS_WRAPPER_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+
+#include <sndfile.hh>
+#include <opus/opus.h>
+
+#include "pcm.hh"
+
+const unsigned int SAMPLE_RATE = 48000; /* Hz */
+const unsigned int NUM_CHANNELS = 2;
+const unsigned int NUM_SAMPLES_IN_OPUS_FRAME = 960;
+const unsigned int EXPECTED_LOOKAHEAD = 312; /* 6.5 ms * 48 kHz */
+const unsigned int EXTRA_FRAMES_PREPENDED = 10;
+const unsigned int OVERLAP_SAMPLES_PREPENDED = (EXTRA_FRAMES_PREPENDED + 1) * NUM_SAMPLES_IN_OPUS_FRAME - EXPECTED_LOOKAHEAD;
+const unsigned int NUM_SAMPLES_IN_OUTPUT = 230400; /* 48kHz * 4.8s */
+const unsigned int NUM_SAMPLES_IN_INPUT = OVERLAP_SAMPLES_PREPENDED + NUM_SAMPLES_IN_OUTPUT;
+const unsigned int MAX_COMPRESSED_FRAME_SIZE = 131072; /* bytes */
+const unsigned int WEBM_TIMEBASE = 1000;
+const float VOLUME_FACTOR = 4.0; /* amplify the volume by 4x */
+const unsigned int GLOBAL_TIMESCALE = 90000; /* of the chunk filenames */
+
+/* make sure target file length is integer number of Opus frames */
+static_assert( (NUM_SAMPLES_IN_OUTPUT / NUM_SAMPLES_IN_OPUS_FRAME) * NUM_SAMPLES_IN_OPUS_FRAME
+               == NUM_SAMPLES_IN_OUTPUT );
+
+const unsigned int NUM_FRAMES_IN_OUTPUT = NUM_SAMPLES_IN_OUTPUT / NUM_SAMPLES_IN_OPUS_FRAME;
+
+/* make sure file is long enough */
+static_assert( NUM_SAMPLES_IN_OUTPUT > 4 * NUM_SAMPLES_IN_OPUS_FRAME );
+
+/* view of raw input, and storage for compressed output */
+using wav_frame_t = std::basic_string_view<int16_t>;
+using opus_frame_t = std::pair<size_t, std::array<uint8_t, MAX_COMPRESSED_FRAME_SIZE>>; // length, buffer
+
+/*
+
+Theory of operation.
+
+Starting with:
+
+   chunk #0: samples 0      .. 230399 (4.8 s)
+   chunk #1: samples 230400 .. 460799 (4.8 s)
+
+Then prepend 648 samples of the previous chunk to each chunk:
+
+   chunk #0: 648 silent       + 0      .. 230399 (4.8135 s)
+   chunk #1: 229752 .. 230399 + 230400 .. 460799 (4.8135 s)
+
+Now encode as Opus with first two frames independent:
+
+ chunk #0:
+   frame 0 (independent): 312 of ignore, then 648 silent                     (chop!)
+   frame 1 (independent):                0      .. 959
+   frame 2              :                960    .. 1919
+   frame 3              :                1920   .. 2879
+   ...
+   frame 240            :                229400 .. 230399
+
+ chunk #1:
+   frame 0 (independent): 312 of ignore, then 229752 .. 230399                     (chop!)
+   frame 1 (independent):                230400 .. 231359
+   frame 2              :                231360 .. 232319
+   frame 3              :                232320 .. 233279
+   ...
+   frame 240            :                459840 .. 460799
+
+Chopping produces:
+
+ chunk #0:
+   frame 1 (independent):                0      .. 959
+   frame 2              :                960    .. 1919
+   frame 3              :                1920   .. 2879
+   ...
+   frame 240            :                229400 .. 230399
+
+ chunk #1:
+   frame 1 (independent):                230400 .. 231359
+   frame 2              :                231360 .. 232319
+   frame 3              :                232320 .. 233279
+   ...
+   frame 240            :                459840 .. 460799
+
+So, for gapless playback, we prepend 648 samples from the previous chunk, then encode
+the first two frames as independent (no prediction), and chop the
+first of them. In practice we use 10 extra overlapping frames because this seems
+to make all the audible glitches go away.
+
+*/
+
+template <typename T>
+inline T * notnull( const std::string & context, T * const x )
+{
+  return x ? x : throw std::runtime_error( context + ": returned null pointer" );
+}
+
+/* wrap Opus encoder in RAII class with error cherk */
+class OpusEncoderWrapper
+{
+  struct opus_deleter { void operator()( OpusEncoder * x ) const { opus_encoder_destroy( x ); } };
+  std::unique_ptr<OpusEncoder, opus_deleter> encoder_ {};
+
+  static int opus_check( const int retval )
+  {
+    if ( retval < 0 ) {
+      throw std::runtime_error( "Opus error: " + std::string( opus_strerror( retval ) ) );      
+    }
+
+    return retval;
+  }
+
+public:
+  OpusEncoderWrapper( const int bit_rate )
+  {
+    int out;
+
+    /* create encoder */
+    encoder_.reset( notnull( "opus_encoder_create",
+                             opus_encoder_create( SAMPLE_RATE, NUM_CHANNELS, OPUS_APPLICATION_AUDIO, &out ) ) );
+    opus_check( out );
+
+    /* set bit rate */
+    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_SET_BITRATE( bit_rate ) ) );
+
+    /* check bitrate */
+    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_GET_BITRATE( &out ) ) );
+    if ( out != bit_rate ) { throw std::runtime_error( "bit rate mismatch" ); }
+
+    /* check sample rate */
+    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_GET_SAMPLE_RATE( &out ) ) );
+    if ( out != SAMPLE_RATE ) { throw std::runtime_error( "sample rate mismatch" ); }
+
+    /* check lookahead */
+    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_GET_LOOKAHEAD( &out ) ) );
+    if ( out != EXPECTED_LOOKAHEAD ) { throw std::runtime_error( "lookahead mismatch" ); }
+  }
+
+  void disable_prediction()
+  {
+    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_SET_PREDICTION_DISABLED( 1 ) ) );
+  }
+
+  void enable_prediction()
+  {
+    opus_check( opus_encoder_ctl( encoder_.get(), OPUS_SET_PREDICTION_DISABLED( 0 ) ) );
+  }
+
+  void encode( const wav_frame_t & wav_frame, opus_frame_t & opus_frame )
+  {
+    if ( wav_frame.size() != NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME ) {
+      throw std::runtime_error( "wav_frame is not 20 ms long" );
+    }
+
+    opus_frame.first = opus_check( opus_encode( encoder_.get(),
+                                                wav_frame.data(),
+                                                NUM_SAMPLES_IN_OPUS_FRAME,
+                                                opus_frame.second.data(),
+                                                opus_frame.second.size() ) );
+  }
+};
+
+/* wrap WAV file with error/validity checks */
+class WavWrapper
+{
+  SndfileHandle handle_;
+  std::vector<int16_t> samples_;
+
+public:
+  WavWrapper( const std::string & filename )
+    : handle_( filename ),
+      samples_( NUM_CHANNELS * ( NUM_SAMPLES_IN_INPUT + EXPECTED_LOOKAHEAD ) )
+  {
+    if ( handle_.error() ) {
+      throw std::runtime_error( filename + ": " + handle_.strError() );
+    }
+
+    if ( handle_.format() != (SF_FORMAT_WAV | SF_FORMAT_PCM_16) ) {
+      throw std::runtime_error( filename + ": not a 16-bit PCM WAV file" );
+    }
+
+    if ( handle_.samplerate() != SAMPLE_RATE ) {
+      throw std::runtime_error( filename + " sample rate is " + std::to_string( handle_.samplerate() ) + ", not " + std::to_string( SAMPLE_RATE ) );
+    }
+
+    if ( handle_.channels() != NUM_CHANNELS ) {
+      throw std::runtime_error( filename + " channel # is " + std::to_string( handle_.channels() ) + ", not " + std::to_string( NUM_CHANNELS ) );
+    }
+
+    if ( handle_.frames() != NUM_SAMPLES_IN_INPUT ) {
+      throw std::runtime_error( filename + " length is " + std::to_string( handle_.frames() ) + ", not " + std::to_string( NUM_SAMPLES_IN_INPUT ) + " samples" );
+    }
+
+    /* read file into memory */
+    const auto retval = handle_.read( samples_.data(), NUM_CHANNELS * NUM_SAMPLES_IN_INPUT );
+    if ( retval != NUM_CHANNELS * NUM_SAMPLES_IN_INPUT ) {
+      throw std::runtime_error( "unexpected read of " + std::to_string( retval ) + " samples" );
+    }
+
+    /* verify EOF */
+    int16_t dummy;
+    if ( 0 != handle_.read( &dummy, 1 ) ) {
+      throw std::runtime_error( "unexpected extra data in WAV file" );
+    }
+  }
+
+  /* adjust the volume once, for every encoder */
+  void amplify()
+  {
+    pcm_apply_gain( samples_.data(), samples_.data(), samples_.size(), VOLUME_FACTOR );
+  }
+
+  wav_frame_t view( const size_t offset ) const
+  {
+    if ( offset > samples_.size() ) {
+      throw std::out_of_range( "offset > samples_.size()" );
+    }
+
+    const size_t member_length = NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME;
+
+    if ( offset + member_length > samples_.size() ) {
+      throw std::out_of_range( "offset + len > samples_.size()" );
+    }
+
+    /* second bounds check */
+    int16_t first_sample __attribute((unused)) = samples_.at( offset );
+    int16_t last_sample __attribute((unused)) = samples_.at( offset + member_length - 1 );
+
+    return { samples_.data() + offset, member_length };
+  }
+};
+
+/* OpusHead structure, the codec private data */
+std::string opus_head();
+
+/* encode a chunk, calling output() with every frame that belongs in it */
+void encode_chunk( const WavWrapper & wav_file,
+                   OpusEncoderWrapper & encoder,
+                   opus_frame_t & opus_frame,
+                   const std::function<void( opus_frame_t & opus_frame,
+                                             const unsigned int starting_sample_number )> & output );
+
+#endif /* OPUS_WRAPPER_HH */
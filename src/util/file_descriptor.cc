@@ -7,6 +7,8 @@
 #include <fcntl.h>
 #include <cassert>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <climits>
 
 using namespace std;
 
@@ -107,6 +109,23 @@ string FileDescriptor::read( const size_t limit )
   return string( buffer, bytes_read );
 }
 
+/* read into caller-provided storage without an intermediate copy */
+size_t FileDescriptor::read_into( char * buffer, const size_t limit )
+{
+  if ( limit == 0 ) {
+    throw runtime_error( "read_into: no space to read into" );
+  }
+
+  ssize_t bytes_read = CheckSystemCall( "read", ::read( fd_, buffer, limit ) );
+  if ( bytes_read == 0 ) {
+    set_eof();
+  }
+
+  register_read();
+
+  return bytes_read;
+}
+
 /* write method */
 string_view::const_iterator FileDescriptor::write( const string_view buffer )
 {
@@ -125,6 +144,35 @@ string_view::const_iterator FileDescriptor::write( const string_view buffer )
   return it;
 }
 
+void FileDescriptor::writev( const vector<string_view> & buffers )
+{
+  vector<iovec> iovecs;
+  iovecs.reserve( buffers.size() );
+  for ( const auto & buffer : buffers ) {
+    if ( not buffer.empty() ) {
+      iovecs.push_back( { const_cast<char *>( buffer.data() ), buffer.size() } );
+    }
+  }
+
+  size_t next = 0;
+  while ( next < iovecs.size() ) {
+    const int count = min( iovecs.size() - next, size_t( IOV_MAX ) );
+    size_t bytes_written = CheckSystemCall( "writev", ::writev( fd_, &iovecs[ next ], count ) );
+    register_write();
+
+    /* skip over whatever was written, including partial buffers */
+    while ( next < iovecs.size() and bytes_written >= iovecs[ next ].iov_len ) {
+      bytes_written -= iovecs[ next ].iov_len;
+      next++;
+    }
+
+    if ( bytes_written > 0 ) {
+      iovecs[ next ].iov_base = static_cast<char *>( iovecs[ next ].iov_base ) + bytes_written;
+      iovecs[ next ].iov_len -= bytes_written;
+    }
+  }
+}
+
 size_t FileDescriptor::nb_write( const string_view buffer )
 {
   if (buffer.empty()) {
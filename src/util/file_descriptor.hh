@@ -4,6 +4,7 @@
 #define FILE_DESCRIPTOR_HH
 
 #include <string>
+#include <vector>
 #include <unistd.h>
 
 #include "config.h"
@@ -55,10 +56,15 @@ public:
   /* read and write methods */
   std::string read( const size_t limit = BUFFER_SIZE );
   std::string read_exactly( const size_t length, const bool fail_silently = false );
+  /* read into caller-provided storage; returns bytes read (0 on EOF) */
+  size_t read_into( char * buffer, const size_t limit );
   std::string_view::const_iterator write( const std::string_view buffer );
   std::string_view::const_iterator write( const std::string_view::const_iterator begin,
                                           const std::string_view::const_iterator end );
 
+  /* gather-write all of the buffers, in as few writev calls as possible */
+  void writev( const std::vector<std::string_view> & buffers );
+
   // non-blocking write
   // returns 0 on EWOULDBLOCK, or otherwise the bytes written
   size_t nb_write( const std::string_view buffer );
@@ -1,5 +1,6 @@
 #include "formatter.hh"
 #include <stdexcept>
+#include <algorithm>
 
 using namespace std;
 
@@ -17,13 +18,12 @@ void Formatter::parse(const string & format_string)
   while (pos < format_string.size()) {
     size_t lpos = format_string.find("{", pos);
     if (lpos == string::npos) {
-      fields_.emplace_back(make_unique<Literal>(format_string.substr(pos)));
+      add_literal(string_view(format_string).substr(pos));
       break;
     }
 
     if (lpos > pos) {
-      fields_.emplace_back(make_unique<Literal>(
-                           format_string.substr(pos, lpos - pos)));
+      add_literal(string_view(format_string).substr(pos, lpos - pos));
     }
     pos = lpos + 1;
 
@@ -42,7 +42,7 @@ void Formatter::parse(const string & format_string)
                             "to manual field specification");
       }
 
-      fields_.emplace_back(make_unique<Replacement>(*auto_field_index_));
+      add_replacement(format_string, lpos, rpos, *auto_field_index_);
       auto_field_index_ = *auto_field_index_ + 1;
     } else {  // {INDEX}
       if (not auto_field_numbering_) {
@@ -57,38 +57,113 @@ void Formatter::parse(const string & format_string)
         throw runtime_error("invalid negative index");
       }
 
-      fields_.emplace_back(make_unique<Replacement>(index));
+      add_replacement(format_string, lpos, rpos, index);
     }
   }
 }
 
-string Formatter::format(const vector<string> & values)
+string Formatter::format(const vector<string> & values) const
 {
   string ret;
+  format_to(ret, {values.begin(), values.end()});
+  return ret;
+}
 
-  for (const auto & field : fields_) {
-    if (field->type == Type::literal) {
-      ret += static_cast<Literal*>(field.get())->text;
-    } else if (field->type == Type::replacement) {
-      unsigned int index = static_cast<Replacement*>(field.get())->index;
+/* copy an integer value, which InfluxDB would reject otherwise */
+static void emit_integer(string & out, const string_view value)
+{
+  size_t digits = (not value.empty() and value[0] == '-') ? 1 : 0;
 
-      if (index >= values.size()) {
-        throw runtime_error("index out of range");
-      }
+  if (digits == value.size()) {
+    throw runtime_error("invalid integer value: \"" + string(value) + "\"");
+  }
 
-      ret += values.at(index);
-    } else {
-      throw runtime_error("invalid field type");
+  for (; digits < value.size(); digits++) {
+    if (value[digits] < '0' or value[digits] > '9') {
+      throw runtime_error("invalid integer value: \"" + string(value) + "\"");
     }
   }
 
-  return ret;
+  out += value;
+}
+
+/* copy a string value, escaping what would end the quoted string */
+static void emit_string(string & out, const string_view value)
+{
+  size_t pos = 0;
+
+  for (size_t special; (special = value.find_first_of("\"\\", pos))
+                       != string_view::npos; pos = special + 1) {
+    out += value.substr(pos, special - pos);
+    out += '\\';
+    out += value[special];
+  }
+
+  out += value.substr(pos);
+}
+
+void Formatter::format_to(string & out,
+                          const vector<string_view> & values) const
+{
+  if (values.size() < num_values_) {
+    throw runtime_error("index out of range");
+  }
+
+  for (const auto & instruction : instructions_) {
+    switch (instruction.op) {
+      case Op::literal:
+        out.append(literals_, instruction.index, instruction.length);
+        break;
+      case Op::value:
+        out += values[instruction.index];
+        break;
+      case Op::integer:
+        emit_integer(out, values[instruction.index]);
+        break;
+      case Op::string:
+        emit_string(out, values[instruction.index]);
+        break;
+    }
+  }
 }
 
 void Formatter::reset()
 {
-  fields_.clear();
+  literals_.clear();
+  instructions_.clear();
+  num_values_ = 0;
 
   auto_field_numbering_.reset();
   auto_field_index_.reset();
 }
+
+void Formatter::add_literal(const string_view text)
+{
+  instructions_.push_back({Op::literal, static_cast<uint32_t>(literals_.size()),
+                           static_cast<uint32_t>(text.size())});
+  literals_ += text;
+}
+
+/* the replacement field {...} spans [lpos, rpos] in format_string */
+void Formatter::add_replacement(const string & format_string,
+                                const size_t lpos, const size_t rpos,
+                                const unsigned int index)
+{
+  Op op = Op::value;
+
+  const char before = lpos > 0 ? format_string[lpos - 1] : '\0';
+  const char after = rpos + 1 < format_string.size() ?
+                     format_string[rpos + 1] : '\0';
+  const char after_i = rpos + 2 < format_string.size() ?
+                       format_string[rpos + 2] : '\0';
+
+  if (before == '"' and after == '"') {
+    op = Op::string;
+  } else if (after == 'i' and
+             (after_i == ',' or after_i == ' ' or after_i == '\0')) {
+    op = Op::integer;
+  }
+
+  instructions_.push_back({op, index, 0});
+  num_values_ = max<size_t>(num_values_, index + 1);
+}
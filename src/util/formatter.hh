@@ -1,50 +1,53 @@
 #ifndef FORMATTER_HH
 #define FORMATTER_HH
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
-#include <memory>
 
 /* A Formatter similar to the one in Python 3. Currently supported formats:
  * '{}': simple positional formatting
- * '{INDEX}': explicit positional formatting with integer index */
+ * '{INDEX}': explicit positional formatting with integer index
+ *
+ * parse() compiles the format string into a list of instructions that copy
+ * either a span of literal text or a value. Following InfluxDB line
+ * protocol, a replacement field followed by 'i' (e.g., '{3}i,') must be an
+ * integer, and one between double quotes (e.g., '"{4}"') is a string whose
+ * '"' and '\' are escaped. */
 class Formatter
 {
 public:
   void parse(const std::string & format_string);
-  std::string format(const std::vector<std::string> & values);
+  std::string format(const std::vector<std::string> & values) const;
 
-  enum class Type {literal, replacement};
+  /* append the formatted values to out, which can be reused across calls
+   * to avoid allocating */
+  void format_to(std::string & out,
+                 const std::vector<std::string_view> & values) const;
 
-  struct Field {
-    Type type;
-
-    Field(const Type type_) : type(type_) {}
-    virtual ~Field() {}
-  };
-
-  struct Literal : Field {
-    std::string text;
-
-    Literal(const std::string & text_)
-      : Field(Type::literal), text(text_) {}
-  };
-
-  struct Replacement : Field {
-    unsigned int index;
+private:
+  enum class Op {literal, value, integer, string};
 
-    Replacement(const unsigned int index_)
-      : Field(Type::replacement), index(index_) {}
+  struct Instruction {
+    Op op;
+    uint32_t index;   /* of the value, or of the text in literals_ */
+    uint32_t length;  /* of the literal text */
   };
 
-private:
-  std::vector<std::unique_ptr<Field>> fields_ {};
+  std::string literals_ {};
+  std::vector<Instruction> instructions_ {};
+  size_t num_values_ {0};  /* the largest index plus one */
 
   std::optional<bool> auto_field_numbering_ {};
   std::optional<unsigned int> auto_field_index_ {};
 
   void reset();
+  void add_literal(const std::string_view text);
+  void add_replacement(const std::string & format_string,
+                       const size_t lpos, const size_t rpos,
+                       const unsigned int index);
 };
 
 #endif /* FORMATTER_HH */
@@ -0,0 +1,311 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "job_scheduler.hh"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <stdexcept>
+
+#include "exception.hh"
+#include "timestamp.hh"
+#include "tokenize.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* forget the due time of a chunk this long after it was first seen */
+static const uint64_t due_time_expiry_ms = 10 * 60 * 1000;
+
+/* scheduler sockets must not leak into the jobs */
+static void set_cloexec(const FileDescriptor & fd)
+{
+  CheckSystemCall("fcntl", fcntl(fd.fd_num(), F_SETFD, FD_CLOEXEC));
+}
+
+/* write a line without raising SIGPIPE; returns false if the peer is gone */
+static bool send_line(FileDescriptor & fd, const string & line)
+{
+  const ssize_t ret = ::send(fd.fd_num(), line.data(), line.size(), MSG_NOSIGNAL);
+  if (ret < 0 and (errno == EPIPE or errno == ECONNRESET)) {
+    return false;
+  }
+
+  if (CheckSystemCall("send", ret) != static_cast<ssize_t>(line.size())) {
+    throw runtime_error("JobScheduler: short write");
+  }
+
+  fd.register_write();
+  return true;
+}
+
+JobScheduler::JobScheduler(Poller & poller, const string & socket_path,
+                           const unsigned int max_jobs)
+  : poller_(poller), socket_path_(socket_path), max_jobs_(max_jobs),
+    last_report_ms_(timestamp_ms())
+{
+  if (max_jobs_ == 0) {
+    throw runtime_error("JobScheduler: max_jobs must be positive");
+  }
+
+  /* remove a socket left behind by a previous run */
+  unlink(socket_path.c_str());
+
+  set_cloexec(listener_);
+  listener_.bind(socket_path);
+  listener_.listen();
+
+  poller_.add_action(Poller::Action(listener_, Direction::In,
+    [this]() {
+      accept_connection();
+      return ResultType::Continue;
+    }
+  ));
+}
+
+JobScheduler::~JobScheduler()
+{
+  unlink(socket_path_.c_str());
+}
+
+void JobScheduler::accept_connection()
+{
+  /* destroy connections that closed, no longer have waiting jobs, and whose
+   * action is gone (a connection closed by a failed send in schedule() is
+   * still polled until its EOF or error) */
+  for (auto it = connections_.begin(); it != connections_.end();) {
+    if (it->closed and it->waiting == 0 and it->action_done) {
+      it = connections_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  Connection & connection = connections_.emplace_back(listener_.accept());
+  listener_.register_read();
+  set_cloexec(connection.fd);
+
+  poller_.add_action(Poller::Action(connection.fd, Direction::In,
+    [this, &connection]() {
+      const Result result = read_from(connection);
+      if (result.result == ResultType::CancelAll) {
+        connection.action_done = true;
+      }
+      return result;
+    },
+    [] { return true; },
+    [this, &connection]() {
+      close_connection(connection);
+      connection.action_done = true;
+      schedule();
+    }
+  ));
+}
+
+Result JobScheduler::read_from(Connection & connection)
+{
+  const string data = connection.fd.read();
+
+  if (data.empty()) {
+    close_connection(connection);
+    schedule();
+    return ResultType::CancelAll;
+  }
+
+  /* nothing more to do for a notifier that went away; wait for its EOF */
+  if (connection.closed) {
+    return ResultType::Continue;
+  }
+
+  connection.buffer += data;
+
+  try {
+    size_t line_end;
+    while ((line_end = connection.buffer.find('\n')) != string::npos) {
+      const string line = connection.buffer.substr(0, line_end);
+      connection.buffer.erase(0, line_end + 1);
+      handle_message(connection, line);
+    }
+  } catch (const exception & e) {
+    /* a misbehaving client should not take down the scheduler */
+    print_exception("JobScheduler", e);
+    close_connection(connection);
+    schedule();
+    return ResultType::CancelAll;
+  }
+
+  schedule();
+  return ResultType::Continue;
+}
+
+void JobScheduler::handle_message(Connection & connection, const string & line)
+{
+  const vector<string> words = split(line, " ");
+
+  if (words.size() == 6 and words[0] == "request") {
+    const uint64_t now = timestamp_ms();
+
+    waiting_.push({static_cast<unsigned int>(stoul(words[5])),
+                   due_time(words[2], words[3]), next_seq_++, now,
+                   &connection, words[1], words[4]});
+    connection.waiting++;
+  } else if (words.size() == 2 and words[0] == "done") {
+    if (connection.running == 0) {
+      throw runtime_error("JobScheduler: done without a running job");
+    }
+
+    connection.running--;
+    running_--;
+  } else {
+    throw runtime_error("JobScheduler: invalid message: " + line);
+  }
+}
+
+void JobScheduler::close_connection(Connection & connection)
+{
+  /* the jobs of a notifier that went away can no longer be running */
+  running_ -= connection.running;
+  connection.running = 0;
+  connection.closed = true;
+}
+
+uint64_t JobScheduler::due_time(const string & channel, const string & chunk)
+{
+  const uint64_t now = timestamp_ms();
+
+  while (not due_expiry_.empty() and
+         get<0>(due_expiry_.front()) + due_time_expiry_ms < now) {
+    const auto & [first_seen_ms, expired_channel, expired_chunk] = due_expiry_.front();
+    const auto it = due_ms_.find({expired_channel, expired_chunk});
+    if (it != due_ms_.end() and it->second == first_seen_ms) {
+      due_ms_.erase(it);
+    }
+    due_expiry_.pop_front();
+  }
+
+  const auto [it, inserted] = due_ms_.emplace(make_pair(channel, chunk), now);
+  if (inserted) {
+    due_expiry_.emplace_back(now, channel, chunk);
+  }
+
+  return it->second;
+}
+
+void JobScheduler::schedule()
+{
+  while (running_ < max_jobs_ and not waiting_.empty()) {
+    const Job job = waiting_.top();
+    waiting_.pop();
+    job.connection->waiting--;
+
+    if (job.connection->closed) {
+      continue;
+    }
+
+    if (not send_line(job.connection->fd, "start " + job.id + "\n")) {
+      /* the notifier exited; its EOF will be read later */
+      close_connection(*job.connection);
+      continue;
+    }
+
+    job.connection->running++;
+    running_++;
+
+    const uint64_t wait_ms = timestamp_ms() - job.queued_ms;
+    StageStats & stats = stats_[job.stage];
+    stats.started++;
+    stats.total_wait_ms += wait_ms;
+    stats.max_wait_ms = max(stats.max_wait_ms, wait_ms);
+  }
+
+  report();
+}
+
+void JobScheduler::report()
+{
+  const uint64_t now = timestamp_ms();
+  if (report_period_ms_ == 0 or now < last_report_ms_ + report_period_ms_) {
+    return;
+  }
+
+  /* per-stage queue latency since the last report */
+  for (const auto & [stage, stats] : stats_) {
+    cerr << "JobScheduler: " << stage << ": " << stats.started
+         << " jobs started, queue latency mean "
+         << stats.total_wait_ms / max<uint64_t>(stats.started, 1)
+         << " ms, max " << stats.max_wait_ms << " ms\n";
+  }
+
+  cerr << "JobScheduler: " << running_ << "/" << max_jobs_ << " running, "
+       << waiting_.size() << " waiting" << endl;
+
+  stats_.clear();
+  last_report_ms_ = now;
+}
+
+JobSchedulerClient::JobSchedulerClient(Poller & poller,
+                                       const string & socket_path,
+                                       const string & channel,
+                                       const string & stage,
+                                       const unsigned int priority)
+  : channel_(channel), stage_(stage), priority_(priority)
+{
+  for (const auto & name : {channel, stage}) {
+    if (name.empty() or name.find_first_of(" \n") != string::npos) {
+      throw runtime_error("JobSchedulerClient: invalid name: " + name);
+    }
+  }
+
+  set_cloexec(socket_);
+  socket_.connect(socket_path);
+
+  poller.add_action(Poller::Action(socket_, Direction::In,
+    [this]() {
+      const string data = socket_.read();
+      if (data.empty()) {
+        throw runtime_error("JobSchedulerClient: scheduler went away");
+      }
+
+      buffer_ += data;
+
+      size_t line_end;
+      while ((line_end = buffer_.find('\n')) != string::npos) {
+        const vector<string> words = split(buffer_.substr(0, line_end), " ");
+        buffer_.erase(0, line_end + 1);
+
+        if (words.size() != 2 or words[0] != "start") {
+          throw runtime_error("JobSchedulerClient: invalid message");
+        }
+
+        const auto it = pending_.find(words[1]);
+        if (it == pending_.end()) {
+          throw runtime_error("JobSchedulerClient: unknown job " + words[1]);
+        }
+
+        const start_t start = move(it->second);
+        pending_.erase(it);
+        start(words[1]);
+      }
+
+      return ResultType::Continue;
+    }
+  ));
+}
+
+void JobSchedulerClient::submit(const string & chunk, const start_t & start)
+{
+  if (chunk.empty() or chunk.find_first_of(" \n") != string::npos) {
+    throw runtime_error("JobSchedulerClient: invalid chunk name: " + chunk);
+  }
+
+  const string id = to_string(next_id_++);
+  pending_.emplace(id, start);
+
+  socket_.write("request " + id + " " + channel_ + " " + chunk + " "
+                + stage_ + " " + to_string(priority_) + "\n");
+}
+
+void JobSchedulerClient::done(const string & id)
+{
+  socket_.write("done " + id + "\n");
+}
@@ -0,0 +1,146 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef JOB_SCHEDULER_HH
+#define JOB_SCHEDULER_HH
+
+#include <cstdint>
+#include <string>
+#include <list>
+#include <map>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <tuple>
+#include <functional>
+#include <unordered_map>
+
+#include "file_descriptor.hh"
+#include "ipc_socket.hh"
+#include "poller.hh"
+
+/* Pipeline stages (each a notifier process) ask the scheduler over a Unix
+ * socket before starting a job, so that at most max_jobs encoding jobs run
+ * at once across all channels. Waiting jobs start in order of priority class
+ * (lower first; e.g., 0 for stages that gate ready media), then due time.
+ *
+ * A chunk is due when its raw file is written (the decoder shifts its
+ * timebase so that chunks are not written early), so the due time of a
+ * (channel, chunk) is the time the scheduler first hears about it; later
+ * stages of the same chunk inherit it.
+ *
+ * Protocol, one message per line:
+ *   client: "request <id> <channel> <chunk> <stage> <priority>", "done <id>"
+ *   server: "start <id>" */
+class JobScheduler
+{
+public:
+  JobScheduler(Poller & poller, const std::string & socket_path,
+               const unsigned int max_jobs);
+
+  /* remove the socket */
+  ~JobScheduler();
+
+  /* log queue latency per stage every period_ms (0 to disable) */
+  void set_report_period(const uint64_t period_ms) { report_period_ms_ = period_ms; }
+
+private:
+  struct Connection
+  {
+    FileDescriptor fd;
+    std::string buffer {};
+    unsigned int running {0};
+    unsigned int waiting {0};
+    bool closed {false};
+    bool action_done {false};  /* the Poller no longer refers to fd */
+
+    Connection(FileDescriptor && s_fd) : fd(std::move(s_fd)) {}
+  };
+
+  struct Job
+  {
+    unsigned int priority;
+    uint64_t due_ms;
+    uint64_t seq;  /* FIFO among equals */
+    uint64_t queued_ms;
+    Connection * connection;
+    std::string id;
+    std::string stage;
+
+    /* std::priority_queue pops the greatest element */
+    bool operator<(const Job & other) const
+    {
+      return std::tie(priority, due_ms, seq) >
+             std::tie(other.priority, other.due_ms, other.seq);
+    }
+  };
+
+  struct StageStats
+  {
+    uint64_t started {0};
+    uint64_t total_wait_ms {0};
+    uint64_t max_wait_ms {0};
+  };
+
+  Poller & poller_;
+  std::string socket_path_;
+  IPCSocket listener_ {};
+  unsigned int max_jobs_;
+  unsigned int running_ {0};
+
+  std::list<Connection> connections_ {};
+  std::priority_queue<Job> waiting_ {};
+  uint64_t next_seq_ {0};
+
+  /* due time of each (channel, chunk), forgotten after a while */
+  std::map<std::pair<std::string, std::string>, uint64_t> due_ms_ {};
+  std::deque<std::tuple<uint64_t, std::string, std::string>> due_expiry_ {};
+
+  std::map<std::string, StageStats> stats_ {};
+  uint64_t report_period_ms_ {60000};
+  uint64_t last_report_ms_;
+
+  void accept_connection();
+  PollerShortNames::Result read_from(Connection & connection);
+  void handle_message(Connection & connection, const std::string & line);
+  void close_connection(Connection & connection);
+
+  uint64_t due_time(const std::string & channel, const std::string & chunk);
+
+  /* start waiting jobs while there is room in the budget */
+  void schedule();
+  void report();
+
+public:
+  /* forbid copying */
+  JobScheduler(const JobScheduler & other) = delete;
+  JobScheduler & operator=(const JobScheduler & other) = delete;
+};
+
+/* the notifier's side of the JobScheduler protocol */
+class JobSchedulerClient
+{
+public:
+  JobSchedulerClient(Poller & poller, const std::string & socket_path,
+                     const std::string & channel, const std::string & stage,
+                     const unsigned int priority);
+
+  using start_t = std::function<void(const std::string & job_id)>;
+
+  /* call start(job_id) once the scheduler lets the job for chunk run;
+   * pass job_id to done() when the job has finished */
+  void submit(const std::string & chunk, const start_t & start);
+
+  /* tell the scheduler that a job has finished */
+  void done(const std::string & id);
+
+private:
+  IPCSocket socket_ {};
+  std::string channel_, stage_;
+  unsigned int priority_;
+
+  std::string buffer_ {};
+  uint64_t next_id_ {0};
+  std::unordered_map<std::string, start_t> pending_ {};
+};
+
+#endif /* JOB_SCHEDULER_HH */
@@ -0,0 +1,42 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pcm.hh"
+
+using namespace std;
+
+void pcm_apply_gain( const int16_t * in, int16_t * out,
+                     const size_t count, const float gain )
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  /* 8 samples at a time: widen to int32, scale as float, truncate, and
+     narrow back with signed saturation (which is the clamp) */
+  const __m128 gain_ps = _mm_set1_ps( gain );
+
+  for ( ; i + 8 <= count; i += 8 ) {
+    const __m128i x = _mm_loadu_si128( reinterpret_cast<const __m128i *>( in + i ) );
+
+    /* sign-extend by unpacking each sample into the high half of a lane */
+    const __m128i lo = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+    const __m128i hi = _mm_srai_epi32( _mm_unpackhi_epi16( x, x ), 16 );
+
+    const __m128i lo_scaled = _mm_cvttps_epi32( _mm_mul_ps( _mm_cvtepi32_ps( lo ), gain_ps ) );
+    const __m128i hi_scaled = _mm_cvttps_epi32( _mm_mul_ps( _mm_cvtepi32_ps( hi ), gain_ps ) );
+
+    _mm_storeu_si128( reinterpret_cast<__m128i *>( out + i ),
+                      _mm_packs_epi32( lo_scaled, hi_scaled ) );
+  }
+#endif
+
+  for ( ; i < count; i++ ) {
+    const int32_t scaled = static_cast<int32_t>( in[ i ] * gain );
+    out[ i ] = clamp( scaled, INT16_MIN, INT16_MAX );
+  }
+}
@@ -0,0 +1,17 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef PCM_HH
+#define PCM_HH
+
+#include <cstddef>
+#include <cstdint>
+
+/* Kernels for 16-bit PCM samples (any interleaving), vectorized with SSE2
+ * where available and otherwise scalar; both give identical results. */
+
+/* out[i] = in[i] * gain, truncated toward zero and saturated to int16;
+ * 'in' and 'out' may be the same buffer; |gain| must be below 65536 */
+void pcm_apply_gain( const int16_t * in, int16_t * out,
+                     const size_t count, const float gain );
+
+#endif /* PCM_HH */
@@ -0,0 +1,109 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "ring_buffer.hh"
+#include "exception.hh"
+
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+static size_t round_up_to_page( const size_t length )
+{
+  const size_t page_size = sysconf( _SC_PAGESIZE );
+  return ( ( length + page_size - 1 ) / page_size ) * page_size;
+}
+
+RingBuffer::RingBuffer( const size_t capacity )
+  : capacity_( round_up_to_page( capacity ) ),
+    backing_fd_( CheckSystemCall( "memfd_create",
+                                  memfd_create( "RingBuffer", MFD_CLOEXEC ) ) ),
+    base_( nullptr )
+{
+  if ( capacity_ == 0 ) {
+    throw runtime_error( "RingBuffer: capacity must be positive" );
+  }
+
+  CheckSystemCall( "ftruncate", ftruncate( backing_fd_.fd_num(), capacity_ ) );
+
+  /* reserve twice the capacity, then map the same pages into both halves */
+  void * reserved = mmap( nullptr, 2 * capacity_, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if ( reserved == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+
+  base_ = static_cast<char *>( reserved );
+
+  for ( const size_t half : { size_t( 0 ), capacity_ } ) {
+    if ( mmap( base_ + half, capacity_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, backing_fd_.fd_num(), 0 ) == MAP_FAILED ) {
+      const int saved_errno = errno;
+      munmap( base_, 2 * capacity_ );
+      throw unix_error( "mmap", saved_errno );
+    }
+  }
+}
+
+RingBuffer::~RingBuffer()
+{
+  if ( munmap( base_, 2 * capacity_ ) < 0 ) {
+    print_exception( "RingBuffer", unix_error( "munmap" ) );
+  }
+}
+
+string_view RingBuffer::readable_region() const
+{
+  return { at( read_offset_ ), readable_size() };
+}
+
+char * RingBuffer::at( const uint64_t offset )
+{
+  if ( offset < read_offset_ or offset > write_offset_ ) {
+    throw out_of_range( "RingBuffer: offset is not in the readable region" );
+  }
+
+  return base_ + offset % capacity_;
+}
+
+const char * RingBuffer::at( const uint64_t offset ) const
+{
+  return const_cast<RingBuffer *>( this )->at( offset );
+}
+
+void RingBuffer::push( const size_t length )
+{
+  if ( length > writable_size() ) {
+    throw out_of_range( "RingBuffer: push past capacity" );
+  }
+
+  write_offset_ += length;
+}
+
+void RingBuffer::push( const string_view data )
+{
+  if ( data.size() > writable_size() ) {
+    throw out_of_range( "RingBuffer: push past capacity" );
+  }
+
+  memcpy( writable_region(), data.data(), data.size() );
+  write_offset_ += data.size();
+}
+
+void RingBuffer::pop( const size_t length )
+{
+  if ( length > readable_size() ) {
+    throw out_of_range( "RingBuffer: pop past write offset" );
+  }
+
+  read_offset_ += length;
+}
+
+size_t RingBuffer::read_from( FileDescriptor & fd )
+{
+  const size_t bytes_read = fd.read_into( writable_region(), writable_size() );
+  write_offset_ += bytes_read;
+  return bytes_read;
+}
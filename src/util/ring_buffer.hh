@@ -0,0 +1,68 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef RING_BUFFER_HH
+#define RING_BUFFER_HH
+
+#include <cstdint>
+#include <string>
+
+#include "file_descriptor.hh"
+
+/* A fixed-capacity byte ring whose (page-aligned) storage is mapped twice,
+ * back to back, so that any readable or writable region is contiguous in
+ * memory even when it wraps around the end of the ring.
+ *
+ * Positions are absolute byte offsets counted since construction: bytes in
+ * [read_offset(), write_offset()) are readable, and a pointer to any of them
+ * stays valid until it is popped. */
+class RingBuffer
+{
+private:
+  size_t capacity_;
+  FileDescriptor backing_fd_;
+  char * base_;
+
+  uint64_t read_offset_ { 0 };
+  uint64_t write_offset_ { 0 };
+
+public:
+  /* capacity is rounded up to a multiple of the page size */
+  explicit RingBuffer( const size_t capacity );
+  ~RingBuffer();
+
+  size_t capacity() const { return capacity_; }
+  size_t readable_size() const { return write_offset_ - read_offset_; }
+  size_t writable_size() const { return capacity_ - readable_size(); }
+
+  uint64_t read_offset() const { return read_offset_; }
+  uint64_t write_offset() const { return write_offset_; }
+
+  /* all unconsumed bytes, as one contiguous view */
+  std::string_view readable_region() const;
+
+  /* contiguous free space (writable_size() bytes) */
+  char * writable_region() { return at( write_offset_ ); }
+
+  /* the byte at an absolute offset within [read_offset(), write_offset()] */
+  char * at( const uint64_t offset );
+  const char * at( const uint64_t offset ) const;
+
+  /* mark bytes as written (after filling writable_region()) */
+  void push( const size_t length );
+
+  /* append a copy of data */
+  void push( const std::string_view data );
+
+  /* consume bytes from the front */
+  void pop( const size_t length );
+  void pop_to( const uint64_t offset ) { pop( offset - read_offset_ ); }
+
+  /* read(2) directly into the free space; returns bytes read (0 on EOF) */
+  size_t read_from( FileDescriptor & fd );
+
+  /* forbid copying */
+  RingBuffer( const RingBuffer & other ) = delete;
+  RingBuffer & operator=( const RingBuffer & other ) = delete;
+};
+
+#endif /* RING_BUFFER_HH */
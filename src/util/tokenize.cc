@@ -32,3 +32,17 @@ vector< string > split( const string & str, const string & separator )
 
   return ret;
 }
+
+void split_into( const string_view str, const char separator,
+                 vector< string_view > & tokens )
+{
+  tokens.clear();
+
+  size_t begin = 0;
+  for ( size_t end; (end = str.find( separator, begin )) != string_view::npos;
+        begin = end + 1 ) {
+    tokens.push_back( str.substr( begin, end - begin ) );
+  }
+
+  tokens.push_back( str.substr( begin ) );
+}
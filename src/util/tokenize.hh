@@ -4,9 +4,14 @@
 #define TOKENIZE_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 
 std::vector< std::string > split( const std::string & str, const std::string & separator );
 
+/* split without copying: tokens (cleared first) are views into str */
+void split_into( const std::string_view str, const char separator,
+                 std::vector< std::string_view > & tokens );
+
 #endif /* TOKENIZE_HH */
@@ -0,0 +1,186 @@
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+#include "webm_writer.hh"
+#include "webm_info.hh"
+
+using namespace std;
+
+/* element IDs not needed by WebmParser */
+enum WriterTagID : uint32_t {
+  EBMLVersion         = 0x4286,
+  EBMLReadVersion     = 0x42F7,
+  EBMLMaxIDLength     = 0x42F2,
+  EBMLMaxSizeLength   = 0x42F3,
+  DocType             = 0x4282,
+  DocTypeVersion      = 0x4287,
+  DocTypeReadVersion  = 0x4285,
+  MuxingApp           = 0x4D80,
+  WritingApp          = 0x5741,
+  TrackUID            = 0x73C5,
+  FlagLacing          = 0x9C,
+  Language            = 0x22B59C,
+  CodecID             = 0x86,
+  CodecPrivate        = 0x63A2,
+  CodecDelay          = 0x56AA,
+  SeekPreRoll         = 0x56BB,
+  Channels            = 0x9F,
+  BitDepth            = 0x6264,
+};
+
+static const uint64_t timecode_scale = 1000000; /* ns, i.e., ms timecodes */
+static const uint64_t opus_seek_pre_roll = 80000000; /* ns */
+static const char writing_app[] = "puffer";
+
+static void append_big_endian(string & out, const uint64_t value,
+                              const unsigned int bytes)
+{
+  for (unsigned int i = bytes; i > 0; i--) {
+    out.push_back(static_cast<char>((value >> (8 * (i - 1))) & 0xFF));
+  }
+}
+
+static void append_id(string & out, const uint32_t id)
+{
+  /* IDs carry their own length marker */
+  unsigned int bytes = 1;
+  while (bytes < 4 and (id >> (8 * bytes)) != 0) {
+    bytes++;
+  }
+
+  append_big_endian(out, id, bytes);
+}
+
+static void append_size(string & out, const uint64_t size)
+{
+  /* shortest encoding; all ones is reserved for "unknown size" */
+  unsigned int bytes = 1;
+  while (bytes < 8 and size >= (uint64_t(1) << (7 * bytes)) - 1) {
+    bytes++;
+  }
+
+  if (size >= (uint64_t(1) << 56) - 1) {
+    throw runtime_error("EBML element is too large");
+  }
+
+  append_big_endian(out, size | (uint64_t(1) << (7 * bytes)), bytes);
+}
+
+string ebml_element(const uint32_t id, const string_view payload)
+{
+  string element;
+  element.reserve(payload.size() + 12);
+
+  append_id(element, id);
+  append_size(element, payload.size());
+  element.append(payload);
+
+  return element;
+}
+
+string ebml_uint(const uint32_t id, const uint64_t value)
+{
+  unsigned int bytes = 1;
+  while (bytes < 8 and (value >> (8 * bytes)) != 0) {
+    bytes++;
+  }
+
+  string payload;
+  append_big_endian(payload, value, bytes);
+  return ebml_element(id, payload);
+}
+
+string ebml_float(const uint32_t id, const float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  string payload;
+  append_big_endian(payload, bits, 4);
+  return ebml_element(id, payload);
+}
+
+static string duration_string(const uint64_t duration_ms)
+{
+  /* HH:MM:SS.nnnnnnnnn, as parsed by WebmInfo::get_duration */
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%02u:%02u:%02u.%09u",
+           unsigned(duration_ms / 3600000), unsigned(duration_ms / 60000 % 60),
+           unsigned(duration_ms / 1000 % 60),
+           unsigned(duration_ms % 1000 * 1000000));
+  return buf;
+}
+
+string opus_init_segment(const uint32_t sample_rate,
+                         const uint8_t channels,
+                         const string & codec_private,
+                         const uint64_t duration_ms)
+{
+  const string ebml_header = ebml_element(EBML,
+    ebml_uint(EBMLVersion, 1) +
+    ebml_uint(EBMLReadVersion, 1) +
+    ebml_uint(EBMLMaxIDLength, 4) +
+    ebml_uint(EBMLMaxSizeLength, 8) +
+    ebml_element(DocType, "webm") +
+    ebml_uint(DocTypeVersion, 4) +
+    ebml_uint(DocTypeReadVersion, 2));
+
+  const string info = ebml_element(Info,
+    ebml_uint(TimecodeScale, timecode_scale) +
+    ebml_element(MuxingApp, writing_app) +
+    ebml_element(WritingApp, writing_app));
+
+  const string tracks = ebml_element(Tracks,
+    ebml_element(TrackEntry,
+      ebml_uint(TrackNumber, 1) +
+      ebml_uint(TrackUID, 1) +
+      ebml_uint(FlagLacing, 0) +
+      ebml_element(Language, "und") +
+      ebml_element(CodecID, "A_OPUS") +
+      ebml_uint(CodecDelay, 0) +
+      ebml_uint(SeekPreRoll, opus_seek_pre_roll) +
+      ebml_uint(TrackType, 2 /* audio */) +
+      ebml_element(CodecPrivate, codec_private) +
+      ebml_element(Audio,
+        ebml_uint(Channels, channels) +
+        ebml_float(SamplingFrequency, sample_rate) +
+        ebml_uint(BitDepth, 16))));
+
+  const string tags = ebml_element(Tags,
+    ebml_element(Tag,
+      ebml_element(SimpleTag,
+        ebml_element(TagName, "DURATION") +
+        ebml_element(TagString, duration_string(duration_ms)))));
+
+  /* Segment of unknown size, followed by the clusters in <num>.chk */
+  string segment_header;
+  append_id(segment_header, Segment);
+  segment_header.append("\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8);
+
+  return ebml_header + segment_header + info + tracks + tags;
+}
+
+void WebmCluster::add_simple_block(const int16_t relative_timecode,
+                                   const string_view frame)
+{
+  append_id(blocks_, SimpleBlock);
+  append_size(blocks_, 4 + frame.size());
+
+  blocks_.push_back(static_cast<char>(0x81));  /* track number 1 */
+  append_big_endian(blocks_, static_cast<uint16_t>(relative_timecode), 2);
+  blocks_.push_back(static_cast<char>(0x80));  /* keyframe */
+  blocks_.append(frame);
+}
+
+void WebmCluster::write(FileDescriptor & fd) const
+{
+  const string timecode = ebml_uint(Timecode, timecode_);
+
+  string header;
+  append_id(header, Cluster);
+  append_size(header, timecode.size() + blocks_.size());
+  header.append(timecode);
+
+  fd.writev({header, blocks_});
+}
@@ -0,0 +1,40 @@
+#ifndef WEBM_WRITER_HH
+#define WEBM_WRITER_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "file_descriptor.hh"
+
+/* EBML encoding of an element: ID, size and payload */
+std::string ebml_element(const uint32_t id, const std::string_view payload);
+std::string ebml_uint(const uint32_t id, const uint64_t value);
+std::string ebml_float(const uint32_t id, const float value);
+
+/* the init segment of a single-track Opus WebM: EBML header, Segment (of
+ * unknown size), Info, Tracks and a DURATION tag, as webm_fragment would
+ * extract from a complete .webm */
+std::string opus_init_segment(const uint32_t sample_rate,
+                              const uint8_t channels,
+                              const std::string & codec_private,
+                              const uint64_t duration_ms);
+
+/* a media segment (<num>.chk): a single Cluster of SimpleBlocks on
+ * track 1, all keyframes; timecodes are in milliseconds */
+class WebmCluster
+{
+public:
+  WebmCluster(const uint64_t timecode) : timecode_(timecode) {}
+
+  void add_simple_block(const int16_t relative_timecode,
+                        const std::string_view frame);
+
+  void write(FileDescriptor & fd) const;
+
+private:
+  uint64_t timecode_;
+  std::string blocks_ {};
+};
+
+#endif /* WEBM_WRITER_HH */
@@ -3,12 +3,19 @@
 #include <vector>
 #include <tuple>
 #include <set>
+#include <map>
+#include <optional>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <unistd.h>
 
 #include "filesystem.hh"
 #include "path.hh"
 #include "child_process.hh"
 #include "media_formats.hh"
 #include "tokenize.hh"
+#include "job_scheduler.hh"
 #include "yaml.hh"
 
 using namespace std;
@@ -19,6 +26,7 @@ static const uint32_t clean_window_s = 60;
 static fs::path src_path;
 static fs::path media_dir;
 static string notifier;
+static string scheduler_socket;  /* empty if jobs are not scheduled */
 
 void print_usage(const string & program_name)
 {
@@ -27,6 +35,23 @@ void print_usage(const string & program_name)
   << endl;
 }
 
+/* make the notifier started with args wait for the job scheduler;
+ * priority 0 is for stages whose output gates ready media */
+void use_scheduler(vector<string> & args,
+                   const fs::path & output_path,
+                   const string & stage,
+                   const unsigned int priority = 0)
+{
+  if (scheduler_socket.empty()) {
+    return;
+  }
+
+  auto exec_it = find(args.begin(), args.end(), "--exec");
+  args.insert(exec_it, {"--scheduler", scheduler_socket,
+                        output_path.filename().string(), stage,
+                        to_string(priority)});
+}
+
 void run_video_canonicalizer(ProcessManager & proc_manager,
                              const fs::path & output_path,
                              vector<tuple<string, string>> & vwork)
@@ -48,6 +73,7 @@ void run_video_canonicalizer(ProcessManager & proc_manager,
   vector<string> args {
     notifier, src_dir, ".y4m", "--check", dst_dir, ".y4m", "--tmp", tmp_dir,
     "--exec", video_canonicalizer };
+  use_scheduler(args, output_path, "video_canonicalizer");
   proc_manager.run_as_child(notifier, args);
 }
 
@@ -75,6 +101,7 @@ void run_video_encoder(ProcessManager & proc_manager,
     notifier, src_dir, ".y4m", "--check", dst_dir, ".mp4", "--tmp", tmp_dir,
     "--exec", video_encoder, "-s", vf.resolution(), "--crf", to_string(vf.crf)
   };
+  use_scheduler(args, output_path, "video_encoder:" + vf.to_string());
   proc_manager.run_as_child(notifier, args);
 }
 
@@ -103,6 +130,7 @@ void run_video_fragmenter(ProcessManager & proc_manager,
   vector<string> args {
     notifier, src_dir, ".mp4", "--check", dst_dir, ".m4s", "--tmp", tmp_dir,
     "--exec", video_fragmenter, "-i", dst_init_path };
+  use_scheduler(args, output_path, "video_fragmenter:" + vf.to_string());
   proc_manager.run_as_child(notifier, args);
 }
 
@@ -131,137 +159,134 @@ void run_ssim_calculator(ProcessManager & proc_manager,
   vector<string> args {
     notifier, src_dir, ".mp4", "--check", dst_dir, ".ssim", "--tmp", tmp_dir,
     "--exec", ssim_calculator, "--canonical", canonical_dir };
+  /* SSIMs are only monitored, so they yield to stages gating ready media */
+  use_scheduler(args, output_path, "ssim_calculator:" + vf.to_string(), 1);
   proc_manager.run_as_child(notifier, args);
 }
 
 void run_audio_encoder(ProcessManager & proc_manager,
                        const fs::path & output_path,
                        vector<tuple<string, string>> & awork,
-                       const AudioFormat & af)
+                       vector<tuple<string, string>> & aready,
+                       const vector<AudioFormat> & aformats)
 {
+  if (aformats.empty()) {
+    return;
+  }
+
   /* prepare directories */
-  string base = af.to_string() + "-" + "webm";
   string src_dir = output_path / "working/audio-raw";
-  string dst_dir = output_path / "working" / base;
-  string tmp_dir = output_path / "tmp" / base;
+  string tmp_dir = output_path / "tmp/audio";
 
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
+  for (const auto & dir : {src_dir, tmp_dir}) {
     fs::create_directories(dir);
   }
 
   awork.emplace_back(src_dir, ".wav");
-  awork.emplace_back(dst_dir, ".webm");
 
-  /* notifier runs audio_encoder */
+  /* a single opus-encoder reads each WAV once, encodes every bitrate in
+   * parallel and writes WebM fragments (and init.webm) straight to ready/ */
   string audio_encoder = src_path / "opus-encoder/opus-encoder";
 
   vector<string> args {
-    notifier, src_dir, ".wav", "--check", dst_dir, ".webm", "--tmp", tmp_dir,
-    "--exec", audio_encoder, "-b", af.to_string() };
-  proc_manager.run_as_child(notifier, args);
-}
+    notifier, src_dir, ".wav", "--exec", audio_encoder, "--tmp", tmp_dir };
 
-void run_audio_fragmenter(ProcessManager & proc_manager,
-                          const fs::path & output_path,
-                          vector<tuple<string, string>> & aready,
-                          const AudioFormat & af)
-{
-  /* prepare directories */
-  string working_base = af.to_string() + "-" + "webm";
-  string ready_base = af.to_string();
-  string src_dir = output_path / "working" / working_base;
-  string dst_dir = output_path / "ready" / ready_base;
-  string tmp_dir = output_path / "tmp" / ready_base;
-
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
-    fs::create_directories(dir);
-  }
+  for (const auto & af : aformats) {
+    string dst_dir = output_path / "ready" / af.to_string();
+    fs::create_directories(dst_dir);
 
-  aready.emplace_back(dst_dir, ".chk");
+    aready.emplace_back(dst_dir, ".chk");
 
-  /* notifier runs audio_fragmenter */
-  string audio_fragmenter = src_path / "wrappers/audio_fragmenter";
-  string dst_init_path = fs::path(dst_dir) / "init.webm";
+    args.emplace_back("-b");
+    args.emplace_back(af.to_string());
+    args.emplace_back(dst_dir);
+  }
 
-  vector<string> args {
-    notifier, src_dir, ".webm", "--check", dst_dir, ".chk", "--tmp", tmp_dir,
-    "--exec", audio_fragmenter, "-i", dst_init_path };
+  use_scheduler(args, output_path, "audio_encoder");
   proc_manager.run_as_child(notifier, args);
 }
 
-void run_file_sender(ProcessManager & proc_manager,
-                     const vector<tuple<string, string>> & ready,
-                     const YAML::Node & config)
+void run_file_forwarder(ProcessManager & proc_manager,
+                        const vector<tuple<string, string>> & ready,
+                        const YAML::Node & config)
 {
-  string host = config["host"].as<string>();
-  uint16_t port = config["port"].as<uint16_t>();
-  fs::path dst_media_dir = config["media_dir"].as<string>();
-  string file_sender = src_path / "forwarder/file_sender";
+  string file_forwarder = src_path / "forwarder/file_forwarder";
+
+  /* a single process reads every file in ready/ (e.g., init.mp4 and .m4s
+   * in a vready dir) once and sends it to each remote media server */
+  vector<string> args { file_forwarder, media_dir.string() };
 
   for (const auto & item : ready) {
-    const auto & dir = std::get<0>(item);
+    args.emplace_back(std::get<0>(item));
+  }
 
-    /* remove the prefix of media_dir from dir and append to dst_media_dir */
-    string remaining = dir.substr(media_dir.string().size());
-    string dst_dir = dst_media_dir / remaining;
+  /* remote_media_server is either one server or a list of them */
+  vector<YAML::Node> servers;
+  if (config.IsSequence()) {
+    for (const auto & server : config) {
+      servers.emplace_back(server);
+    }
+  } else {
+    servers.emplace_back(config);
+  }
 
-    /* file sender is interested in any move-in files
-     * e.g., init.mp4 and .m4s in a vready dir */
-    vector<string> notifier_args { notifier, dir, ".", "--exec",
-      file_sender, host, to_string(port), dst_dir };
-    proc_manager.run_as_child(notifier, notifier_args);
+  /* on each server, files go to the same path relative to its media_dir */
+  for (const auto & server : servers) {
+    args.emplace_back("--to");
+    args.emplace_back(server["host"].as<string>());
+    args.emplace_back(to_string(server["port"].as<uint16_t>()));
+    args.emplace_back(server["media_dir"].as<string>());
   }
+
+  proc_manager.run_as_child(file_forwarder, args);
 }
 
-void run_depcleaner(ProcessManager & proc_manager,
-                    const vector<tuple<string, string>> & work,
-                    const vector<tuple<string, string>> & ready)
+void run_channelcleaner(ProcessManager & proc_manager,
+                        const vector<tuple<string, string>> & vwork,
+                        const vector<tuple<string, string>> & vready,
+                        const vector<tuple<string, string>> & awork,
+                        const vector<tuple<string, string>> & aready,
+                        const optional<unsigned int> & clean_window_ts)
 {
-  string depcleaner = src_path / "cleaner/depcleaner";
-  vector<string> args = {depcleaner};
-
-  args.emplace_back("--clean");
-  for (const auto & item : work) {
-    const auto & [dir, ext] = item;
-    args.emplace_back(dir);
-    args.emplace_back(ext);
-  }
+  string channelcleaner = src_path / "cleaner/channelcleaner";
+  vector<string> args = {channelcleaner};
 
-  args.emplace_back("--depend");
-  for (const auto & item : ready) {
-    const auto & [dir, ext] = item;
-    args.emplace_back(dir);
-    args.emplace_back(ext);
+  /* clean up files in ready/ that fall out of the time window */
+  if (clean_window_ts) {
+    args.emplace_back("--window");
+    args.emplace_back(to_string(*clean_window_ts));
   }
 
-  /* run notifier to start depcleaner for each directory in ready/ */
-  for (const auto & item : ready) {
-    const auto & [dir, ext] = item;
-    vector<string> notifier_args { notifier, dir, ext, "--exec" };
-    notifier_args.insert(notifier_args.end(), args.begin(), args.end());
-    proc_manager.run_as_child(notifier, notifier_args);
+  /* clean up files in working/ once their outputs are all in ready/ */
+  for (const auto & [work, ready] : {make_pair(&vwork, &vready),
+                                     make_pair(&awork, &aready)}) {
+    args.emplace_back("--clean");
+    for (const auto & [dir, ext] : *work) {
+      args.emplace_back(dir);
+      args.emplace_back(ext);
+    }
+
+    args.emplace_back("--depend");
+    for (const auto & [dir, ext] : *ready) {
+      args.emplace_back(dir);
+      args.emplace_back(ext);
+    }
   }
+
+  /* a single long-running process watches every directory of the channel */
+  proc_manager.run_as_child(channelcleaner, args);
 }
 
-void run_windowcleaner(ProcessManager & proc_manager,
-                       const vector<tuple<string, string>> & ready,
-                       const unsigned int clean_window_ts)
+/* a channel's share of a decoder process */
+struct DecoderProgram
 {
-  string windowcleaner = src_path / "cleaner/windowcleaner";
-
-  /* run notifier to start windowcleaner for each directory in ready/ */
-  for (const auto & item : ready) {
-    const auto & [dir, ext] = item;
-    vector<string> notifier_args { notifier, dir, ext, "--exec", windowcleaner,
-                                   ext, to_string(clean_window_ts) };
-    proc_manager.run_as_child(notifier, notifier_args);
-  }
-}
+  string channel_name;
+  vector<string> args;  /* decoder_args followed by the output directories */
+};
 
-void run_decoder(ProcessManager & proc_manager,
-                 const fs::path & output_path,
-                 const string & channel_name,
-                 const YAML::Node & config)
+DecoderProgram prepare_decoder_program(const fs::path & output_path,
+                                       const string & channel_name,
+                                       const YAML::Node & config)
 {
   /* prepare directories */
   string video_raw = output_path / "working/video-raw";
@@ -272,19 +297,83 @@ void run_decoder(ProcessManager & proc_manager,
     fs::create_directories(dir);
   }
 
+  vector<string> args = split(config["decoder_args"].as<string>(), " ");
+  args.insert(args.end(), {video_raw, audio_raw, "--tmp", tmp_raw});
+
+  return {channel_name, args};
+}
+
+void run_decoder(ProcessManager & proc_manager,
+                 const DecoderProgram & program)
+{
+  string decoder = src_path / "atsc/decoder";
+  string decoder_log = src_path / "atsc" /
+                       (program.channel_name + "_decoder.log");
+
+  vector<string> args { decoder };
+  args.insert(args.end(), program.args.begin(), program.args.end());
+
+  proc_manager.run_as_child(decoder, args, {}, {}, decoder_log);
+}
+
+/* run one decoder that ingests the multiplex at tcp_addr once and decodes
+   every program in programs on its own thread */
+void run_multi_program_decoder(ProcessManager & proc_manager,
+                               const string & tcp_addr,
+                               const vector<DecoderProgram> & programs)
+{
   string decoder = src_path / "atsc/decoder";
-  vector<string> decoder_args = split(config["decoder_args"].as<string>(), " ");
-  string decoder_log = src_path / "atsc" / (channel_name + "_decoder.log");
 
-  vector<string> args { decoder, video_raw, audio_raw, "--tmp", tmp_raw };
-  args.insert(args.begin() + 1, decoder_args.begin(), decoder_args.end());
+  string log_name;
+  vector<string> args { decoder, "--tcp", tcp_addr };
+
+  for (const auto & program : programs) {
+    log_name += (log_name.empty() ? "" : "+") + program.channel_name;
+
+    /* everything but --tcp, with the tmp directory as an optional 9th argument */
+    string program_arg;
+    for (size_t i = 0; i < program.args.size(); i++) {
+      if (program.args[i] == "--tcp" or program.args[i] == "--tmp") {
+        if (program.args[i] == "--tmp" and i + 1 < program.args.size()) {
+          program_arg += " " + program.args[i + 1];
+        }
+        i++;
+      } else if (not program.args[i].empty()) {
+        program_arg += " " + program.args[i];
+      }
+    }
+
+    args.insert(args.end(), {"--program", program_arg.substr(1)});
+  }
 
+  string decoder_log = src_path / "atsc" / (log_name + "_decoder.log");
   proc_manager.run_as_child(decoder, args, {}, {}, decoder_log);
 }
 
+/* channels with "share_multiplex: true" that read the same --tcp address
+   are decoded by one process; returns that address, or "" if not shared */
+string shared_multiplex(const YAML::Node & channel_config)
+{
+  if (not channel_config["share_multiplex"] or
+      not channel_config["share_multiplex"].as<bool>()) {
+    return "";
+  }
+
+  vector<string> decoder_args =
+    split(channel_config["decoder_args"].as<string>(), " ");
+  for (size_t i = 0; i + 1 < decoder_args.size(); i++) {
+    if (decoder_args[i] == "--tcp") {
+      return decoder_args[i + 1];
+    }
+  }
+
+  return "";
+}
+
 void run_pipeline(ProcessManager & proc_manager,
                   const string & channel_name,
-                  const YAML::Node & config)
+                  const YAML::Node & config,
+                  map<string, vector<DecoderProgram>> & shared_decoders)
 {
   const auto & channel_config = config["channel_configs"][channel_name];
   vector<VideoFormat> vformats = channel_video_formats(channel_config);
@@ -314,38 +403,43 @@ void run_pipeline(ProcessManager & proc_manager,
     run_ssim_calculator(proc_manager, output_path, vready, vf);
   }
 
-  for (const auto & af : aformats) {
-    /* run audio encoder and audio fragmenter */
-    run_audio_encoder(proc_manager, output_path, awork, af);
-    run_audio_fragmenter(proc_manager, output_path, aready, af);
-  }
+  /* run audio encoder, which also fragments */
+  run_audio_encoder(proc_manager, output_path, awork, aready, aformats);
 
   if (config["remote_media_server"]) {
-    /* run file_sender to transfer files in ready/ */
-    run_file_sender(proc_manager, vready, config["remote_media_server"]);
-    run_file_sender(proc_manager, aready, config["remote_media_server"]);
+    /* run file_forwarder to transfer files in ready/ */
+    vector<tuple<string, string>> ready = vready;
+    ready.insert(ready.end(), aready.begin(), aready.end());
+    run_file_forwarder(proc_manager, ready, config["remote_media_server"]);
   }
 
   /* vwork, awork, vready, aready should already be filled in */
 
-  /* run depcleaner to clean up files in working/ */
-  run_depcleaner(proc_manager, vwork, vready);
-  run_depcleaner(proc_manager, awork, aready);
-
+  /* run channelcleaner to clean up files in working/ and ready/ */
+  optional<unsigned int> clean_window_ts;
   if (not config["clean_ready_media"] or
       config["clean_ready_media"].as<bool>()) {
-    /* run windowcleaner to clean up files in ready/ */
-    unsigned int clean_window_ts = clean_window_s * global_timescale;
-    run_windowcleaner(proc_manager, vready, clean_window_ts);
-    run_windowcleaner(proc_manager, aready, clean_window_ts);
+    clean_window_ts = clean_window_s * global_timescale;
   }
 
+  run_channelcleaner(proc_manager, vwork, vready, awork, aready,
+                     clean_window_ts);
+
   /* run decoder */
   if (not config["decoder"] or config["decoder"].as<bool>()) {
     /* create a tmp directory for decoder to output raw media chunks */
     fs::create_directories(output_path / "tmp" / "raw");
 
-    run_decoder(proc_manager, output_path, channel_name, channel_config);
+    DecoderProgram program = prepare_decoder_program(
+        output_path, channel_name, channel_config);
+
+    const string tcp_addr = shared_multiplex(channel_config);
+    if (tcp_addr.empty()) {
+      run_decoder(proc_manager, program);
+    } else {
+      /* started once all channels of the multiplex are known */
+      shared_decoders[tcp_addr].emplace_back(move(program));
+    }
   }
 }
 
@@ -372,10 +466,35 @@ int main(int argc, char * argv[])
 
   ProcessManager proc_manager;
 
+  /* limit concurrent encoding jobs across all channels (0: no limit) */
+  unsigned int max_jobs = thread::hardware_concurrency();
+  if (config["scheduler_max_jobs"]) {
+    max_jobs = config["scheduler_max_jobs"].as<unsigned int>();
+  }
+
+  unique_ptr<JobScheduler> scheduler;
+  if (max_jobs > 0) {
+    scheduler_socket = fs::temp_directory_path() /
+                       ("run_pipeline." + to_string(getpid()) + ".sock");
+    scheduler = make_unique<JobScheduler>(proc_manager.poller(),
+                                          scheduler_socket, max_jobs);
+  }
+
+  /* multiplex address -> channels decoded from it by a single decoder */
+  map<string, vector<DecoderProgram>> shared_decoders;
+
   set<string> channel_set = load_channels(config);
   for (const auto & channel_name : channel_set) {
     /* run the encoding pipeline for channel_name */
-    run_pipeline(proc_manager, channel_name, config);
+    run_pipeline(proc_manager, channel_name, config, shared_decoders);
+  }
+
+  for (const auto & [tcp_addr, programs] : shared_decoders) {
+    if (programs.size() == 1) {
+      run_decoder(proc_manager, programs.front());
+    } else {
+      run_multi_program_decoder(proc_manager, tcp_addr, programs);
+    }
   }
 
   /* if logging is enabled */